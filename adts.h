@@ -0,0 +1,195 @@
+#ifndef FMP4_ADTS_H
+#define FMP4_ADTS_H
+
+/*
+ * ADTS (ISO 14496-3 1.A.2), the framing cameras and encoders use for AAC outside a container.
+ *
+ * Every AAC frame comes with a 7 byte header (9 with a CRC) giving its size, the object type, the
+ * sampling frequency index and the channel configuration. In MP4 the headers go: the samples are
+ * the bare raw_data_block()s and the configuration moves to an AudioSpecificConfig in the sample
+ * entry. Splitter finds the frames of a stream buffer by buffer and returns where their payloads are,
+ * so a writer can reference them in place instead of copying them out; AudioSpecificConfig() builds
+ * the decoder config from the first header, for any sampling frequency and channel configuration.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace fmp4 {
+namespace adts {
+
+static const uint32_t kSamplesPerFrame = 1024;     // of a raw_data_block(), the sample duration
+static const size_t kHeaderSize = 7;
+static const uint8_t kObjectTypeAacLc = 2;
+
+static const uint32_t kSampleRates[] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+static const uint8_t kExplicitSampleRate = 15;     // no index, the rate follows in 24 bits (not in ADTS)
+
+inline uint8_t SampleRateIndex(uint32_t sample_rate)
+{
+    for (uint8_t i = 0; i < sizeof(kSampleRates) / sizeof(kSampleRates[0]); i++) {
+        if (kSampleRates[i] == sample_rate) return i;
+    }
+    return kExplicitSampleRate;
+}
+
+// channel_configuration 1-6 is the channel count, 7 is 7.1; 0 (a PCE in the stream) is not supported
+inline uint32_t ChannelCount(uint8_t channel_config) { return channel_config == 7 ? 8 : channel_config; }
+inline uint8_t ChannelConfig(uint32_t channels) { return channels == 8 ? 7 : channels <= 6 ? (uint8_t)channels : 0; }
+
+struct Header
+{
+    uint8_t object_type;        // audioObjectType, the ADTS profile + 1: 2 for AAC LC
+    uint8_t sample_rate_index;
+    uint8_t channel_config;
+    uint32_t sample_rate;
+    uint32_t header_size;       // 7, or 9 with the CRC
+    uint32_t frame_size;        // header included
+    uint32_t raw_blocks;        // raw_data_block()s in the frame
+};
+
+// The ADTS header at data; false when there is none: no sync word, a layer other than 0, a reserved
+// sampling frequency index, a PCE channel configuration or a frame shorter than its header
+inline bool ParseHeader(const uint8_t *data, size_t size, Header &header)
+{
+    if (size < kHeaderSize || data[0] != 0xff || (data[1] & 0xf6) != 0xf0) return false;
+
+    const bool has_crc = !(data[1] & 0x01);
+    header.object_type       = (uint8_t)((data[2] >> 6) + 1);
+    header.sample_rate_index = (data[2] >> 2) & 0x0f;
+    header.channel_config    = (uint8_t)((data[2] & 0x01) << 2 | data[3] >> 6);
+    header.frame_size        = (uint32_t)(data[3] & 0x03) << 11 | (uint32_t)data[4] << 3 | data[5] >> 5;
+    header.raw_blocks        = (data[6] & 0x03) + 1u;
+    header.header_size       = (uint32_t)kHeaderSize + (has_crc ? 2 : 0);
+
+    if (header.sample_rate_index >= sizeof(kSampleRates) / sizeof(kSampleRates[0]) || !header.channel_config) return false;
+    header.sample_rate = kSampleRates[header.sample_rate_index];
+    return header.frame_size > header.header_size;
+}
+
+// The payload of an AAC frame: bytes [offset, offset + size) of the buffer given to Split(); gap: the
+// samples of the frames skipped right before it, the time to leave between it and the frame before
+struct Frame
+{
+    uint32_t offset;
+    uint32_t size;
+    uint32_t gap;
+};
+
+// The frames of one ADTS stream given in consecutive buffers. The first frame fixes the configuration
+// of the stream (First()); a frame with another one is a configuration change when another header
+// follows it right away, and is skipped (counted in ChangedFrames()), otherwise it is taken for lost sync.
+class Splitter
+{
+public:
+
+    Splitter() : has_first(false), gap(0), changed_frames(0) {}
+
+    // The complete frames of a buffer, appended to frames. Bytes that are not ADTS (sync lost) are
+    // skipped up to the next header, frames with more than one raw_data_block() are skipped (the
+    // blocks cannot be told apart without decoding), both counted in skipped; the samples of skipped
+    // frames go to the gap of the next frame returned, in this buffer or a later one. Returns the
+    // bytes used up: an incomplete frame at the end is left for the next buffer.
+    size_t Split(const uint8_t *data, size_t size, std::vector<Frame> &frames, size_t *skipped = nullptr)
+    {
+        size_t position = 0;
+        Header header, next;
+        while (position + kHeaderSize <= size) {
+            if (!ParseHeader(data + position, size - position, header)) {
+                position++;
+                if (skipped) (*skipped)++;
+                continue;
+            }
+
+            const bool is_same = !has_first || IsSameConfig(header, first);
+            if (!is_same) {
+                // another configuration, or garbage that looks like a header
+                const size_t end = position + header.frame_size;
+                const bool is_change = end == size ||
+                    (end < size && ParseHeader(data + end, size - end, next));
+                if (!is_change) {
+                    position++;
+                    if (skipped) (*skipped)++;
+                    continue;
+                }
+            }
+            if (position + header.frame_size > size) break;
+
+            if (!is_same) {
+                // the time it takes, at the sampling frequency of the stream
+                gap += (uint64_t)header.raw_blocks * kSamplesPerFrame * first.sample_rate / header.sample_rate;
+                changed_frames++;
+                if (skipped) *skipped += header.frame_size;
+            } else if (header.raw_blocks != 1) {
+                gap += (uint64_t)header.raw_blocks * kSamplesPerFrame;
+                if (skipped) *skipped += header.frame_size;
+            } else {
+                if (!has_first) first = header;
+                has_first = true;
+                const Frame frame = { (uint32_t)position + header.header_size, header.frame_size - header.header_size,
+                                      (uint32_t)gap };
+                frames.push_back(frame);
+                gap = 0;
+            }
+            position += header.frame_size;
+        }
+        return position;
+    }
+
+    // The header of the first frame returned, valid once there is one
+    bool HasFirst() const { return has_first; }
+    const Header &First() const { return first; }
+
+    // Frames skipped because they have another configuration than the first
+    uint64_t ChangedFrames() const { return changed_frames; }
+
+private:
+
+    static bool IsSameConfig(const Header &a, const Header &b)
+    {
+        return a.sample_rate_index == b.sample_rate_index && a.channel_config == b.channel_config &&
+               a.object_type == b.object_type;
+    }
+
+    Header first;
+    bool has_first;
+    uint64_t gap;               // samples of the frames skipped since the last frame returned
+    uint64_t changed_frames;
+};
+
+// AudioSpecificConfig (ISO 14496-3 1.6.2.1) for the decoder config of the sample entry: object type,
+// sampling frequency index (or 15 and the rate itself when it has none), channel configuration, and a
+// GASpecificConfig of zeros: 1024 samples per frame, no core coder, no extension
+inline std::vector<uint8_t> AudioSpecificConfig(uint8_t object_type, uint32_t sample_rate, uint8_t channel_config)
+{
+    uint64_t bits = 0;
+    int count = 0;
+    auto put = [&](uint32_t value, int width) {
+        bits = bits << width | (value & ((1u << width) - 1));
+        count += width;
+    };
+
+    const uint8_t index = SampleRateIndex(sample_rate);
+    put(object_type, 5);
+    put(index, 4);
+    if (index == kExplicitSampleRate) put(sample_rate, 24);
+    put(channel_config, 4);
+    put(0, 3);
+
+    const int padding = (8 - count % 8) % 8;
+    bits <<= padding;
+    count += padding;
+
+    std::vector<uint8_t> config(count / 8);
+    for (size_t i = 0; i < config.size(); i++) config[i] = (uint8_t)(bits >> (8 * (config.size() - 1 - i)));
+    return config;
+}
+
+} // namespace adts
+} // namespace fmp4
+
+#endif // FMP4_ADTS_H
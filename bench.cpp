@@ -0,0 +1,1035 @@
+/*
+ * fMP4-bench: reproducible benchmarks for the sample pipelines.
+ *
+ * In-process cases (timed around the hot loop only, input preloaded in memory):
+ *   nalu_scan       gst_h264_parser_identify_nalu + parse_nal over AnnexB samples (ParseH264NALU)
+ *   nalu_type       h264_parser.h type-only tier: start code scan + NAL type byte
+ *   nalu_slice      slice-light tier: + first_mb/slice_type/frame_num of every slice, SPS/PPS fully
+ *                   parsed only when they change (ParameterSetCache)
+ *   nalu_full       full tier on every NAL unit: SPS/PPS re-parsed at each key frame + slice headers
+ *   rbsp_strip      emulation prevention removal over every NAL unit (bit_reader.h, SIMD 00 00 03 scan)
+ *   avcc_to_annexb  length prefix -> start code, in place (MP4Reader::GetNextH264VideoSample)
+ *   annexb_to_avcc  start code -> length prefix, in place (MP4Writer::WriteH264VideoSample)
+ *   mp4_read        MP4Reader style sequential MP4ReadSample through mp4v2
+ *   rescale_exact   video dts replayed to 1M samples, track timescale -> 90 kHz with Rescale() per
+ *                   value (what av_rescale_q_rnd costs in the sample2 remux loop)
+ *   rescale_fast    same with TimestampRescaler over the whole run (timestamp.h)
+ *   yuv_*           3840x2160 test picture generation of sample1 / fMP4-generator (yuv_pattern.h)
+ *   adts_split      10 min of 48 kHz stereo AAC LC in ADTS: frames found and headers stripped, payloads
+ *                   left in place (adts.h, sample10 FMP4_ADTS_MODE)
+ *
+ * Pipeline cases run the sample executables found next to fMP4-bench as child processes, so the
+ * numbers include process start-up. Allocation counts come from the child's metrics dump
+ * (FMP4_METRICS build with FMP4_METRICS_COUNT_ALLOCATIONS), "-" is reported when the child was built
+ * without it.
+ *   sample5   ffmpeg fragment writer, custom AVIO
+ *   sample6   ffmpeg fragment writer, AnnexB input parsed with gst
+ *   sample9   Bento4 one frame per fragment
+ *   sample10  Bento4 audio + video fragments
+ *   sample8   demux of the frag/1/ segments produced by sample7 (sample7 run is not timed)
+ *
+ * Every case runs over every clip: one warm-up, then --repeat timed runs; median and min are
+ * reported as ns/sample, MB/s of input and allocations/sample. On x86 the median is also given in
+ * TSC cycles/sample (reference cycles, not core cycles under frequency scaling).
+ *
+ * The drift report replays the sample durations of every track for 24 hours and gives how far the
+ * end time lands from the exact one, for the former millisecond round trip (ms, then 50 ms for
+ * zero durations, then AP4_ConvertTime to the writer timescale) and for DurationRescaler
+ * (timestamp.h). Filter with "drift".
+ *
+ * usage: fMP4-bench [--repeat N] [--json file] [--filter substring] [clip-dir]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <mp4v2/mp4v2.h>
+#include <netinet/in.h>
+
+#define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
+#include <gst/codecparsers/gsth264parser.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The bench always counts its own allocations, whatever the samples are built with.
+#ifndef FMP4_METRICS
+#define FMP4_METRICS
+#endif
+#ifndef FMP4_METRICS_COUNT_ALLOCATIONS
+#define FMP4_METRICS_COUNT_ALLOCATIONS
+#endif
+
+#include "adts.h"
+#include "h264_parser.h"
+#include "logger.h"
+#include "metrics.h"
+#include "mp4_index.h"
+#include "param_set_cache.h"
+#include "timestamp.h"
+#include "yuv_pattern.h"
+
+#ifndef FMP4_SOURCE_DIR
+#define FMP4_SOURCE_DIR "."
+#endif
+
+static const char *kClips[] = { "dropcam.mp4", "I-only.mp4", "bbc_dash_video.mp4" };
+
+static uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 0 where there is no cycle counter
+static uint64_t Cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t Allocations()
+{
+    return fmp4::metrics::AllocationCount();
+}
+
+struct Clip
+{
+    std::string name;
+    std::string path;
+    uint64_t file_size;
+
+    unsigned int nal_length_size;
+    std::vector<std::vector<uint8_t> > sps, pps;
+
+    std::vector<std::vector<uint8_t> > avcc;      // video samples as stored in the file
+    std::vector<std::vector<uint8_t> > annexb;    // same, AnnexB, SPS/PPS in front of key frames
+    std::vector<bool> is_key_frame;
+    uint64_t video_bytes;
+    size_t audio_samples;
+
+    uint32_t video_timescale;
+    uint32_t audio_timescale;                   // 0 without audio
+    std::vector<uint32_t> video_durations;      // in track timescale ticks
+    std::vector<uint32_t> audio_durations;
+};
+
+struct Result
+{
+    std::string name;
+    std::string clip;
+    std::string status;         // "ok", or why the case could not run
+    uint64_t samples;
+    uint64_t bytes;
+    std::vector<uint64_t> run_ns;
+    std::vector<uint64_t> run_cycles;
+    std::vector<double> run_allocs;
+
+    double MedianNs() const
+    {
+        std::vector<uint64_t> v(run_ns);
+        std::sort(v.begin(), v.end());
+        return v.empty() ? 0 : (double)v[v.size() / 2];
+    }
+
+    double MinNs() const { return run_ns.empty() ? 0 : (double)*std::min_element(run_ns.begin(), run_ns.end()); }
+
+    double NsPerSample() const { return samples ? MedianNs() / samples : 0; }
+    double MinNsPerSample() const { return samples ? MinNs() / samples : 0; }
+    // 0 when there is no cycle counter
+    double CyclesPerSample() const
+    {
+        if (run_cycles.empty() || !samples) return 0;
+        std::vector<uint64_t> v(run_cycles);
+        std::sort(v.begin(), v.end());
+        return (double)v[v.size() / 2] / samples;
+    }
+
+    double MBPerSecond() const { return MedianNs() > 0 ? bytes / (MedianNs() / 1e9) / (1024.0 * 1024.0) : 0; }
+
+    // -1 when unknown
+    double AllocsPerSample() const
+    {
+        if (run_allocs.empty() || !samples) return -1;
+        std::vector<double> v(run_allocs);
+        std::sort(v.begin(), v.end());
+        return v[v.size() / 2] < 0 ? -1 : v[v.size() / 2] / samples;
+    }
+};
+
+struct Options
+{
+    Options() : repeat(5), clip_dir(FMP4_SOURCE_DIR) {}
+
+    int repeat;
+    std::string clip_dir;
+    std::string json_path;
+    std::string filter;
+    std::string bin_dir;
+};
+
+struct Case
+{
+    const char *name;
+    bool (*run)(const Options &options, Clip &clip, Result &result);
+    bool per_clip;      // false: runs once on synthetic input, reported under kSyntheticClip
+};
+
+static const char *kSyntheticClip = "synthetic-2160p";
+
+// Run one warm-up and options.repeat timed iterations of body(). setup() is called untimed before each.
+static void Measure(const Options &options, Result &result,
+                    const std::function<void()> &setup, const std::function<void()> &body)
+{
+    for (int i = -1; i < options.repeat; i++) {
+        setup();
+        uint64_t allocations = Allocations();
+        uint64_t start = NowNs();
+        uint64_t start_cycles = Cycles();
+        body();
+        uint64_t cycles = Cycles() - start_cycles;
+        uint64_t elapsed = NowNs() - start;
+        if (i < 0) continue;
+        result.run_ns.push_back(elapsed);
+        result.run_cycles.push_back(cycles);
+        result.run_allocs.push_back((double)(Allocations() - allocations));
+    }
+}
+
+/*
+ * Clip loading
+ */
+
+static void ToAnnexB(const uint8_t *data, size_t size, unsigned int nal_length_size, std::vector<uint8_t> &out)
+{
+    size_t offset = 0;
+    while (offset + nal_length_size <= size) {
+        uint32_t nal_size = 0;
+        for (unsigned int i = 0; i < nal_length_size; i++) nal_size = nal_size << 8 | data[offset + i];
+        offset += nal_length_size;
+        if (offset + nal_size > size) break;
+
+        static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+        out.insert(out.end(), start_code, start_code + 4);
+        out.insert(out.end(), data + offset, data + offset + nal_size);
+        offset += nal_size;
+    }
+}
+
+static void ToAnnexBParameterSet(const std::vector<uint8_t> &nal, std::vector<uint8_t> &out)
+{
+    static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+    out.insert(out.end(), start_code, start_code + 4);
+    out.insert(out.end(), nal.begin(), nal.end());
+}
+
+static bool LoadClip(const std::string &dir, const char *name, Clip &clip)
+{
+    clip.name            = name;
+    clip.path            = dir + "/" + name;
+    clip.nal_length_size = 4;
+    clip.video_bytes     = 0;
+    clip.audio_samples   = 0;
+    clip.video_timescale = 0;
+    clip.audio_timescale = 0;
+
+    fmp4::MP4Index index;
+    if (!index.Open(clip.path)) {
+        printf("Fail to open clip %s\n", clip.path.c_str());
+        return false;
+    }
+    clip.file_size = index.GetFile().Size();
+
+    fmp4::Track *video = index.VideoTrack();
+    if (!video) {
+        printf("No video track in %s\n", clip.path.c_str());
+        return false;
+    }
+    clip.video_timescale = video->timescale;
+    for (const auto &info : video->samples) clip.video_durations.push_back(info.duration);
+    if (index.AudioTrack()) {
+        clip.audio_samples = index.AudioTrack()->samples.size();
+        clip.audio_timescale = index.AudioTrack()->timescale;
+        for (const auto &info : index.AudioTrack()->samples) clip.audio_durations.push_back(info.duration);
+    }
+
+    // avcC: configurationVersion, profile, compat, level, lengthSizeMinusOne, numSPS, {len, sps}, numPPS, {len, pps}
+    const uint8_t *avcc = nullptr;
+    uint64_t avcc_size = 0;
+    if (video->FindSampleEntryChild(FMP4_FOURCC('a', 'v', 'c', 'C'), avcc, avcc_size) && avcc_size >= 7) {
+        clip.nal_length_size = (avcc[4] & 0x03) + 1;
+
+        uint64_t offset = 5;
+        for (int list = 0; list < 2 && offset < avcc_size; list++) {
+            unsigned int count = list == 0 ? (avcc[offset] & 0x1f) : avcc[offset];
+            offset++;
+            for (unsigned int i = 0; i < count && offset + 2 <= avcc_size; i++) {
+                uint16_t size = fmp4::ReadU16(avcc + offset);
+                offset += 2;
+                if (offset + size > avcc_size) break;
+                (list == 0 ? clip.sps : clip.pps).push_back(std::vector<uint8_t>(avcc + offset, avcc + offset + size));
+                offset += size;
+            }
+        }
+    }
+
+    std::vector<uint8_t> sample;
+    for (const auto &info : video->samples) {
+        if (!index.ReadSample(info, sample)) {
+            printf("Fail to read sample of %s\n", clip.path.c_str());
+            return false;
+        }
+        clip.avcc.push_back(sample);
+        clip.is_key_frame.push_back(info.is_sync);
+        clip.video_bytes += sample.size();
+
+        std::vector<uint8_t> annexb;
+        if (info.is_sync) {
+            for (const auto &sps : clip.sps) ToAnnexBParameterSet(sps, annexb);
+            for (const auto &pps : clip.pps) ToAnnexBParameterSet(pps, annexb);
+        }
+        ToAnnexB(sample.data(), sample.size(), clip.nal_length_size, annexb);
+        clip.annexb.push_back(annexb);
+    }
+    return true;
+}
+
+/*
+ * In-process cases
+ */
+
+static bool RunNaluScan(const Options &options, Clip &clip, Result &result)
+{
+    GstH264NalParser *parser = gst_h264_nal_parser_new();
+    size_t nalus = 0;
+
+    result.samples = clip.annexb.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [] {}, [&] {
+        for (auto &sample : clip.annexb) {
+            GstH264NalUnit nalu = {0};
+            unsigned int offset = 0;
+            while (gst_h264_parser_identify_nalu(parser, sample.data(), offset, sample.size(), &nalu) == GST_H264_PARSER_OK) {
+                gst_h264_parser_parse_nal(parser, &nalu);
+                offset = nalu.size + nalu.offset;
+                nalus++;
+            }
+        }
+    });
+
+    gst_h264_nal_parser_free(parser);
+    return nalus > 0;
+}
+
+static bool RunNaluType(const Options &options, Clip &clip, Result &result)
+{
+    std::vector<fmp4::h264::NalUnit> nalus;
+    size_t vcl = 0;
+
+    result.samples = clip.annexb.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [] {}, [&] {
+        for (auto &sample : clip.annexb) {
+            fmp4::h264::SplitAnnexB(sample.data(), sample.size(), nalus);
+            for (auto &nalu : nalus) vcl += fmp4::h264::IsVcl(nalu.type);
+        }
+    });
+    return vcl > 0;
+}
+
+static bool RunNaluSlice(const Options &options, Clip &clip, Result &result)
+{
+    std::vector<fmp4::h264::NalUnit> nalus;
+    size_t pictures = 0;
+
+    result.samples = clip.annexb.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [] {}, [&] {
+        fmp4::ParameterSetCache parameter_sets;
+        fmp4::h264::SpsInfo sps;
+        for (auto &sample : clip.annexb) {
+            fmp4::h264::SplitAnnexB(sample.data(), sample.size(), nalus);
+            for (auto &nalu : nalus) {
+                if (nalu.type == fmp4::h264::NAL_SPS) {
+                    if (parameter_sets.Update(nalu.data, nalu.size) != fmp4::ParameterSetCache::PARAMETER_SET_UNCHANGED)
+                        fmp4::h264::ParseSps(nalu.data, nalu.size, sps);
+                } else if (nalu.type == fmp4::h264::NAL_PPS) {
+                    parameter_sets.Update(nalu.data, nalu.size);
+                } else if (fmp4::h264::IsVcl(nalu.type)) {
+                    fmp4::h264::SliceHeader header;
+                    if (fmp4::h264::ParseSliceHeader(nalu.data, nalu.size, sps, header) && !header.first_mb_in_slice)
+                        pictures++;
+                }
+            }
+        }
+    });
+    return pictures > 0;
+}
+
+static bool RunNaluFull(const Options &options, Clip &clip, Result &result)
+{
+    std::vector<fmp4::h264::NalUnit> nalus;
+    size_t pictures = 0;
+
+    result.samples = clip.annexb.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [] {}, [&] {
+        fmp4::h264::SpsInfo sps;
+        fmp4::h264::PpsInfo pps;
+        for (auto &sample : clip.annexb) {
+            fmp4::h264::SplitAnnexB(sample.data(), sample.size(), nalus);
+            for (auto &nalu : nalus) {
+                if (nalu.type == fmp4::h264::NAL_SPS) {
+                    fmp4::h264::ParseSps(nalu.data, nalu.size, sps);
+                } else if (nalu.type == fmp4::h264::NAL_PPS) {
+                    fmp4::h264::ParsePps(nalu.data, nalu.size, pps);
+                } else if (fmp4::h264::IsVcl(nalu.type)) {
+                    fmp4::h264::SliceHeader header;
+                    if (fmp4::h264::ParseSliceHeader(nalu.data, nalu.size, sps, header) && !header.first_mb_in_slice)
+                        pictures++;
+                }
+            }
+        }
+    });
+    return pictures > 0;
+}
+
+static bool RunRbspStrip(const Options &options, Clip &clip, Result &result)
+{
+    std::vector<fmp4::h264::NalUnit> nalus;
+    std::vector<uint8_t> rbsp;
+    uint64_t rbsp_bytes = 0;
+
+    result.samples = clip.annexb.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [&] { rbsp_bytes = 0; }, [&] {
+        for (auto &sample : clip.annexb) {
+            fmp4::h264::SplitAnnexB(sample.data(), sample.size(), nalus);
+            for (auto &nalu : nalus) {
+                size_t size = nalu.size;
+                fmp4::StripEmulationPrevention(nalu.data, size, rbsp);
+                rbsp_bytes += size;
+            }
+        }
+    });
+    return rbsp_bytes > 0;
+}
+
+static bool RunAvccToAnnexB(const Options &options, Clip &clip, Result &result)
+{
+    if (clip.nal_length_size != 4) {
+        result.status = "nal length size is not 4, in place conversion not possible";
+        return false;
+    }
+
+    std::vector<std::vector<uint8_t> > work;
+    result.samples = clip.avcc.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [&] { work = clip.avcc; }, [&] {
+        for (auto &sample : work) {
+            uint8_t *p = sample.data();
+            uint8_t *end = p + sample.size();
+            while (p + 4 <= end) {
+                uint32_t nal_size = ntohl(*(uint32_t *)p);
+                *(uint32_t *)p = htonl(1);
+                p += 4 + nal_size;
+            }
+        }
+    });
+    return true;
+}
+
+static bool RunAnnexBToAvcc(const Options &options, Clip &clip, Result &result)
+{
+    GstH264NalParser *parser = gst_h264_nal_parser_new();
+
+    std::vector<std::vector<uint8_t> > work;
+    result.samples = clip.annexb.size();
+    result.bytes   = clip.video_bytes;
+    Measure(options, result, [&] { work = clip.annexb; }, [&] {
+        for (auto &sample : work) {
+            GstH264NalUnit nalu = {0};
+            unsigned int offset = 0;
+            while (gst_h264_parser_identify_nalu(parser, sample.data(), offset, sample.size(), &nalu) == GST_H264_PARSER_OK) {
+                offset = nalu.size + nalu.offset;
+                if (nalu.sc_offset + 4 == nalu.offset) *(uint32_t *)(nalu.data + nalu.sc_offset) = htonl(nalu.size);
+            }
+        }
+    });
+
+    gst_h264_nal_parser_free(parser);
+    return true;
+}
+
+static bool RunMP4Read(const Options &options, Clip &clip, Result &result)
+{
+    MP4FileHandle handle = MP4Read(clip.path.c_str());
+    if (handle == MP4_INVALID_FILE_HANDLE) {
+        result.status = "mp4v2 cannot open the clip";
+        return false;
+    }
+
+    MP4TrackId track_id = MP4FindTrackId(handle, 0, MP4_VIDEO_TRACK_TYPE);
+    uint32_t sample_number = MP4GetTrackNumberOfSamples(handle, track_id);
+    if (track_id == MP4_INVALID_TRACK_ID || sample_number == 0) {
+        MP4Close(handle);
+        result.status = "no samples through mp4v2 (fragmented file)";
+        return false;
+    }
+
+    uint32_t max_size = MP4GetTrackMaxSampleSize(handle, track_id);
+    std::vector<uint8_t> buffer(max_size);
+    uint64_t bytes = 0;
+
+    result.samples = sample_number;
+    Measure(options, result, [&] { bytes = 0; }, [&] {
+        for (MP4SampleId id = 1; id <= sample_number; id++) {
+            uint8_t *p = buffer.data();
+            uint32_t size = max_size;
+            MP4Duration duration = 0;
+            bool is_sync = false;
+            if (!MP4ReadSample(handle, track_id, id, &p, &size, NULL, &duration, NULL, &is_sync)) break;
+            bytes += size;
+        }
+    });
+    result.bytes = bytes;
+
+    MP4Close(handle);
+    return true;
+}
+
+static const size_t kRescaleValues = 1 << 20;
+static const uint32_t kRescaleTimescale = 90000;
+
+// Video dts of the clip, replayed until there are kRescaleValues of them
+static bool MakeRescaleInput(const Clip &clip, Result &result, std::vector<int64_t> &dts)
+{
+    if (clip.video_durations.empty() || !clip.video_timescale) {
+        result.status = "no video durations";
+        return false;
+    }
+
+    dts.resize(kRescaleValues);
+    int64_t next = 0;
+    for (size_t i = 0; i < dts.size(); i++) {
+        dts[i] = next;
+        next += clip.video_durations[i % clip.video_durations.size()];
+    }
+    result.samples = dts.size();
+    result.bytes   = dts.size() * sizeof(int64_t);
+    return true;
+}
+
+static bool RunRescaleExact(const Options &options, Clip &clip, Result &result)
+{
+    std::vector<int64_t> input, work;
+    if (!MakeRescaleInput(clip, result, input)) return false;
+
+    const fmp4::Rational from = fmp4::TimeBase(clip.video_timescale), to = fmp4::TimeBase(kRescaleTimescale);
+    Measure(options, result, [&] { work = input; }, [&] {
+        for (auto &value : work) value = fmp4::Rescale(value, from, to);
+    });
+    return true;
+}
+
+static bool RunRescaleFast(const Options &options, Clip &clip, Result &result)
+{
+    std::vector<int64_t> input, work;
+    if (!MakeRescaleInput(clip, result, input)) return false;
+
+    const fmp4::Rational from = fmp4::TimeBase(clip.video_timescale), to = fmp4::TimeBase(kRescaleTimescale);
+    const fmp4::TimestampRescaler rescaler(from, to);
+    Measure(options, result, [&] { work = input; }, [&] {
+        rescaler.Rescale(work.data(), work.size());
+    });
+
+    for (size_t i = 0; i < input.size(); i++) {
+        if (work[i] != fmp4::Rescale(input[i], from, to)) {
+            result.status = "differs from Rescale()";
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool RunYuvPattern(const Options &options, Result &result, fmp4::yuv::Pattern pattern)
+{
+    const int width = 3840, height = 2160, frames = 100;
+
+    std::vector<uint8_t> planes[3];
+    fmp4::yuv::Picture pict;
+    pict.width  = width;
+    pict.height = height;
+    for (int i = 0; i < 3; i++) {
+        pict.linesize[i] = ((i ? width / 2 : width) + 31) & ~31;
+        planes[i].resize(pict.linesize[i] * (i ? height / 2 : height));
+        pict.data[i] = planes[i].data();
+    }
+
+    fmp4::yuv::Generator generator;
+    result.samples = frames;
+    result.bytes   = (uint64_t)frames * width * height * 3 / 2;
+    Measure(options, result, [] {}, [&] {
+        for (int i = 0; i < frames; i++) generator.Fill(pict, i, pattern, pattern != fmp4::yuv::PATTERN_GRADIENT);
+    });
+    return true;
+}
+
+static bool RunYuvGradient(const Options &options, Clip &, Result &result)
+{
+    return RunYuvPattern(options, result, fmp4::yuv::PATTERN_GRADIENT);
+}
+
+static bool RunYuvBars(const Options &options, Clip &, Result &result)
+{
+    return RunYuvPattern(options, result, fmp4::yuv::PATTERN_BARS);
+}
+
+static bool RunYuvNoise(const Options &options, Clip &, Result &result)
+{
+    return RunYuvPattern(options, result, fmp4::yuv::PATTERN_NOISE);
+}
+
+static bool RunAdtsSplit(const Options &options, Clip &, Result &result)
+{
+    const uint32_t sample_rate = 48000, channel_config = 2, frames = 10 * 60 * sample_rate / fmp4::adts::kSamplesPerFrame;
+
+    // AAC LC frames of 250 to 450 bytes, payloads without 0xff so that only the headers sync
+    std::vector<uint8_t> adts;
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < frames; i++) {
+        seed = seed * 1103515245 + 12345;
+        const uint32_t frame_size = (uint32_t)fmp4::adts::kHeaderSize + 250 + (seed >> 16) % 201;
+        const uint8_t header[fmp4::adts::kHeaderSize] = {
+            0xff, 0xf1,
+            (uint8_t)((fmp4::adts::kObjectTypeAacLc - 1) << 6 | fmp4::adts::SampleRateIndex(sample_rate) << 2 | channel_config >> 2),
+            (uint8_t)((channel_config & 3) << 6 | frame_size >> 11),
+            (uint8_t)(frame_size >> 3),
+            (uint8_t)((frame_size & 7) << 5 | 0x1f),
+            0xfc
+        };
+        adts.insert(adts.end(), header, header + sizeof(header));
+        for (uint32_t j = fmp4::adts::kHeaderSize; j < frame_size; j++) adts.push_back((uint8_t)(i + j) & 0x7f);
+    }
+
+    std::vector<fmp4::adts::Frame> split;
+    split.reserve(frames);
+    fmp4::adts::Splitter splitter;
+    size_t used = 0;
+    result.clip    = "synthetic-48k-stereo";
+    result.samples = frames;
+    result.bytes   = adts.size();
+    Measure(options, result, [&] { splitter = fmp4::adts::Splitter(); split.clear(); }, [&] {
+        used = splitter.Split(adts.data(), adts.size(), split);
+    });
+
+    const fmp4::adts::Header &first = splitter.First();
+    const std::vector<uint8_t> config =
+            fmp4::adts::AudioSpecificConfig(first.object_type, first.sample_rate, first.channel_config);
+    if (split.size() != frames || used != adts.size() || config != std::vector<uint8_t>{0x11, 0x90}) {
+        result.status = "wrong frames or AudioSpecificConfig";
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Pipeline cases
+ */
+
+// Fork/exec argv in work_dir with stdout silenced, return the wall time in ns (0 on failure).
+static uint64_t RunProcess(const std::vector<std::string> &args, const std::string &work_dir,
+                           const std::string &metrics_prefix)
+{
+    std::vector<char *> argv;
+    for (const auto &arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    uint64_t start = NowNs();
+    pid_t pid = fork();
+    if (pid < 0) return 0;
+    if (pid == 0) {
+        if (chdir(work_dir.c_str()) < 0) _exit(127);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        setenv("FMP4_METRICS_FILE", metrics_prefix.c_str(), 1);
+        setenv("FMP4_METRICS_INTERVAL_MS", "0", 1);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    uint64_t elapsed = NowNs() - start;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? elapsed : 0;
+}
+
+// "allocations" of the child's metrics dump, -1 when it was not written.
+static double ReadChildAllocations(const std::string &metrics_prefix)
+{
+    FILE *fptr = fopen((metrics_prefix + ".json").c_str(), "rb");
+    if (!fptr) return -1;
+
+    char buffer[4096];
+    size_t size = fread(buffer, 1, sizeof(buffer) - 1, fptr);
+    fclose(fptr);
+    buffer[size] = 0;
+
+    const char *p = strstr(buffer, "\"allocations\":");
+    return p ? strtod(p + strlen("\"allocations\":"), nullptr) : -1;
+}
+
+static bool MakeWorkDir(const std::string &case_name, std::string &work_dir)
+{
+    char tmpl[256];
+    snprintf(tmpl, sizeof(tmpl), "/tmp/fmp4-bench-%s-XXXXXX", case_name.c_str());
+    if (!mkdtemp(tmpl)) return false;
+    work_dir = tmpl;
+    return true;
+}
+
+static void RemoveWorkDir(const std::string &work_dir)
+{
+    std::string command = "rm -rf '" + work_dir + "'";
+    if (system(command.c_str()) != 0) printf("Fail to remove %s\n", work_dir.c_str());
+}
+
+static bool RunPipeline(const Options &options, Clip &clip, Result &result, const std::string &sample,
+                        uint64_t samples, const std::string &setup_sample = std::string())
+{
+    std::string exe = options.bin_dir + "/fMP4-" + sample;
+    if (access(exe.c_str(), X_OK) != 0) {
+        result.status = "fMP4-" + sample + " not found next to fMP4-bench";
+        return false;
+    }
+
+    std::string work_dir;
+    if (!MakeWorkDir(sample, work_dir)) {
+        result.status = "cannot create work directory";
+        return false;
+    }
+
+    // sample8 consumes frag/1/init.mp4, frag-1.m4s, ... written by sample7 (fails when it demuxes nothing)
+    std::vector<std::string> args;
+    if (!setup_sample.empty()) {
+        std::string setup_exe = options.bin_dir + "/fMP4-" + setup_sample;
+        std::string frag_dir = work_dir + "/frag";
+        mkdir(frag_dir.c_str(), 0755);
+        if (!RunProcess({ setup_exe, clip.path, work_dir + "/setup.mp4" }, work_dir, work_dir + "/setup-metrics")) {
+            result.status = "fMP4-" + setup_sample + " failed";
+            RemoveWorkDir(work_dir);
+            return false;
+        }
+        args = { exe, frag_dir + "/1/", work_dir + "/out.mp4" };
+    } else {
+        args = { exe, clip.path, work_dir + "/out.mp4" };
+    }
+
+    result.samples = samples;
+    result.bytes   = clip.file_size;
+    for (int i = -1; i < options.repeat; i++) {
+        std::string metrics_prefix = work_dir + "/metrics";
+        unlink((metrics_prefix + ".json").c_str());
+        unlink((work_dir + "/out.mp4").c_str());
+
+        uint64_t elapsed = RunProcess(args, work_dir, metrics_prefix);
+        if (!elapsed) {
+            result.status = "fMP4-" + sample + " failed";
+            RemoveWorkDir(work_dir);
+            return false;
+        }
+        if (i < 0) continue;
+        result.run_ns.push_back(elapsed);
+        result.run_allocs.push_back(ReadChildAllocations(metrics_prefix));
+    }
+
+    RemoveWorkDir(work_dir);
+    return true;
+}
+
+static bool RunSample5(const Options &options, Clip &clip, Result &result)
+{
+    return RunPipeline(options, clip, result, "sample5", clip.avcc.size());
+}
+
+static bool RunSample6(const Options &options, Clip &clip, Result &result)
+{
+    return RunPipeline(options, clip, result, "sample6", clip.avcc.size());
+}
+
+static bool RunSample9(const Options &options, Clip &clip, Result &result)
+{
+    return RunPipeline(options, clip, result, "sample9", clip.avcc.size());
+}
+
+static bool RunSample10(const Options &options, Clip &clip, Result &result)
+{
+    return RunPipeline(options, clip, result, "sample10", clip.avcc.size() + clip.audio_samples);
+}
+
+static bool RunSample8(const Options &options, Clip &clip, Result &result)
+{
+    return RunPipeline(options, clip, result, "sample8", clip.avcc.size(), "sample7");
+}
+
+static const Case kCases[] = {
+    { "nalu_scan",      RunNaluScan,     true },
+    { "nalu_type",      RunNaluType,     true },
+    { "nalu_slice",     RunNaluSlice,    true },
+    { "nalu_full",      RunNaluFull,     true },
+    { "rbsp_strip",     RunRbspStrip,    true },
+    { "avcc_to_annexb", RunAvccToAnnexB, true },
+    { "annexb_to_avcc", RunAnnexBToAvcc, true },
+    { "mp4_read",       RunMP4Read,      true },
+    { "rescale_exact",  RunRescaleExact, true },
+    { "rescale_fast",   RunRescaleFast,  true },
+    { "yuv_gradient",   RunYuvGradient,  false },
+    { "yuv_bars",       RunYuvBars,      false },
+    { "yuv_noise",      RunYuvNoise,     false },
+    { "adts_split",     RunAdtsSplit,    false },
+    { "sample5",        RunSample5,      true },
+    { "sample6",        RunSample6,      true },
+    { "sample9",        RunSample9,      true },
+    { "sample10",       RunSample10,     true },
+    { "sample8",        RunSample8,      true },
+};
+
+/*
+ * Timestamp drift
+ */
+
+struct Drift
+{
+    std::string clip;
+    std::string track;
+    uint32_t timescale;
+    uint32_t target_timescale;
+    uint64_t samples;
+    double ms_round_trip_ms;    // end time error after 24 hours, positive: too late
+    double rescaler_ms;
+};
+
+static const double kDriftHours = 24;
+
+// durations: one pass of the track, repeated until kDriftHours. Zero durations become the track
+// average like in the readers.
+static bool MeasureDrift(const Clip &clip, const char *track, const std::vector<uint32_t> &durations,
+                         uint32_t timescale, uint32_t target_timescale, Drift &drift)
+{
+    if (durations.empty() || !timescale) return false;
+
+    uint64_t total = 0;
+    for (uint32_t duration : durations) total += duration;
+    const uint64_t average = total / durations.size();
+    if (!average) return false;
+
+    const uint64_t end = (uint64_t)(kDriftHours * 3600) * timescale;
+    fmp4::DurationRescaler rescaler(fmp4::TimeBase(timescale), fmp4::TimeBase(target_timescale));
+    uint64_t exact = 0, ms_round_trip = 0, rescaled = 0, samples = 0;
+    for (size_t i = 0; exact < end; i++, samples++) {
+        const uint64_t duration = durations[i % durations.size()] ? durations[i % durations.size()] : average;
+        exact += duration;
+
+        uint64_t ms = (1000 * duration) / timescale;
+        if (!ms) ms = 50;
+        ms_round_trip += ms * target_timescale / 1000;
+        rescaled += rescaler.Duration(duration);
+    }
+
+    const double exact_ms = exact * 1000.0 / timescale;
+    drift.clip             = clip.name;
+    drift.track            = track;
+    drift.timescale        = timescale;
+    drift.target_timescale = target_timescale;
+    drift.samples          = samples;
+    drift.ms_round_trip_ms = ms_round_trip * 1000.0 / target_timescale - exact_ms;
+    drift.rescaler_ms      = rescaled * 1000.0 / target_timescale - exact_ms;
+    return true;
+}
+
+// Video goes to the former 9000 Hz writer timescale (sample9/sample10), audio to its sample rate.
+static std::vector<Drift> MeasureDrifts(const std::vector<Clip> &clips)
+{
+    std::vector<Drift> drifts;
+    for (const Clip &clip : clips) {
+        Drift drift;
+        if (MeasureDrift(clip, "video", clip.video_durations, clip.video_timescale, 9000, drift))
+            drifts.push_back(drift);
+        if (MeasureDrift(clip, "audio", clip.audio_durations, clip.audio_timescale, clip.audio_timescale, drift))
+            drifts.push_back(drift);
+    }
+    return drifts;
+}
+
+/*
+ * Reporting
+ */
+
+static std::string JsonEscape(const std::string &s)
+{
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+static bool WriteJson(const std::string &path, const Options &options, const std::vector<Result> &results,
+                      const std::vector<Drift> &drifts)
+{
+    FILE *fptr = fopen(path.c_str(), "wb");
+    if (!fptr) {
+        printf("Fail to open %s\n", path.c_str());
+        return false;
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    time_t now = time(nullptr);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(fptr, "{\n  \"version\": 1,\n  \"date\": \"%s\",\n", date);
+    fprintf(fptr, "  \"host\": {\"system\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\", \"cpus\": %ld},\n",
+            uts.sysname, uts.release, uts.machine, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(fptr, "  \"compiler\": \"%s\",\n  \"repeat\": %d,\n  \"results\": [", JsonEscape(__VERSION__).c_str(), options.repeat);
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(fptr, "%s\n    {\"case\": \"%s\", \"clip\": \"%s\", \"status\": \"%s\", \"samples\": %llu, \"bytes\": %llu",
+                i ? "," : "", r.name.c_str(), r.clip.c_str(), JsonEscape(r.status).c_str(),
+                (unsigned long long)r.samples, (unsigned long long)r.bytes);
+        if (r.status == "ok") {
+            fprintf(fptr, ", \"ns_per_sample\": %.1f, \"min_ns_per_sample\": %.1f, \"cycles_per_sample\": %.0f, \"mb_per_s\": %.2f, \"allocs_per_sample\": ",
+                    r.NsPerSample(), r.MinNsPerSample(), r.CyclesPerSample(), r.MBPerSecond());
+            if (r.AllocsPerSample() < 0) fprintf(fptr, "null");
+            else fprintf(fptr, "%.3f", r.AllocsPerSample());
+            fprintf(fptr, ", \"runs_ns\": [");
+            for (size_t j = 0; j < r.run_ns.size(); j++) fprintf(fptr, "%s%llu", j ? ", " : "", (unsigned long long)r.run_ns[j]);
+            fprintf(fptr, "]");
+        }
+        fprintf(fptr, "}");
+    }
+    fprintf(fptr, "\n  ],\n  \"drift_hours\": %.0f,\n  \"drift\": [", kDriftHours);
+    for (size_t i = 0; i < drifts.size(); i++) {
+        const Drift &d = drifts[i];
+        fprintf(fptr, "%s\n    {\"clip\": \"%s\", \"track\": \"%s\", \"timescale\": %u, \"target_timescale\": %u, \"samples\": %llu, "
+                "\"ms_round_trip_ms\": %.3f, \"rescaler_ms\": %.3f}",
+                i ? "," : "", d.clip.c_str(), d.track.c_str(), d.timescale, d.target_timescale,
+                (unsigned long long)d.samples, d.ms_round_trip_ms, d.rescaler_ms);
+    }
+    fprintf(fptr, "\n  ]\n}\n");
+    fclose(fptr);
+    return true;
+}
+
+static void PrintResult(const Result &r)
+{
+    if (r.status != "ok") {
+        printf("%-16s %-20s %s\n", r.name.c_str(), r.clip.c_str(), r.status.c_str());
+        return;
+    }
+
+    char allocs[32] = "-";
+    if (r.AllocsPerSample() >= 0) snprintf(allocs, sizeof(allocs), "%.2f", r.AllocsPerSample());
+    printf("%-16s %-20s %8llu %14.1f %14.1f %14.0f %10.2f %12s\n", r.name.c_str(), r.clip.c_str(),
+           (unsigned long long)r.samples, r.NsPerSample(), r.MinNsPerSample(), r.CyclesPerSample(), r.MBPerSecond(), allocs);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc) {
+            options.repeat = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--json" && i + 1 < argc) {
+            options.json_path = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg[0] == '-') {
+            printf("usage: %s [--repeat N] [--json file] [--filter substring] [clip-dir]\n", argv[0]);
+            return 1;
+        } else {
+            options.clip_dir = arg;
+        }
+    }
+
+    char exe[4096];
+    ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (n > 0) {
+        exe[n] = 0;
+        options.bin_dir = exe;
+        options.bin_dir = options.bin_dir.substr(0, options.bin_dir.rfind('/'));
+    } else {
+        options.bin_dir = ".";
+    }
+
+    std::vector<Clip> clips;
+    for (const char *name : kClips) {
+        Clip clip;
+        if (!LoadClip(options.clip_dir, name, clip)) return 1;
+        clips.push_back(clip);
+    }
+
+    printf("%-16s %-20s %8s %14s %14s %14s %10s %12s\n",
+           "case", "clip", "samples", "ns/sample", "min ns/sample", "cycles/sample", "MB/s", "allocs/sample");
+
+    Clip synthetic = Clip();
+    synthetic.name = kSyntheticClip;
+
+    std::vector<Result> results;
+    for (const Case &c : kCases) {
+        for (size_t i = 0; i < (c.per_clip ? clips.size() : 1); i++) {
+            Clip &clip = c.per_clip ? clips[i] : synthetic;
+            std::string key = std::string(c.name) + "/" + clip.name;
+            if (!options.filter.empty() && key.find(options.filter) == std::string::npos) continue;
+
+            Result result;
+            result.name    = c.name;
+            result.clip    = clip.name;
+            result.samples = 0;
+            result.bytes   = 0;
+            if (c.run(options, clip, result)) {
+                result.status = "ok";
+            } else if (result.status.empty()) {
+                result.status = "failed";
+            }
+            PrintResult(result);
+            results.push_back(result);
+        }
+    }
+
+    std::vector<Drift> drifts;
+    if (options.filter.empty() || std::string("drift").find(options.filter) != std::string::npos) {
+        drifts = MeasureDrifts(clips);
+        printf("\n%-20s %-6s %10s %10s %12s %20s %14s\n", "drift over 24 h", "track", "timescale", "target",
+               "samples", "ms round trip (ms)", "rescaler (ms)");
+        for (const Drift &d : drifts) {
+            printf("%-20s %-6s %10u %10u %12llu %20.3f %14.3f\n", d.clip.c_str(), d.track.c_str(), d.timescale,
+                   d.target_timescale, (unsigned long long)d.samples, d.ms_round_trip_ms, d.rescaler_ms);
+        }
+    }
+
+    if (!options.json_path.empty() && !WriteJson(options.json_path, options, results, drifts)) return 1;
+    return 0;
+}
@@ -0,0 +1,202 @@
+#ifndef FMP4_BIT_READER_H
+#define FMP4_BIT_READER_H
+
+/*
+ * MSB-first bit reader over a NAL unit payload (RBSP).
+ *
+ * Emulation prevention bytes (00 00 03) are found by FindEmulationPrevention(), an SSE2 scan for the
+ * whole 00 00 03 pattern 16 positions at a time. BitReader scans only a small window ahead of what
+ * it reads (a slice header parse does not touch the rest of the slice) and skips the bytes without
+ * copying; StripEmulationPrevention() gives a whole RBSP and copies only when there is something to
+ * remove. Bits are served from a 64 bit cache refilled eight bytes at a time and Exp-Golomb codes
+ * use count-leading-zeros instead of a bit loop. Reading past the end returns zero bits and sets
+ * IsOverrun().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace fmp4 {
+
+// Offset of the first emulation_prevention_three_byte at or after from, size when there is none
+inline size_t FindEmulationPrevention(const uint8_t *data, size_t size, size_t from)
+{
+    size_t i = from < 2 ? 0 : from - 2;     // i: first of the two zero bytes
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i three = _mm_set1_epi8(3);
+    for (; i + 18 <= size; i += 16) {
+        const __m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+        const __m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        const __m128i b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+        const __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                          _mm_cmpeq_epi8(b2, three));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hit);
+        while (mask) {
+            const size_t offset = i + __builtin_ctz(mask) + 2;
+            if (offset >= from) return offset;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i + 3 <= size; i++) {
+        if (data[i + 2] == 3 && data[i] == 0 && data[i + 1] == 0 && i + 2 >= from) return i + 2;
+    }
+    return size;
+}
+
+// Returns the RBSP: data itself when there is no emulation prevention byte, otherwise a copy
+// without them in rbsp. size is updated to the RBSP size.
+inline const uint8_t *StripEmulationPrevention(const uint8_t *data, size_t &size, std::vector<uint8_t> &rbsp)
+{
+    size_t epb = FindEmulationPrevention(data, size, 0);
+    if (epb == size) return data;
+
+    rbsp.clear();
+    rbsp.reserve(size);
+    size_t start = 0;
+    while (epb < size) {
+        rbsp.insert(rbsp.end(), data + start, data + epb);
+        start = epb + 1;
+        epb = FindEmulationPrevention(data, size, start + 2);
+    }
+    rbsp.insert(rbsp.end(), data + start, data + size);
+
+    size = rbsp.size();
+    return rbsp.data();
+}
+
+class BitReader
+{
+public:
+
+    // data: NAL unit payload, with emulation prevention bytes
+    BitReader(const uint8_t *data, size_t size)
+        : data(data), size(size), position(0), scan_end(0), epb(0), cache(0), cache_bits(0), is_overrun(false)
+    {
+    }
+
+    uint32_t ReadBit()
+    {
+        return ReadBits(1);
+    }
+
+    // n <= 32
+    uint32_t ReadBits(unsigned int n)
+    {
+        if (!n) return 0;
+        if (cache_bits < n) {
+            Refill();
+            if (cache_bits < n) {
+                // the bits after the end of the cache are zero
+                is_overrun = true;
+                cache_bits = n;
+            }
+        }
+        const uint32_t value = (uint32_t)(cache >> (64 - n));
+        cache <<= n;
+        cache_bits -= n;
+        return value;
+    }
+
+    void SkipBits(unsigned int n)
+    {
+        for (; n > 32; n -= 32) ReadBits(32);
+        ReadBits(n);
+    }
+
+    // ue(v)
+    uint32_t ReadUE()
+    {
+        if (cache_bits < 32) Refill();
+        if (!cache) {
+            // more than 31 leading zeros (or the end of data): not a valid code for us
+            is_overrun = true;
+            cache_bits = 0;
+            return 0;
+        }
+        const unsigned int leading_zeros = __builtin_clzll(cache);
+        if (leading_zeros > 31 || leading_zeros >= cache_bits) {
+            is_overrun = true;
+            cache_bits = 0;
+            cache = 0;
+            return 0;
+        }
+        SkipBits(leading_zeros);
+        return ReadBits(leading_zeros + 1) - 1;
+    }
+
+    // se(v)
+    int32_t ReadSE()
+    {
+        uint32_t value = ReadUE();
+        return (value & 1) ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+    }
+
+    bool IsOverrun() const { return is_overrun; }
+
+private:
+
+    enum { SCAN_WINDOW = 32 };
+
+    // Look for the next emulation prevention byte in [position, position + SCAN_WINDOW)
+    void ScanAhead()
+    {
+        scan_end = position + SCAN_WINDOW < size ? position + SCAN_WINDOW : size;
+        epb = FindEmulationPrevention(data, scan_end, position);     // scan_end: none in the window
+    }
+
+    // Top up the cache to at least 57 bits (or the end of data). Bits below cache_bits stay zero.
+    void Refill()
+    {
+        while (cache_bits <= 56 && position < size) {
+            if (position >= scan_end) ScanAhead();
+            if (position == epb && epb < scan_end) {
+                position++;
+                ScanAhead();
+                continue;
+            }
+
+            const size_t clean = (epb < scan_end ? epb : scan_end) - position;
+            if (clean >= 8) {
+                uint64_t word;
+                memcpy(&word, data + position, 8);
+                word = __builtin_bswap64(word);
+                const unsigned int bytes = (64 - cache_bits) >> 3;
+                const unsigned int bits = bytes * 8;
+                // keep only the whole bytes that fit
+                word >>= cache_bits;
+                word &= ~((1ull << (64 - cache_bits - bits)) - 1);
+                cache |= word;
+                cache_bits += bits;
+                position += bytes;
+                return;
+            }
+
+            cache |= (uint64_t)data[position++] << (56 - cache_bits);
+            cache_bits += 8;
+        }
+    }
+
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+    size_t scan_end;            // [position, scan_end) has been searched for emulation prevention
+    size_t epb;                 // next emulation prevention byte, scan_end when none
+    uint64_t cache;             // next bits, MSB first
+    unsigned int cache_bits;
+    bool is_overrun;
+};
+
+} // namespace fmp4
+
+#endif // FMP4_BIT_READER_H
@@ -0,0 +1,262 @@
+#ifndef FMP4_CMAF_H
+#define FMP4_CMAF_H
+
+/*
+ * CMAF chunked output: segments that start on key frames, written as a series of chunks (moof+mdat).
+ *
+ * ChunkScheduler decides where a writer that fragments on demand (movflags frag_custom) cuts its
+ * chunks: before every key frame, so that segments start on one, and after a number of frames or a
+ * duration, whichever comes first. The latency is that of a chunk, a client still fetches (and a
+ * cache still stores) whole segments.
+ *
+ * SegmentBuffer holds a segment while it is written, for sinks that send it on before it is complete
+ * (chunked transfer, LL-HLS parts). It is backed by a memfd: one writer appends, any number of readers
+ * in any thread pread() or sendfile() the bytes below Size(), which never move. The chunk boundaries
+ * come from Segmenter::on_chunk_end.
+ *
+ * SegmentRing keeps the init segment and the last few segments of a writer, fed from the Segmenter
+ * callbacks, and tells sinks (an HTTP server) when a segment is added, dropped or has grown.
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "segmenter.h"
+
+namespace fmp4 {
+
+class ChunkScheduler
+{
+public:
+
+    // max_frames, max_duration (any clock): 0 for no limit
+    ChunkScheduler(uint32_t max_frames, uint64_t max_duration)
+        : max_frames(max_frames), max_duration(max_duration), frames(0), duration(0)
+    {
+    }
+
+    // A frame is about to be written: the open chunk has to be cut first
+    bool IsCutBefore(bool is_key_frame) const { return frames && is_key_frame; }
+
+    // A frame was written: the chunk is full
+    bool AddFrame(uint64_t frame_duration)
+    {
+        frames++;
+        duration += frame_duration;
+        return (max_frames && frames >= max_frames) || (max_duration && duration >= max_duration);
+    }
+
+    void Cut()
+    {
+        frames = 0;
+        duration = 0;
+    }
+
+private:
+
+    const uint32_t max_frames;
+    const uint64_t max_duration;
+    uint32_t frames;            // in the open chunk
+    uint64_t duration;
+};
+
+class SegmentBuffer
+{
+public:
+
+    // number: of the segment, 0 for the init segment
+    explicit SegmentBuffer(uint32_t number)
+        : number(number), fd(memfd_create("fmp4-segment", MFD_CLOEXEC)), size(0), is_complete(false)
+    {
+    }
+
+    ~SegmentBuffer()
+    {
+        if (fd >= 0) close(fd);
+    }
+
+    SegmentBuffer(const SegmentBuffer &) = delete;
+    SegmentBuffer &operator=(const SegmentBuffer &) = delete;
+
+    bool IsOpen() const { return fd >= 0; }
+
+    uint32_t Number() const { return number; }
+
+    // Writer side
+
+    bool Append(const uint8_t *data, size_t length)
+    {
+        uint64_t end = size.load(std::memory_order_relaxed);
+        while (length) {
+            const ssize_t n = pwrite(fd, data, length, (off_t)end);
+            if (n <= 0) return false;
+            data += n;
+            length -= (size_t)n;
+            end += (uint64_t)n;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size.store(end, std::memory_order_release);
+        }
+        grown.notify_all();
+        return true;
+    }
+
+    void AddChunk(const MediaChunk &chunk)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunks.push_back(chunk);
+        }
+        grown.notify_all();
+    }
+
+    void Complete()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_complete.store(true, std::memory_order_release);
+        }
+        grown.notify_all();
+    }
+
+    // Reader side, any thread
+
+    // Bytes that can be read: [0, Size()) of Descriptor() is written and stays as it is
+    uint64_t Size() const { return size.load(std::memory_order_acquire); }
+
+    int Descriptor() const { return fd; }
+
+    bool IsComplete() const { return is_complete.load(std::memory_order_acquire); }
+
+    size_t Read(uint64_t offset, uint8_t *out, size_t length) const
+    {
+        const uint64_t available = Size();
+        if (offset >= available) return 0;
+        if (length > available - offset) length = (size_t)(available - offset);
+        const ssize_t n = pread(fd, out, length, (off_t)offset);
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    // Complete chunks so far
+    std::vector<MediaChunk> Chunks() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return chunks;
+    }
+
+    // Wait until there are more than offset bytes or the segment is complete; the new Size()
+    uint64_t WaitForData(uint64_t offset, int timeout_ms) const
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        grown.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                       [&] { return Size() > offset || IsComplete(); });
+        return Size();
+    }
+
+private:
+
+    const uint32_t number;
+    const int fd;
+    std::atomic<uint64_t> size;
+    std::atomic<bool> is_complete;
+    std::vector<MediaChunk> chunks;
+    mutable std::mutex mutex;           // chunks, and the waits on size and is_complete
+    mutable std::condition_variable grown;
+};
+
+class SegmentRing
+{
+public:
+
+    std::function<void(const std::shared_ptr<const SegmentBuffer> &segment)> on_add;
+    std::function<void(uint32_t number)> on_drop;
+    std::function<void()> on_update;            // a chunk or a segment is complete
+
+    // capacity: media segments kept, the one being written included. The sinks behind the callbacks
+    // have to outlive the ring, it drops its segments when it goes.
+    explicit SegmentRing(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    ~SegmentRing()
+    {
+        for (const std::shared_ptr<SegmentBuffer> &segment : segments) {
+            if (on_drop) on_drop(segment->Number());
+        }
+        if (init && on_drop) on_drop(0);
+    }
+
+    // Segmenter::on_segment_start: completes the previous segment (the init segment has no end of
+    // its own); a new init segment drops the segments of the previous one
+    bool Open(uint32_t number)
+    {
+        Complete();
+
+        std::shared_ptr<SegmentBuffer> segment = std::make_shared<SegmentBuffer>(number);
+        if (!segment->IsOpen()) return false;
+
+        while (!segments.empty() && (!number || segments.size() >= capacity)) {
+            if (on_drop) on_drop(segments.front()->Number());
+            segments.pop_front();
+        }
+        if (number) {
+            segments.push_back(segment);
+        } else {
+            init = segment;
+        }
+        current = segment;
+        if (on_add) on_add(segment);
+        return true;
+    }
+
+    // Segmenter::on_data
+    bool Append(const uint8_t *data, size_t size)
+    {
+        return current && current->Append(data, size);
+    }
+
+    // Segmenter::on_chunk_end
+    void AddChunk(const MediaChunk &chunk)
+    {
+        if (!current) return;
+        current->AddChunk(chunk);
+        if (on_update) on_update();
+    }
+
+    // Segmenter::on_segment_end
+    void Complete()
+    {
+        if (!current) return;
+        current->Complete();
+        current.reset();
+        if (on_update) on_update();
+    }
+
+    std::shared_ptr<const SegmentBuffer> Init() const { return init; }
+
+    // oldest first
+    std::vector<std::shared_ptr<const SegmentBuffer>> Segments() const
+    {
+        return std::vector<std::shared_ptr<const SegmentBuffer>>(segments.begin(), segments.end());
+    }
+
+private:
+
+    const size_t capacity;
+    std::shared_ptr<SegmentBuffer> init;
+    std::deque<std::shared_ptr<SegmentBuffer>> segments;
+    std::shared_ptr<SegmentBuffer> current;     // being written
+};
+
+} // namespace fmp4
+
+#endif // FMP4_CMAF_H
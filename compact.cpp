@@ -0,0 +1,245 @@
+/*
+ * fMP4-compact: merge the one-frame fragments of a low latency recording into GOP-sized fragments.
+ *
+ * Files written in FMP4_ONEFRAME_MODE (sample6) or by sample9 have a moof per frame: about 100 bytes
+ * of boxes per frame and thousands of fragments for a player to walk when it seeks. The compactor
+ * reads such a file once, front to back (ftyp, moov, then moof + mdat pairs, see
+ * MP4Index::AddMoof()), and writes the result once: every output fragment starts at a video key
+ * frame and has one traf per track with a single trun for the whole GOP.
+ *
+ * Memory is bounded by one output fragment, at most kMaxFragmentBytes of samples (a fragment is
+ * closed early beyond that). Without a video track a fragment is closed every
+ * kAudioOnlyFragmentSeconds. Other top-level boxes of the input (sidx, mfra, ...) describe the old
+ * fragments and are dropped. An init segment in the middle of the input (fMP4-concat output, sample6
+ * after a parameter set change) closes the open fragment and is copied, its tracks apply from there.
+ *
+ * usage: fMP4-compact input.mp4 output.mp4
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "logger.h"
+#include "mp4_builder.h"
+#include "mp4_index.h"
+
+static const uint64_t kMaxFragmentBytes = 64 << 20;
+static const double kAudioOnlyFragmentSeconds = 2.0;
+
+static double NowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Collects the samples of one output fragment per track and writes it as moof + mdat
+class FragmentCollector
+{
+public:
+
+    explicit FragmentCollector(fmp4::OutputFile &output)
+        : output(output), writer(header), video_track(-1), pending_bytes(0), fragments(0)
+    {
+    }
+
+    // After Flush(): the tracks of a new moov
+    void SetTracks(const std::vector<fmp4::Track> &tracks)
+    {
+        video_track = -1;
+        runs.resize(tracks.size());
+        payloads.resize(tracks.size());
+        timescales.resize(tracks.size());
+        for (size_t t = 0; t < tracks.size(); t++) {
+            runs[t].track_id = tracks[t].track_id;
+            timescales[t] = tracks[t].timescale;
+            if (video_track < 0 && tracks[t].IsVideo()) video_track = (int)t;
+        }
+    }
+
+    bool Add(size_t t, const fmp4::Sample &sample, const uint8_t *payload)
+    {
+        if (pending_bytes && IsFragmentStart(t, sample) && !Flush()) return false;
+
+        fmp4::TrackRun &run = runs[t];
+        if (run.samples.empty()) run.base_dts = sample.dts;
+        fmp4::FragmentSample out = { sample.size, sample.duration, fmp4::SampleFlags(sample.is_sync), sample.cts_offset };
+        run.samples.push_back(out);
+        payloads[t].insert(payloads[t].end(), payload, payload + sample.size);
+        pending_bytes += sample.size;
+        return true;
+    }
+
+    bool Flush()
+    {
+        present.clear();
+        for (size_t t = 0; t < runs.size(); t++) {
+            if (!runs[t].samples.empty()) present.push_back(runs[t]);
+        }
+        if (present.empty()) return true;
+
+        header.clear();
+        fmp4::WriteFragmentHeader(writer, ++fragments, present);
+        if (!output.Write(header)) return false;
+        for (size_t t = 0; t < runs.size(); t++) {
+            if (!payloads[t].empty() && !output.Write(payloads[t])) return false;
+            runs[t].samples.clear();
+            payloads[t].clear();
+        }
+        pending_bytes = 0;
+        return true;
+    }
+
+    uint32_t Fragments() const { return fragments; }
+
+private:
+
+    bool IsFragmentStart(size_t t, const fmp4::Sample &sample) const
+    {
+        if (pending_bytes + sample.size > kMaxFragmentBytes) return true;
+        if (video_track >= 0) return (int)t == video_track && sample.is_sync;
+
+        const fmp4::TrackRun &run = runs[t];
+        return !run.samples.empty() && sample.dts - run.base_dts >= kAudioOnlyFragmentSeconds * timescales[t];
+    }
+
+    fmp4::OutputFile &output;
+    std::vector<uint8_t> header;
+    fmp4::BoxWriter writer;
+    std::vector<fmp4::TrackRun> runs;           // per input track, samples of the open fragment
+    std::vector<fmp4::TrackRun> present;        // the non-empty ones, at flush
+    std::vector<std::vector<uint8_t> > payloads;
+    std::vector<uint32_t> timescales;
+    int video_track;
+    uint64_t pending_bytes;
+    uint32_t fragments;
+};
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        printf("usage: %s input.mp4 output.mp4\n", argv[0]);
+        return 1;
+    }
+    const std::string input_path = argv[1], output_path = argv[2];
+
+    const double start = NowSeconds();
+
+    fmp4::File input;
+    if (!input.Open(input_path)) {
+        FMP4_LOGE("cannot open %s\n", input_path.c_str());
+        return 1;
+    }
+    posix_fadvise(input.Descriptor(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    fmp4::OutputFile output;
+    if (!output.Open(output_path)) {
+        FMP4_LOGE("cannot create %s\n", output_path.c_str());
+        return 1;
+    }
+
+    fmp4::MP4Index index;
+    FragmentCollector collector(output);
+    std::vector<uint8_t> box_data, mdat;
+    uint32_t input_fragments = 0;
+    uint64_t samples = 0, payload_bytes = 0, dropped_bytes = 0;
+    bool has_moov = false;
+
+    uint64_t offset = 0;
+    fmp4::BoxHeader box;
+    while (fmp4::ReadBoxHeader(input, offset, box) && box.End() <= input.Size()) {
+        offset = box.End();
+
+        if (box.type == FMP4_FOURCC('f', 't', 'y', 'p') || box.type == FMP4_FOURCC('m', 'o', 'o', 'v')) {
+            box_data.resize(box.size);
+            if (!input.Read(box.offset, box_data.data(), box.size)) {
+                FMP4_LOGE("cannot read %s\n", fmp4::FourCCString(box.type).c_str());
+                return 1;
+            }
+            if (box.type == FMP4_FOURCC('m', 'o', 'o', 'v')) {
+                if (!index.AddMoov(box_data)) {
+                    FMP4_LOGE("cannot parse moov\n");
+                    return 1;
+                }
+                if (!index.IsFragmented()) {
+                    FMP4_LOGE("%s is not fragmented (no mvex), nothing to compact\n", input_path.c_str());
+                    return 1;
+                }
+            }
+            // the fragment of the previous init segment goes before this one
+            if (!collector.Flush() || !output.Write(box_data)) {
+                FMP4_LOGE("cannot copy %s\n", fmp4::FourCCString(box.type).c_str());
+                return 1;
+            }
+            if (box.type == FMP4_FOURCC('m', 'o', 'o', 'v')) {
+                collector.SetTracks(index.Tracks());
+                has_moov = true;
+            }
+        } else if (box.type == FMP4_FOURCC('m', 'o', 'o', 'f') && has_moov) {
+            box_data.resize(box.size);
+            if (!input.Read(box.offset, box_data.data(), box.size) || !index.AddMoof(box, box_data)) {
+                FMP4_LOGE("cannot parse moof at %llu\n", (unsigned long long)box.offset);
+                return 1;
+            }
+            input_fragments++;
+        } else if (box.type == FMP4_FOURCC('m', 'd', 'a', 't') && has_moov) {
+            mdat.resize(box.PayloadSize());
+            if (!input.Read(box.PayloadOffset(), mdat.data(), mdat.size())) {
+                FMP4_LOGE("cannot read mdat at %llu\n", (unsigned long long)box.offset);
+                return 1;
+            }
+
+            // video first, so a key frame closes the fragment before the rest of its moof is added
+            std::vector<fmp4::Track> &tracks = index.Tracks();
+            std::vector<size_t> order;
+            for (size_t t = 0; t < tracks.size(); t++) {
+                if (tracks[t].IsVideo()) order.insert(order.begin(), t);
+                else order.push_back(t);
+            }
+            for (size_t t : order) {
+                for (const fmp4::Sample &sample : tracks[t].samples) {
+                    if (sample.offset < box.PayloadOffset() || sample.offset + sample.size > box.End()) {
+                        FMP4_LOGE("sample at %llu is not in the mdat that follows its moof\n",
+                                  (unsigned long long)sample.offset);
+                        return 1;
+                    }
+                    if (!collector.Add(t, sample, mdat.data() + (sample.offset - box.PayloadOffset()))) {
+                        FMP4_LOGE("cannot write %s\n", output_path.c_str());
+                        return 1;
+                    }
+                    samples++;
+                    payload_bytes += sample.size;
+                }
+            }
+            index.ClearSamples();
+        } else {
+            dropped_bytes += box.size;
+        }
+    }
+
+    if (!has_moov) {
+        FMP4_LOGE("%s has no moov\n", input_path.c_str());
+        return 1;
+    }
+    if (!collector.Flush() || !output.Close()) {
+        FMP4_LOGE("cannot write %s\n", output_path.c_str());
+        return 1;
+    }
+
+    const double seconds = NowSeconds() - start;
+    const uint64_t input_size = input.Size(), output_size = output.Position();
+    printf("%s: %u fragments -> %u, %llu samples\n", output_path.c_str(), input_fragments, collector.Fragments(),
+           (unsigned long long)samples);
+    printf("size %llu -> %llu bytes (%.1f%%), box overhead %.1f -> %.1f bytes/sample",
+           (unsigned long long)input_size, (unsigned long long)output_size,
+           input_size ? 100.0 * output_size / input_size : 0.0,
+           samples ? (double)(input_size - payload_bytes - dropped_bytes) / samples : 0.0,
+           samples ? (double)(output_size - payload_bytes) / samples : 0.0);
+    if (dropped_bytes) printf(", %llu bytes of other boxes dropped", (unsigned long long)dropped_bytes);
+    printf("\n%.3f s, %.1f MB/s of input\n", seconds, seconds > 0 ? input_size / seconds / (1024.0 * 1024.0) : 0.0);
+    return 0;
+}
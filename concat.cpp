@@ -0,0 +1,74 @@
+/*
+ * fMP4-concat: join MP4 or fMP4 recordings into one fMP4 file on a continuous timeline (mp4_concat.h).
+ *
+ * Sequence numbers and decode times go on from one input to the next, and one init segment is
+ * written for as long as the codec parameters stay the same. The samples are copied as byte
+ * ranges and never parsed, so joining an hour of camera clips costs about as much as copying them.
+ * One input is indexed at a time.
+ *
+ * usage: fMP4-concat input1 [input2 ...] output.mp4
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+
+#include "logger.h"
+#include "mp4_builder.h"
+#include "mp4_concat.h"
+#include "mp4_index.h"
+
+static double NowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("usage: %s input1 [input2 ...] output.mp4\n", argv[0]);
+        return 1;
+    }
+    const std::string output_path = argv[argc - 1];
+
+    const double start = NowSeconds();
+
+    fmp4::OutputFile output;
+    if (!output.Open(output_path)) {
+        FMP4_LOGE("cannot create %s\n", output_path.c_str());
+        return 1;
+    }
+
+    fmp4::Concatenator concatenator(output);
+    uint64_t input_bytes = 0;
+    for (int i = 1; i < argc - 1; i++) {
+        fmp4::MP4Index index;
+        if (!index.Open(argv[i])) {
+            FMP4_LOGE("cannot index %s\n", argv[i]);
+            return 1;
+        }
+        if (!concatenator.Add(index)) {
+            FMP4_LOGE("cannot append %s\n", argv[i]);
+            return 1;
+        }
+        input_bytes += index.GetFile().Size();
+        printf("#%d: %s (%s), %.3f s\n", i, argv[i], index.IsFragmented() ? "fragmented" : "progressive",
+               concatenator.Result().duration);
+    }
+    if (!output.Close()) {
+        FMP4_LOGE("cannot write %s\n", output_path.c_str());
+        return 1;
+    }
+
+    const fmp4::ConcatResult &result = concatenator.Result();
+    const double seconds = NowSeconds() - start;
+    printf("%s: %u inputs, %.3f s, %llu video samples in %u fragments, %u init segment(s)\n", output_path.c_str(),
+           result.inputs, result.duration, (unsigned long long)result.video_samples, result.fragments,
+           result.init_segments);
+    printf("%llu of %llu input bytes copied, %.3f s (%.1f MB/s)\n", (unsigned long long)result.bytes_copied,
+           (unsigned long long)input_bytes, seconds, seconds > 0 ? input_bytes / seconds / 1e6 : 0.0);
+    return 0;
+}
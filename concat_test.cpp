@@ -0,0 +1,116 @@
+/*
+ * fMP4-concat-test: concatenation of inputs with the same and with different tracks, and the index of
+ * the result (mp4_concat.h, MP4Index::Open()).
+ *
+ * Two inputs with the same tracks share one init segment and index as one timeline. Inputs with
+ * different tracks get a second ftyp + moov; the output indexes as the tracks of the last init
+ * segment, each with its own samples in its own timescale.
+ *
+ * usage: fMP4-concat-test same.mp4 other.mp4 (the clips differ in their video timescale)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "mp4_builder.h"
+#include "mp4_concat.h"
+#include "mp4_index.h"
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition);       \
+            return false;                                                       \
+        }                                                                       \
+    } while (0)
+
+// Concatenate inputs into path; video_samples: per input, the video samples written
+static bool Concat(const std::vector<std::string> &inputs, const std::string &path, std::vector<uint64_t> &video_samples)
+{
+    fmp4::OutputFile output;
+    CHECK(output.Open(path));
+    fmp4::Concatenator concatenator(output);
+    for (const std::string &input : inputs) {
+        fmp4::MP4Index index;
+        CHECK(index.Open(input));
+        const uint64_t before = concatenator.Result().video_samples;
+        CHECK(concatenator.Add(index));
+        video_samples.push_back(concatenator.Result().video_samples - before);
+    }
+    CHECK(output.Close());
+    return true;
+}
+
+// dts of every track goes on without a gap or an overlap
+static bool IsContinuous(const fmp4::Track &track)
+{
+    for (size_t i = 1; i < track.samples.size(); i++) {
+        if (track.samples[i].dts != track.samples[i - 1].dts + track.samples[i - 1].duration) return false;
+    }
+    return true;
+}
+
+static bool TestSameTracks(const std::string &clip, const std::string &path)
+{
+    std::vector<uint64_t> video_samples;
+    CHECK(Concat({ clip, clip }, path, video_samples));
+
+    fmp4::MP4Index input, output;
+    CHECK(input.Open(clip));
+    CHECK(output.Open(path));
+    CHECK(output.InitSegments() == 1);
+    CHECK(output.Tracks().size() == input.Tracks().size());
+    CHECK(output.VideoTrack() && output.VideoTrack()->timescale == input.VideoTrack()->timescale);
+    CHECK(output.VideoTrack()->samples.size() == video_samples[0] + video_samples[1]);
+    CHECK(IsContinuous(*output.VideoTrack()));
+    return true;
+}
+
+static bool TestDifferentTracks(const std::string &clip, const std::string &other, const std::string &path)
+{
+    std::vector<uint64_t> video_samples;
+    CHECK(Concat({ clip, other }, path, video_samples));
+
+    fmp4::MP4Index input, output;
+    CHECK(input.Open(other));
+    CHECK(output.Open(path));
+    CHECK(output.InitSegments() == 2);
+
+    // the tracks of the second init segment only, no track listed twice
+    CHECK(output.Tracks().size() == input.Tracks().size());
+    for (const fmp4::Track &track : output.Tracks()) {
+        const fmp4::Track *source = input.FindTrackById(track.track_id);
+        CHECK(source && source->timescale == track.timescale && source->handler == track.handler);
+    }
+    CHECK(output.VideoTrack() && output.VideoTrack()->timescale == input.VideoTrack()->timescale);
+    CHECK(output.VideoTrack()->samples.size() == video_samples[1]);
+    CHECK(IsContinuous(*output.VideoTrack()));
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        printf("usage: %s same.mp4 other.mp4\n", argv[0]);
+        return 1;
+    }
+
+    char path[] = "/tmp/fmp4-concat-test-XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("cannot create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+
+    bool ok = true;
+    ok = TestSameTracks(argv[1], path) && ok;
+    ok = TestDifferentTracks(argv[1], argv[2], path) && ok;
+    unlink(path);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
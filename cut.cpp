@@ -0,0 +1,69 @@
+/*
+ * fMP4-cut: lossless clip export from an MP4 or fMP4 recording (mp4_cut.h).
+ *
+ * The clip is widened to the key frames around [start, end] and written as fMP4 starting at time
+ * zero. Only the index (moov, or the moof boxes of fragmented input) and the clip's own bytes are
+ * read, so a one minute clip of a 24 hour recording costs about as much as the minute.
+ *
+ * usage: fMP4-cut input start-ms end-ms output.mp4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+#include "logger.h"
+#include "mp4_cut.h"
+#include "mp4_index.h"
+
+static double NowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 5) {
+        printf("usage: %s input start-ms end-ms output.mp4\n", argv[0]);
+        return 1;
+    }
+    const std::string input_path = argv[1], output_path = argv[4];
+    const uint64_t start_ms = strtoull(argv[2], nullptr, 10), end_ms = strtoull(argv[3], nullptr, 10);
+    if (end_ms <= start_ms) {
+        printf("end must be after start\n");
+        return 1;
+    }
+
+    const double start = NowSeconds();
+
+    fmp4::MP4Index index;
+    if (!index.Open(input_path)) {
+        FMP4_LOGE("cannot index %s\n", input_path);
+        return 1;
+    }
+
+    fmp4::OutputFile output;
+    if (!output.Open(output_path)) {
+        FMP4_LOGE("cannot create %s\n", output_path);
+        return 1;
+    }
+
+    fmp4::CutResult result;
+    if (!fmp4::CutMP4(index, start_ms, end_ms, output, result) || !output.Close()) {
+        FMP4_LOGE("cannot cut %s\n", input_path);
+        return 1;
+    }
+
+    const double seconds = NowSeconds() - start;
+    printf("%s: %.3f s - %.3f s of %s (%s), %llu video samples in %u fragments\n", output_path.c_str(),
+           result.start_time, result.end_time, input_path.c_str(), index.IsFragmented() ? "fragmented" : "progressive",
+           (unsigned long long)result.video_samples, result.fragments);
+    printf("%llu of %llu input bytes copied (%.1f%%), %.3f s\n", (unsigned long long)result.bytes_copied,
+           (unsigned long long)index.GetFile().Size(),
+           index.GetFile().Size() ? 100.0 * result.bytes_copied / index.GetFile().Size() : 0.0, seconds);
+    return 0;
+}
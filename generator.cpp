@@ -0,0 +1,619 @@
+/*
+ * Synthetic H.264/AAC corpus generator, built on the muxing example of sample1.
+ *
+ * Produces <output>.mp4 plus the raw elementary streams <output>.h264 (AnnexB, SPS/PPS in front of
+ * every IDR) and <output>.aac (ADTS), so benchmarks and servers can be fed at realistic sizes.
+ *
+ * Multiple SPS/PPS: every GOP is encoded by its own libx264 instance using sps-id (GOP index modulo
+ * the number of parameter sets). All parameter sets are listed in the avcC box of the MP4 and are
+ * repeated in-band in the AnnexB stream.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+#include <libavformat/avformat.h>
+}
+
+#include "adts.h"
+#include "h264_parser.h"
+#include "logger.h"
+#include "yuv_pattern.h"
+
+static const std::string av_make_error_string(int errnum)
+{
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(errnum, errbuf, AV_ERROR_MAX_STRING_SIZE);
+    return (std::string)errbuf;
+}
+
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string(errnum).c_str()
+
+struct GeneratorOptions
+{
+    GeneratorOptions()
+        : width(1280), height(720), fps(25), gop(50), b_frames(0), slices(1), parameter_sets(1)
+        , bit_rate(2000000), audio_sample_rate(48000), audio_channels(2), hours(10.0 / 3600)
+        , fragmented(false), pattern(fmp4::yuv::PATTERN_GRADIENT), burn_in(false)
+    {
+    }
+
+    int width, height;
+    int fps;
+    int gop;
+    int b_frames;
+    int slices;
+    int parameter_sets;         // number of SPS/PPS pairs, rotated per GOP
+    int bit_rate;
+    int audio_sample_rate;      // 0: no audio
+    int audio_channels;
+    double hours;
+    bool fragmented;
+    fmp4::yuv::Pattern pattern;
+    bool burn_in;               // frame number and time in the top left corner
+    std::string output;
+};
+
+// a wrapper around a single output AVStream
+typedef struct OutputStream {
+    AVStream *st;
+    AVCodecContext *enc;
+
+    /* pts of the next frame that will be generated */
+    int64_t next_pts;
+    int64_t total_frames;
+
+    AVPacket *pkt;          // what the encoder returns, unreferenced once written
+
+    /* audio tone */
+    float t, tincr;
+
+    /* video: encoder rotation */
+    int gop_index;
+    int64_t frames_in_gop;
+    std::vector<uint8_t> annexb_headers;   // SPS/PPS of the current encoder, AnnexB
+
+    fmp4::yuv::Generator *yuv_generator;
+
+    FILE *raw;
+} OutputStream;
+
+static void AnnexBToAvcc(const uint8_t *data, int size, std::vector<uint8_t> &out)
+{
+    std::vector<fmp4::h264::NalUnit> nalus;
+    fmp4::h264::SplitAnnexB(data, size, nalus);
+
+    out.clear();
+    for (const fmp4::h264::NalUnit &nalu : nalus) {
+        uint8_t length[4] = { (uint8_t)(nalu.size >> 24), (uint8_t)(nalu.size >> 16),
+                              (uint8_t)(nalu.size >> 8), (uint8_t)nalu.size };
+        out.insert(out.end(), length, length + 4);
+        out.insert(out.end(), nalu.data, nalu.data + nalu.size);
+    }
+}
+
+/**************************************************************/
+/* video output */
+
+static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
+{
+    AVFrame *picture = av_frame_alloc();
+    if (!picture)
+        return NULL;
+
+    picture->format = pix_fmt;
+    picture->width  = width;
+    picture->height = height;
+
+    /* allocate the buffers for the frame data */
+    if (av_frame_get_buffer(picture, 32) < 0) {
+        fprintf(stderr, "Could not allocate frame data.\n");
+        exit(1);
+    }
+
+    return picture;
+}
+
+/* Open a libx264 instance whose SPS/PPS use the given id. */
+static AVCodecContext *open_video_encoder(const GeneratorOptions &options, int sps_id)
+{
+    AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        fprintf(stderr, "Could not find encoder 'libx264'\n");
+        exit(1);
+    }
+
+    AVCodecContext *c = avcodec_alloc_context3(codec);
+    c->codec_id     = AV_CODEC_ID_H264;
+    c->bit_rate     = options.bit_rate;
+    c->width        = options.width;
+    c->height       = options.height;
+    c->time_base    = (AVRational){ 1, options.fps };
+    c->gop_size     = options.gop;
+    c->keyint_min   = options.gop;
+    c->max_b_frames = options.b_frames;
+    c->slices       = options.slices;
+    c->pix_fmt      = AV_PIX_FMT_YUV420P;
+    c->flags       |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    /* fixed, closed GOPs so that every GOP can be handed to a different encoder */
+    char params[128];
+    snprintf(params, sizeof(params), "sps-id=%d:scenecut=0:open-gop=0", sps_id);
+    av_opt_set(c->priv_data, "x264-params", params, 0);
+    av_opt_set(c->priv_data, "preset", "veryfast", 0);
+
+    int ret = avcodec_open2(c, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
+        exit(1);
+    }
+    return c;
+}
+
+/*
+ * Build an avcC holding the SPS/PPS of every encoder instance.
+ * Since the extradata starts with version 1, the mp4 muxer writes it as is.
+ */
+static std::vector<uint8_t> build_avcc(const GeneratorOptions &options)
+{
+    std::vector<std::vector<uint8_t> > sps, pps;
+    for (int i = 0; i < options.parameter_sets; i++) {
+        AVCodecContext *c = open_video_encoder(options, i);
+
+        std::vector<fmp4::h264::NalUnit> nalus;
+        fmp4::h264::SplitAnnexB(c->extradata, c->extradata_size, nalus);
+        for (const fmp4::h264::NalUnit &nalu : nalus) {
+            if (nalu.type == fmp4::h264::NAL_SPS) sps.push_back(std::vector<uint8_t>(nalu.data, nalu.data + nalu.size));
+            else if (nalu.type == fmp4::h264::NAL_PPS) pps.push_back(std::vector<uint8_t>(nalu.data, nalu.data + nalu.size));
+        }
+
+        avcodec_free_context(&c);
+    }
+    if (sps.empty() || pps.empty()) {
+        fprintf(stderr, "No SPS/PPS from libx264\n");
+        exit(1);
+    }
+
+    std::vector<uint8_t> avcc;
+    avcc.push_back(0x01);                                       // version
+    avcc.push_back(sps[0][1]);                                  // profile
+    avcc.push_back(sps[0][2]);                                  // profile compat
+    avcc.push_back(sps[0][3]);                                  // level
+    avcc.push_back(0xff);                                       // 6 bits reserved (111111) + 2 bits nal size length - 1 (11)
+    avcc.push_back(0xe0 | (uint8_t)sps.size());                 // 3 bits reserved (111) + 5 bits number of sps
+    for (auto &nal : sps) {
+        avcc.push_back(nal.size() >> 8);
+        avcc.push_back(nal.size() & 0xff);
+        avcc.insert(avcc.end(), nal.begin(), nal.end());
+    }
+    avcc.push_back((uint8_t)pps.size());                        // number of pps
+    for (auto &nal : pps) {
+        avcc.push_back(nal.size() >> 8);
+        avcc.push_back(nal.size() & 0xff);
+        avcc.insert(avcc.end(), nal.begin(), nal.end());
+    }
+    return avcc;
+}
+
+static void add_video_stream(const GeneratorOptions &options, OutputStream *ost, AVFormatContext *oc)
+{
+    ost->st = avformat_new_stream(oc, NULL);
+    if (!ost->st) {
+        fprintf(stderr, "Could not allocate stream\n");
+        exit(1);
+    }
+    ost->st->id = oc->nb_streams - 1;
+
+    ost->enc = open_video_encoder(options, 0);
+    ost->total_frames = (int64_t)(options.hours * 3600 * options.fps);
+
+    /* the stream carries the parameters of the encoders plus an avcC listing all parameter sets */
+    AVCodecParameters *par = ost->st->codecpar;
+    if (avcodec_parameters_from_context(par, ost->enc) < 0) {
+        fprintf(stderr, "Could not copy the stream parameters\n");
+        exit(1);
+    }
+    par->codec_tag = 0;
+    ost->st->time_base = ost->enc->time_base;
+
+    std::vector<uint8_t> avcc = build_avcc(options);
+    av_freep(&par->extradata);
+    par->extradata = (uint8_t *)av_mallocz(avcc.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(par->extradata, avcc.data(), avcc.size());
+    par->extradata_size = avcc.size();
+
+    ost->annexb_headers.assign(ost->enc->extradata, ost->enc->extradata + ost->enc->extradata_size);
+    ost->pkt = av_packet_alloc();
+    ost->yuv_generator = new fmp4::yuv::Generator();
+}
+
+/* Prepare a dummy image, in a frame of its own: the encoder may still reference the ones before. */
+static void fill_yuv_image(const GeneratorOptions &options, OutputStream *ost, AVFrame *pict, int frame_index)
+{
+    fmp4::yuv::Picture picture = {
+        { pict->data[0], pict->data[1], pict->data[2] },
+        { pict->linesize[0], pict->linesize[1], pict->linesize[2] },
+        options.width, options.height
+    };
+    ost->yuv_generator->Fill(picture, frame_index, options.pattern, options.burn_in, options.fps);
+}
+
+static int write_packet(AVFormatContext *oc, OutputStream *ost, AVPacket *pkt)
+{
+    av_packet_rescale_ts(pkt, ost->enc->time_base, ost->st->time_base);
+    pkt->stream_index = ost->st->index;
+    return av_interleaved_write_frame(oc, pkt);
+}
+
+/* Write one encoded H.264 packet to the raw AnnexB file and, as AVCC, to the muxer. */
+static void write_video_packet(AVFormatContext *oc, OutputStream *ost, AVPacket *pkt)
+{
+    if (ost->raw) {
+        if (pkt->flags & AV_PKT_FLAG_KEY)
+            fwrite(ost->annexb_headers.data(), 1, ost->annexb_headers.size(), ost->raw);
+        fwrite(pkt->data, 1, pkt->size, ost->raw);
+    }
+
+    std::vector<uint8_t> avcc;
+    AnnexBToAvcc(pkt->data, pkt->size, avcc);
+
+    /* the timestamps, flags and side data of the packet, the payload as AVCC */
+    AVPacket *out = av_packet_alloc();
+    if (!out || av_new_packet(out, (int)avcc.size()) < 0 || av_packet_copy_props(out, pkt) < 0) {
+        fprintf(stderr, "Could not allocate video packet\n");
+        exit(1);
+    }
+    memcpy(out->data, avcc.data(), avcc.size());
+
+    int ret = write_packet(oc, ost, out);
+    av_packet_free(&out);
+    if (ret < 0) {
+        fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
+        exit(1);
+    }
+}
+
+/* Move every packet the encoder has ready to the muxer. */
+static void receive_video_packets(AVFormatContext *oc, OutputStream *ost)
+{
+    int ret;
+    while ((ret = avcodec_receive_packet(ost->enc, ost->pkt)) >= 0) {
+        write_video_packet(oc, ost, ost->pkt);
+        av_packet_unref(ost->pkt);
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
+        exit(1);
+    }
+}
+
+/* Drain the current encoder into the muxer. */
+static void flush_video_encoder(AVFormatContext *oc, OutputStream *ost)
+{
+    avcodec_send_frame(ost->enc, NULL);
+    receive_video_packets(oc, ost);
+}
+
+/*
+ * encode one video frame and send it to the muxer
+ * return false when encoding is finished, true otherwise
+ */
+static bool write_video_frame(const GeneratorOptions &options, AVFormatContext *oc, OutputStream *ost)
+{
+    if (ost->next_pts >= ost->total_frames) {
+        flush_video_encoder(oc, ost);
+        return false;
+    }
+
+    /* switch to the next parameter set at the start of every GOP */
+    if (options.parameter_sets > 1 && ost->frames_in_gop == options.gop) {
+        flush_video_encoder(oc, ost);
+        avcodec_free_context(&ost->enc);
+
+        ost->gop_index++;
+        ost->enc = open_video_encoder(options, ost->gop_index % options.parameter_sets);
+        ost->annexb_headers.assign(ost->enc->extradata, ost->enc->extradata + ost->enc->extradata_size);
+        ost->frames_in_gop = 0;
+    }
+
+    AVFrame *frame = alloc_picture(AV_PIX_FMT_YUV420P, options.width, options.height);
+    fill_yuv_image(options, ost, frame, ost->next_pts);
+    frame->pts = ost->next_pts++;
+    frame->pict_type = ost->frames_in_gop == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    ost->frames_in_gop++;
+
+    /* the encoder takes its own reference if it keeps the frame */
+    int ret = avcodec_send_frame(ost->enc, frame);
+    av_frame_free(&frame);
+    if (ret < 0) {
+        fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
+        exit(1);
+    }
+    receive_video_packets(oc, ost);
+
+    if (ost->next_pts % (options.fps * 60) == 0)
+        FMP4_LOGI("%lld / %lld frames\n", (long long)ost->next_pts, (long long)ost->total_frames);
+    return true;
+}
+
+/**************************************************************/
+/* audio output */
+
+static void add_audio_stream(const GeneratorOptions &options, OutputStream *ost, AVFormatContext *oc)
+{
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec) {
+        fprintf(stderr, "Could not find encoder for 'aac'\n");
+        exit(1);
+    }
+
+    ost->st = avformat_new_stream(oc, NULL);
+    if (!ost->st) {
+        fprintf(stderr, "Could not allocate stream\n");
+        exit(1);
+    }
+    ost->st->id = oc->nb_streams - 1;
+
+    AVCodecContext *c = avcodec_alloc_context3(codec);
+    if (!c) {
+        fprintf(stderr, "Could not alloc an encoding context\n");
+        exit(1);
+    }
+    c->sample_fmt     = AV_SAMPLE_FMT_FLTP;
+    c->bit_rate       = 64000 * options.audio_channels;
+    c->sample_rate    = options.audio_sample_rate;
+    c->channels       = options.audio_channels;
+    c->channel_layout = av_get_default_channel_layout(options.audio_channels);
+    c->time_base      = (AVRational){ 1, c->sample_rate };
+    ost->st->time_base = c->time_base;
+
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    int ret = avcodec_open2(c, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open audio codec: %s\n", av_err2str(ret));
+        exit(1);
+    }
+    ost->enc = c;
+
+    if (avcodec_parameters_from_context(ost->st->codecpar, c) < 0) {
+        fprintf(stderr, "Could not copy the stream parameters\n");
+        exit(1);
+    }
+    ost->pkt = av_packet_alloc();
+
+    /* 440 Hz tone */
+    ost->t     = 0;
+    ost->tincr = 2 * M_PI * 440.0 / c->sample_rate;
+    ost->total_frames = (int64_t)(options.hours * 3600 * c->sample_rate);
+}
+
+static void write_adts(OutputStream *ost, const AVPacket *pkt)
+{
+    const uint8_t frequency_index = fmp4::adts::SampleRateIndex(ost->enc->sample_rate);
+    const uint8_t channel_config = fmp4::adts::ChannelConfig(ost->enc->channels);
+
+    int length = pkt->size + (int)fmp4::adts::kHeaderSize;
+    uint8_t header[fmp4::adts::kHeaderSize];
+    header[0] = 0xff;                                           // syncword
+    header[1] = 0xf1;                                           // MPEG-4, layer 0, no CRC
+    header[2] = ((fmp4::adts::kObjectTypeAacLc - 1) << 6) | (frequency_index << 2) | (channel_config >> 2);
+    header[3] = ((channel_config & 3) << 6) | (length >> 11);
+    header[4] = (length >> 3) & 0xff;
+    header[5] = ((length & 7) << 5) | 0x1f;                     // buffer fullness 0x7ff
+    header[6] = 0xfc;
+    fwrite(header, 1, sizeof(header), ost->raw);
+    fwrite(pkt->data, 1, pkt->size, ost->raw);
+}
+
+/* A frame of its own for every call: the encoder may still reference the ones before. */
+static AVFrame *alloc_audio_frame(const AVCodecContext *c)
+{
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        fprintf(stderr, "Could not allocate audio frame\n");
+        exit(1);
+    }
+    frame->format         = c->sample_fmt;
+    frame->channel_layout = c->channel_layout;
+    frame->sample_rate    = c->sample_rate;
+    frame->nb_samples     = c->frame_size;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        fprintf(stderr, "Could not allocate audio frame\n");
+        exit(1);
+    }
+    return frame;
+}
+
+/*
+ * encode one audio frame, or flush the encoder at the end, and send the packets to the muxer
+ * return false when encoding is finished, true otherwise
+ */
+static bool write_audio_frame(AVFormatContext *oc, OutputStream *ost)
+{
+    AVFrame *frame = NULL;
+    if (ost->next_pts < ost->total_frames) {
+        frame = alloc_audio_frame(ost->enc);
+
+        for (int j = 0; j < frame->nb_samples; j++) {
+            float v = sinf(ost->t) * 0.3f;
+            for (int ch = 0; ch < ost->enc->channels; ch++)
+                ((float *)frame->data[ch])[j] = v;
+            ost->t += ost->tincr;
+        }
+        if (ost->t > 2 * M_PI) ost->t = fmodf(ost->t, 2 * M_PI);
+
+        frame->pts = ost->next_pts;
+        ost->next_pts += frame->nb_samples;
+    }
+
+    /* a NULL frame flushes the encoder */
+    int ret = avcodec_send_frame(ost->enc, frame);
+    av_frame_free(&frame);
+    if (ret < 0) {
+        fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    while ((ret = avcodec_receive_packet(ost->enc, ost->pkt)) >= 0) {
+        if (ost->raw) write_adts(ost, ost->pkt);
+        int err = write_packet(oc, ost, ost->pkt);
+        av_packet_unref(ost->pkt);
+        if (err < 0) {
+            fprintf(stderr, "Error while writing audio frame: %s\n", av_err2str(err));
+            exit(1);
+        }
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    return ret != AVERROR_EOF;
+}
+
+static void close_stream(OutputStream *ost)
+{
+    avcodec_free_context(&ost->enc);
+    av_packet_free(&ost->pkt);
+    delete ost->yuv_generator;
+    if (ost->raw) fclose(ost->raw);
+}
+
+/**************************************************************/
+
+static void usage(const char *name)
+{
+    printf("usage: %s [options] output\n"
+           "Generate output.mp4, output.h264 (AnnexB) and output.aac (ADTS)\n"
+           "  -s WxH     resolution (1280x720)\n"
+           "  -r fps     frame rate (25)\n"
+           "  -g n       GOP length in frames (50)\n"
+           "  -b n       B-frames (0)\n"
+           "  -l n       slices per frame (1)\n"
+           "  -p n       number of SPS/PPS sets, rotated per GOP (1)\n"
+           "  -v kbps    video bit rate (2000)\n"
+           "  -a hz      AAC sample rate, 0 disables audio (48000)\n"
+           "  -c n       audio channels (2)\n"
+           "  -d hours   duration in hours (10 seconds)\n"
+           "  -f         fragmented MP4 (moof per key frame)\n"
+           "  -P name    picture: gradient, bars or noise (gradient)\n"
+           "  -t         burn the frame number and time into the picture\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    GeneratorOptions options;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:g:b:l:p:v:a:c:d:fP:t")) != -1) {
+        switch (opt) {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &options.width, &options.height) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r': options.fps = atoi(optarg); break;
+            case 'g': options.gop = atoi(optarg); break;
+            case 'b': options.b_frames = atoi(optarg); break;
+            case 'l': options.slices = atoi(optarg); break;
+            case 'p': options.parameter_sets = atoi(optarg); break;
+            case 'v': options.bit_rate = atoi(optarg) * 1000; break;
+            case 'a': options.audio_sample_rate = atoi(optarg); break;
+            case 'c': options.audio_channels = atoi(optarg); break;
+            case 'd': options.hours = atof(optarg); break;
+            case 'f': options.fragmented = true; break;
+            case 'P':
+                if (!fmp4::yuv::ParsePattern(optarg, options.pattern)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't': options.burn_in = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || options.width <= 0 || options.height <= 0 || (options.width | options.height) & 1 ||
+        options.fps <= 0 || options.gop <= 0 || options.parameter_sets < 1 || options.parameter_sets > 31) {
+        usage(argv[0]);
+        return 1;
+    }
+    options.output = argv[optind];
+
+    /* Initialize libavcodec, and register all codecs and formats. */
+    av_register_all();
+
+    std::string filename = options.output + ".mp4";
+
+    AVFormatContext *oc = NULL;
+    avformat_alloc_output_context2(&oc, NULL, "mp4", NULL);
+    if (!oc) {
+        printf("fail to generate mp4 format context");
+        return 1;
+    }
+
+    OutputStream video_st = {0}, audio_st = {0};
+    add_video_stream(options, &video_st, oc);
+    if (options.audio_sample_rate > 0)
+        add_audio_stream(options, &audio_st, oc);
+
+    video_st.raw = fopen((options.output + ".h264").c_str(), "wb");
+    if (audio_st.enc)
+        audio_st.raw = fopen((options.output + ".aac").c_str(), "wb");
+
+    av_dump_format(oc, 0, filename.c_str(), 1);
+
+    int ret = avio_open(&oc->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open '%s': %s\n", filename.c_str(), av_err2str(ret));
+        return 1;
+    }
+
+    AVDictionary *movflags = NULL;
+    if (options.fragmented)
+        av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe", 0);
+    if ((ret = avformat_write_header(oc, &movflags)) < 0) {
+        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(ret));
+        return 1;
+    }
+    av_dict_free(&movflags);
+
+    /* Interleave: always encode the stream which is behind */
+    bool encode_video = true, encode_audio = audio_st.enc != NULL;
+    while (encode_video || encode_audio) {
+        if (encode_video &&
+            (!encode_audio || av_compare_ts(video_st.next_pts, video_st.enc->time_base,
+                                            audio_st.next_pts, audio_st.enc->time_base) <= 0)) {
+            encode_video = write_video_frame(options, oc, &video_st);
+        } else {
+            encode_audio = write_audio_frame(oc, &audio_st);
+        }
+    }
+
+    av_write_trailer(oc);
+
+    close_stream(&video_st);
+    if (audio_st.enc)
+        close_stream(&audio_st);
+
+    avio_closep(&oc->pb);
+    avformat_free_context(oc);
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+#ifndef FMP4_H264_PARSER_H
+#define FMP4_H264_PARSER_H
+
+/*
+ * Tiered H.264 NAL unit parsing, so every caller pays only for what it needs:
+ *
+ *   type only     NalType(): one byte, enough for most writer decisions (VCL or not, IDR, SPS/PPS)
+ *   slice light   ParseSliceHeader(): first_mb_in_slice, slice_type, pic_parameter_set_id and
+ *                 frame_num, e.g. to find picture boundaries or intra slices
+ *   full          ParseSps()/ParsePps(): only when a parameter set is new or changed (see
+ *                 ParameterSetCache), the slice tier keeps the SpsInfo it needs
+ *
+ * Parsing stops as soon as the requested fields are read; the SPS parser ignores the VUI.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "bit_reader.h"
+
+namespace fmp4 {
+namespace h264 {
+
+enum
+{
+    NAL_SLICE       = 1,
+    NAL_SLICE_IDR   = 5,
+    NAL_SEI         = 6,
+    NAL_SPS         = 7,
+    NAL_PPS         = 8,
+    NAL_AUD         = 9,
+};
+
+enum
+{
+    SLICE_P  = 0,
+    SLICE_B  = 1,
+    SLICE_I  = 2,
+    SLICE_SP = 3,
+    SLICE_SI = 4,
+};
+
+inline unsigned int NalType(const uint8_t *nal) { return nal[0] & 0x1f; }
+inline bool IsVcl(unsigned int type) { return type >= NAL_SLICE && type <= NAL_SLICE_IDR; }
+
+struct NalUnit
+{
+    const uint8_t *data;    // NAL unit header, after the start code
+    size_t size;
+    unsigned int type;
+};
+
+// Split an AnnexB buffer (3 or 4 byte start codes) into NAL units. nalus is cleared first and keeps
+// its capacity, so a caller reusing it does not allocate per sample.
+inline void SplitAnnexB(const uint8_t *data, size_t size, std::vector<NalUnit> &nalus)
+{
+    nalus.clear();
+
+    size_t i = 0, start = 0;
+    bool in_nal = false;
+    while (i + 3 <= size) {
+        if (data[i + 2] > 1) {
+            i += 3;         // no start code can end at i + 2 or before
+        } else if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if (in_nal) {
+                size_t end = i;
+                if (end > start && data[end - 1] == 0) end--;   // 4 byte start code
+                if (end > start) nalus.push_back(NalUnit{data + start, end - start, NalType(data + start)});
+            }
+            i += 3;
+            start = i;
+            in_nal = true;
+        } else {
+            i++;
+        }
+    }
+    if (in_nal && size > start) nalus.push_back(NalUnit{data + start, size - start, NalType(data + start)});
+}
+
+struct SpsInfo
+{
+    SpsInfo()
+        : profile_idc(0), constraint_flags(0), level_idc(0), sps_id(0), chroma_format_idc(1)
+        , separate_colour_plane_flag(0), bit_depth_luma_minus8(0), bit_depth_chroma_minus8(0)
+        , log2_max_frame_num(4), pic_order_cnt_type(0), frame_mbs_only_flag(1), width(0), height(0)
+    {
+    }
+
+    uint32_t profile_idc;
+    uint32_t constraint_flags;
+    uint32_t level_idc;
+    uint32_t sps_id;
+    uint32_t chroma_format_idc;
+    uint32_t separate_colour_plane_flag;
+    uint32_t bit_depth_luma_minus8;
+    uint32_t bit_depth_chroma_minus8;
+    uint32_t log2_max_frame_num;
+    uint32_t pic_order_cnt_type;
+    uint32_t frame_mbs_only_flag;
+    uint32_t width;                 // after frame cropping
+    uint32_t height;
+};
+
+struct PpsInfo
+{
+    PpsInfo() : pps_id(0), sps_id(0) {}
+
+    uint32_t pps_id;
+    uint32_t sps_id;
+};
+
+struct SliceHeader
+{
+    SliceHeader() : first_mb_in_slice(0), slice_type(0), pps_id(0), frame_num(0) {}
+
+    bool IsIntra() const { return slice_type == SLICE_I || slice_type == SLICE_SI; }
+
+    uint32_t first_mb_in_slice;     // 0: first slice of a picture
+    uint32_t slice_type;            // 0..4 (the +5 "all slices alike" form is folded)
+    uint32_t pps_id;
+    uint32_t frame_num;
+};
+
+// scaling_list() only has to be skipped, but its length depends on the coded deltas
+template <typename Reader>
+inline void SkipScalingList(Reader &reader, unsigned int size)
+{
+    int last_scale = 8, next_scale = 8;
+    for (unsigned int i = 0; i < size && next_scale; i++) {
+        next_scale = (last_scale + reader.ReadSE() + 256) % 256;
+        if (next_scale) last_scale = next_scale;
+    }
+}
+
+// seq_parameter_set_data() up to frame cropping (H.264 7.3.2.1.1)
+template <typename Reader>
+inline bool ParseSps(Reader &reader, SpsInfo &info)
+{
+    info.profile_idc = reader.ReadBits(8);
+    info.constraint_flags = reader.ReadBits(8);
+    info.level_idc = reader.ReadBits(8);
+    info.sps_id = reader.ReadUE();
+
+    const uint32_t p = info.profile_idc;
+    if (p == 100 || p == 110 || p == 122 || p == 244 || p == 44 || p == 83 || p == 86 || p == 118 ||
+        p == 128 || p == 138 || p == 139 || p == 134 || p == 135) {
+        info.chroma_format_idc = reader.ReadUE();
+        if (info.chroma_format_idc == 3) info.separate_colour_plane_flag = reader.ReadBit();
+        info.bit_depth_luma_minus8 = reader.ReadUE();
+        info.bit_depth_chroma_minus8 = reader.ReadUE();
+        reader.SkipBits(1);                                 // qpprime_y_zero_transform_bypass_flag
+        if (reader.ReadBit()) {                             // seq_scaling_matrix_present_flag
+            const unsigned int count = info.chroma_format_idc != 3 ? 8 : 12;
+            for (unsigned int i = 0; i < count; i++) {
+                if (reader.ReadBit()) SkipScalingList(reader, i < 6 ? 16 : 64);
+            }
+        }
+    }
+
+    info.log2_max_frame_num = reader.ReadUE() + 4;
+    info.pic_order_cnt_type = reader.ReadUE();
+    if (info.pic_order_cnt_type == 0) {
+        reader.ReadUE();                                    // log2_max_pic_order_cnt_lsb_minus4
+    } else if (info.pic_order_cnt_type == 1) {
+        reader.SkipBits(1);                                 // delta_pic_order_always_zero_flag
+        reader.ReadSE();                                    // offset_for_non_ref_pic
+        reader.ReadSE();                                    // offset_for_top_to_bottom_field
+        const uint32_t cycle = reader.ReadUE();
+        for (uint32_t i = 0; i < cycle && !reader.IsOverrun(); i++) reader.ReadSE();
+    }
+    reader.ReadUE();                                        // max_num_ref_frames
+    reader.SkipBits(1);                                     // gaps_in_frame_num_value_allowed_flag
+    const uint32_t width_in_mbs = reader.ReadUE() + 1;
+    const uint32_t height_in_map_units = reader.ReadUE() + 1;
+    info.frame_mbs_only_flag = reader.ReadBit();
+    if (!info.frame_mbs_only_flag) reader.SkipBits(1);     // mb_adaptive_frame_field_flag
+    reader.SkipBits(1);                                     // direct_8x8_inference_flag
+
+    info.width = width_in_mbs * 16;
+    info.height = (2 - info.frame_mbs_only_flag) * height_in_map_units * 16;
+    if (reader.ReadBit()) {                                 // frame_cropping_flag
+        const uint32_t chroma_array_type = info.separate_colour_plane_flag ? 0 : info.chroma_format_idc;
+        const uint32_t sub_width = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+        const uint32_t sub_height = (chroma_array_type == 1) ? 2 : 1;
+        const uint32_t crop_x = chroma_array_type ? sub_width : 1;
+        const uint32_t crop_y = (chroma_array_type ? sub_height : 1) * (2 - info.frame_mbs_only_flag);
+        const uint32_t left = reader.ReadUE(), right = reader.ReadUE();
+        const uint32_t top = reader.ReadUE(), bottom = reader.ReadUE();
+        info.width -= crop_x * (left + right);
+        info.height -= crop_y * (top + bottom);
+    }
+
+    return !reader.IsOverrun() && info.sps_id < 32;
+}
+
+// nal: SPS NAL unit starting with its header byte
+inline bool ParseSps(const uint8_t *nal, size_t size, SpsInfo &info)
+{
+    if (size < 4 || NalType(nal) != NAL_SPS) return false;
+    BitReader reader(nal + 1, size - 1);
+    return ParseSps(reader, info);
+}
+
+inline bool ParsePps(const uint8_t *nal, size_t size, PpsInfo &info)
+{
+    if (size < 2 || NalType(nal) != NAL_PPS) return false;
+    BitReader reader(nal + 1, size - 1);
+    info.pps_id = reader.ReadUE();
+    info.sps_id = reader.ReadUE();
+    return !reader.IsOverrun() && info.pps_id < 256 && info.sps_id < 32;
+}
+
+// The first fields of slice_header() (H.264 7.3.3); sps is the one the slice's PPS refers to
+inline bool ParseSliceHeader(const uint8_t *nal, size_t size, const SpsInfo &sps, SliceHeader &header)
+{
+    if (size < 2 || !IsVcl(NalType(nal))) return false;
+
+    BitReader reader(nal + 1, size - 1);
+    header.first_mb_in_slice = reader.ReadUE();
+    header.slice_type = reader.ReadUE() % 5;
+    header.pps_id = reader.ReadUE();
+    if (sps.separate_colour_plane_flag) reader.SkipBits(2); // colour_plane_id
+    header.frame_num = reader.ReadBits(sps.log2_max_frame_num);
+    return !reader.IsOverrun();
+}
+
+} // namespace h264
+} // namespace fmp4
+
+#endif // FMP4_H264_PARSER_H
@@ -0,0 +1,313 @@
+#ifndef FMP4_HEVC_H
+#define FMP4_HEVC_H
+
+/*
+ * H.265/HEVC helpers for the writers: AnnexB splitting, NAL unit types, the SPS fields needed for a
+ * sample entry, a VPS/SPS/PPS store with change detection and hvcC (ISO/IEC 14496-15 8.3.3.1)
+ * construction and parsing.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bit_reader.h"
+#include "param_set_cache.h"
+
+namespace fmp4 {
+namespace hevc {
+
+enum
+{
+    NAL_BLA_W_LP    = 16,
+    NAL_IDR_W_RADL  = 19,
+    NAL_IDR_N_LP    = 20,
+    NAL_CRA_NUT     = 21,
+    NAL_RSV_IRAP_23 = 23,
+    NAL_VPS         = 32,
+    NAL_SPS         = 33,
+    NAL_PPS         = 34,
+    NAL_AUD         = 35,
+    NAL_SEI_PREFIX  = 39,
+    NAL_SEI_SUFFIX  = 40,
+};
+
+inline unsigned int NalType(const uint8_t *nal) { return (nal[0] >> 1) & 0x3f; }
+inline bool IsVcl(unsigned int type) { return type < 32; }
+// IDR, CRA and BLA pictures: decoding can start here
+inline bool IsIrap(unsigned int type) { return type >= NAL_BLA_W_LP && type <= NAL_RSV_IRAP_23; }
+inline bool IsParameterSet(unsigned int type) { return type >= NAL_VPS && type <= NAL_PPS; }
+
+struct NalUnit
+{
+    const uint8_t *data;    // NAL unit header, after the start code
+    size_t size;
+    unsigned int type;
+};
+
+// Split an AnnexB buffer (3 or 4 byte start codes) into NAL units
+inline std::vector<NalUnit> SplitAnnexB(const uint8_t *data, size_t size)
+{
+    std::vector<NalUnit> nalus;
+
+    size_t i = 0, start = 0;
+    bool in_nal = false;
+    while (i + 3 <= size) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if (in_nal) {
+                size_t end = i;
+                if (end > start && data[end - 1] == 0) end--;   // 4 byte start code
+                if (end - start >= 2) nalus.push_back(NalUnit{data + start, end - start, NalType(data + start)});
+            }
+            i += 3;
+            start = i;
+            in_nal = true;
+        } else {
+            i++;
+        }
+    }
+    if (in_nal && size - start >= 2) nalus.push_back(NalUnit{data + start, size - start, NalType(data + start)});
+
+    return nalus;
+}
+
+// The SPS fields that go into hvcC and the visual sample entry
+struct SpsInfo
+{
+    SpsInfo()
+        : profile_space(0), tier_flag(0), profile_idc(0), profile_compatibility_flags(0)
+        , constraint_indicator_flags(0), level_idc(0), max_sub_layers_minus1(0), temporal_id_nesting_flag(0)
+        , sps_id(0), chroma_format_idc(1), bit_depth_luma_minus8(0), bit_depth_chroma_minus8(0)
+        , width(0), height(0)
+    {
+    }
+
+    uint32_t profile_space;
+    uint32_t tier_flag;
+    uint32_t profile_idc;
+    uint32_t profile_compatibility_flags;
+    uint64_t constraint_indicator_flags;    // 48 bits
+    uint32_t level_idc;
+    uint32_t max_sub_layers_minus1;
+    uint32_t temporal_id_nesting_flag;
+    uint32_t sps_id;
+    uint32_t chroma_format_idc;
+    uint32_t bit_depth_luma_minus8;
+    uint32_t bit_depth_chroma_minus8;
+    uint32_t width;                         // after the conformance window
+    uint32_t height;
+};
+
+// seq_parameter_set_rbsp() up to the bit depths (H.265 7.3.2.2)
+inline bool ParseSps(const uint8_t *nal, size_t size, SpsInfo &info)
+{
+    if (size < 3 || NalType(nal) != NAL_SPS) return false;
+
+    BitReader reader(nal + 2, size - 2);
+    reader.SkipBits(4);                                     // sps_video_parameter_set_id
+    info.max_sub_layers_minus1 = reader.ReadBits(3);
+    info.temporal_id_nesting_flag = reader.ReadBit();
+
+    // profile_tier_level(1, sps_max_sub_layers_minus1)
+    info.profile_space = reader.ReadBits(2);
+    info.tier_flag = reader.ReadBit();
+    info.profile_idc = reader.ReadBits(5);
+    info.profile_compatibility_flags = reader.ReadBits(32);
+    info.constraint_indicator_flags = (uint64_t)reader.ReadBits(16) << 32;
+    info.constraint_indicator_flags |= reader.ReadBits(32);
+    info.level_idc = reader.ReadBits(8);
+
+    bool sub_layer_profile_present[8] = {false}, sub_layer_level_present[8] = {false};
+    for (uint32_t i = 0; i < info.max_sub_layers_minus1; i++) {
+        sub_layer_profile_present[i] = reader.ReadBit();
+        sub_layer_level_present[i] = reader.ReadBit();
+    }
+    if (info.max_sub_layers_minus1 > 0) {
+        for (uint32_t i = info.max_sub_layers_minus1; i < 8; i++) reader.SkipBits(2);
+    }
+    for (uint32_t i = 0; i < info.max_sub_layers_minus1; i++) {
+        if (sub_layer_profile_present[i]) reader.SkipBits(88);
+        if (sub_layer_level_present[i]) reader.SkipBits(8);
+    }
+
+    info.sps_id = reader.ReadUE();
+    info.chroma_format_idc = reader.ReadUE();
+    if (info.chroma_format_idc == 3) reader.SkipBits(1);    // separate_colour_plane_flag
+    info.width = reader.ReadUE();
+    info.height = reader.ReadUE();
+    if (reader.ReadBit()) {
+        // conformance_window_flag, offsets are in chroma sample units
+        const uint32_t sub_width = (info.chroma_format_idc == 1 || info.chroma_format_idc == 2) ? 2 : 1;
+        const uint32_t sub_height = (info.chroma_format_idc == 1) ? 2 : 1;
+        const uint32_t left = reader.ReadUE(), right = reader.ReadUE();
+        const uint32_t top = reader.ReadUE(), bottom = reader.ReadUE();
+        info.width -= sub_width * (left + right);
+        info.height -= sub_height * (top + bottom);
+    }
+    info.bit_depth_luma_minus8 = reader.ReadUE();
+    info.bit_depth_chroma_minus8 = reader.ReadUE();
+
+    return !reader.IsOverrun() && info.sps_id < 16;
+}
+
+// VPS/SPS/PPS by type and id, same contract as fmp4::ParameterSetCache for H.264
+class ParameterSetCache
+{
+public:
+
+    typedef fmp4::ParameterSetCache::Result Result;
+
+    enum
+    {
+        MAX_VPS_COUNT = 16,
+        MAX_SPS_COUNT = 16,
+        MAX_PPS_COUNT = 64,
+    };
+
+    ParameterSetCache() : vps(MAX_VPS_COUNT), sps(MAX_SPS_COUNT), pps(MAX_PPS_COUNT), generation(0) {}
+
+    // nal: one NAL unit starting with its two byte header
+    Result Update(const uint8_t *nal, size_t size)
+    {
+        if (size < 3) return fmp4::ParameterSetCache::PARAMETER_SET_INVALID;
+
+        const unsigned int type = NalType(nal);
+        uint32_t id = 0;
+        if (!ReadId(type, nal, size, id)) return fmp4::ParameterSetCache::PARAMETER_SET_INVALID;
+
+        Entry &entry = (type == NAL_VPS) ? vps[id] : (type == NAL_SPS) ? sps[id] : pps[id];
+        if (entry.is_present && entry.data.size() == size && memcmp(entry.data.data(), nal, size) == 0)
+            return fmp4::ParameterSetCache::PARAMETER_SET_UNCHANGED;
+
+        const Result result = entry.is_present ? fmp4::ParameterSetCache::PARAMETER_SET_CHANGED
+                                               : fmp4::ParameterSetCache::PARAMETER_SET_ADDED;
+        entry.data.assign(nal, nal + size);
+        entry.hash = fmp4::ParameterSetCache::Hash(nal, size);
+        entry.is_present = true;
+        generation++;
+        return result;
+    }
+
+    uint32_t Generation() const { return generation; }
+
+    // SPS with the lowest id, for the sample entry dimensions
+    bool GetSpsInfo(SpsInfo &info) const
+    {
+        for (auto &entry : sps) {
+            if (entry.is_present) return ParseSps(entry.data.data(), entry.data.size(), info);
+        }
+        return false;
+    }
+
+    // HEVCDecoderConfigurationRecord with every stored VPS, SPS and PPS. array_completeness is set
+    // for hvc1 (parameter sets only in the sample entry) and cleared for hev1 (also in-band).
+    // Empty when one of the three is missing.
+    std::vector<uint8_t> BuildHvcC(bool array_completeness, unsigned int nal_length_size = 4) const
+    {
+        std::vector<uint8_t> hvcc;
+
+        SpsInfo info;
+        if (!Count(vps) || !Count(pps) || !GetSpsInfo(info)) return hvcc;
+
+        hvcc.push_back(0x01);                                                   // configurationVersion
+        hvcc.push_back((uint8_t)(info.profile_space << 6 | info.tier_flag << 5 | info.profile_idc));
+        for (int shift = 24; shift >= 0; shift -= 8) hvcc.push_back((uint8_t)(info.profile_compatibility_flags >> shift));
+        for (int shift = 40; shift >= 0; shift -= 8) hvcc.push_back((uint8_t)(info.constraint_indicator_flags >> shift));
+        hvcc.push_back((uint8_t)info.level_idc);
+        hvcc.push_back(0xf0);                                                   // min_spatial_segmentation_idc = 0
+        hvcc.push_back(0x00);
+        hvcc.push_back(0xfc);                                                   // parallelismType = 0 (unknown)
+        hvcc.push_back((uint8_t)(0xfc | info.chroma_format_idc));
+        hvcc.push_back((uint8_t)(0xf8 | info.bit_depth_luma_minus8));
+        hvcc.push_back((uint8_t)(0xf8 | info.bit_depth_chroma_minus8));
+        hvcc.push_back(0x00);                                                   // avgFrameRate = 0 (unspecified)
+        hvcc.push_back(0x00);
+        hvcc.push_back((uint8_t)((info.max_sub_layers_minus1 + 1) << 3 |        // constantFrameRate = 0, numTemporalLayers
+                                 info.temporal_id_nesting_flag << 2 |
+                                 ((nal_length_size - 1) & 0x03)));
+        hvcc.push_back(3);                                                      // numOfArrays
+        AppendArray(hvcc, NAL_VPS, vps, array_completeness);
+        AppendArray(hvcc, NAL_SPS, sps, array_completeness);
+        AppendArray(hvcc, NAL_PPS, pps, array_completeness);
+
+        return hvcc;
+    }
+
+private:
+
+    typedef fmp4::ParameterSetCache::Entry Entry;
+
+    static bool ReadId(unsigned int type, const uint8_t *nal, size_t size, uint32_t &id)
+    {
+        if (type == NAL_VPS) {
+            id = nal[2] >> 4;
+            return true;
+        } else if (type == NAL_SPS) {
+            SpsInfo info;
+            if (!ParseSps(nal, size, info)) return false;
+            id = info.sps_id;
+            return true;
+        } else if (type == NAL_PPS) {
+            BitReader reader(nal + 2, size - 2);
+            id = reader.ReadUE();
+            return !reader.IsOverrun() && id < MAX_PPS_COUNT;
+        }
+        return false;
+    }
+
+    static unsigned int Count(const std::vector<Entry> &entries)
+    {
+        unsigned int count = 0;
+        for (auto &entry : entries) if (entry.is_present) count++;
+        return count;
+    }
+
+    static void AppendArray(std::vector<uint8_t> &hvcc, unsigned int type, const std::vector<Entry> &entries, bool array_completeness)
+    {
+        const unsigned int count = Count(entries);
+        hvcc.push_back((uint8_t)((array_completeness ? 0x80 : 0x00) | type));
+        hvcc.push_back((uint8_t)(count >> 8));
+        hvcc.push_back((uint8_t)count);
+        for (auto &entry : entries) {
+            if (!entry.is_present) continue;
+            hvcc.push_back((uint8_t)(entry.data.size() >> 8));
+            hvcc.push_back((uint8_t)entry.data.size());
+            hvcc.insert(hvcc.end(), entry.data.begin(), entry.data.end());
+        }
+    }
+
+    std::vector<Entry> vps;
+    std::vector<Entry> sps;
+    std::vector<Entry> pps;
+    uint32_t generation;
+};
+
+// Collect the parameter set NAL units of an hvcC payload, in array order
+inline bool ParseHvcC(const uint8_t *hvcc, size_t size, std::vector<std::vector<uint8_t> > &nals)
+{
+    if (size < 23 || hvcc[0] != 1) return false;
+
+    const unsigned int num_arrays = hvcc[22];
+    size_t offset = 23;
+    for (unsigned int i = 0; i < num_arrays; i++) {
+        if (offset + 3 > size) return false;
+        const unsigned int num_nalus = (unsigned int)hvcc[offset + 1] << 8 | hvcc[offset + 2];
+        offset += 3;
+        for (unsigned int j = 0; j < num_nalus; j++) {
+            if (offset + 2 > size) return false;
+            const size_t nal_size = (size_t)hvcc[offset] << 8 | hvcc[offset + 1];
+            offset += 2;
+            if (offset + nal_size > size) return false;
+            nals.push_back(std::vector<uint8_t>(hvcc + offset, hvcc + offset + nal_size));
+            offset += nal_size;
+        }
+    }
+    return true;
+}
+
+} // namespace hevc
+} // namespace fmp4
+
+#endif // FMP4_HEVC_H
@@ -0,0 +1,615 @@
+#ifndef FMP4_HTTP_SERVER_H
+#define FMP4_HTTP_SERVER_H
+
+/*
+ * HTTP/1.1 server for live output: the init segment, segments while they are written, and manifests.
+ *
+ * One thread runs an epoll loop over non-blocking sockets (edge triggered), so a client costs a small
+ * struct and no thread, and thousands of them fit on one core. Writers Publish() the segments they
+ * keep in memory (SegmentBuffer, see cmaf.h) under a path and call Notify() when one has grown; what
+ * is not published (manifests, segments no longer in memory) is served from files under the root
+ * directory. Bodies go out with sendfile() from the memfd or the file, never through user space.
+ *
+ * A segment still being written goes out with chunked transfer coding, one HTTP chunk for what was
+ * written since the last one, and the response ends when the segment is complete. A byte range with
+ * an end (an LL-HLS part) gets its 206 at once and its bytes as they are written. An open range of a
+ * growing segment is answered once the segment is complete, its length is not known before. Query
+ * strings are ignored: there are no blocking playlist reloads.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cmaf.h"
+#include "logger.h"
+
+namespace fmp4 {
+
+class HttpServer
+{
+public:
+
+    HttpServer() : listen_fd(-1), epoll_fd(-1), event_fd(-1), port(0), is_running(false), is_stopping(false) {}
+
+    ~HttpServer() { Stop(); }
+
+    HttpServer(const HttpServer &) = delete;
+    HttpServer &operator=(const HttpServer &) = delete;
+
+    // Listen on address:port (port 0: any free one, see Port()); root: directory of what is not published
+    bool Start(const std::string &address, uint16_t port, const std::string &root)
+    {
+        if (is_running) return false;
+        this->root = root;
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) return false;
+
+        const int one = 1;
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        socklen_t addr_size = sizeof(addr);
+        if (listen_fd < 0 || epoll_fd < 0 || event_fd < 0 ||
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0 ||
+            getsockname(listen_fd, (sockaddr *)&addr, &addr_size) != 0 ||
+            !Watch(listen_fd, EPOLLIN) || !Watch(event_fd, EPOLLIN)) {
+            CloseDescriptors();
+            return false;
+        }
+        this->port = ntohs(addr.sin_port);
+
+        is_stopping = false;
+        is_running = true;
+        thread = std::thread(&HttpServer::Run, this);
+        return true;
+    }
+
+    void Stop()
+    {
+        if (is_running) {
+            is_stopping = true;
+            Wake();
+            thread.join();
+            is_running = false;
+        }
+        connections.clear();
+        waiting.clear();
+        CloseDescriptors();
+    }
+
+    uint16_t Port() const { return port; }
+
+    // Writer side, any thread
+
+    // path: as requested, e.g. /1/frag-3.m4s
+    void Publish(const std::string &path, const std::shared_ptr<const SegmentBuffer> &segment)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        published[path] = segment;
+    }
+
+    void Unpublish(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        published.erase(path);
+    }
+
+    // Published segments have grown or are complete: the responses waiting for them go on
+    void Notify() { Wake(); }
+
+private:
+
+    enum State
+    {
+        STATE_READING,      // the next request
+        STATE_DEFERRED,     // the request waits for its segment to be complete
+        STATE_SENDING
+    };
+
+    struct Request
+    {
+        bool is_head;
+        bool is_keep_alive;
+        std::string path;
+        bool has_range;
+        bool has_range_first;               // bytes=-n: the last n bytes
+        bool has_range_last;
+        uint64_t range_first, range_last;
+    };
+
+    struct Connection
+    {
+        explicit Connection(int fd)
+            : fd(fd), state(STATE_READING), request(), out_sent(0), file_fd(-1), offset(0), end(0)
+            , chunk_remaining(0), is_chunked(false), is_waiting(false), is_read_closed(false), last_active(time(nullptr))
+        {
+        }
+
+        ~Connection()
+        {
+            close(fd);
+            if (file_fd >= 0) close(file_fd);
+        }
+
+        const int fd;
+        State state;
+        std::string in;                     // request bytes not handled yet
+        Request request;
+        std::string out;                    // status line and headers, or chunk framing
+        size_t out_sent;
+
+        // body: [offset, end) of the segment or the file
+        std::shared_ptr<const SegmentBuffer> segment;
+        int file_fd;
+        uint64_t offset;
+        uint64_t end;                       // UINT64_MAX: up to where the growing segment ends
+        uint64_t chunk_remaining;           // bytes of the current HTTP chunk (or run) still to send
+        bool is_chunked;
+        bool is_waiting;                    // in waiting, for a segment to grow
+        bool is_read_closed;                // the client sent everything, the requests left in in are answered
+        time_t last_active;                 // of the last bytes received or sent
+    };
+
+    static const size_t kMaxRequestSize = 16 * 1024;
+    static const int kIdleTimeout = 60;     // seconds without a byte in or out, unless blocked on sending
+
+    void Run()
+    {
+        std::vector<epoll_event> events(256);
+        time_t last_sweep = time(nullptr);
+        while (!is_stopping) {
+            const int n = epoll_wait(epoll_fd, events.data(), (int)events.size(), 1000);
+            if (n < 0 && errno != EINTR) {
+                FMP4_LOGE("epoll_wait failed: %s\n", strerror(errno));
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                const int fd = events[i].data.fd;
+                if (fd == listen_fd) {
+                    Accept();
+                } else if (fd == event_fd) {
+                    uint64_t value;
+                    while (read(event_fd, &value, sizeof(value)) > 0) {}
+                    WakeWaiting();
+                } else {
+                    HandleEvents(fd, events[i].events);
+                }
+            }
+
+            const time_t now = time(nullptr);
+            if (now != last_sweep) {
+                CloseIdle(now);
+                last_sweep = now;
+            }
+        }
+    }
+
+    void Accept()
+    {
+        while (true) {
+            const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_WARN, 1, "accept failed: %s\n", strerror(errno));
+                return;
+            }
+            const int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if ((size_t)fd >= connections.size()) connections.resize(fd + 1);
+            connections[fd].reset(new Connection(fd));
+            if (!Watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) connections[fd].reset();
+        }
+    }
+
+    void HandleEvents(int fd, uint32_t events)
+    {
+        if ((size_t)fd >= connections.size() || !connections[fd]) return;
+        Connection &connection = *connections[fd];
+        connection.last_active = time(nullptr);
+
+        bool is_open = !(events & EPOLLERR);
+        if (is_open && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) is_open = Receive(connection);
+        if (is_open && (events & EPOLLOUT) && connection.state == STATE_SENDING && !connection.is_waiting)
+            is_open = Send(connection);
+        if (!is_open) connections[fd].reset();
+    }
+
+    // Read what is there; false: close
+    bool Receive(Connection &connection)
+    {
+        char buf[4096];
+        while (true) {
+            const ssize_t n = recv(connection.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                connection.in.append(buf, (size_t)n);
+                if (connection.in.size() > kMaxRequestSize) return false;
+                continue;
+            }
+            if (n == 0) {
+                // half closed: the requests received are still answered
+                connection.is_read_closed = true;
+                break;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        return connection.state != STATE_READING || HandleInput(connection);
+    }
+
+    // The next request, if it is complete; without one a connection the client closed is done
+    bool HandleInput(Connection &connection)
+    {
+        const size_t header_end = connection.in.find("\r\n\r\n");
+        if (header_end == std::string::npos) return !connection.is_read_closed;
+
+        const std::string header = connection.in.substr(0, header_end);
+        connection.in.erase(0, header_end + 4);
+
+        const int status = ParseRequest(header, connection.request);
+        if (status != 200) return SendError(connection, status);
+        return Respond(connection);
+    }
+
+    // 200, or the status of the error
+    static int ParseRequest(const std::string &header, Request &request)
+    {
+        request = Request();
+        const size_t line_end = header.find("\r\n");
+        const std::string line = header.substr(0, line_end);
+        const size_t method_end = line.find(' ');
+        const size_t target_end = line.find(' ', method_end + 1);
+        if (method_end == std::string::npos || target_end == std::string::npos) return 400;
+
+        const std::string method = line.substr(0, method_end);
+        std::string target = line.substr(method_end + 1, target_end - method_end - 1);
+        const std::string version = line.substr(target_end + 1);
+        if (version.compare(0, 5, "HTTP/") != 0) return 400;
+        if (method != "GET" && method != "HEAD") return 405;
+
+        request.is_head = method == "HEAD";
+        request.is_keep_alive = version != "HTTP/1.0";
+        target = target.substr(0, target.find('?'));
+        if (target.empty() || target[0] != '/' || target.find("..") != std::string::npos) return 400;
+        request.path = target;
+
+        size_t position = line_end;
+        while (position != std::string::npos && position < header.size()) {
+            const size_t start = position + 2;
+            const size_t next = header.find("\r\n", start);
+            const std::string field = header.substr(start, next == std::string::npos ? std::string::npos : next - start);
+            position = next;
+
+            const size_t colon = field.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = field.substr(0, colon);
+            for (char &c : name) c = (char)tolower((unsigned char)c);
+            const size_t value_start = field.find_first_not_of(" \t", colon + 1);
+            const std::string value = value_start == std::string::npos ? "" : field.substr(value_start);
+
+            if (name == "connection") {
+                std::string lower = value;
+                for (char &c : lower) c = (char)tolower((unsigned char)c);
+                if (lower == "close") request.is_keep_alive = false;
+                if (lower == "keep-alive") request.is_keep_alive = true;
+            } else if (name == "range") {
+                ParseRange(value, request);
+            }
+        }
+        return 200;
+    }
+
+    // bytes=first-last, bytes=first- or bytes=-suffix; anything else (several ranges) is ignored
+    static void ParseRange(const std::string &value, Request &request)
+    {
+        if (value.compare(0, 6, "bytes=") != 0 || value.find(',') != std::string::npos) return;
+        const size_t dash = value.find('-', 6);
+        if (dash == std::string::npos) return;
+        const std::string first = value.substr(6, dash - 6), last = value.substr(dash + 1);
+        if (first.empty() && last.empty()) return;
+
+        request.has_range = true;
+        request.has_range_first = !first.empty();
+        request.has_range_last = !last.empty();
+        request.range_first = first.empty() ? 0 : strtoull(first.c_str(), nullptr, 10);
+        request.range_last = last.empty() ? 0 : strtoull(last.c_str(), nullptr, 10);
+        if (request.has_range_first && request.has_range_last && request.range_last < request.range_first)
+            request.has_range = false;
+    }
+
+    std::shared_ptr<const SegmentBuffer> FindPublished(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::string, std::shared_ptr<const SegmentBuffer>>::const_iterator it = published.find(path);
+        return it == published.end() ? nullptr : it->second;
+    }
+
+    // Status line and headers for the request, and the body to send after them
+    bool Respond(Connection &connection)
+    {
+        const Request &request = connection.request;
+        std::shared_ptr<const SegmentBuffer> segment = FindPublished(request.path);
+        int file_fd = -1;
+        uint64_t size = 0;
+        bool is_complete = true;
+        if (segment) {
+            is_complete = segment->IsComplete();        // before Size(): a complete segment has its final size
+            size = segment->Size();
+        } else {
+            file_fd = open((root + request.path).c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (file_fd < 0 || fstat(file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                if (file_fd >= 0) close(file_fd);
+                return SendError(connection, 404);
+            }
+            size = (uint64_t)st.st_size;
+        }
+
+        uint64_t first = 0, end = is_complete ? size : UINT64_MAX;
+        int status = 200;
+        std::string range_header;
+        if (request.has_range) {
+            if (!is_complete && !(request.has_range_first && request.has_range_last)) {
+                // the length is not known yet
+                connection.state = STATE_DEFERRED;
+                Wait(connection);
+                return true;
+            }
+            if (!request.has_range_first) {
+                first = size > request.range_last ? size - request.range_last : 0;
+            } else {
+                first = request.range_first;
+                end = request.has_range_last ? request.range_last + 1 : size;
+                if (is_complete && end > size) end = size;
+            }
+            if (is_complete && first >= size) {
+                if (file_fd >= 0) close(file_fd);
+                return SendError(connection, 416);
+            }
+            status = 206;
+            char buf[96];
+            if (is_complete) {
+                snprintf(buf, sizeof(buf), "Content-Range: bytes %llu-%llu/%llu\r\n", (unsigned long long)first,
+                         (unsigned long long)(end - 1), (unsigned long long)size);
+            } else {
+                snprintf(buf, sizeof(buf), "Content-Range: bytes %llu-%llu/*\r\n", (unsigned long long)first,
+                         (unsigned long long)(end - 1));
+            }
+            range_header = buf;
+        }
+
+        connection.state = STATE_SENDING;
+        connection.segment = segment;
+        connection.file_fd = file_fd;
+        connection.offset = first;
+        connection.end = end;
+        connection.chunk_remaining = 0;
+        connection.is_chunked = end == UINT64_MAX;
+
+        const bool is_manifest = EndsWith(request.path, ".m3u8") || EndsWith(request.path, ".mpd");
+        std::string &out = connection.out;
+        out = status == 206 ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+        out += "Content-Type: " + ContentType(request.path) + "\r\n";
+        out += is_manifest || !is_complete ? "Cache-Control: no-cache\r\n" : "Cache-Control: max-age=3600\r\n";
+        out += "Access-Control-Allow-Origin: *\r\n";
+        out += range_header;
+        if (connection.is_chunked) {
+            out += "Transfer-Encoding: chunked\r\n";
+        } else {
+            out += "Content-Length: " + std::to_string(end - first) + "\r\n";
+        }
+        out += request.is_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        connection.out_sent = 0;
+        if (request.is_head) connection.end = connection.offset;
+        connection.is_chunked = connection.is_chunked && !request.is_head;
+        return Send(connection);
+    }
+
+    bool SendError(Connection &connection, int status)
+    {
+        const char *reason = status == 404 ? "Not Found" : status == 405 ? "Method Not Allowed"
+                           : status == 416 ? "Range Not Satisfiable" : "Bad Request";
+        char buf[256];
+        snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %u\r\n"
+                 "Access-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n%s\n",
+                 status, reason, (unsigned int)strlen(reason) + 1,
+                 connection.request.is_keep_alive && status != 400 ? "keep-alive" : "close", reason);
+        if (status == 400) connection.request.is_keep_alive = false;
+
+        connection.state = STATE_SENDING;
+        connection.segment.reset();
+        connection.file_fd = -1;
+        connection.offset = connection.end = 0;
+        connection.chunk_remaining = 0;
+        connection.is_chunked = false;
+        connection.out = buf;
+        connection.out_sent = 0;
+        return Send(connection);
+    }
+
+    // Send until the socket is full, the body waits for its segment or the response is done; false: close
+    bool Send(Connection &connection)
+    {
+        while (true) {
+            if (connection.out_sent < connection.out.size()) {
+                const ssize_t n = send(connection.fd, connection.out.data() + connection.out_sent,
+                                       connection.out.size() - connection.out_sent, MSG_NOSIGNAL);
+                if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                connection.out_sent += (size_t)n;
+                connection.last_active = time(nullptr);
+                continue;
+            }
+            connection.out.clear();
+            connection.out_sent = 0;
+
+            if (connection.chunk_remaining) {
+                const int body_fd = connection.segment ? connection.segment->Descriptor() : connection.file_fd;
+                off_t offset = (off_t)connection.offset;
+                const ssize_t n = sendfile(connection.fd, body_fd, &offset,
+                                           (size_t)std::min<uint64_t>(connection.chunk_remaining, 1 << 20));
+                if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                if (n == 0) return false;   // the file got shorter
+                connection.last_active = time(nullptr);
+                connection.offset += (uint64_t)n;
+                connection.chunk_remaining -= (uint64_t)n;
+                if (!connection.chunk_remaining && connection.is_chunked) connection.out = "\r\n";
+                continue;
+            }
+
+            // what is there now
+            const bool is_complete = !connection.segment || connection.segment->IsComplete();
+            const uint64_t available = connection.segment ? connection.segment->Size() : connection.end;
+            const uint64_t limit = std::min(available, connection.end);
+            if (connection.offset < limit) {
+                connection.chunk_remaining = limit - connection.offset;
+                if (connection.is_chunked) {
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), "%llx\r\n", (unsigned long long)connection.chunk_remaining);
+                    connection.out = buf;
+                }
+                continue;
+            }
+
+            if (!is_complete && connection.offset < connection.end) {
+                Wait(connection);
+                return true;
+            }
+            if (connection.end != UINT64_MAX && connection.offset < connection.end) return false;  // came up short
+            if (connection.is_chunked) {
+                connection.out = "0\r\n\r\n";
+                connection.is_chunked = false;
+                connection.end = connection.offset;
+                continue;
+            }
+            return EndResponse(connection);
+        }
+    }
+
+    bool EndResponse(Connection &connection)
+    {
+        connection.state = STATE_READING;
+        connection.segment.reset();
+        if (connection.file_fd >= 0) close(connection.file_fd);
+        connection.file_fd = -1;
+        if (!connection.request.is_keep_alive) return false;
+        return HandleInput(connection);        // a pipelined request
+    }
+
+    void Wait(Connection &connection)
+    {
+        if (connection.is_waiting) return;
+        connection.is_waiting = true;
+        waiting.push_back(connection.fd);
+    }
+
+    // A writer called Notify(): everything that waits looks again
+    void WakeWaiting()
+    {
+        std::vector<int> woken;
+        woken.swap(waiting);
+        for (int fd : woken) {
+            if ((size_t)fd >= connections.size() || !connections[fd] || !connections[fd]->is_waiting) continue;
+            Connection &connection = *connections[fd];
+            connection.is_waiting = false;
+            const bool is_open = connection.state == STATE_DEFERRED ? Respond(connection) : Send(connection);
+            if (!is_open) connections[fd].reset();
+        }
+    }
+
+    // Reading a request, waiting for a segment or for the rest of one: a response blocked on a full
+    // socket is left to TCP
+    void CloseIdle(time_t now)
+    {
+        for (std::unique_ptr<Connection> &connection : connections) {
+            if (!connection || now - connection->last_active <= kIdleTimeout) continue;
+            if (connection->state != STATE_SENDING || connection->is_waiting) connection.reset();
+        }
+    }
+
+    bool Watch(int fd, uint32_t events)
+    {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = fd;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    void Wake()
+    {
+        const uint64_t one = 1;
+        if (event_fd >= 0 && write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_WARN, 1, "Fail to wake the server: %s\n", strerror(errno));
+    }
+
+    void CloseDescriptors()
+    {
+        for (int *fd : { &listen_fd, &epoll_fd, &event_fd }) {
+            if (*fd >= 0) close(*fd);
+            *fd = -1;
+        }
+    }
+
+    static bool EndsWith(const std::string &text, const char *suffix)
+    {
+        const size_t n = strlen(suffix);
+        return text.size() >= n && text.compare(text.size() - n, n, suffix) == 0;
+    }
+
+    static std::string ContentType(const std::string &path)
+    {
+        if (EndsWith(path, ".m3u8")) return "application/vnd.apple.mpegurl";
+        if (EndsWith(path, ".mpd")) return "application/dash+xml";
+        if (EndsWith(path, ".m4s")) return "video/iso.segment";
+        if (EndsWith(path, ".mp4")) return "video/mp4";
+        return "application/octet-stream";
+    }
+
+    std::string root;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;                           // Notify() and Stop()
+    uint16_t port;
+    bool is_running;
+    std::atomic<bool> is_stopping;
+    std::thread thread;
+
+    std::mutex mutex;                       // published
+    std::map<std::string, std::shared_ptr<const SegmentBuffer>> published;
+
+    // loop thread only
+    std::vector<std::unique_ptr<Connection>> connections;  // by socket
+    std::vector<int> waiting;               // sockets of responses waiting for a segment
+};
+
+} // namespace fmp4
+
+#endif // FMP4_HTTP_SERVER_H
@@ -0,0 +1,683 @@
+#ifndef FMP4_LOGGER_H
+#define FMP4_LOGGER_H
+
+/*
+ * Low overhead logger for the per-sample hot paths.
+ *
+ * - Levels below FMP4_LOG_LEVEL are removed at compile time, the arguments are not even evaluated.
+ * - Every thread owns a lock-free SPSC ring. The caller only encodes the format pointer and the
+ *   raw argument values (binary, no formatting) into its ring and returns.
+ * - A background thread drains all rings, formats the records and writes them to stdout
+ *   (or FMP4_LOG_FILE). When a ring is full the record is dropped and counted instead of blocking.
+ *   The thread sleeps while the rings are empty, a caller wakes it only if it is asleep.
+ * - Messages logged during static destruction are written directly, the same way to the same output.
+ * - FMP4_LOG_RATE_LIMITED() limits a call site to N records per second.
+ *
+ * Runtime knobs (environment):
+ *   FMP4_LOG_FILE  write to this file instead of stdout
+ *   FMP4_LOG_JSON  emit one JSON object per line instead of plain text
+ *
+ * Usage:
+ *   FMP4_LOGD("%d video: %dbytes, %lldms\n", count, sample_size, duration);
+ *   FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_WARN, 10, "Fail to write frame\n");
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define FMP4_LOG_LEVEL_TRACE 0
+#define FMP4_LOG_LEVEL_DEBUG 1
+#define FMP4_LOG_LEVEL_INFO  2
+#define FMP4_LOG_LEVEL_WARN  3
+#define FMP4_LOG_LEVEL_ERROR 4
+#define FMP4_LOG_LEVEL_NONE  5
+
+#ifndef FMP4_LOG_LEVEL
+#define FMP4_LOG_LEVEL FMP4_LOG_LEVEL_INFO
+#endif
+
+namespace fmp4 {
+namespace log {
+
+// Argument tags of the binary record encoding
+enum ArgTag : uint8_t
+{
+    ARG_INT    = 'i',
+    ARG_UINT   = 'u',
+    ARG_DOUBLE = 'f',
+    ARG_STRING = 's',
+    ARG_PTR    = 'p'
+};
+
+// Layout of one record inside a ring: [RecordHeader][encoded args]
+struct RecordHeader
+{
+    uint32_t size;              // header + args
+    uint8_t level;
+    uint8_t reserved[3];
+    int line;
+    const char *file;
+    const char *format;         // must be a string literal
+    uint64_t timestamp_ns;
+};
+
+static const unsigned int kMaxRecordSize  = 1024;
+static const unsigned int kMaxStringSize  = 256;
+static const unsigned int kRingCapacity   = 256 * 1024;   // per thread, power of two
+
+class Encoder
+{
+public:
+
+    Encoder() : size(sizeof(RecordHeader)), overflow(false) {}
+
+    // Arguments are written all-or-nothing so a truncated record still decodes.
+    bool Fits(unsigned int bytes)
+    {
+        if (size + bytes > kMaxRecordSize) {
+            overflow = true;
+            return false;
+        }
+        return true;
+    }
+
+    void Put(const void *data, unsigned int bytes)
+    {
+        memcpy(buffer + size, data, bytes);
+        size += bytes;
+    }
+
+    void PutTag(ArgTag tag) { Put(&tag, 1); }
+
+    RecordHeader *Header() { return reinterpret_cast<RecordHeader *>(buffer); }
+
+    alignas(8) unsigned char buffer[kMaxRecordSize];
+    unsigned int size;
+    bool overflow;
+};
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+EncodeArg(Encoder &encoder, T value)
+{
+    int64_t v = value;
+    if (!encoder.Fits(1 + sizeof(v))) return;
+    encoder.PutTag(ARG_INT);
+    encoder.Put(&v, sizeof(v));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+EncodeArg(Encoder &encoder, T value)
+{
+    uint64_t v = value;
+    if (!encoder.Fits(1 + sizeof(v))) return;
+    encoder.PutTag(ARG_UINT);
+    encoder.Put(&v, sizeof(v));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value>::type
+EncodeArg(Encoder &encoder, T value)
+{
+    EncodeArg(encoder, static_cast<int64_t>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type
+EncodeArg(Encoder &encoder, T value)
+{
+    double v = value;
+    if (!encoder.Fits(1 + sizeof(v))) return;
+    encoder.PutTag(ARG_DOUBLE);
+    encoder.Put(&v, sizeof(v));
+}
+
+inline void EncodeArg(Encoder &encoder, const char *value)
+{
+    if (!value) value = "(null)";
+    size_t len = strlen(value);
+    uint16_t v = static_cast<uint16_t>(len > kMaxStringSize ? kMaxStringSize : len);
+    if (!encoder.Fits(1 + sizeof(v) + v)) return;
+    encoder.PutTag(ARG_STRING);
+    encoder.Put(&v, sizeof(v));
+    encoder.Put(value, v);
+}
+
+inline void EncodeArg(Encoder &encoder, char *value) { EncodeArg(encoder, (const char *)value); }
+
+inline void EncodeArg(Encoder &encoder, const std::string &value) { EncodeArg(encoder, value.c_str()); }
+
+template <typename T>
+inline void EncodeArg(Encoder &encoder, const T *value)
+{
+    uint64_t v = reinterpret_cast<uintptr_t>(value);
+    if (!encoder.Fits(1 + sizeof(v))) return;
+    encoder.PutTag(ARG_PTR);
+    encoder.Put(&v, sizeof(v));
+}
+
+inline void EncodeArgs(Encoder &) {}
+
+template <typename T, typename... Args>
+inline void EncodeArgs(Encoder &encoder, const T &value, const Args &... args)
+{
+    EncodeArg(encoder, value);
+    EncodeArgs(encoder, args...);
+}
+
+// Single producer (the owning thread), single consumer (the drain thread).
+class Ring
+{
+public:
+
+    Ring(unsigned int thread_index)
+        : thread_index(thread_index)
+        , head(0)
+        , tail(0)
+        , dropped(0)
+        , retired(false)
+    {
+    }
+
+    bool Push(const unsigned char *data, unsigned int bytes)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t t = tail.load(std::memory_order_acquire);
+        if (kRingCapacity - (h - t) < bytes) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        unsigned int pos = (unsigned int)(h & (kRingCapacity - 1));
+        unsigned int first = std::min(bytes, kRingCapacity - pos);
+        memcpy(data_ + pos, data, first);
+        memcpy(data_, data + first, bytes - first);
+
+        head.store(h + bytes, std::memory_order_release);
+        return true;
+    }
+
+    // Return false when the ring is empty.
+    bool Pop(unsigned char *record)
+    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        if (h == t) return false;
+
+        uint32_t size = 0;
+        Read(t, reinterpret_cast<unsigned char *>(&size), sizeof(size));
+        Read(t, record, size);
+
+        tail.store(t + size, std::memory_order_release);
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    const unsigned int thread_index;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> retired;
+
+private:
+
+    void Read(uint64_t from, unsigned char *out, unsigned int bytes)
+    {
+        unsigned int pos = (unsigned int)(from & (kRingCapacity - 1));
+        unsigned int first = std::min(bytes, kRingCapacity - pos);
+        memcpy(out, data_ + pos, first);
+        memcpy(out + first, data_, bytes - first);
+    }
+
+    unsigned char data_[kRingCapacity];
+};
+
+class Logger
+{
+public:
+
+    static Logger &Instance()
+    {
+        static Logger instance;
+        return instance;
+    }
+
+    static bool IsDestroyed() { return state().load(std::memory_order_acquire) == STATE_DESTROYED; }
+
+    template <typename... Args>
+    void Log(int level, const char *file, int line, const char *format, const Args &... args)
+    {
+        Encoder encoder;
+        EncodeArgs(encoder, args...);
+
+        RecordHeader *header = encoder.Header();
+        header->size         = encoder.size;
+        header->level        = static_cast<uint8_t>(level);
+        header->line         = line;
+        header->file         = file;
+        header->format       = format;
+        header->timestamp_ns = Now();
+
+        LocalRing()->Push(encoder.buffer, encoder.size);
+
+        // pairs with the fence in DrainLoop(): either the drain thread sees the record or we see it asleep
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (is_sleeping.load(std::memory_order_relaxed)) Wake();
+    }
+
+    // Synchronous fallback for messages logged during static destruction
+    template <typename... Args>
+    static void LogDirect(int level, const char *file, int line, const char *format, const Args &... args)
+    {
+        Encoder encoder;
+        EncodeArgs(encoder, args...);
+
+        std::string message;
+        Format(message, format, encoder.buffer + sizeof(RecordHeader), encoder.size - sizeof(RecordHeader));
+        WriteLine(output(), level, -1, Now(), file, line, message);
+        fflush(output().file);
+    }
+
+    ~Logger()
+    {
+        state().store(STATE_DESTROYED, std::memory_order_release);
+        is_running = false;
+        Wake();
+        if (drain_thread.joinable())
+            drain_thread.join();
+
+        // Final drain after the worker stopped, the output stays open for LogDirect()
+        DrainAll();
+        fflush(output().file);
+    }
+
+private:
+
+    Logger()
+        : is_running(true)
+        , is_sleeping(false)
+        , is_woken(false)
+        , thread_count(0)
+    {
+        Now();
+        output();
+        state().store(STATE_ALIVE, std::memory_order_release);
+        drain_thread = std::thread(&Logger::DrainLoop, this);
+    }
+
+    struct Output
+    {
+        FILE *file;
+        bool is_json;
+    };
+
+    // Opened once, for the rings and LogDirect() alike, and never closed: exit() flushes it
+    static const Output &output()
+    {
+        static const Output value = OpenOutput();
+        return value;
+    }
+
+    static Output OpenOutput()
+    {
+        Output out = { stdout, getenv("FMP4_LOG_JSON") != nullptr };
+        const char *file = getenv("FMP4_LOG_FILE");
+        if (file) {
+            FILE *fptr = fopen(file, "w");
+            if (fptr) out.file = fptr;
+        }
+        return out;
+    }
+
+    // Nanoseconds since the first use of the logger
+    static uint64_t Now()
+    {
+        static const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    enum State { STATE_NONE, STATE_ALIVE, STATE_DESTROYED };
+
+    static std::atomic<int> &state()
+    {
+        static std::atomic<int> value(STATE_NONE);
+        return value;
+    }
+
+    // Mark the ring of an exiting thread, the drain thread frees it once it is empty.
+    struct RingHolder
+    {
+        RingHolder() : ring(nullptr) {}
+        ~RingHolder() { if (ring) ring->retired.store(true, std::memory_order_release); }
+        Ring *ring;
+    };
+
+    Ring *LocalRing()
+    {
+        static thread_local RingHolder holder;
+        if (!holder.ring) {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.emplace_back(new Ring(thread_count++));
+            holder.ring = rings.back().get();
+        }
+        return holder.ring;
+    }
+
+    void DrainLoop()
+    {
+        while (is_running) {
+            if (DrainAll()) continue;
+
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            is_sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!HasPending())
+                wake_cv.wait(lock, [this] { return is_woken || !is_running; });
+            is_sleeping.store(false, std::memory_order_relaxed);
+            is_woken = false;
+        }
+    }
+
+    void Wake()
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        is_woken = true;
+        wake_cv.notify_one();
+    }
+
+    // Records or drop counts not written yet
+    bool HasPending()
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (const std::unique_ptr<Ring> &ring : rings) {
+            if (!ring->Empty() || ring->dropped.load(std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    // Return true if anything was written.
+    bool DrainAll()
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+
+        FILE *file = output().file;
+        bool has_output = false;
+        for (auto it = rings.begin(); it != rings.end();) {
+            Ring *ring = it->get();
+
+            // Bound the work per ring so a chatty thread cannot starve the others
+            for (int n = 0; n < 256 && ring->Pop(record); n++) {
+                WriteRecord(ring->thread_index, *reinterpret_cast<RecordHeader *>(record),
+                            record + sizeof(RecordHeader));
+                has_output = true;
+            }
+
+            uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped) {
+                fprintf(file, "[logger] T%u dropped %llu messages\n", ring->thread_index, (unsigned long long)dropped);
+                has_output = true;
+            }
+
+            if (ring->retired.load(std::memory_order_acquire) && ring->Empty()) {
+                it = rings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if (has_output)
+            fflush(file);
+        return has_output;
+    }
+
+    void WriteRecord(unsigned int thread_index, const RecordHeader &header, const unsigned char *args)
+    {
+        message.clear();
+        Format(message, header.format, args, header.size - sizeof(RecordHeader));
+        WriteLine(output(), header.level, (int)thread_index, header.timestamp_ns, header.file, header.line, message);
+    }
+
+    // One line per message; thread_index -1: logged directly, not from a ring
+    static void WriteLine(const Output &out, int level_value, int thread_index, uint64_t timestamp_ns,
+                          const char *file, int line, std::string &message)
+    {
+        static const char *level_names[] = { "T", "D", "I", "W", "E" };
+
+        // Strip the trailing newline, every record is one line
+        while (!message.empty() && message[message.size() - 1] == '\n')
+            message.resize(message.size() - 1);
+
+        char thread[16] = "-";
+        if (thread_index >= 0) snprintf(thread, sizeof(thread), "%d", thread_index);
+
+        double ts = timestamp_ns / 1e9;
+        const char *level = level_value >= 0 && level_value <= FMP4_LOG_LEVEL_ERROR ? level_names[level_value] : "?";
+        if (out.is_json) {
+            std::string escaped;
+            for (char c : message) {
+                if (c == '"' || c == '\\') { escaped += '\\'; escaped += c; }
+                else if (c == '\n') escaped += "\\n";
+                else if ((unsigned char)c < 0x20) escaped += ' ';
+                else escaped += c;
+            }
+            fprintf(out.file, "{\"ts\":%.6f,\"level\":\"%s\",\"tid\":%s,\"src\":\"%s:%d\",\"msg\":\"%s\"}\n",
+                    ts, level, thread_index >= 0 ? thread : "null", Basename(file), line, escaped.c_str());
+        } else {
+            fprintf(out.file, "%12.6f %s T%s %s\n", ts, level, thread, message.c_str());
+        }
+    }
+
+    static const char *Basename(const char *path)
+    {
+        const char *p = strrchr(path, '/');
+        return p ? p + 1 : path;
+    }
+
+    // printf-style formatting of the binary encoded arguments. Length modifiers in the
+    // format are ignored because the argument width is known from its tag.
+    static void Format(std::string &out, const char *format, const unsigned char *args, unsigned int args_size)
+    {
+        const unsigned char *arg_end = args + args_size;
+        char spec[32], buf[512];
+
+        for (const char *p = format; *p; p++) {
+            if (*p != '%') {
+                out += *p;
+                continue;
+            }
+            if (p[1] == '%') {
+                out += '%';
+                p++;
+                continue;
+            }
+
+            // flags, width and precision
+            unsigned int spec_len = 0;
+            spec[spec_len++] = *p++;
+            while (*p && strchr("-+ #0123456789.", *p) && spec_len < sizeof(spec) - 4)
+                spec[spec_len++] = *p++;
+            // skip length modifiers
+            while (*p && strchr("hlLqjzt", *p))
+                p++;
+            if (!*p) break;
+            char conversion = *p;
+
+            if (args >= arg_end) {
+                out += "<?>";
+                continue;
+            }
+
+            ArgTag tag = static_cast<ArgTag>(*args++);
+            switch (tag) {
+                case ARG_INT:
+                case ARG_UINT: {
+                    uint64_t raw;
+                    memcpy(&raw, args, sizeof(raw));
+                    args += sizeof(raw);
+                    if (strchr("eEfFgGaA", conversion)) {
+                        spec[spec_len++] = conversion; spec[spec_len] = 0;
+                        snprintf(buf, sizeof(buf), spec, tag == ARG_INT ? (double)(int64_t)raw : (double)raw);
+                    } else if (conversion == 'c') {
+                        spec[spec_len++] = 'c'; spec[spec_len] = 0;
+                        snprintf(buf, sizeof(buf), spec, (int)raw);
+                    } else if (conversion == 'd' || conversion == 'i') {
+                        spec[spec_len++] = 'l'; spec[spec_len++] = 'l'; spec[spec_len++] = 'd'; spec[spec_len] = 0;
+                        snprintf(buf, sizeof(buf), spec, (long long)raw);
+                    } else {
+                        if (!strchr("uxXo", conversion)) conversion = tag == ARG_INT ? 'd' : 'u';
+                        spec[spec_len++] = 'l'; spec[spec_len++] = 'l'; spec[spec_len++] = conversion; spec[spec_len] = 0;
+                        snprintf(buf, sizeof(buf), spec, (unsigned long long)raw);
+                    }
+                    break;
+                }
+                case ARG_DOUBLE: {
+                    double v;
+                    memcpy(&v, args, sizeof(v));
+                    args += sizeof(v);
+                    if (!strchr("eEfFgGaA", conversion)) conversion = 'g';
+                    spec[spec_len++] = conversion; spec[spec_len] = 0;
+                    snprintf(buf, sizeof(buf), spec, v);
+                    break;
+                }
+                case ARG_STRING: {
+                    uint16_t len;
+                    memcpy(&len, args, sizeof(len));
+                    args += sizeof(len);
+                    std::string s((const char *)args, len);
+                    args += len;
+                    spec[spec_len++] = 's'; spec[spec_len] = 0;
+                    snprintf(buf, sizeof(buf), spec, s.c_str());
+                    break;
+                }
+                case ARG_PTR: {
+                    uint64_t v;
+                    memcpy(&v, args, sizeof(v));
+                    args += sizeof(v);
+                    snprintf(buf, sizeof(buf), "%p", (void *)(uintptr_t)v);
+                    break;
+                }
+                default:
+                    // Corrupted record, stop here
+                    out += "<bad arg>";
+                    return;
+            }
+            out += buf;
+        }
+    }
+
+    std::atomic<bool> is_running;
+    std::thread drain_thread;
+
+    // The drain thread waits on wake_cv while the rings are empty
+    std::atomic<bool> is_sleeping;
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+    bool is_woken;
+
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    unsigned int thread_count;
+
+    // Only touched by the drain thread (or the destructor after it stopped)
+    alignas(8) unsigned char record[kMaxRecordSize];
+    std::string message;
+};
+
+// Per call site limiter used by FMP4_LOG_RATE_LIMITED()
+class RateLimiter
+{
+public:
+
+    RateLimiter() : window(0), count(0) {}
+
+    bool Allow(unsigned int max_per_second)
+    {
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t current = window.load(std::memory_order_relaxed);
+        if (current != now && window.compare_exchange_strong(current, now, std::memory_order_relaxed)) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        return count.fetch_add(1, std::memory_order_relaxed) < max_per_second;
+    }
+
+private:
+
+    std::atomic<int64_t> window;
+    std::atomic<unsigned int> count;
+};
+
+template <typename... Args>
+inline void Write(int level, const char *file, int line, const char *format, const Args &... args)
+{
+    if (Logger::IsDestroyed()) {
+        Logger::LogDirect(level, file, line, format, args...);
+    } else {
+        Logger::Instance().Log(level, file, line, format, args...);
+    }
+}
+
+} // namespace log
+} // namespace fmp4
+
+#define FMP4_LOG(level, ...) ::fmp4::log::Write(level, __FILE__, __LINE__, __VA_ARGS__)
+
+#define FMP4_LOG_RATE_LIMITED(level, max_per_second, ...)                  \
+    do {                                                                   \
+        if ((level) >= FMP4_LOG_LEVEL) {                                   \
+            static ::fmp4::log::RateLimiter fmp4_log_limiter;              \
+            if (fmp4_log_limiter.Allow(max_per_second))                    \
+                FMP4_LOG(level, __VA_ARGS__);                              \
+        }                                                                  \
+    } while (0)
+
+#if FMP4_LOG_LEVEL <= FMP4_LOG_LEVEL_TRACE
+#define FMP4_LOGT(...) FMP4_LOG(FMP4_LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define FMP4_LOGT(...) do {} while (0)
+#endif
+
+#if FMP4_LOG_LEVEL <= FMP4_LOG_LEVEL_DEBUG
+#define FMP4_LOGD(...) FMP4_LOG(FMP4_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define FMP4_LOGD(...) do {} while (0)
+#endif
+
+#if FMP4_LOG_LEVEL <= FMP4_LOG_LEVEL_INFO
+#define FMP4_LOGI(...) FMP4_LOG(FMP4_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define FMP4_LOGI(...) do {} while (0)
+#endif
+
+#if FMP4_LOG_LEVEL <= FMP4_LOG_LEVEL_WARN
+#define FMP4_LOGW(...) FMP4_LOG(FMP4_LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define FMP4_LOGW(...) do {} while (0)
+#endif
+
+#if FMP4_LOG_LEVEL <= FMP4_LOG_LEVEL_ERROR
+#define FMP4_LOGE(...) FMP4_LOG(FMP4_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define FMP4_LOGE(...) do {} while (0)
+#endif
+
+#endif // FMP4_LOGGER_H
@@ -0,0 +1,428 @@
+#ifndef FMP4_MANIFEST_H
+#define FMP4_MANIFEST_H
+
+/*
+ * DASH MPD and HLS playlist for segments written as files.
+ *
+ * ManifestWriter takes the completed segments (see segmenter.h) and keeps two manifests up to date
+ * next to them: index.mpd (SegmentTemplate with $Number$ and a SegmentTimeline) and index.m3u8 (fMP4
+ * media playlist with EXT-X-MAP). Without a window every segment stays listed (an HLS EVENT
+ * playlist); with one the manifests are a live sliding window of the last segments.
+ *
+ * A published manifest is never written to again: readers (see http_server.h) open it and send it
+ * while the next version is made. ManifestFile writes every version to a new temporary file, the
+ * unchanged entries copied in the kernel from the version before (copy_file_range(), which shares the
+ * extents on file systems that can), the new entries and the tail (closing tags) written after them,
+ * and renames it over the manifest. Only the new text goes through user space however many segments
+ * are listed. Only changes that touch the whole manifest build it anew: the sliding window drops its
+ * oldest segments half a window at a time, and a new bandwidth or target duration is announced only
+ * when a segment exceeds the current one, so the rewrites stay a constant cost per segment on average.
+ *
+ * With a part target the chunks of the segments (see cmaf.h) are announced as they are written:
+ * AddPart() appends an LL-HLS EXT-X-PART (a byte range of the segment file being written) and moves
+ * the EXT-X-PRELOAD-HINT in the tail, and the MPD gets an availabilityTimeOffset so that DASH clients
+ * request a segment once its first chunk is there. Parts of earlier segments stay listed until the
+ * playlist is next rewritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+
+#include "segmenter.h"
+
+namespace fmp4 {
+
+struct ManifestOptions
+{
+    ManifestOptions()
+        : init_uri("init.mp4"), media_prefix("frag-"), media_suffix(".m4s"), timescale(0), width(0), height(0)
+        , target_duration(2.0), window(0), part_target(0)
+    {
+    }
+
+    std::string directory;          // of the segments, the manifests are written there too
+    std::string init_uri;           // URIs relative to the manifests
+    std::string media_prefix;       // segment n is media_prefix + n + media_suffix
+    std::string media_suffix;
+    uint32_t timescale;             // of the segment times
+    std::string codecs;             // RFC 6381, e.g. avc1.64001f
+    uint32_t width, height;
+    double target_duration;         // seconds, the expected longest segment
+    size_t window;                  // segments in a live sliding window, 0: all of them
+    double part_target;             // seconds, the longest chunk; 0: no parts
+};
+
+// RFC 6381 codecs parameter: avc1.PPCCLL from the avcC of H.264 tracks, the sample entry type otherwise
+inline std::string CodecsString(const Track &track)
+{
+    const uint8_t *avcc;
+    uint64_t avcc_size;
+    if (track.FindSampleEntryChild(FMP4_FOURCC('a', 'v', 'c', 'C'), avcc, avcc_size) && avcc_size >= 4) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%s.%02X%02X%02X", FourCCString(track.sample_entry_type).c_str(), avcc[1], avcc[2], avcc[3]);
+        return buf;
+    }
+    return FourCCString(track.sample_entry_type);
+}
+
+// A manifest file updated by appending, every version a new file published by rename
+class ManifestFile
+{
+public:
+
+    ManifestFile() : fd(-1), body_end(0), is_rewrite(true) {}
+
+    ~ManifestFile()
+    {
+        if (fd >= 0) close(fd);
+    }
+
+    bool Open(const std::string &directory, const std::string &name)
+    {
+        path = directory + "/" + name;
+        temp_path = directory + "/." + name + ".tmp";
+        return true;
+    }
+
+    // New content as a whole, written out when it is next published
+    void Reset(const std::string &head, const std::string &body, const std::string &tail)
+    {
+        this->head = head;
+        this->tail = tail;
+        pending = body;
+        is_rewrite = true;
+    }
+
+    void Append(const std::string &text) { pending += text; }
+
+    // The head may only change in place (fixed width fields), anything else needs Reset()
+    bool SetHead(const std::string &head)
+    {
+        if (head.size() != this->head.size()) return false;
+        this->head = head;
+        return true;
+    }
+
+    void SetTail(const std::string &tail) { this->tail = tail; }
+
+    bool Publish()
+    {
+        unlink(temp_path.c_str());
+        const int next = open(temp_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (next < 0) return false;
+
+        bool ok = WriteAt(next, head, 0);
+        uint64_t next_body_end = head.size();
+        if (ok && !is_rewrite && fd >= 0) {
+            // the entries of the published version, after its head
+            ok = CopyAt(next, next_body_end, body_end - next_body_end);
+            next_body_end = body_end;
+        }
+        ok = ok && WriteAt(next, pending + tail, next_body_end);
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+            close(next);
+            unlink(temp_path.c_str());
+            return false;
+        }
+
+        // kept open as the source of the next version, its name now belongs to the readers
+        if (fd >= 0) close(fd);
+        fd = next;
+        body_end = next_body_end + pending.size();
+        pending.clear();
+        is_rewrite = false;
+        return true;
+    }
+
+private:
+
+    static bool WriteAt(int fd, const std::string &text, uint64_t offset)
+    {
+        size_t done = 0;
+        while (done < text.size()) {
+            const ssize_t n = pwrite(fd, text.data() + done, text.size() - done, (off_t)(offset + done));
+            if (n <= 0) return false;
+            done += (size_t)n;
+        }
+        return true;
+    }
+
+    // size bytes from offset of the published version to the same offset of out
+    bool CopyAt(int out, uint64_t offset, uint64_t size)
+    {
+        loff_t in_offset = (loff_t)offset, out_offset = (loff_t)offset;
+        while (size) {
+            const ssize_t n = copy_file_range(fd, &in_offset, out, &out_offset, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            size -= (uint64_t)n;
+        }
+
+        // not supported here (older kernel): through a buffer
+        char buffer[1 << 16];
+        while (size) {
+            const ssize_t n = pread(fd, buffer, std::min<uint64_t>(size, sizeof(buffer)), (off_t)in_offset);
+            if (n <= 0 || pwrite(out, buffer, (size_t)n, (off_t)out_offset) != n) return false;
+            in_offset += n;
+            out_offset += n;
+            size -= (uint64_t)n;
+        }
+        return true;
+    }
+
+    std::string path;
+    std::string temp_path;
+    std::string head;
+    std::string tail;
+    std::string pending;        // body text not published yet
+    int fd;                     // the published version, -1 before the first
+    uint64_t body_end;          // where its tail starts
+    bool is_rewrite;            // the next version is head + pending + tail only
+};
+
+class ManifestWriter
+{
+public:
+
+    explicit ManifestWriter(const ManifestOptions &options)
+        : options(options), availability_start(time(nullptr)), time_offset(0), next_start(0), is_first_entry(true)
+        , bandwidth(0)
+        , target_duration((unsigned int)ceil(options.target_duration)), is_finished(false)
+        , hint_number(0), hint_offset(0)
+    {
+    }
+
+    bool Open()
+    {
+        return mpd.Open(options.directory, "index.mpd") && m3u8.Open(options.directory, "index.m3u8");
+    }
+
+    bool AddSegment(const MediaSegment &segment)
+    {
+        if (segments.empty()) time_offset = segment.start;
+        segments.push_back(segment);
+
+        bool is_reset = segments.size() == 1;
+        const double seconds = (double)segment.duration / options.timescale;
+        const uint64_t bits_per_second = seconds > 0 ? (uint64_t)(segment.size * 8 / seconds) : 0;
+        if (bits_per_second > bandwidth) {
+            bandwidth = bits_per_second + bits_per_second / 4;
+            is_reset = true;
+        }
+        if ((unsigned int)lround(seconds) > target_duration) {
+            target_duration = (unsigned int)lround(seconds);
+            is_reset = true;
+        }
+
+        // the window goes over by up to half of it before the oldest segments are dropped
+        const size_t slack = options.window / 2 ? options.window / 2 : 1;
+        if (options.window && segments.size() > options.window + slack) {
+            segments.erase(segments.begin(), segments.end() - options.window);
+            is_reset = true;
+        }
+
+        // the next part is the start of the next segment
+        hint_number = segment.number + 1;
+        hint_offset = 0;
+
+        if (is_reset) {
+            ResetManifests();
+        } else {
+            mpd.Append(MpdEntry(segment));
+            mpd.SetHead(MpdHead());
+            m3u8.Append(M3u8Entry(segment));
+            m3u8.SetTail(M3u8Tail());
+        }
+        return mpd.Publish() && m3u8.Publish();
+    }
+
+    // A chunk of the segment being written, before AddSegment() of that segment. Parts are listed
+    // from the second segment on, once the playlist exists.
+    bool AddPart(const MediaChunk &chunk)
+    {
+        if (options.part_target <= 0 || segments.empty()) return true;
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "#EXT-X-PART:DURATION=%.5f,URI=\"%s\",BYTERANGE=\"%llu@%llu\"%s\n",
+                 (double)chunk.duration / options.timescale, SegmentUri(chunk.segment_number).c_str(),
+                 (unsigned long long)chunk.size, (unsigned long long)chunk.offset,
+                 chunk.is_independent ? ",INDEPENDENT=YES" : "");
+        m3u8.Append(buf);
+
+        hint_number = chunk.segment_number;
+        hint_offset = chunk.offset + chunk.size;
+        m3u8.SetTail(M3u8Tail());
+        return m3u8.Publish();
+    }
+
+    // No more segments: a static MPD and an ended playlist
+    bool Finish()
+    {
+        if (segments.empty()) return true;
+        is_finished = true;
+        ResetManifests();
+        return mpd.Publish() && m3u8.Publish();
+    }
+
+private:
+
+    void ResetManifests()
+    {
+        std::string mpd_body, m3u8_body;
+        next_start = segments.front().start;
+        is_first_entry = true;
+        for (const MediaSegment &segment : segments) {
+            mpd_body += MpdEntry(segment);
+            m3u8_body += M3u8Entry(segment);
+        }
+        mpd.Reset(MpdHead(), mpd_body, MpdTail());
+        m3u8.Reset(M3u8Head(), m3u8_body, M3u8Tail());
+    }
+
+    std::string SegmentUri(uint32_t number) const
+    {
+        return options.media_prefix + std::to_string(number) + options.media_suffix;
+    }
+
+    static std::string UtcTime(time_t t)
+    {
+        char buf[32];
+        struct tm tm;
+        strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));    // always 20 characters
+        return buf;
+    }
+
+    std::string MpdHead() const
+    {
+        std::string out;
+        char buf[512];
+
+        out += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+        out += "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\"";
+        if (is_finished) {
+            const MediaSegment &last = segments.back();
+            snprintf(buf, sizeof(buf), " type=\"static\" mediaPresentationDuration=\"PT%.3fS\"",
+                     (double)(last.start + (int64_t)last.duration - time_offset) / options.timescale);
+            out += buf;
+        } else {
+            out += " type=\"dynamic\" availabilityStartTime=\"" + UtcTime(availability_start) + "\"";
+            out += " publishTime=\"" + UtcTime(time(nullptr)) + "\"";
+            snprintf(buf, sizeof(buf), " minimumUpdatePeriod=\"PT%uS\"", target_duration);
+            out += buf;
+            if (options.window) {
+                snprintf(buf, sizeof(buf), " timeShiftBufferDepth=\"PT%uS\"", (unsigned int)(target_duration * options.window));
+                out += buf;
+            }
+        }
+        snprintf(buf, sizeof(buf), " minBufferTime=\"PT%uS\">\n", target_duration);
+        out += buf;
+
+        out += "  <Period id=\"0\" start=\"PT0S\">\n";
+        out += "    <AdaptationSet contentType=\"video\" mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n";
+        snprintf(buf, sizeof(buf), "      <Representation id=\"0\" codecs=\"%s\" width=\"%u\" height=\"%u\" bandwidth=\"%llu\">\n",
+                 options.codecs.c_str(), options.width, options.height, (unsigned long long)bandwidth);
+        out += buf;
+        snprintf(buf, sizeof(buf), "        <SegmentTemplate timescale=\"%u\" presentationTimeOffset=\"%lld\" initialization=\"%s\""
+                 " media=\"%s$Number$%s\" startNumber=\"%u\"",
+                 options.timescale, (long long)time_offset, options.init_uri.c_str(), options.media_prefix.c_str(),
+                 options.media_suffix.c_str(), segments.front().number);
+        out += buf;
+        if (options.part_target > 0 && !is_finished) {
+            // a segment can be requested when its first chunk is written, the rest comes as it is written
+            const double offset = target_duration > options.part_target ? target_duration - options.part_target : 0;
+            snprintf(buf, sizeof(buf), " availabilityTimeOffset=\"%.3f\" availabilityTimeComplete=\"false\"", offset);
+            out += buf;
+        }
+        out += ">\n";
+        out += "          <SegmentTimeline>\n";
+        return out;
+    }
+
+    // S@t only where the timeline does not simply go on from the previous segment
+    std::string MpdEntry(const MediaSegment &segment)
+    {
+        char buf[128];
+        if (is_first_entry || segment.start != next_start) {
+            snprintf(buf, sizeof(buf), "            <S t=\"%lld\" d=\"%llu\"/>\n",
+                     (long long)segment.start, (unsigned long long)segment.duration);
+        } else {
+            snprintf(buf, sizeof(buf), "            <S d=\"%llu\"/>\n", (unsigned long long)segment.duration);
+        }
+        is_first_entry = false;
+        next_start = segment.start + (int64_t)segment.duration;
+        return buf;
+    }
+
+    static std::string MpdTail()
+    {
+        return "          </SegmentTimeline>\n"
+               "        </SegmentTemplate>\n"
+               "      </Representation>\n"
+               "    </AdaptationSet>\n"
+               "  </Period>\n"
+               "</MPD>\n";
+    }
+
+    std::string M3u8Head() const
+    {
+        std::string out;
+        char buf[256];
+        out += "#EXTM3U\n#EXT-X-VERSION:7\n";
+        snprintf(buf, sizeof(buf), "#EXT-X-TARGETDURATION:%u\n#EXT-X-MEDIA-SEQUENCE:%u\n", target_duration,
+                 segments.front().number);
+        out += buf;
+        if (!options.window) out += "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+        if (options.part_target > 0) {
+            snprintf(buf, sizeof(buf), "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+                     3 * options.part_target, options.part_target);
+            out += buf;
+        }
+        out += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+        out += "#EXT-X-MAP:URI=\"" + options.init_uri + "\"\n";
+        return out;
+    }
+
+    // The end of the playlist, or where the next part is expected
+    std::string M3u8Tail() const
+    {
+        if (is_finished) return "#EXT-X-ENDLIST\n";
+        if (options.part_target <= 0) return "";
+        char buf[64];
+        snprintf(buf, sizeof(buf), "\",BYTERANGE-START=%llu\n", (unsigned long long)hint_offset);
+        return "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" + SegmentUri(hint_number) + buf;
+    }
+
+    std::string M3u8Entry(const MediaSegment &segment) const
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "#EXTINF:%.6f,\n", (double)segment.duration / options.timescale);
+        return buf + SegmentUri(segment.number) + "\n";
+    }
+
+    const ManifestOptions options;
+    ManifestFile mpd;
+    ManifestFile m3u8;
+    std::deque<MediaSegment> segments;      // listed in the manifests
+    time_t availability_start;
+    int64_t time_offset;                    // start of the first segment, presentation time zero
+    int64_t next_start;                     // expected start of the next S
+    bool is_first_entry;                    // the next S is the first of the timeline
+    uint64_t bandwidth;                     // announced, bits per second
+    unsigned int target_duration;           // announced, seconds
+    bool is_finished;
+    uint32_t hint_number;                   // segment of the next part
+    uint64_t hint_offset;                   // and where it starts in it
+};
+
+} // namespace fmp4
+
+#endif // FMP4_MANIFEST_H
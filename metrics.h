@@ -0,0 +1,584 @@
+#ifndef FMP4_METRICS_H
+#define FMP4_METRICS_H
+
+/*
+ * Built-in instrumentation for the mux pipeline.
+ *
+ * - Per stage latency histograms (HDR style: log2 buckets with 16 linear sub-buckets, ~6% precision)
+ *   for every stream and merged into a global view.
+ * - Sample / byte / fragment counters per stream and operator new counts (FMP4_METRICS_COUNT_ALLOCATIONS,
+ *   per thread as well, summed at scrape time; without it the dumps have no allocation figures).
+ * - Every thread records into its own accumulator, a scrape merges all of them. Writers only do
+ *   relaxed stores on memory they own, so there is no contention on the hot path.
+ * - Dumper periodically writes <prefix>.json and <prefix>.prom (Prometheus text format).
+ *
+ * Everything compiles to nothing unless FMP4_METRICS is defined.
+ *
+ * Runtime knobs (environment):
+ *   FMP4_METRICS_FILE         output prefix (default: fmp4-metrics)
+ *   FMP4_METRICS_INTERVAL_MS  dump interval (default: 1000)
+ */
+
+#ifdef FMP4_METRICS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fmp4 {
+namespace metrics {
+
+enum Stage
+{
+    STAGE_READ_SAMPLE,      // MP4Reader::GetNext*Sample
+    STAGE_PARSE_NALU,       // ParseH264NALU
+    STAGE_FEED,             // segment builder Feed
+    STAGE_WRITE_MOOF,       // build and write moof
+    STAGE_WRITE_MDAT,       // write mdat
+    STAGE_WRITE_FRAME,      // av_interleaved_write_frame
+    STAGE_COUNT
+};
+
+enum Stream
+{
+    STREAM_VIDEO,
+    STREAM_AUDIO,
+    STREAM_MUX,             // stages working on all streams at once
+    STREAM_COUNT
+};
+
+enum Counter
+{
+    COUNTER_SAMPLES,
+    COUNTER_SAMPLE_BYTES,
+    COUNTER_FRAGMENTS,
+    COUNTER_OUTPUT_BYTES,
+    COUNTER_COUNT
+};
+
+static const char *const kStageNames[STAGE_COUNT] = {
+    "read_sample", "parse_nalu", "feed", "write_moof", "write_mdat", "write_frame"
+};
+static const char *const kStreamNames[STREAM_COUNT] = { "video", "audio", "mux" };
+static const char *const kCounterNames[COUNTER_COUNT] = { "samples", "sample_bytes", "fragments", "output_bytes" };
+
+inline uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Single writer histogram. Buckets 0..15 hold the values 0..15, every following group of 16
+// buckets covers [2^k, 2^(k+1)) linearly.
+class Histogram
+{
+public:
+
+    static const unsigned int kSubBuckets = 16;
+    static const unsigned int kBuckets    = (64 - 4 + 1) * kSubBuckets;
+
+    Histogram() : count(0), sum(0), max(0)
+    {
+        for (unsigned int i = 0; i < kBuckets; i++) buckets[i] = 0;
+    }
+
+    static unsigned int BucketIndex(uint64_t value)
+    {
+        if (value < kSubBuckets) return (unsigned int)value;
+        unsigned int msb = 63 - __builtin_clzll(value);
+        unsigned int shift = msb - 4;
+        return (shift + 1) * kSubBuckets + (unsigned int)((value >> shift) & (kSubBuckets - 1));
+    }
+
+    static uint64_t BucketValue(unsigned int index)
+    {
+        if (index < kSubBuckets) return index;
+        unsigned int shift = index / kSubBuckets - 1;
+        return (uint64_t)(kSubBuckets + index % kSubBuckets) << shift;
+    }
+
+    void Record(uint64_t value)
+    {
+        Bump(buckets[BucketIndex(value)], 1);
+        Bump(count, 1);
+        Bump(sum, value);
+        if (value > max.load(std::memory_order_relaxed))
+            max.store(value, std::memory_order_relaxed);
+    }
+
+    void Merge(const Histogram &other)
+    {
+        for (unsigned int i = 0; i < kBuckets; i++) {
+            uint64_t v = other.buckets[i].load(std::memory_order_relaxed);
+            if (v) buckets[i].store(buckets[i].load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+        Bump(count, other.count.load(std::memory_order_relaxed));
+        Bump(sum, other.sum.load(std::memory_order_relaxed));
+        uint64_t other_max = other.max.load(std::memory_order_relaxed);
+        if (other_max > max.load(std::memory_order_relaxed))
+            max.store(other_max, std::memory_order_relaxed);
+    }
+
+    uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return sum.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max.load(std::memory_order_relaxed); }
+
+    uint64_t Percentile(double percentile) const
+    {
+        uint64_t total = Count();
+        if (!total) return 0;
+
+        uint64_t target = (uint64_t)(percentile / 100.0 * total + 0.5);
+        if (target < 1) target = 1;
+
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < kBuckets; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= target) return std::min(BucketValue(i), Max());
+        }
+        return Max();
+    }
+
+private:
+
+    // Only the owning thread writes, so a plain load + store is enough.
+    static void Bump(std::atomic<uint64_t> &value, uint64_t delta)
+    {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> buckets[kBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+struct ThreadStats
+{
+    ThreadStats() : scopes(0)
+    {
+        for (int c = 0; c < COUNTER_COUNT; c++)
+            for (int s = 0; s < STREAM_COUNT; s++)
+                counters[c][s] = 0;
+    }
+
+    void Add(Counter counter, Stream stream, uint64_t value)
+    {
+        counters[counter][stream].store(counters[counter][stream].load(std::memory_order_relaxed) + value,
+                                        std::memory_order_relaxed);
+    }
+
+    Histogram latency[STAGE_COUNT][STREAM_COUNT];
+    std::atomic<uint64_t> counters[COUNTER_COUNT][STREAM_COUNT];
+    std::atomic<uint64_t> scopes;
+};
+
+// Allocation counters of a thread, bumped from the operator new replacement below. They live in a
+// static table rather than in ThreadStats: operator new cannot allocate to register a thread.
+struct AllocationCounters
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+};
+
+// Threads past this many share the last slot, with atomic increments
+static const unsigned int kAllocationSlots = 256;
+
+inline AllocationCounters *AllocationSlots()
+{
+    static AllocationCounters slots[kAllocationSlots + 1];     // zero-initialized, static storage
+    return slots;
+}
+
+inline void CountAllocation(size_t size)
+{
+    static std::atomic<unsigned int> threads(0);
+    static thread_local AllocationCounters *local = nullptr;
+    if (!local) local = &AllocationSlots()[std::min(threads.fetch_add(1, std::memory_order_relaxed), kAllocationSlots)];
+
+    if (local == &AllocationSlots()[kAllocationSlots]) {
+        local->count.fetch_add(1, std::memory_order_relaxed);
+        local->bytes.fetch_add(size, std::memory_order_relaxed);
+        return;
+    }
+    // only the owning thread writes, as in Histogram
+    local->count.store(local->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    local->bytes.store(local->bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+}
+
+// Sums over all threads so far
+inline uint64_t AllocationCount()
+{
+    uint64_t sum = 0;
+    for (unsigned int i = 0; i <= kAllocationSlots; i++) sum += AllocationSlots()[i].count.load(std::memory_order_relaxed);
+    return sum;
+}
+
+inline uint64_t AllocationBytes()
+{
+    uint64_t sum = 0;
+    for (unsigned int i = 0; i <= kAllocationSlots; i++) sum += AllocationSlots()[i].bytes.load(std::memory_order_relaxed);
+    return sum;
+}
+
+struct Snapshot
+{
+    Snapshot() : uptime_ns(0), scopes(0), scope_cost_ns(0), allocations(0), allocated_bytes(0)
+    {
+        for (int c = 0; c < COUNTER_COUNT; c++)
+            for (int s = 0; s < STREAM_COUNT; s++)
+                counters[c][s] = 0;
+    }
+
+    // Share of the wall time spent inside the instrumentation itself
+    double OverheadRatio() const
+    {
+        return uptime_ns ? (double)scopes * scope_cost_ns / uptime_ns : 0.0;
+    }
+
+    uint64_t uptime_ns;
+    uint64_t scopes;
+    double scope_cost_ns;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    Histogram latency[STAGE_COUNT][STREAM_COUNT];
+    Histogram global[STAGE_COUNT];
+    uint64_t counters[COUNTER_COUNT][STREAM_COUNT];
+};
+
+class Registry
+{
+public:
+
+    static Registry &Instance()
+    {
+        static Registry instance;
+        return instance;
+    }
+
+    ThreadStats &Local()
+    {
+        static thread_local ThreadStats *local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.emplace_back(new ThreadStats());
+            local = threads.back().get();
+        }
+        return *local;
+    }
+
+    std::unique_ptr<Snapshot> Scrape()
+    {
+        std::unique_ptr<Snapshot> snapshot(new Snapshot());
+        snapshot->uptime_ns       = NowNs() - start_ns;
+        snapshot->scope_cost_ns   = scope_cost_ns;
+        snapshot->allocations     = AllocationCount();
+        snapshot->allocated_bytes = AllocationBytes();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &thread : threads) {
+            snapshot->scopes += thread->scopes.load(std::memory_order_relaxed);
+            for (int stage = 0; stage < STAGE_COUNT; stage++) {
+                for (int stream = 0; stream < STREAM_COUNT; stream++) {
+                    snapshot->latency[stage][stream].Merge(thread->latency[stage][stream]);
+                    snapshot->global[stage].Merge(thread->latency[stage][stream]);
+                }
+            }
+            for (int c = 0; c < COUNTER_COUNT; c++)
+                for (int s = 0; s < STREAM_COUNT; s++)
+                    snapshot->counters[c][s] += thread->counters[c][s].load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+private:
+
+    Registry() : start_ns(NowNs()), scope_cost_ns(0)
+    {
+        // Calibrate the cost of one timed scope so the dump can report the overhead we add.
+        std::unique_ptr<Histogram> scratch(new Histogram());
+        const int rounds = 10000;
+        uint64_t begin = NowNs();
+        for (int i = 0; i < rounds; i++) {
+            uint64_t t0 = NowNs();
+            scratch->Record(NowNs() - t0);
+        }
+        scope_cost_ns = (double)(NowNs() - begin) / rounds;
+    }
+
+    const uint64_t start_ns;
+    double scope_cost_ns;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadStats>> threads;
+};
+
+class ScopedTimer
+{
+public:
+
+    ScopedTimer(Stage stage, Stream stream)
+        : stats(Registry::Instance().Local())
+        , stage(stage)
+        , stream(stream)
+        , start(NowNs())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        stats.latency[stage][stream].Record(NowNs() - start);
+        stats.scopes.store(stats.scopes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+private:
+
+    ThreadStats &stats;
+    const Stage stage;
+    const Stream stream;
+    const uint64_t start;
+};
+
+inline void Add(Counter counter, Stream stream, uint64_t value)
+{
+    Registry::Instance().Local().Add(counter, stream, value);
+}
+
+inline std::string ToJson(const Snapshot &snapshot)
+{
+    std::string out;
+    char buf[512];
+
+    auto append_histogram = [&](const Histogram &h) {
+        snprintf(buf, sizeof(buf),
+                 "{\"count\":%llu,\"mean_ns\":%.1f,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+                 (unsigned long long)h.Count(), h.Count() ? (double)h.Sum() / h.Count() : 0.0,
+                 (unsigned long long)h.Percentile(50), (unsigned long long)h.Percentile(90),
+                 (unsigned long long)h.Percentile(99), (unsigned long long)h.Percentile(99.9),
+                 (unsigned long long)h.Max());
+        out += buf;
+    };
+
+    snprintf(buf, sizeof(buf), "{\"uptime_s\":%.3f,\"scope_cost_ns\":%.1f,\"overhead_ratio\":%.6f,",
+             snapshot.uptime_ns / 1e9, snapshot.scope_cost_ns, snapshot.OverheadRatio());
+    out += buf;
+#ifdef FMP4_METRICS_COUNT_ALLOCATIONS
+    snprintf(buf, sizeof(buf), "\"allocations\":%llu,\"allocated_bytes\":%llu,",
+             (unsigned long long)snapshot.allocations, (unsigned long long)snapshot.allocated_bytes);
+    out += buf;
+#endif
+
+    out += "\"streams\":{";
+    for (int stream = 0; stream < STREAM_COUNT; stream++) {
+        if (stream) out += ",";
+        out += std::string("\"") + kStreamNames[stream] + "\":{\"counters\":{";
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            snprintf(buf, sizeof(buf), "%s\"%s\":%llu", c ? "," : "", kCounterNames[c],
+                     (unsigned long long)snapshot.counters[c][stream]);
+            out += buf;
+        }
+        out += "},\"stages\":{";
+        bool first = true;
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            if (!snapshot.latency[stage][stream].Count()) continue;
+            out += std::string(first ? "" : ",") + "\"" + kStageNames[stage] + "\":";
+            append_histogram(snapshot.latency[stage][stream]);
+            first = false;
+        }
+        out += "}}";
+    }
+
+    out += "},\"global\":{";
+    bool first = true;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        if (!snapshot.global[stage].Count()) continue;
+        out += std::string(first ? "" : ",") + "\"" + kStageNames[stage] + "\":";
+        append_histogram(snapshot.global[stage]);
+        first = false;
+    }
+    out += "}}\n";
+
+    return out;
+}
+
+inline std::string ToPrometheus(const Snapshot &snapshot)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    std::string out;
+    char buf[512];
+
+    auto append_summary = [&](const Histogram &h, const char *stage, const char *stream) {
+        for (double q : quantiles) {
+            snprintf(buf, sizeof(buf), "fmp4_stage_latency_ns{stage=\"%s\",stream=\"%s\",quantile=\"%g\"} %llu\n",
+                     stage, stream, q, (unsigned long long)h.Percentile(q * 100));
+            out += buf;
+        }
+        snprintf(buf, sizeof(buf),
+                 "fmp4_stage_latency_ns_sum{stage=\"%s\",stream=\"%s\"} %llu\n"
+                 "fmp4_stage_latency_ns_count{stage=\"%s\",stream=\"%s\"} %llu\n",
+                 stage, stream, (unsigned long long)h.Sum(), stage, stream, (unsigned long long)h.Count());
+        out += buf;
+    };
+
+    out += "# TYPE fmp4_stage_latency_ns summary\n";
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        for (int stream = 0; stream < STREAM_COUNT; stream++) {
+            if (snapshot.latency[stage][stream].Count())
+                append_summary(snapshot.latency[stage][stream], kStageNames[stage], kStreamNames[stream]);
+        }
+        if (snapshot.global[stage].Count())
+            append_summary(snapshot.global[stage], kStageNames[stage], "all");
+    }
+
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        snprintf(buf, sizeof(buf), "# TYPE fmp4_%s_total counter\n", kCounterNames[c]);
+        out += buf;
+        for (int stream = 0; stream < STREAM_COUNT; stream++) {
+            snprintf(buf, sizeof(buf), "fmp4_%s_total{stream=\"%s\"} %llu\n", kCounterNames[c],
+                     kStreamNames[stream], (unsigned long long)snapshot.counters[c][stream]);
+            out += buf;
+        }
+    }
+
+#ifdef FMP4_METRICS_COUNT_ALLOCATIONS
+    snprintf(buf, sizeof(buf),
+             "# TYPE fmp4_allocations_total counter\nfmp4_allocations_total %llu\n"
+             "# TYPE fmp4_allocated_bytes_total counter\nfmp4_allocated_bytes_total %llu\n",
+             (unsigned long long)snapshot.allocations, (unsigned long long)snapshot.allocated_bytes);
+    out += buf;
+#endif
+    snprintf(buf, sizeof(buf),
+             "# TYPE fmp4_instrumentation_overhead_ratio gauge\nfmp4_instrumentation_overhead_ratio %.6f\n"
+             "# TYPE fmp4_uptime_seconds gauge\nfmp4_uptime_seconds %.3f\n",
+             snapshot.OverheadRatio(), snapshot.uptime_ns / 1e9);
+    out += buf;
+
+    return out;
+}
+
+// Periodically scrape the registry and write <prefix>.json and <prefix>.prom. The files are
+// replaced atomically so readers never see a partial dump. A last dump is written on destruction.
+class Dumper
+{
+public:
+
+    Dumper()
+        : prefix(getenv("FMP4_METRICS_FILE") ? getenv("FMP4_METRICS_FILE") : "fmp4-metrics")
+        , interval_ms(getenv("FMP4_METRICS_INTERVAL_MS") ? atoi(getenv("FMP4_METRICS_INTERVAL_MS")) : 1000)
+        , is_running(true)
+    {
+        Registry::Instance();
+        if (interval_ms > 0)
+            dump_thread = std::thread(&Dumper::Run, this);
+    }
+
+    ~Dumper()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_running = false;
+        }
+        cond.notify_all();
+        if (dump_thread.joinable())
+            dump_thread.join();
+
+        Dump();
+    }
+
+    void Dump()
+    {
+        std::unique_ptr<Snapshot> snapshot = Registry::Instance().Scrape();
+        WriteFile(prefix + ".json", ToJson(*snapshot));
+        WriteFile(prefix + ".prom", ToPrometheus(*snapshot));
+    }
+
+private:
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (is_running) {
+            cond.wait_for(lock, std::chrono::milliseconds(interval_ms));
+            if (!is_running) break;
+
+            lock.unlock();
+            Dump();
+            lock.lock();
+        }
+    }
+
+    static void WriteFile(const std::string &path, const std::string &content)
+    {
+        std::string tmp_path = path + ".tmp";
+        FILE *fptr = fopen(tmp_path.c_str(), "wb");
+        if (!fptr) return;
+        fwrite(content.data(), 1, content.size(), fptr);
+        fclose(fptr);
+        rename(tmp_path.c_str(), path.c_str());
+    }
+
+    const std::string prefix;
+    const int interval_ms;
+
+    bool is_running;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread dump_thread;
+};
+
+} // namespace metrics
+} // namespace fmp4
+
+#ifdef FMP4_METRICS_COUNT_ALLOCATIONS
+// Count every C++ allocation of the program. Only define this in the translation unit holding main().
+void *operator new(size_t size)
+{
+    fmp4::metrics::CountAllocation(size);
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    fmp4::metrics::CountAllocation(size);
+    return malloc(size ? size : 1);
+}
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { free(p); }
+#endif
+
+#define FMP4_METRICS_CONCAT_(a, b) a##b
+#define FMP4_METRICS_CONCAT(a, b) FMP4_METRICS_CONCAT_(a, b)
+
+#define FMP4_METRICS_SCOPE(stage, stream) \
+    ::fmp4::metrics::ScopedTimer FMP4_METRICS_CONCAT(fmp4_metrics_scope_, __LINE__)(::fmp4::metrics::stage, ::fmp4::metrics::stream)
+#define FMP4_METRICS_ADD(counter, stream, value) \
+    ::fmp4::metrics::Add(::fmp4::metrics::counter, ::fmp4::metrics::stream, value)
+#define FMP4_METRICS_DUMPER() \
+    ::fmp4::metrics::Dumper fmp4_metrics_dumper
+
+#else
+
+#define FMP4_METRICS_SCOPE(stage, stream) do {} while (0)
+#define FMP4_METRICS_ADD(counter, stream, value) do {} while (0)
+#define FMP4_METRICS_DUMPER() do {} while (0)
+
+#endif // FMP4_METRICS
+
+#endif // FMP4_METRICS_H
@@ -0,0 +1,421 @@
+#ifndef FMP4_MP4_BUILDER_H
+#define FMP4_MP4_BUILDER_H
+
+/*
+ * Minimal ISO BMFF box writer, the counterpart of mp4_index.h for the rewriting tools.
+ *
+ * BoxWriter appends big-endian fields to a byte vector and patches box sizes when a box is closed.
+ * On top of it WriteInitSegment() builds ftyp + moov (empty sample tables, mvex/trex) for tracks
+ * taken from an MP4Index, and WriteFragmentHeader() builds moof + the mdat header for one run of
+ * samples per track. Sample payloads are not copied here: the caller writes them after the header,
+ * in run order, straight from the input file. OutputFile is the sequential writer for all of it and
+ * copies byte ranges of an input file without passing them through user space when it can.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <vector>
+
+#include "mp4_index.h"
+
+namespace fmp4 {
+
+// trun/trex sample_flags
+static const uint32_t kSyncSampleFlags    = 0x02000000;     // sample_depends_on = 2 (does not depend on others)
+static const uint32_t kNonSyncSampleFlags = 0x01010000;     // sample_depends_on = 1, sample_is_non_sync_sample
+
+inline uint32_t SampleFlags(bool is_sync) { return is_sync ? kSyncSampleFlags : kNonSyncSampleFlags; }
+
+class BoxWriter
+{
+public:
+
+    explicit BoxWriter(std::vector<uint8_t> &out) : out(out) {}
+
+    // Returns the box offset to hand to EndBox()
+    size_t StartBox(uint32_t type)
+    {
+        const size_t offset = out.size();
+        U32(0);
+        U32(type);
+        return offset;
+    }
+
+    size_t StartFullBox(uint32_t type, uint8_t version, uint32_t flags)
+    {
+        const size_t offset = StartBox(type);
+        U32((uint32_t)version << 24 | (flags & 0xffffff));
+        return offset;
+    }
+
+    void EndBox(size_t offset) { WriteU32(out.data() + offset, (uint32_t)(out.size() - offset)); }
+
+    void U8(uint8_t v) { out.push_back(v); }
+    void U16(uint16_t v) { size_t n = Grow(2); WriteU16(out.data() + n, v); }
+    void U32(uint32_t v) { size_t n = Grow(4); WriteU32(out.data() + n, v); }
+    void U64(uint64_t v) { size_t n = Grow(8); WriteU64(out.data() + n, v); }
+    void Zeros(size_t count) { out.resize(out.size() + count, 0); }
+    void Bytes(const void *data, size_t size) { const uint8_t *p = (const uint8_t *)data; out.insert(out.end(), p, p + size); }
+    void String(const char *s) { Bytes(s, strlen(s) + 1); }
+
+    // Overwrite a field written earlier
+    void PatchU32(size_t offset, uint32_t v) { WriteU32(out.data() + offset, v); }
+
+    size_t Size() const { return out.size(); }
+
+private:
+
+    size_t Grow(size_t bytes)
+    {
+        const size_t offset = out.size();
+        out.resize(offset + bytes);
+        return offset;
+    }
+
+    std::vector<uint8_t> &out;
+};
+
+// Sequential output file written with plain write()/writev(), no stdio buffer in between
+class OutputFile
+{
+public:
+
+    OutputFile() : fd(-1), position(0) {}
+    ~OutputFile() { Close(); }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        position = 0;
+        return fd >= 0;
+    }
+
+    bool Close()
+    {
+        bool ok = true;
+        if (fd >= 0) ok = close(fd) == 0;
+        fd = -1;
+        return ok;
+    }
+
+    bool Write(const void *data, size_t size)
+    {
+        return Write(data, size, nullptr, 0);
+    }
+
+    bool Write(const std::vector<uint8_t> &data) { return Write(data.data(), data.size()); }
+
+    // Two buffers in one system call, e.g. a fragment header and its payload
+    bool Write(const void *first, size_t first_size, const void *second, size_t second_size)
+    {
+        struct iovec iov[2] = { { (void *)first, first_size }, { (void *)second, second_size } };
+        int count = second_size ? 2 : 1;
+        struct iovec *next = iov;
+        while (count) {
+            ssize_t n = writev(fd, next, count);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            position += (uint64_t)n;
+            while (count && (size_t)n >= next->iov_len) {
+                n -= next->iov_len;
+                next++;
+                count--;
+            }
+            if (count) {
+                next->iov_base = (uint8_t *)next->iov_base + n;
+                next->iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    // size bytes of input from offset, in the kernel (copy_file_range) when the file systems allow it
+    bool Copy(const File &input, uint64_t offset, uint64_t size)
+    {
+        loff_t in_offset = (loff_t)offset;
+        while (size) {
+            ssize_t n = copy_file_range(input.Descriptor(), &in_offset, fd, nullptr, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            position += (uint64_t)n;
+            size -= (uint64_t)n;
+        }
+        if (!size) return true;
+
+        // not supported here (older kernel, cross file system copy): through a buffer
+        std::vector<uint8_t> buffer(std::min<uint64_t>(size, 1 << 20));
+        while (size) {
+            const uint64_t bytes = std::min<uint64_t>(size, buffer.size());
+            if (!input.Read((uint64_t)in_offset, buffer.data(), bytes) || !Write(buffer.data(), bytes)) return false;
+            in_offset += bytes;
+            size -= bytes;
+        }
+        return true;
+    }
+
+    int Descriptor() const { return fd; }
+    uint64_t Position() const { return position; }
+
+private:
+
+    OutputFile(const OutputFile &);
+    OutputFile &operator=(const OutputFile &);
+
+    int fd;
+    uint64_t position;
+};
+
+inline void WriteMatrix(BoxWriter &w)
+{
+    static const uint32_t kIdentity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+    for (uint32_t v : kIdentity) w.U32(v);
+}
+
+inline void WriteFtyp(BoxWriter &w)
+{
+    size_t ftyp = w.StartBox(FMP4_FOURCC('f', 't', 'y', 'p'));
+    w.U32(FMP4_FOURCC('i', 's', 'o', '6'));
+    w.U32(0);
+    w.U32(FMP4_FOURCC('i', 's', 'o', '6'));
+    w.U32(FMP4_FOURCC('m', 'p', '4', '1'));
+    w.EndBox(ftyp);
+}
+
+inline void WriteTrak(BoxWriter &w, const Track &track)
+{
+    size_t trak = w.StartBox(FMP4_FOURCC('t', 'r', 'a', 'k'));
+
+    size_t tkhd = w.StartFullBox(FMP4_FOURCC('t', 'k', 'h', 'd'), 0, 0x000003);    // enabled, in movie
+    w.U32(0);                                   // creation_time
+    w.U32(0);                                   // modification_time
+    w.U32(track.track_id);
+    w.U32(0);
+    w.U32(0);                                   // duration: fragmented
+    w.Zeros(8);
+    w.U16(0);                                   // layer
+    w.U16(0);                                   // alternate_group
+    w.U16(track.IsAudio() ? 0x0100 : 0);        // volume
+    w.U16(0);
+    WriteMatrix(w);
+    w.U32(track.width << 16);
+    w.U32(track.height << 16);
+    w.EndBox(tkhd);
+
+    // the edit of the source (a composition delay, audio priming), for the whole fragmented duration
+    if (track.edit_media_time > 0) {
+        size_t edts = w.StartBox(FMP4_FOURCC('e', 'd', 't', 's'));
+        size_t elst = w.StartFullBox(FMP4_FOURCC('e', 'l', 's', 't'), 1, 0);
+        w.U32(1);
+        w.U64(0);                               // segment_duration
+        w.U64((uint64_t)track.edit_media_time);
+        w.U16(1);                               // media_rate 1.0
+        w.U16(0);
+        w.EndBox(elst);
+        w.EndBox(edts);
+    }
+
+    size_t mdia = w.StartBox(FMP4_FOURCC('m', 'd', 'i', 'a'));
+    size_t mdhd = w.StartFullBox(FMP4_FOURCC('m', 'd', 'h', 'd'), 0, 0);
+    w.U32(0);
+    w.U32(0);
+    w.U32(track.timescale);
+    w.U32(0);
+    w.U16(0x55c4);                              // 'und'
+    w.U16(0);
+    w.EndBox(mdhd);
+
+    size_t hdlr = w.StartFullBox(FMP4_FOURCC('h', 'd', 'l', 'r'), 0, 0);
+    w.U32(0);
+    w.U32(track.handler);
+    w.Zeros(12);
+    w.String(track.IsVideo() ? "VideoHandler" : track.IsAudio() ? "SoundHandler" : "DataHandler");
+    w.EndBox(hdlr);
+
+    size_t minf = w.StartBox(FMP4_FOURCC('m', 'i', 'n', 'f'));
+    if (track.IsVideo()) {
+        size_t vmhd = w.StartFullBox(FMP4_FOURCC('v', 'm', 'h', 'd'), 0, 1);
+        w.Zeros(8);                             // graphicsmode, opcolor
+        w.EndBox(vmhd);
+    } else if (track.IsAudio()) {
+        size_t smhd = w.StartFullBox(FMP4_FOURCC('s', 'm', 'h', 'd'), 0, 0);
+        w.Zeros(4);                             // balance
+        w.EndBox(smhd);
+    } else {
+        w.EndBox(w.StartFullBox(FMP4_FOURCC('n', 'm', 'h', 'd'), 0, 0));
+    }
+
+    size_t dinf = w.StartBox(FMP4_FOURCC('d', 'i', 'n', 'f'));
+    size_t dref = w.StartFullBox(FMP4_FOURCC('d', 'r', 'e', 'f'), 0, 0);
+    w.U32(1);
+    w.EndBox(w.StartFullBox(FMP4_FOURCC('u', 'r', 'l', ' '), 0, 1));      // media in the same file
+    w.EndBox(dref);
+    w.EndBox(dinf);
+
+    size_t stbl = w.StartBox(FMP4_FOURCC('s', 't', 'b', 'l'));
+    size_t stsd = w.StartFullBox(FMP4_FOURCC('s', 't', 's', 'd'), 0, 0);
+    w.U32(1);
+    w.Bytes(track.sample_entry.data(), track.sample_entry.size());
+    w.EndBox(stsd);
+    const uint32_t empty_tables[] = {
+        FMP4_FOURCC('s', 't', 't', 's'), FMP4_FOURCC('s', 't', 's', 'c'), FMP4_FOURCC('s', 't', 'c', 'o')
+    };
+    for (uint32_t type : empty_tables) {
+        size_t table = w.StartFullBox(type, 0, 0);
+        w.U32(0);
+        w.EndBox(table);
+    }
+    size_t stsz = w.StartFullBox(FMP4_FOURCC('s', 't', 's', 'z'), 0, 0);
+    w.U32(0);
+    w.U32(0);
+    w.EndBox(stsz);
+    w.EndBox(stbl);
+
+    w.EndBox(minf);
+    w.EndBox(mdia);
+    w.EndBox(trak);
+}
+
+// ftyp + moov for fragments of the given tracks; mvhd uses the timescale of the first one
+inline void WriteInitSegment(BoxWriter &w, const std::vector<const Track *> &tracks)
+{
+    WriteFtyp(w);
+
+    uint32_t next_track_id = 1;
+    for (const Track *track : tracks) next_track_id = std::max(next_track_id, track->track_id + 1);
+
+    size_t moov = w.StartBox(FMP4_FOURCC('m', 'o', 'o', 'v'));
+    size_t mvhd = w.StartFullBox(FMP4_FOURCC('m', 'v', 'h', 'd'), 0, 0);
+    w.U32(0);
+    w.U32(0);
+    w.U32(tracks.empty() ? 1000 : tracks[0]->timescale);
+    w.U32(0);
+    w.U32(0x00010000);                          // rate
+    w.U16(0x0100);                              // volume
+    w.Zeros(10);
+    WriteMatrix(w);
+    w.Zeros(24);                                // pre_defined
+    w.U32(next_track_id);
+    w.EndBox(mvhd);
+
+    for (const Track *track : tracks) WriteTrak(w, *track);
+
+    size_t mvex = w.StartBox(FMP4_FOURCC('m', 'v', 'e', 'x'));
+    for (const Track *track : tracks) {
+        size_t trex = w.StartFullBox(FMP4_FOURCC('t', 'r', 'e', 'x'), 0, 0);
+        w.U32(track->track_id);
+        w.U32(1);                               // default_sample_description_index
+        w.U32(0);
+        w.U32(0);
+        w.U32(0);
+        w.EndBox(trex);
+    }
+    w.EndBox(mvex);
+    w.EndBox(moov);
+}
+
+struct FragmentSample
+{
+    uint32_t size;
+    uint32_t duration;
+    uint32_t flags;             // trun sample_flags, see SampleFlags()
+    int32_t cts_offset;
+};
+
+// The samples of one track in a fragment, one traf
+struct TrackRun
+{
+    TrackRun() : track_id(0), base_dts(0) {}
+
+    uint32_t track_id;
+    uint64_t base_dts;                      // tfdt
+    std::vector<FragmentSample> samples;
+    std::vector<uint8_t> trick_play;        // optional 'trik' entries, one per sample
+
+    uint64_t PayloadSize() const
+    {
+        uint64_t size = 0;
+        for (const FragmentSample &sample : samples) size += sample.size;
+        return size;
+    }
+};
+
+// moof (one traf per run, default-base-is-moof) followed by the mdat header. The caller appends the
+// payload of runs[0], runs[1], ... in that order. Returns the payload size the mdat header announces.
+inline uint64_t WriteFragmentHeader(BoxWriter &w, uint32_t sequence_number, const std::vector<TrackRun> &runs)
+{
+    const size_t moof = w.StartBox(FMP4_FOURCC('m', 'o', 'o', 'f'));
+    size_t mfhd = w.StartFullBox(FMP4_FOURCC('m', 'f', 'h', 'd'), 0, 0);
+    w.U32(sequence_number);
+    w.EndBox(mfhd);
+
+    std::vector<size_t> data_offset_fields;
+    for (const TrackRun &run : runs) {
+        bool has_cts = false;
+        for (const FragmentSample &sample : run.samples) has_cts |= sample.cts_offset != 0;
+
+        size_t traf = w.StartBox(FMP4_FOURCC('t', 'r', 'a', 'f'));
+        size_t tfhd = w.StartFullBox(FMP4_FOURCC('t', 'f', 'h', 'd'), 0, 0x020000);     // default-base-is-moof
+        w.U32(run.track_id);
+        w.EndBox(tfhd);
+
+        size_t tfdt = w.StartFullBox(FMP4_FOURCC('t', 'f', 'd', 't'), 1, 0);
+        w.U64(run.base_dts);
+        w.EndBox(tfdt);
+
+        // data-offset, sample duration, size, flags, composition time offset
+        size_t trun = w.StartFullBox(FMP4_FOURCC('t', 'r', 'u', 'n'), has_cts ? 1 : 0,
+                                     0x000001 | 0x000100 | 0x000200 | 0x000400 | (has_cts ? 0x000800 : 0));
+        w.U32((uint32_t)run.samples.size());
+        data_offset_fields.push_back(w.Size());
+        w.U32(0);
+        for (const FragmentSample &sample : run.samples) {
+            w.U32(sample.duration);
+            w.U32(sample.size);
+            w.U32(sample.flags);
+            if (has_cts) w.U32((uint32_t)sample.cts_offset);
+        }
+        w.EndBox(trun);
+
+        if (!run.trick_play.empty()) {
+            size_t trik = w.StartFullBox(FMP4_FOURCC('t', 'r', 'i', 'k'), 0, 0);
+            w.Bytes(run.trick_play.data(), run.trick_play.size());
+            w.EndBox(trik);
+        }
+        w.EndBox(traf);
+    }
+    w.EndBox(moof);
+
+    uint64_t payload_size = 0;
+    for (const TrackRun &run : runs) payload_size += run.PayloadSize();
+    const bool is_large = payload_size + 8 > 0xffffffffull;
+
+    // data offsets are relative to the first byte of the moof
+    uint64_t data_offset = w.Size() - moof + (is_large ? 16 : 8);
+    for (size_t i = 0; i < runs.size(); i++) {
+        w.PatchU32(data_offset_fields[i], (uint32_t)data_offset);
+        data_offset += runs[i].PayloadSize();
+    }
+
+    if (is_large) {
+        w.U32(1);
+        w.U32(FMP4_FOURCC('m', 'd', 'a', 't'));
+        w.U64(payload_size + 16);
+    } else {
+        w.U32((uint32_t)(payload_size + 8));
+        w.U32(FMP4_FOURCC('m', 'd', 'a', 't'));
+    }
+    return payload_size;
+}
+
+} // namespace fmp4
+
+#endif // FMP4_MP4_BUILDER_H
@@ -0,0 +1,160 @@
+#ifndef FMP4_MP4_CONCAT_H
+#define FMP4_MP4_CONCAT_H
+
+/*
+ * Concatenation of MP4 and fMP4 recordings into one fMP4 file on a continuous timeline.
+ *
+ * Concatenator takes the inputs one after the other (each an MP4Index, progressive or fragmented).
+ * Every input goes on where the previous one ended: the mfhd sequence numbers and the tfdt of every
+ * track carry on, and all tracks of an input start at the end of the video of the previous one (an
+ * audio track that ran longer than its video keeps going from its own end instead).
+ *
+ * One init segment covers the inputs as long as their tracks match: same handlers, timescales and
+ * sample entries, so the same codec parameters. An input that does not match gets a new ftyp + moov
+ * in front of its fragments, the way sample6 appends one when the parameter sets change; its
+ * timeline still goes on. The output track ids are those of the input that brought the init segment.
+ *
+ * The fragments are built from the sample index, one per video GOP (WriteGopFragments() of
+ * mp4_cut.h). Payloads are copied as byte ranges of the input with OutputFile::Copy(), contiguous
+ * samples in one call, and are never parsed. Samples before the first key frame of an input are
+ * dropped.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "logger.h"
+#include "mp4_builder.h"
+#include "mp4_cut.h"
+#include "mp4_index.h"
+
+namespace fmp4 {
+
+struct ConcatResult
+{
+    ConcatResult() : inputs(0), init_segments(0), fragments(0), video_samples(0), bytes_copied(0), duration(0) {}
+
+    uint32_t inputs;
+    uint32_t init_segments;
+    uint32_t fragments;         // also the last sequence number
+    uint64_t video_samples;
+    uint64_t bytes_copied;      // payloads, from the inputs
+    double duration;            // seconds of video
+};
+
+class Concatenator
+{
+public:
+
+    explicit Concatenator(OutputFile &output) : output(output), video_end(0) {}
+
+    // Append the video track of an input and the tracks that go with it
+    bool Add(MP4Index &index)
+    {
+        Track *video = index.VideoTrack();
+        if (!video || !video->timescale || video->sync_samples.empty()) {
+            FMP4_LOGE("No video track with key frames\n");
+            return false;
+        }
+        const size_t first = video->sync_samples[0];
+        if (first) FMP4_LOGW("%u video samples before the first key frame dropped\n", (unsigned int)first);
+
+        // a recording cut short: its last fragment can point past the end of the file
+        size_t last = video->samples.size();
+        while (last > first && video->samples[last - 1].offset + video->samples[last - 1].size > index.GetFile().Size()) last--;
+        if (last == first) return false;
+        if (last < video->samples.size()) {
+            FMP4_LOGW("Truncated input, %u video samples past the end dropped\n", (unsigned int)(video->samples.size() - last));
+        }
+
+        std::vector<const Track *> tracks(1, video);
+        for (const Track &track : index.Tracks()) {
+            if (&track != video && !track.samples.empty() && track.timescale) tracks.push_back(&track);
+        }
+
+        if (!Matches(tracks) && !WriteInitSegment(tracks)) return false;
+
+        // the video goes on from its end; the other tracks from the same time, or from their own end when
+        // their last sample ran past the video
+        std::vector<TrackPlacement> placements(tracks.size());
+        for (size_t t = 0; t < tracks.size(); t++) {
+            placements[t].track_id = current[t].track_id;
+            placements[t].start = t ? std::max(ConvertTimescale(video_end, current[0].timescale, current[t].timescale), current[t].end)
+                                    : video_end;
+        }
+
+        if (!WriteGopFragments(index, tracks, first, last, false, placements, output, result.fragments,
+                               result.bytes_copied)) return false;
+
+        for (size_t t = 0; t < tracks.size(); t++) current[t].end = placements[t].end;
+        video_end = placements[0].end;
+        result.video_samples += last - first;
+        result.duration = (double)video_end / current[0].timescale;
+        result.inputs++;
+        return true;
+    }
+
+    const ConcatResult &Result() const { return result; }
+
+private:
+
+    // A track of the current init segment
+    struct OutputTrack
+    {
+        uint32_t track_id;
+        uint32_t handler;
+        uint32_t timescale;
+        std::vector<uint8_t> sample_entry;
+        uint64_t end;           // dts after the last sample written
+    };
+
+    static uint64_t ConvertTimescale(uint64_t value, uint32_t from, uint32_t to)
+    {
+        return (uint64_t)Rescale((int64_t)value, TimeBase(from), TimeBase(to));
+    }
+
+    bool Matches(const std::vector<const Track *> &tracks) const
+    {
+        if (tracks.size() != current.size()) return false;
+        for (size_t t = 0; t < tracks.size(); t++) {
+            if (tracks[t]->handler != current[t].handler || tracks[t]->timescale != current[t].timescale ||
+                tracks[t]->sample_entry != current[t].sample_entry) return false;
+        }
+        return true;
+    }
+
+    // ftyp + moov for the tracks of this input; the timeline goes on in the new timescales
+    bool WriteInitSegment(const std::vector<const Track *> &tracks)
+    {
+        if (!current.empty()) FMP4_LOGI("Tracks changed, writing a new init segment\n");
+
+        std::vector<uint8_t> header;
+        BoxWriter writer(header);
+        fmp4::WriteInitSegment(writer, tracks);
+        if (!output.Write(header)) return false;
+        result.init_segments++;
+
+        if (!current.empty()) video_end = ConvertTimescale(video_end, current[0].timescale, tracks[0]->timescale);
+        current.resize(tracks.size());
+        for (size_t t = 0; t < tracks.size(); t++) {
+            OutputTrack &track = current[t];
+            track.track_id     = tracks[t]->track_id;
+            track.handler      = tracks[t]->handler;
+            track.timescale    = tracks[t]->timescale;
+            track.sample_entry = tracks[t]->sample_entry;
+            track.end          = 0;
+        }
+        return true;
+    }
+
+    OutputFile &output;
+    std::vector<OutputTrack> current;
+    uint64_t video_end;         // dts after the last video sample, in current[0].timescale
+    ConcatResult result;
+};
+
+} // namespace fmp4
+
+#endif // FMP4_MP4_CONCAT_H
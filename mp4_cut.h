@@ -0,0 +1,355 @@
+#ifndef FMP4_MP4_CUT_H
+#define FMP4_MP4_CUT_H
+
+/*
+ * Lossless cut of an MP4 or fMP4 recording at GOP boundaries.
+ *
+ * CutMP4() takes [start_ms, end_ms) on the presentation timeline of the video track and widens it to
+ * the key frames around it: the last one at or before start, the first one at or after end. The clip
+ * is written as fMP4 starting at time zero, and only its own bytes are read from the input:
+ *
+ *   fragmented input   ftyp and moov are copied, then every fragment of the clip as it is; only the
+ *                      moof is patched (mfhd sequence number, tfdt, an explicit base_data_offset),
+ *                      and the durations in the moov (mehd, mvhd) are set to the clip's.
+ *                      Cuts are on fragments that start with a video key frame.
+ *   progressive input  one fragment per GOP is built from the sample index (mp4_builder.h), the
+ *                      samples of the other tracks in the same time range go into the same fragment.
+ *                      Edit lists carry over (Track::edit_media_time): all tracks shift alike.
+ *
+ * Payloads are copied with OutputFile::Copy(), a run of contiguous samples in one call. The cost is
+ * the index plus the clip, not the whole file.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "mp4_builder.h"
+#include "mp4_index.h"
+#include "timestamp.h"
+
+namespace fmp4 {
+
+struct CutResult
+{
+    CutResult() : start_time(0), end_time(0), fragments(0), video_samples(0), bytes_copied(0) {}
+
+    double start_time;          // seconds on the input presentation timeline, widened to the key frames
+    double end_time;
+    uint32_t fragments;
+    uint64_t video_samples;
+    uint64_t bytes_copied;      // from the input: payloads, or whole fragments for fragmented input
+};
+
+inline int64_t PresentationTime(const Sample &sample) { return (int64_t)sample.dts + sample.cts_offset; }
+
+// [first, last) video samples from the last cut point at or before start to the first one at or
+// after end; cut_points are video sample indices of key frames, in decode order
+inline bool FindCutRange(const Track &video, const std::vector<uint32_t> &cut_points, int64_t start, int64_t end,
+                         size_t &first, size_t &last)
+{
+    if (cut_points.empty()) return false;
+
+    first = cut_points[0];
+    last  = video.samples.size();
+    for (uint32_t index : cut_points) {
+        const int64_t pts = PresentationTime(video.samples[index]);
+        if (pts <= start) {
+            first = index;
+        } else if (pts >= end && index > first) {
+            last = index;
+            break;
+        }
+    }
+    return first < last;
+}
+
+// samples [begin, end) of a track, contiguous ones in one copy
+inline bool CopySamples(const MP4Index &index, const Track &track, size_t begin, size_t end, OutputFile &output,
+                        uint64_t &bytes)
+{
+    size_t i = begin;
+    while (i < end) {
+        const uint64_t offset = track.samples[i].offset;
+        uint64_t size = track.samples[i].size;
+        for (i++; i < end && track.samples[i].offset == offset + size; i++) size += track.samples[i].size;
+        if (!output.Copy(index.GetFile(), offset, size)) return false;
+        bytes += size;
+    }
+    return true;
+}
+
+inline uint64_t ConvertTime(uint64_t value, const Track &from, const Track &to)
+{
+    return (uint64_t)Rescale((int64_t)value, TimeBase(from.timescale), TimeBase(to.timescale));
+}
+
+// Where the samples of a track go in the output: its track id there, the dts of its first sample
+// (the video start of the input maps to start in every track) and, once written, the dts after its
+// last sample
+struct TrackPlacement
+{
+    TrackPlacement() : track_id(0), start(0), end(0) {}
+
+    uint32_t track_id;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Video samples [first, last) of tracks[0], one fragment per GOP, with the samples of the other tracks
+// in the same time range in the same fragment. Samples of other tracks before the first video dts are
+// left out, and after the last one unless is_tail_kept (a clip to the end of the file). mfhd sequence
+// numbers go on from sequence_number.
+inline bool WriteGopFragments(const MP4Index &index, const std::vector<const Track *> &tracks, size_t first, size_t last,
+                              bool is_tail_kept, std::vector<TrackPlacement> &placements, OutputFile &output,
+                              uint32_t &sequence_number, uint64_t &bytes_copied)
+{
+    const Track &video = *tracks[0];
+
+    // every track keeps its position relative to the video: all shift by the first video dts
+    const uint64_t video_base = video.samples[first].dts;
+    std::vector<uint64_t> bases(tracks.size(), video_base);
+    std::vector<size_t> cursors(tracks.size());
+    for (size_t t = 1; t < tracks.size(); t++) {
+        const std::vector<Sample> &samples = tracks[t]->samples;
+        bases[t] = ConvertTime(video_base, video, *tracks[t]);
+        cursors[t] = std::lower_bound(samples.begin(), samples.end(), bases[t],
+                                      [](const Sample &sample, uint64_t dts) { return sample.dts < dts; }) - samples.begin();
+    }
+
+    std::vector<TrackRun> runs(tracks.size());
+    for (size_t t = 0; t < tracks.size(); t++) {
+        runs[t].track_id = placements[t].track_id;
+        placements[t].end = placements[t].start;
+    }
+
+    std::vector<uint8_t> header;
+    BoxWriter writer(header);
+    std::vector<size_t> run_begin(tracks.size());
+    size_t gop = first;
+    while (gop < last) {
+        size_t gop_end = gop + 1;
+        while (gop_end < last && !video.samples[gop_end].is_sync) gop_end++;
+        const bool is_final = is_tail_kept && gop_end == last && last == video.samples.size();
+
+        for (size_t t = 0; t < tracks.size(); t++) {
+            const Track &track = *tracks[t];
+            TrackRun &run = runs[t];
+            run.samples.clear();
+
+            size_t begin = t ? cursors[t] : gop, end = t ? cursors[t] : gop_end;
+            if (t) {
+                const Sample &last_sample = video.samples.back();
+                const uint64_t end_dts = ConvertTime(gop_end < video.samples.size() ? video.samples[gop_end].dts
+                                                                                     : last_sample.dts + last_sample.duration,
+                                                     video, track);
+                while (end < track.samples.size() && (is_final || track.samples[end].dts < end_dts)) end++;
+                cursors[t] = end;
+            }
+            run_begin[t] = begin;
+            run.base_dts = begin < track.samples.size() ? placements[t].start + track.samples[begin].dts - bases[t] : 0;
+            for (size_t i = begin; i < end; i++) {
+                const Sample &sample = track.samples[i];
+                FragmentSample out = { sample.size, sample.duration, SampleFlags(sample.is_sync), sample.cts_offset };
+                run.samples.push_back(out);
+            }
+            if (begin < end) {
+                placements[t].end = placements[t].start + track.samples[end - 1].dts + track.samples[end - 1].duration - bases[t];
+            }
+        }
+
+        // tracks with nothing in this GOP get no traf
+        std::vector<TrackRun> present;
+        std::vector<size_t> present_tracks;
+        for (size_t t = 0; t < tracks.size(); t++) {
+            if (runs[t].samples.empty()) continue;
+            present.push_back(runs[t]);
+            present_tracks.push_back(t);
+        }
+
+        header.clear();
+        WriteFragmentHeader(writer, ++sequence_number, present);
+        if (!output.Write(header)) return false;
+        for (size_t t : present_tracks) {
+            if (!CopySamples(index, *tracks[t], run_begin[t], run_begin[t] + runs[t].samples.size(), output,
+                             bytes_copied)) return false;
+        }
+
+        gop = gop_end;
+    }
+    return true;
+}
+
+inline bool CutProgressive(MP4Index &index, const Track &video, size_t first, size_t last, OutputFile &output,
+                           CutResult &result)
+{
+    std::vector<const Track *> tracks(1, &video);
+    for (const Track &track : index.Tracks()) {
+        if (&track != &video && !track.samples.empty() && track.timescale) tracks.push_back(&track);
+    }
+
+    std::vector<uint8_t> header;
+    BoxWriter writer(header);
+    WriteInitSegment(writer, tracks);
+    if (!output.Write(header)) return false;
+
+    // the clip starts at zero, track ids stay
+    std::vector<TrackPlacement> placements(tracks.size());
+    for (size_t t = 0; t < tracks.size(); t++) placements[t].track_id = tracks[t]->track_id;
+
+    if (!WriteGopFragments(index, tracks, first, last, true, placements, output, result.fragments, result.bytes_copied))
+        return false;
+    result.video_samples += last - first;
+    return true;
+}
+
+// Patch a moof copied from the input for its new place in the output
+inline bool PatchMoof(std::vector<uint8_t> &moof, uint32_t sequence_number, int64_t position_delta,
+                      const std::vector<uint32_t> &track_ids, const std::vector<uint64_t> &shifts)
+{
+    BoxHeader root;
+    if (!ParseBoxHeader(moof.data(), moof.size(), 0, root)) return false;
+
+    BoxIterator it(moof.data(), root.PayloadOffset(), root.End());
+    BoxHeader box;
+    while (it.Next(box)) {
+        if (box.type == FMP4_FOURCC('m', 'f', 'h', 'd')) {
+            WriteU32(moof.data() + box.PayloadOffset() + 4, sequence_number);
+            continue;
+        }
+        if (box.type != FMP4_FOURCC('t', 'r', 'a', 'f')) continue;
+
+        BoxHeader tfhd, tfdt;
+        if (!FindChildBox(moof.data(), box, FMP4_FOURCC('t', 'f', 'h', 'd'), tfhd)) return false;
+        uint8_t *p = moof.data() + tfhd.PayloadOffset();
+        const uint32_t track_id = ReadU32(p + 4);
+        if (ReadU24(p + 1) & 0x000001) WriteU64(p + 8, ReadU64(p + 8) + position_delta);     // base_data_offset
+
+        const size_t t = std::find(track_ids.begin(), track_ids.end(), track_id) - track_ids.begin();
+        if (t == track_ids.size() || !FindChildBox(moof.data(), box, FMP4_FOURCC('t', 'f', 'd', 't'), tfdt)) continue;
+        uint8_t *q = moof.data() + tfdt.PayloadOffset();
+        if (q[0] == 1) {
+            WriteU64(q + 4, ReadU64(q + 4) - shifts[t]);
+        } else {
+            WriteU32(q + 4, (uint32_t)(ReadU32(q + 4) - shifts[t]));
+        }
+    }
+    return true;
+}
+
+// Set the movie durations of a copied moov to the clip's: mehd (fragment_duration), and mvhd when it
+// gives one. Both are in the mvhd timescale.
+inline bool PatchMoovDuration(std::vector<uint8_t> &moov, double seconds)
+{
+    BoxHeader root, mvhd, mvex, mehd;
+    if (!ParseBoxHeader(moov.data(), moov.size(), 0, root) ||
+        !FindChildBox(moov.data(), root, FMP4_FOURCC('m', 'v', 'h', 'd'), mvhd)) return false;
+
+    uint8_t *p = moov.data() + mvhd.PayloadOffset();
+    const uint32_t timescale = ReadU32(p + (p[0] == 1 ? 20 : 12));
+    const uint64_t duration = (uint64_t)(seconds * timescale + 0.5);
+    if (p[0] == 1) {
+        if (ReadU64(p + 24)) WriteU64(p + 24, duration);
+    } else if (ReadU32(p + 16)) {
+        WriteU32(p + 16, (uint32_t)duration);
+    }
+
+    if (FindChildBox(moov.data(), root, FMP4_FOURCC('m', 'v', 'e', 'x'), mvex) &&
+        FindChildBox(moov.data(), mvex, FMP4_FOURCC('m', 'e', 'h', 'd'), mehd)) {
+        uint8_t *q = moov.data() + mehd.PayloadOffset();
+        if (q[0] == 1) {
+            WriteU64(q + 4, duration);
+        } else {
+            WriteU32(q + 4, (uint32_t)duration);
+        }
+    }
+    return true;
+}
+
+inline bool CutFragmented(MP4Index &index, const Track &video, size_t first, size_t last, OutputFile &output,
+                          CutResult &result)
+{
+    const std::vector<Fragment> &fragments = index.Fragments();
+    const uint32_t first_fragment = video.samples[first].fragment;
+    const uint32_t end_fragment = last < video.samples.size() ? video.samples[last].fragment : (uint32_t)fragments.size();
+
+    std::vector<uint8_t> moov = index.Moov();
+    if (!PatchMoovDuration(moov, result.end_time - result.start_time)) return false;
+    if (!output.Write(index.Ftyp()) || !output.Write(moov)) return false;
+
+    // tfdt shift: the first video dts, in every track's timescale, but never past a track's own start
+    std::vector<uint32_t> track_ids;
+    std::vector<uint64_t> shifts;
+    for (const Track &track : index.Tracks()) {
+        if (!track.timescale) continue;
+        uint64_t shift = ConvertTime(video.samples[first].dts, video, track);
+        for (const Sample &sample : track.samples) {
+            if (sample.fragment == Sample::kNoFragment || sample.fragment < first_fragment) continue;
+            shift = std::min(shift, sample.dts);
+            break;
+        }
+        track_ids.push_back(track.track_id);
+        shifts.push_back(shift);
+    }
+
+    std::vector<uint8_t> moof;
+    for (uint32_t f = first_fragment; f < end_fragment; f++) {
+        const Fragment &fragment = fragments[f];
+        if (!fragment.mdat_size) break;         // truncated tail
+
+        moof.resize(fragment.moof_size);
+        if (!index.GetFile().Read(fragment.moof_offset, moof.data(), moof.size())) return false;
+        const int64_t position_delta = (int64_t)output.Position() - (int64_t)fragment.moof_offset;
+        if (!PatchMoof(moof, ++result.fragments, position_delta, track_ids, shifts)) return false;
+        if (!output.Write(moof)) return false;
+
+        // everything up to the end of the mdat, so data offsets relative to the moof still hold
+        const uint64_t moof_end = fragment.moof_offset + fragment.moof_size;
+        const uint64_t mdat_end = fragment.mdat_offset + fragment.mdat_size;
+        if (!output.Copy(index.GetFile(), moof_end, mdat_end - moof_end)) return false;
+        result.bytes_copied += mdat_end - fragment.moof_offset;
+    }
+
+    for (size_t i = first; i < last; i++) {
+        if (video.samples[i].fragment < end_fragment) result.video_samples++;
+    }
+    return true;
+}
+
+// Cut [start_ms, end_ms) of the video track (and what goes with it) of an indexed file into output
+inline bool CutMP4(MP4Index &index, uint64_t start_ms, uint64_t end_ms, OutputFile &output, CutResult &result)
+{
+    const Track *video = index.VideoTrack();
+    if (!video || video->samples.empty() || !video->timescale) return false;
+
+    // possible cut points: key frames, for fragmented input only those that start a fragment
+    std::vector<uint32_t> cut_points;
+    for (uint32_t index_in_track : video->sync_samples) {
+        const Sample &sample = video->samples[index_in_track];
+        if (!index.IsFragmented() ||
+            index_in_track == 0 || video->samples[index_in_track - 1].fragment != sample.fragment)
+            cut_points.push_back(index_in_track);
+    }
+
+    const Rational ms = { 1, 1000 };
+    const int64_t start = Rescale((int64_t)start_ms, ms, TimeBase(video->timescale));
+    const int64_t end   = Rescale((int64_t)end_ms, ms, TimeBase(video->timescale));
+    size_t first, last;
+    if (!FindCutRange(*video, cut_points, start, end, first, last)) return false;
+
+    // presentation end: the latest pts + duration of the clip (B-frames are shown after later dts)
+    int64_t end_pts = PresentationTime(video->samples[first]);
+    for (size_t i = first; i < last; i++) {
+        end_pts = std::max(end_pts, PresentationTime(video->samples[i]) + video->samples[i].duration);
+    }
+    result.start_time = (double)PresentationTime(video->samples[first]) / video->timescale;
+    result.end_time   = (double)end_pts / video->timescale;
+
+    return index.IsFragmented() ? CutFragmented(index, *video, first, last, output, result)
+                                : CutProgressive(index, *video, first, last, output, result);
+}
+
+} // namespace fmp4
+
+#endif // FMP4_MP4_CUT_H
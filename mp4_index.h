@@ -0,0 +1,743 @@
+#ifndef FMP4_MP4_INDEX_H
+#define FMP4_MP4_INDEX_H
+
+/*
+ * Minimal ISO BMFF box reader and sample index.
+ *
+ * MP4Index reads only the box headers, ftyp, moov and moof boxes of a file (never mdat payload) and
+ * builds a per-track sample table. Both layouts are supported:
+ *   - progressive files: stsz/stco/co64/stsc/stts/ctts/stss
+ *   - fragmented files: mvex/trex + moof/tfhd/tfdt/trun
+ * Sample payloads are read on demand with pread(), so tools can touch only the bytes they need.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace fmp4 {
+
+#define FMP4_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+inline uint16_t ReadU16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+inline uint32_t ReadU24(const uint8_t *p) { return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]; }
+inline uint32_t ReadU32(const uint8_t *p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+inline uint64_t ReadU64(const uint8_t *p) { return (uint64_t)ReadU32(p) << 32 | ReadU32(p + 4); }
+
+inline void WriteU16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = (uint8_t)v; }
+inline void WriteU32(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+inline void WriteU64(uint8_t *p, uint64_t v) { WriteU32(p, (uint32_t)(v >> 32)); WriteU32(p + 4, (uint32_t)v); }
+
+inline std::string FourCCString(uint32_t type)
+{
+    char s[5] = { (char)(type >> 24), (char)(type >> 16), (char)(type >> 8), (char)type, 0 };
+    return s;
+}
+
+struct BoxHeader
+{
+    uint32_t type;
+    uint64_t offset;        // of the box header, relative to the parsed buffer (or file)
+    uint64_t size;          // including header
+    uint32_t header_size;
+
+    uint64_t PayloadOffset() const { return offset + header_size; }
+    uint64_t PayloadSize() const { return size - header_size; }
+    uint64_t End() const { return offset + size; }
+};
+
+// Parse one box header from memory. Return false if it does not fit in [data, data + size).
+inline bool ParseBoxHeader(const uint8_t *data, uint64_t size, uint64_t offset, BoxHeader &box)
+{
+    if (offset + 8 > size) return false;
+
+    const uint8_t *p = data + offset;
+    box.offset      = offset;
+    box.size        = ReadU32(p);
+    box.type        = ReadU32(p + 4);
+    box.header_size = 8;
+    if (box.size == 1) {
+        if (offset + 16 > size) return false;
+        box.size        = ReadU64(p + 8);
+        box.header_size = 16;
+    } else if (box.size == 0) {
+        box.size = size - offset;
+    }
+    return box.size >= box.header_size && offset + box.size <= size;
+}
+
+// Iterate sibling boxes inside [begin, end) of a memory buffer.
+class BoxIterator
+{
+public:
+
+    BoxIterator(const uint8_t *data, uint64_t begin, uint64_t end)
+        : data(data), position(begin), end(end)
+    {
+    }
+
+    bool Next(BoxHeader &box)
+    {
+        if (!ParseBoxHeader(data, end, position, box)) return false;
+        position = box.End();
+        return true;
+    }
+
+private:
+
+    const uint8_t *data;
+    uint64_t position;
+    uint64_t end;
+};
+
+inline bool FindChildBox(const uint8_t *data, const BoxHeader &parent, uint32_t type, BoxHeader &child,
+                         uint64_t skip = 0)
+{
+    BoxIterator it(data, parent.PayloadOffset() + skip, parent.End());
+    while (it.Next(child)) {
+        if (child.type == type) return true;
+    }
+    return false;
+}
+
+class File
+{
+public:
+
+    File() : fd(-1), size(0) {}
+    ~File() { Close(); }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            Close();
+            return false;
+        }
+        size = (uint64_t)st.st_size;
+        return true;
+    }
+
+    void Close()
+    {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        size = 0;
+    }
+
+    bool Read(uint64_t offset, void *buffer, uint64_t bytes) const
+    {
+        uint8_t *p = static_cast<uint8_t *>(buffer);
+        while (bytes) {
+            ssize_t n = pread(fd, p, bytes, (off_t)offset);
+            if (n <= 0) return false;
+            p += n;
+            offset += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    int Descriptor() const { return fd; }
+    uint64_t Size() const { return size; }
+
+private:
+
+    File(const File &);
+    File &operator=(const File &);
+
+    int fd;
+    uint64_t size;
+};
+
+// Box header at offset of a file. The box may extend past the end of the file (truncated file).
+inline bool ReadBoxHeader(const File &file, uint64_t offset, BoxHeader &box)
+{
+    if (offset + 8 > file.Size()) return false;
+
+    uint8_t header[16];
+    const uint64_t header_bytes = std::min<uint64_t>(16, file.Size() - offset);
+    if (!file.Read(offset, header, header_bytes)) return false;
+
+    box.type        = ReadU32(header + 4);
+    box.offset      = offset;
+    box.size        = ReadU32(header);
+    box.header_size = 8;
+    if (box.size == 1) {
+        if (header_bytes < 16) return false;
+        box.size        = ReadU64(header + 8);
+        box.header_size = 16;
+    } else if (box.size == 0) {
+        box.size = file.Size() - offset;
+    }
+    return box.size >= box.header_size;
+}
+
+struct Sample
+{
+    uint64_t offset;        // absolute file offset of the payload
+    uint64_t dts;           // in track timescale
+    uint32_t size;
+    uint32_t duration;
+    int32_t cts_offset;     // pts = dts + cts_offset
+    uint32_t fragment;      // index into MP4Index::Fragments(), kNoFragment for progressive files
+    bool is_sync;
+
+    static const uint32_t kNoFragment = 0xffffffff;
+};
+
+struct Track
+{
+    Track()
+        : track_id(0), handler(0), timescale(0), duration(0), width(0), height(0), sample_entry_type(0)
+        , trex_default_duration(0), trex_default_size(0), trex_default_flags(0)
+        , has_sync_table(false), next_fragment_dts(0), edit_media_time(-1)
+    {
+    }
+
+    bool IsVideo() const { return handler == FMP4_FOURCC('v', 'i', 'd', 'e'); }
+    bool IsAudio() const { return handler == FMP4_FOURCC('s', 'o', 'u', 'n'); }
+
+    // Offset of the child boxes (avcC, hvcC, esds, ...) inside sample_entry
+    uint64_t SampleEntryChildrenOffset() const
+    {
+        if (IsVideo()) return 8 + 78;
+        if (IsAudio()) return 8 + 28;
+        return 8 + 8;
+    }
+
+    // Find a child box (for example avcC) of the sample entry. Return false if absent.
+    bool FindSampleEntryChild(uint32_t type, const uint8_t *&payload, uint64_t &payload_size) const
+    {
+        if (sample_entry.size() < SampleEntryChildrenOffset()) return false;
+        BoxIterator it(sample_entry.data(), SampleEntryChildrenOffset(), sample_entry.size());
+        BoxHeader box;
+        while (it.Next(box)) {
+            if (box.type == type) {
+                payload = sample_entry.data() + box.PayloadOffset();
+                payload_size = box.PayloadSize();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t track_id;
+    uint32_t handler;
+    uint32_t timescale;
+    uint64_t duration;
+    uint32_t width, height;                 // from tkhd, integer part
+    uint32_t sample_entry_type;             // avc1, avc3, hvc1, mp4a, ...
+    std::vector<uint8_t> sample_entry;      // first stsd entry, including its box header
+    std::vector<uint8_t> trak;              // the whole trak box (for rewriting tools)
+    std::vector<Sample> samples;
+    std::vector<uint32_t> sync_samples;     // indices into samples, from stss or the trun sample flags
+
+    uint32_t trex_default_duration;
+    uint32_t trex_default_size;
+    uint32_t trex_default_flags;
+    bool has_sync_table;                    // stss present (progressive files)
+    uint64_t next_fragment_dts;             // running dts when tfdt is absent
+    int64_t edit_media_time;                // elst: media time shown first (first edit that is not empty), -1: none
+};
+
+struct Fragment
+{
+    uint64_t moof_offset;
+    uint64_t moof_size;
+    uint64_t mdat_offset;
+    uint64_t mdat_size;
+    uint32_t sequence_number;
+};
+
+class MP4Index
+{
+public:
+
+    MP4Index() : is_fragmented(false), init_segments(0) {}
+
+    // A moov after fragments (sample6 after a parameter set change, fMP4-concat of different inputs)
+    // starts a new track table: see ParseNextMoov()
+    bool Open(const std::string &path)
+    {
+        if (!file.Open(path)) return false;
+
+        tracks.clear();
+        fragments.clear();
+        top_level.clear();
+        init_segments = 0;
+
+        uint64_t offset = 0;
+        while (offset + 8 <= file.Size()) {
+            BoxHeader box;
+            if (!ReadBoxHeader(file, offset, box)) return false;
+            if (box.End() > file.Size()) {
+                // Truncated tail (for example a recording that crashed), index what is complete.
+                break;
+            }
+            top_level.push_back(box);
+
+            if (box.type == FMP4_FOURCC('f', 't', 'y', 'p')) {
+                if (!ReadBox(box, ftyp)) return false;
+            } else if (box.type == FMP4_FOURCC('m', 'o', 'o', 'v')) {
+                if (!ReadBox(box, moov) || !ParseNextMoov()) return false;
+                init_segments++;
+            } else if (box.type == FMP4_FOURCC('m', 'o', 'o', 'f')) {
+                std::vector<uint8_t> moof;
+                if (!ReadBox(box, moof) || !ParseMoof(box, moof)) return false;
+            } else if (box.type == FMP4_FOURCC('m', 'd', 'a', 't')) {
+                if (!fragments.empty() && fragments.back().mdat_size == 0) {
+                    fragments.back().mdat_offset = box.offset;
+                    fragments.back().mdat_size   = box.size;
+                }
+            }
+
+            offset = box.End();
+        }
+
+        return !tracks.empty();
+    }
+
+    // Streaming use, for a file read front to back by the caller: hand over moov and every moof as
+    // they come. Samples accumulate in the tracks (offsets are file offsets) until ClearSamples(). A
+    // moov replaces the tracks of the one before (a new init segment in the middle of the file).
+    bool AddMoov(const std::vector<uint8_t> &box)
+    {
+        moov = box;
+        tracks.clear();
+        fragments.clear();
+        is_fragmented = false;
+        return ParseMoov();
+    }
+
+    bool AddMoof(const BoxHeader &box, const std::vector<uint8_t> &moof) { return ParseMoof(box, moof); }
+
+    void ClearSamples()
+    {
+        for (auto &track : tracks) {
+            track.samples.clear();
+            track.sync_samples.clear();
+        }
+        fragments.clear();
+    }
+
+    Track *FindTrack(uint32_t handler)
+    {
+        for (auto &track : tracks) {
+            if (track.handler == handler) return &track;
+        }
+        return nullptr;
+    }
+
+    Track *FindTrackById(uint32_t track_id)
+    {
+        for (auto &track : tracks) {
+            if (track.track_id == track_id) return &track;
+        }
+        return nullptr;
+    }
+
+    Track *VideoTrack() { return FindTrack(FMP4_FOURCC('v', 'i', 'd', 'e')); }
+    Track *AudioTrack() { return FindTrack(FMP4_FOURCC('s', 'o', 'u', 'n')); }
+
+    bool ReadSample(const Sample &sample, uint8_t *buffer) const
+    {
+        return file.Read(sample.offset, buffer, sample.size);
+    }
+
+    bool ReadSample(const Sample &sample, std::vector<uint8_t> &buffer) const
+    {
+        buffer.resize(sample.size);
+        return sample.size == 0 || file.Read(sample.offset, buffer.data(), sample.size);
+    }
+
+    std::vector<Track> &Tracks() { return tracks; }
+    const std::vector<Fragment> &Fragments() const { return fragments; }
+    const std::vector<BoxHeader> &TopLevelBoxes() const { return top_level; }
+    const std::vector<uint8_t> &Ftyp() const { return ftyp; }
+    const std::vector<uint8_t> &Moov() const { return moov; }
+    const File &GetFile() const { return file; }
+    bool IsFragmented() const { return is_fragmented; }
+    // moov boxes seen by Open()
+    uint32_t InitSegments() const { return init_segments; }
+
+private:
+
+    bool ReadBox(const BoxHeader &box, std::vector<uint8_t> &out)
+    {
+        out.resize(box.size);
+        return file.Read(box.offset, out.data(), box.size);
+    }
+
+    // The tracks of a moov replace those of the one before. A track that goes on (same id, handler and
+    // timescale, no samples of its own in the moov) keeps the samples indexed so far; the samples of
+    // the others are dropped, they cannot be told apart from what follows.
+    bool ParseNextMoov()
+    {
+        std::vector<Track> previous;
+        previous.swap(tracks);
+        if (!ParseMoov()) return false;
+
+        for (Track &track : tracks) {
+            for (Track &old : previous) {
+                if (old.track_id != track.track_id || old.handler != track.handler ||
+                    old.timescale != track.timescale || !track.samples.empty()) continue;
+                track.samples.swap(old.samples);
+                track.sync_samples.swap(old.sync_samples);
+                track.next_fragment_dts = old.next_fragment_dts;
+                break;
+            }
+        }
+        return true;
+    }
+
+    bool ParseMoov()
+    {
+        BoxHeader root;
+        if (!ParseBoxHeader(moov.data(), moov.size(), 0, root)) return false;
+
+        BoxIterator it(moov.data(), root.PayloadOffset(), root.End());
+        BoxHeader box;
+        while (it.Next(box)) {
+            if (box.type == FMP4_FOURCC('t', 'r', 'a', 'k')) {
+                Track track;
+                if (ParseTrak(moov.data(), box, track)) tracks.push_back(track);
+            } else if (box.type == FMP4_FOURCC('m', 'v', 'e', 'x')) {
+                is_fragmented = true;
+                mvex = box;
+            }
+        }
+
+        // trex defaults for fragmented files
+        if (is_fragmented) {
+            BoxIterator mvex_it(moov.data(), mvex.PayloadOffset(), mvex.End());
+            while (mvex_it.Next(box)) {
+                if (box.type != FMP4_FOURCC('t', 'r', 'e', 'x') || box.PayloadSize() < 24) continue;
+                const uint8_t *p = moov.data() + box.PayloadOffset();
+                Track *track = FindTrackById(ReadU32(p + 4));
+                if (!track) continue;
+                track->trex_default_duration = ReadU32(p + 12);
+                track->trex_default_size     = ReadU32(p + 16);
+                track->trex_default_flags    = ReadU32(p + 20);
+            }
+        }
+        return true;
+    }
+
+    bool ParseTrak(const uint8_t *data, const BoxHeader &trak, Track &track)
+    {
+        track.trak.assign(data + trak.offset, data + trak.End());
+
+        BoxHeader tkhd, mdia, mdhd, hdlr, minf, stbl;
+        if (FindChildBox(data, trak, FMP4_FOURCC('t', 'k', 'h', 'd'), tkhd)) {
+            const uint8_t *p = data + tkhd.PayloadOffset();
+            track.track_id = ReadU32(p + (p[0] == 1 ? 20 : 12));
+            if (tkhd.PayloadSize() >= 8) {
+                const uint8_t *end = data + tkhd.End();
+                track.width  = ReadU32(end - 8) >> 16;
+                track.height = ReadU32(end - 4) >> 16;
+            }
+        }
+        BoxHeader edts, elst;
+        if (FindChildBox(data, trak, FMP4_FOURCC('e', 'd', 't', 's'), edts) &&
+            FindChildBox(data, edts, FMP4_FOURCC('e', 'l', 's', 't'), elst) && elst.PayloadSize() >= 8) {
+            const uint8_t *p = data + elst.PayloadOffset();
+            const uint64_t entry_size = p[0] == 1 ? 20 : 12;
+            const uint32_t count = (uint32_t)std::min<uint64_t>(ReadU32(p + 4), (elst.PayloadSize() - 8) / entry_size);
+            for (uint32_t i = 0; i < count && track.edit_media_time < 0; i++) {
+                const uint8_t *entry = p + 8 + i * entry_size;
+                track.edit_media_time = p[0] == 1 ? (int64_t)ReadU64(entry + 8) : (int32_t)ReadU32(entry + 4);
+            }
+        }
+        if (!FindChildBox(data, trak, FMP4_FOURCC('m', 'd', 'i', 'a'), mdia)) return false;
+        if (FindChildBox(data, mdia, FMP4_FOURCC('m', 'd', 'h', 'd'), mdhd)) {
+            const uint8_t *p = data + mdhd.PayloadOffset();
+            if (p[0] == 1) {
+                track.timescale = ReadU32(p + 20);
+                track.duration  = ReadU64(p + 24);
+            } else {
+                track.timescale = ReadU32(p + 12);
+                track.duration  = ReadU32(p + 16);
+            }
+        }
+        if (FindChildBox(data, mdia, FMP4_FOURCC('h', 'd', 'l', 'r'), hdlr)) {
+            track.handler = ReadU32(data + hdlr.PayloadOffset() + 8);
+        }
+        if (!FindChildBox(data, mdia, FMP4_FOURCC('m', 'i', 'n', 'f'), minf)) return false;
+        if (!FindChildBox(data, minf, FMP4_FOURCC('s', 't', 'b', 'l'), stbl)) return false;
+
+        return ParseStbl(data, stbl, track);
+    }
+
+    bool ParseStbl(const uint8_t *data, const BoxHeader &stbl, Track &track)
+    {
+        BoxHeader stsd, stsz, stco, stsc, stts, ctts, stss;
+
+        // sample description (keep the first entry)
+        if (FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 's', 'd'), stsd)) {
+            BoxHeader entry;
+            if (ParseBoxHeader(data, stsd.End(), stsd.PayloadOffset() + 8, entry)) {
+                track.sample_entry_type = entry.type;
+                track.sample_entry.assign(data + entry.offset, data + entry.End());
+            }
+        }
+
+        // sample sizes
+        std::vector<uint32_t> sizes;
+        if (FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 's', 'z'), stsz)) {
+            const uint8_t *p = data + stsz.PayloadOffset();
+            uint32_t sample_size = ReadU32(p + 4);
+            uint32_t count       = ReadU32(p + 8);
+            if (sample_size == 0 && stsz.PayloadSize() < 12 + 4ull * count) return false;
+            sizes.resize(count);
+            for (uint32_t i = 0; i < count; i++)
+                sizes[i] = sample_size ? sample_size : ReadU32(p + 12 + 4 * i);
+        } else if (FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 'z', '2'), stsz)) {
+            const uint8_t *p = data + stsz.PayloadOffset();
+            uint8_t field_size = p[7];
+            uint32_t count     = ReadU32(p + 8);
+            sizes.resize(count);
+            for (uint32_t i = 0; i < count; i++) {
+                if (field_size == 16) sizes[i] = ReadU16(p + 12 + 2 * i);
+                else if (field_size == 8) sizes[i] = p[12 + i];
+                else sizes[i] = (p[12 + i / 2] >> ((i & 1) ? 0 : 4)) & 0xf;
+            }
+        }
+        if (sizes.empty()) return true;     // fragmented file, samples come from moof
+
+        // chunk offsets
+        std::vector<uint64_t> chunk_offsets;
+        if (FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 'c', 'o'), stco)) {
+            const uint8_t *p = data + stco.PayloadOffset();
+            uint32_t count = ReadU32(p + 4);
+            if (stco.PayloadSize() < 8 + 4ull * count) return false;
+            chunk_offsets.resize(count);
+            for (uint32_t i = 0; i < count; i++) chunk_offsets[i] = ReadU32(p + 8 + 4 * i);
+        } else if (FindChildBox(data, stbl, FMP4_FOURCC('c', 'o', '6', '4'), stco)) {
+            const uint8_t *p = data + stco.PayloadOffset();
+            uint32_t count = ReadU32(p + 4);
+            if (stco.PayloadSize() < 8 + 8ull * count) return false;
+            chunk_offsets.resize(count);
+            for (uint32_t i = 0; i < count; i++) chunk_offsets[i] = ReadU64(p + 8 + 8 * i);
+        } else {
+            return false;
+        }
+
+        track.samples.resize(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            Sample &sample    = track.samples[i];
+            sample.size       = sizes[i];
+            sample.offset     = 0;
+            sample.dts        = 0;
+            sample.duration   = 0;
+            sample.cts_offset = 0;
+            sample.fragment   = Sample::kNoFragment;
+            sample.is_sync    = true;
+        }
+
+        // sample to chunk
+        if (!FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 's', 'c'), stsc)) return false;
+        {
+            const uint8_t *p = data + stsc.PayloadOffset();
+            uint32_t count = ReadU32(p + 4);
+            if (stsc.PayloadSize() < 8 + 12ull * count) return false;
+
+            size_t sample_index = 0;
+            for (uint32_t i = 0; i < count && sample_index < sizes.size(); i++) {
+                uint32_t first_chunk       = ReadU32(p + 8 + 12 * i);
+                uint32_t samples_per_chunk = ReadU32(p + 8 + 12 * i + 4);
+                uint32_t last_chunk        = (i + 1 < count) ? ReadU32(p + 8 + 12 * (i + 1)) - 1
+                                                             : (uint32_t)chunk_offsets.size();
+                for (uint32_t chunk = first_chunk; chunk <= last_chunk && chunk <= chunk_offsets.size(); chunk++) {
+                    uint64_t offset = chunk_offsets[chunk - 1];
+                    for (uint32_t s = 0; s < samples_per_chunk && sample_index < sizes.size(); s++) {
+                        track.samples[sample_index].offset = offset;
+                        offset += sizes[sample_index];
+                        sample_index++;
+                    }
+                }
+            }
+        }
+
+        // decoding time to sample
+        if (FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 't', 's'), stts)) {
+            const uint8_t *p = data + stts.PayloadOffset();
+            uint32_t count = ReadU32(p + 4);
+            uint64_t dts = 0;
+            size_t sample_index = 0;
+            for (uint32_t i = 0; i < count && 8 + 8ull * (i + 1) <= stts.PayloadSize(); i++) {
+                uint32_t sample_count = ReadU32(p + 8 + 8 * i);
+                uint32_t delta        = ReadU32(p + 8 + 8 * i + 4);
+                for (uint32_t s = 0; s < sample_count && sample_index < sizes.size(); s++) {
+                    track.samples[sample_index].dts      = dts;
+                    track.samples[sample_index].duration = delta;
+                    dts += delta;
+                    sample_index++;
+                }
+            }
+        }
+
+        // composition offsets
+        if (FindChildBox(data, stbl, FMP4_FOURCC('c', 't', 't', 's'), ctts)) {
+            const uint8_t *p = data + ctts.PayloadOffset();
+            uint32_t count = ReadU32(p + 4);
+            size_t sample_index = 0;
+            for (uint32_t i = 0; i < count && 8 + 8ull * (i + 1) <= ctts.PayloadSize(); i++) {
+                uint32_t sample_count = ReadU32(p + 8 + 8 * i);
+                int32_t offset        = (int32_t)ReadU32(p + 8 + 8 * i + 4);
+                for (uint32_t s = 0; s < sample_count && sample_index < sizes.size(); s++)
+                    track.samples[sample_index++].cts_offset = offset;
+            }
+        }
+
+        // sync samples
+        if (FindChildBox(data, stbl, FMP4_FOURCC('s', 't', 's', 's'), stss)) {
+            track.has_sync_table = true;
+            for (auto &sample : track.samples) sample.is_sync = false;
+
+            const uint8_t *p = data + stss.PayloadOffset();
+            uint32_t count = ReadU32(p + 4);
+            for (uint32_t i = 0; i < count && 8 + 4ull * (i + 1) <= stss.PayloadSize(); i++) {
+                uint32_t number = ReadU32(p + 8 + 4 * i);
+                if (number >= 1 && number <= track.samples.size()) {
+                    track.samples[number - 1].is_sync = true;
+                    track.sync_samples.push_back(number - 1);
+                }
+            }
+        } else {
+            // no stss: every sample is a sync sample
+            track.sync_samples.resize(track.samples.size());
+            for (size_t i = 0; i < track.samples.size(); i++) track.sync_samples[i] = (uint32_t)i;
+        }
+
+        return true;
+    }
+
+    bool ParseMoof(const BoxHeader &moof_box, const std::vector<uint8_t> &moof)
+    {
+        is_fragmented = true;
+
+        Fragment fragment = { moof_box.offset, moof_box.size, 0, 0, 0 };
+        uint32_t fragment_index = (uint32_t)fragments.size();
+
+        BoxHeader root;
+        if (!ParseBoxHeader(moof.data(), moof.size(), 0, root)) return false;
+
+        BoxIterator it(moof.data(), root.PayloadOffset(), root.End());
+        BoxHeader box;
+        while (it.Next(box)) {
+            if (box.type == FMP4_FOURCC('m', 'f', 'h', 'd')) {
+                fragment.sequence_number = ReadU32(moof.data() + box.PayloadOffset() + 4);
+            } else if (box.type == FMP4_FOURCC('t', 'r', 'a', 'f')) {
+                if (!ParseTraf(moof.data(), box, moof_box.offset, fragment_index)) return false;
+            }
+        }
+
+        fragments.push_back(fragment);
+        return true;
+    }
+
+    bool ParseTraf(const uint8_t *data, const BoxHeader &traf, uint64_t moof_offset, uint32_t fragment_index)
+    {
+        BoxHeader tfhd;
+        if (!FindChildBox(data, traf, FMP4_FOURCC('t', 'f', 'h', 'd'), tfhd)) return false;
+
+        const uint8_t *p = data + tfhd.PayloadOffset();
+        uint32_t tfhd_flags = ReadU24(p + 1);
+        Track *track = FindTrackById(ReadU32(p + 4));
+        if (!track) return true;    // unknown track, skip it
+
+        p += 8;
+        uint64_t base_data_offset = moof_offset;
+        uint32_t default_duration = track->trex_default_duration;
+        uint32_t default_size     = track->trex_default_size;
+        uint32_t default_flags    = track->trex_default_flags;
+        if (tfhd_flags & 0x000001) { base_data_offset = ReadU64(p); p += 8; }
+        if (tfhd_flags & 0x000002) { p += 4; }
+        if (tfhd_flags & 0x000008) { default_duration = ReadU32(p); p += 4; }
+        if (tfhd_flags & 0x000010) { default_size = ReadU32(p); p += 4; }
+        if (tfhd_flags & 0x000020) { default_flags = ReadU32(p); p += 4; }
+
+        uint64_t dts = track->next_fragment_dts;
+        BoxHeader tfdt;
+        if (FindChildBox(data, traf, FMP4_FOURCC('t', 'f', 'd', 't'), tfdt)) {
+            const uint8_t *q = data + tfdt.PayloadOffset();
+            dts = (q[0] == 1) ? ReadU64(q + 4) : ReadU32(q + 4);
+        }
+
+        uint64_t data_offset = base_data_offset;
+        BoxIterator it(data, traf.PayloadOffset(), traf.End());
+        BoxHeader box;
+        while (it.Next(box)) {
+            if (box.type != FMP4_FOURCC('t', 'r', 'u', 'n')) continue;
+
+            const uint8_t *q   = data + box.PayloadOffset();
+            const uint8_t *end = data + box.End();
+            uint8_t version     = q[0];
+            uint32_t trun_flags = ReadU24(q + 1);
+            uint32_t count      = ReadU32(q + 4);
+            q += 8;
+
+            if (trun_flags & 0x000001) { data_offset = base_data_offset + (int32_t)ReadU32(q); q += 4; }
+            uint32_t first_sample_flags = default_flags;
+            bool has_first_sample_flags = (trun_flags & 0x000004) != 0;
+            if (has_first_sample_flags) { first_sample_flags = ReadU32(q); q += 4; }
+
+            for (uint32_t i = 0; i < count; i++) {
+                Sample sample;
+                sample.duration   = default_duration;
+                sample.size       = default_size;
+                sample.cts_offset = 0;
+                uint32_t flags    = (i == 0 && has_first_sample_flags) ? first_sample_flags : default_flags;
+
+                if (trun_flags & 0x000100) { if (q + 4 > end) return false; sample.duration = ReadU32(q); q += 4; }
+                if (trun_flags & 0x000200) { if (q + 4 > end) return false; sample.size = ReadU32(q); q += 4; }
+                if (trun_flags & 0x000400) { if (q + 4 > end) return false; flags = ReadU32(q); q += 4; }
+                if (trun_flags & 0x000800) {
+                    if (q + 4 > end) return false;
+                    uint32_t v = ReadU32(q);
+                    sample.cts_offset = version == 0 ? (int32_t)std::min<uint32_t>(v, 0x7fffffff) : (int32_t)v;
+                    q += 4;
+                }
+
+                sample.offset   = data_offset;
+                sample.dts      = dts;
+                sample.fragment = fragment_index;
+                sample.is_sync  = !(flags & 0x00010000);    // sample_is_non_sync_sample
+
+                data_offset += sample.size;
+                dts += sample.duration;
+                if (sample.is_sync) track->sync_samples.push_back((uint32_t)track->samples.size());
+                track->samples.push_back(sample);
+            }
+        }
+
+        track->next_fragment_dts = dts;
+        return true;
+    }
+
+    File file;
+    bool is_fragmented;
+    uint32_t init_segments;
+    std::vector<uint8_t> ftyp;
+    std::vector<uint8_t> moov;
+    BoxHeader mvex;
+    std::vector<Track> tracks;
+    std::vector<Fragment> fragments;
+    std::vector<BoxHeader> top_level;
+};
+
+} // namespace fmp4
+
+#endif // FMP4_MP4_INDEX_H
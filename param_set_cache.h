@@ -0,0 +1,193 @@
+#ifndef FMP4_PARAM_SET_CACHE_H
+#define FMP4_PARAM_SET_CACHE_H
+
+/*
+ * H.264 SPS/PPS store with change detection.
+ *
+ * Parameter sets are kept by type and id together with a content hash. Update() tells whether a NAL
+ * unit repeats a stored set (the common case: MP4Reader puts SPS/PPS in front of every key frame),
+ * adds a new id or replaces a set with different content. Writers remember Generation() when they
+ * write an init segment and compare it at the next key frame to know whether the init segment is
+ * still valid. BuildAvcC() turns everything in the store into an avcC record, so streams with several
+ * SPS/PPS (for example one PPS per slice type) keep all of them in the init segment.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "bit_reader.h"
+
+namespace fmp4 {
+
+class ParameterSetCache
+{
+public:
+
+    enum Result
+    {
+        PARAMETER_SET_UNCHANGED,    // byte identical repeat, nothing to do
+        PARAMETER_SET_ADDED,        // first set with this id
+        PARAMETER_SET_CHANGED,      // same id, different content
+        PARAMETER_SET_INVALID,      // not a SPS/PPS or the id could not be read
+    };
+
+    enum
+    {
+        NAL_SPS = 7,
+        NAL_PPS = 8,
+        MAX_SPS_COUNT = 32,
+        MAX_PPS_COUNT = 256,
+    };
+
+    struct Entry
+    {
+        Entry() : hash(0), is_present(false) {}
+
+        std::vector<uint8_t> data;  // NAL unit without start code / length prefix
+        uint64_t hash;
+        bool is_present;
+    };
+
+    ParameterSetCache() : sps(MAX_SPS_COUNT), pps(MAX_PPS_COUNT), generation(0) {}
+
+    // nal: one NAL unit starting with its header byte
+    Result Update(const uint8_t *nal, size_t size)
+    {
+        if (size < 2) return PARAMETER_SET_INVALID;
+
+        const unsigned int type = nal[0] & 0x1f;
+        if (type != NAL_SPS && type != NAL_PPS) return PARAMETER_SET_INVALID;
+
+        // Cheap path first: a repeat of what we have for this id
+        uint32_t id = 0;
+        if (!ReadId(type, nal, size, id)) return PARAMETER_SET_INVALID;
+
+        Entry &entry = (type == NAL_SPS) ? sps[id] : pps[id];
+        if (entry.is_present && entry.data.size() == size && memcmp(entry.data.data(), nal, size) == 0)
+            return PARAMETER_SET_UNCHANGED;
+
+        const Result result = entry.is_present ? PARAMETER_SET_CHANGED : PARAMETER_SET_ADDED;
+        entry.data.assign(nal, nal + size);
+        entry.hash = Hash(nal, size);
+        entry.is_present = true;
+        generation++;
+        return result;
+    }
+
+    // Incremented on every added or changed parameter set
+    uint32_t Generation() const { return generation; }
+
+    const Entry *FindSps(uint32_t id) const { return id < sps.size() && sps[id].is_present ? &sps[id] : nullptr; }
+    const Entry *FindPps(uint32_t id) const { return id < pps.size() && pps[id].is_present ? &pps[id] : nullptr; }
+
+    // AVCDecoderConfigurationRecord (ISO/IEC 14496-15 5.3.3.1) listing every stored SPS and PPS in id
+    // order. Profile and level come from the lowest SPS id; High profiles get the chroma format and
+    // bit depth fields (and no SPS extensions). Empty when there is no SPS or PPS yet.
+    std::vector<uint8_t> BuildAvcC(unsigned int nal_length_size = 4) const
+    {
+        std::vector<uint8_t> avcc;
+
+        const Entry *first_sps = nullptr;
+        unsigned int sps_count = 0, pps_count = 0;
+        for (auto &entry : sps) if (entry.is_present && !sps_count++) first_sps = &entry;
+        for (auto &entry : pps) if (entry.is_present) pps_count++;
+        if (!first_sps || !pps_count) return avcc;
+
+        const std::vector<uint8_t> &first = first_sps->data;
+        avcc.push_back(0x01);                                   // configurationVersion
+        avcc.push_back(first[1]);                               // AVCProfileIndication
+        avcc.push_back(first[2]);                               // profile_compatibility (constraint flags)
+        avcc.push_back(first[3]);                               // AVCLevelIndication
+        avcc.push_back(0xfc | ((nal_length_size - 1) & 0x03)); // 6 bits reserved + lengthSizeMinusOne
+        avcc.push_back(0xe0 | sps_count);                       // 3 bits reserved + numOfSequenceParameterSets
+        for (auto &entry : sps) if (entry.is_present) AppendParameterSet(avcc, entry.data);
+        avcc.push_back((uint8_t)pps_count);                     // numOfPictureParameterSets
+        for (auto &entry : pps) if (entry.is_present) AppendParameterSet(avcc, entry.data);
+
+        if (first[1] != 66 && first[1] != 77 && first[1] != 88) {
+            SpsFormat format;
+            ReadFormat(first.data(), first.size(), format);
+            avcc.push_back(0xfc | (format.chroma_format_idc & 0x03));
+            avcc.push_back(0xf8 | (format.bit_depth_luma_minus8 & 0x07));
+            avcc.push_back(0xf8 | (format.bit_depth_chroma_minus8 & 0x07));
+            avcc.push_back(0x00);                               // numOfSequenceParameterSetExt
+        }
+        return avcc;
+    }
+
+    void Clear()
+    {
+        for (auto &entry : sps) entry = Entry();
+        for (auto &entry : pps) entry = Entry();
+        generation++;
+    }
+
+    // FNV-1a, to tell sets apart (for example in logs or when comparing two caches)
+    static uint64_t Hash(const uint8_t *data, size_t size)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= data[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+private:
+
+    struct SpsFormat
+    {
+        SpsFormat() : chroma_format_idc(1), bit_depth_luma_minus8(0), bit_depth_chroma_minus8(0) {}
+
+        uint32_t chroma_format_idc;
+        uint32_t bit_depth_luma_minus8;
+        uint32_t bit_depth_chroma_minus8;
+    };
+
+    // The fields only exist for the profiles listed in 7.3.2.1.1; everything else is 4:2:0 8 bit.
+    static void ReadFormat(const uint8_t *nal, size_t size, SpsFormat &format)
+    {
+        const uint8_t profile_idc = nal[1];
+        if (profile_idc != 100 && profile_idc != 110 && profile_idc != 122 && profile_idc != 244 &&
+            profile_idc != 44 && profile_idc != 83 && profile_idc != 86 && profile_idc != 118 &&
+            profile_idc != 128 && profile_idc != 138 && profile_idc != 139 && profile_idc != 134 &&
+            profile_idc != 135)
+            return;
+
+        BitReader reader(nal + 1, size - 1);
+        reader.SkipBits(24);
+        reader.ReadUE();                                        // seq_parameter_set_id
+        SpsFormat parsed;
+        parsed.chroma_format_idc = reader.ReadUE();
+        if (parsed.chroma_format_idc == 3) reader.SkipBits(1);  // separate_colour_plane_flag
+        parsed.bit_depth_luma_minus8 = reader.ReadUE();
+        parsed.bit_depth_chroma_minus8 = reader.ReadUE();
+        if (!reader.IsOverrun()) format = parsed;
+    }
+
+    static void AppendParameterSet(std::vector<uint8_t> &avcc, const std::vector<uint8_t> &nal)
+    {
+        avcc.push_back((uint8_t)(nal.size() >> 8));
+        avcc.push_back((uint8_t)nal.size());
+        avcc.insert(avcc.end(), nal.begin(), nal.end());
+    }
+
+    // seq_parameter_set_id follows profile_idc, constraint flags and level_idc; pic_parameter_set_id comes first.
+    static bool ReadId(unsigned int type, const uint8_t *nal, size_t size, uint32_t &id)
+    {
+        BitReader reader(nal + 1, size - 1);
+        if (type == NAL_SPS) reader.SkipBits(24);
+        id = reader.ReadUE();
+        return !reader.IsOverrun() && id < (type == NAL_SPS ? (uint32_t)MAX_SPS_COUNT : (uint32_t)MAX_PPS_COUNT);
+    }
+
+    std::vector<Entry> sps;
+    std::vector<Entry> pps;
+    uint32_t generation;
+};
+
+} // namespace fmp4
+
+#endif // FMP4_PARAM_SET_CACHE_H
@@ -0,0 +1,293 @@
+#ifndef FMP4_RECORDING_H
+#define FMP4_RECORDING_H
+
+/*
+ * Long running fMP4 recordings: rotation into numbered files, and recovery after a crash.
+ *
+ * RecordingRotator turns an output path (rec.mp4) into rec-0001.mp4, rec-0002.mp4, ... The writer
+ * asks IsDue() before every key frame and, once the media duration or the size of the current file
+ * reached its limit, closes the file and takes the next one with OpenNext(), writing a new init
+ * segment first. A background thread creates the next file and reserves its space with fallocate()
+ * (FALLOC_FL_KEEP_SIZE: the size still grows with what is written) while the current one fills up,
+ * so a rotation is a pointer swap on the write path. CloseFile() gives back what was reserved and not
+ * used.
+ *
+ * A recording that was cut short ends in a partial box. FindRecoveryPoint() walks the top-level boxes
+ * and returns the end of the last complete moof+mdat (or init segment); RecoverRecording() truncates
+ * the file there so that it can be played, and appended to. The rotator recovers the last file of an
+ * earlier run and goes on with the next number; the empty files after it (the next file, created ahead
+ * of time when the run stopped) are removed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "logger.h"
+#include "mp4_index.h"
+
+namespace fmp4 {
+
+// End of the last complete fragment (moof and its mdat) or init segment (ftyp, moov) of a fragmented
+// MP4 file. Boxes in between (styp, sidx, free, ...) count with the fragment that follows them, a
+// complete mfra counts on its own. Files that are not fragmented MP4 are left whole.
+inline uint64_t FindRecoveryPoint(const File &file)
+{
+    uint64_t position = 0, recovery_point = 0;
+    bool has_moov = false, has_moof = false;
+    BoxHeader box;
+    while (ReadBoxHeader(file, position, box)) {
+        switch (box.type) {
+        case FMP4_FOURCC('m', 'o', 'o', 'v'):
+            if (box.End() > file.Size()) return recovery_point;
+            has_moov = true;
+            has_moof = false;
+            recovery_point = box.End();
+            break;
+        case FMP4_FOURCC('m', 'o', 'o', 'f'):
+            has_moof = true;
+            break;
+        case FMP4_FOURCC('m', 'd', 'a', 't'):
+            if (!has_moov) return file.Size();          // progressive MP4
+            if (box.End() > file.Size()) return recovery_point;
+            if (has_moof) recovery_point = box.End();
+            has_moof = false;
+            break;
+        case FMP4_FOURCC('m', 'f', 'r', 'a'):
+            if (box.End() > file.Size()) return recovery_point;
+            recovery_point = box.End();
+            break;
+        case FMP4_FOURCC('f', 't', 'y', 'p'):
+        case FMP4_FOURCC('s', 't', 'y', 'p'):
+        case FMP4_FOURCC('s', 'i', 'd', 'x'):
+        case FMP4_FOURCC('f', 'r', 'e', 'e'):
+        case FMP4_FOURCC('s', 'k', 'i', 'p'):
+        case FMP4_FOURCC('p', 'r', 'f', 't'):
+        case FMP4_FOURCC('e', 'm', 's', 'g'):
+        case FMP4_FOURCC('u', 'u', 'i', 'd'):
+            break;
+        default:
+            // garbage, e.g. the zeros of a block that was allocated but never written
+            return position ? recovery_point : file.Size();
+        }
+        if (box.End() > file.Size()) return recovery_point;
+        position = box.End();
+    }
+    // an invalid box header at the start: not ours
+    return position || file.Size() < 8 ? recovery_point : file.Size();
+}
+
+// Truncate a recording to its recovery point. removed: bytes cut off. The file is truncated even when
+// nothing is cut off: that gives back the space preallocated past its end and never written.
+inline bool RecoverRecording(const std::string &path, uint64_t &removed)
+{
+    removed = 0;
+    File file;
+    if (!file.Open(path)) return errno == ENOENT;
+
+    const uint64_t recovery_point = std::min(FindRecoveryPoint(file), file.Size());
+    removed = file.Size() - recovery_point;
+    return truncate(path.c_str(), (off_t)recovery_point) == 0;
+}
+
+struct RotationOptions
+{
+    RotationOptions() : max_duration_ms(0), max_size(0), preallocate(0) {}
+
+    uint64_t max_duration_ms;       // of media in a file, 0: no limit
+    uint64_t max_size;              // bytes in a file, 0: no limit
+    uint64_t preallocate;           // bytes reserved for every file ahead of time, 0: none
+};
+
+class RecordingRotator
+{
+public:
+
+    // path: of the recording, the files get a number in front of the extension
+    RecordingRotator(const std::string &path, const RotationOptions &options)
+        : options(options), next_number(1), bytes(0), duration(0), timescale(0)
+        , prepared(nullptr), prepared_number(0), is_preparing(false), is_stopping(false)
+    {
+        const size_t slash = path.rfind('/');
+        const size_t dot = path.rfind('.');
+        const bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        base = has_extension ? path.substr(0, dot) : path;
+        extension = has_extension ? path.substr(dot) : "";
+
+        // go on after the files of an earlier run: the last ones can be empty, created ahead of time, and
+        // the last one written to may have been cut short
+        struct stat st;
+        while (stat(FilePath(next_number).c_str(), &st) == 0) next_number++;
+        while (next_number > 1 && stat(FilePath(next_number - 1).c_str(), &st) == 0 && st.st_size == 0) {
+            unlink(FilePath(next_number - 1).c_str());
+            next_number--;
+        }
+        if (next_number > 1) {
+            uint64_t removed = 0;
+            if (!RecoverRecording(FilePath(next_number - 1), removed)) {
+                FMP4_LOGE("Fail to recover %s\n", FilePath(next_number - 1).c_str());
+            } else if (removed) {
+                FMP4_LOGI("Recovered %s: %llu bytes of an incomplete fragment removed\n",
+                          FilePath(next_number - 1).c_str(), (unsigned long long)removed);
+            }
+        }
+
+        worker = std::thread(&RecordingRotator::Prepare, this);
+    }
+
+    ~RecordingRotator()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+
+        // the next file was never used
+        if (prepared) {
+            fclose(prepared);
+            unlink(FilePath(prepared_number).c_str());
+        }
+    }
+
+    // The next file of the recording, empty and open for writing; nullptr on failure. Close it with
+    // CloseFile().
+    FILE *OpenNext()
+    {
+        FILE *file = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !is_preparing; });
+            if (prepared && prepared_number == next_number) {
+                file = prepared;
+                prepared = nullptr;
+            }
+        }
+        if (!file) file = CreateFile(FilePath(next_number));     // the worker did not get to it
+        if (!file) return nullptr;
+
+        current_path = FilePath(next_number);
+        next_number++;
+        bytes = 0;
+        duration = 0;
+
+        // reserve the one after while this one is written
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_preparing = true;
+        }
+        changed.notify_all();
+        return file;
+    }
+
+    // Give back the space reserved past what was written, and close
+    void CloseFile(FILE *file) const
+    {
+        if (!file) return;
+        fflush(file);
+        struct stat st;
+        if (options.preallocate && fstat(fileno(file), &st) == 0 && (uint64_t)st.st_size < options.preallocate) {
+            // the blocks past the end go with a truncate to the size the file has
+            if (ftruncate(fileno(file), st.st_size) != 0) {
+                FMP4_LOGW("Fail to release the space reserved past %llu bytes\n", (unsigned long long)st.st_size);
+            }
+        }
+        fclose(file);
+    }
+
+    const std::string &CurrentPath() const { return current_path; }
+
+    // What went into the current file
+    void AddBytes(uint64_t size) { bytes += size; }
+
+    void AddDuration(uint64_t ticks, uint32_t ticks_per_second)
+    {
+        if (ticks_per_second != timescale) {
+            duration = timescale ? duration * ticks_per_second / timescale : 0;
+            timescale = ticks_per_second;
+        }
+        duration += ticks;
+    }
+
+    // Asked before a key frame: the current file is full, the key frame goes to the next one
+    bool IsDue() const
+    {
+        if (options.max_size && bytes >= options.max_size) return true;
+        return options.max_duration_ms && timescale && duration * 1000 >= options.max_duration_ms * timescale;
+    }
+
+private:
+
+    std::string FilePath(uint32_t number) const
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "-%04u", number);
+        return base + buf + extension;
+    }
+
+    FILE *CreateFile(const std::string &path) const
+    {
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!file) {
+            FMP4_LOGE("Fail to create %s\n", path.c_str());
+            return nullptr;
+        }
+        if (options.preallocate &&
+            fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, (off_t)options.preallocate) != 0 && errno != EOPNOTSUPP) {
+            FMP4_LOGW("Fail to preallocate %s: %s\n", path.c_str(), strerror(errno));
+        }
+        return file;
+    }
+
+    // Worker: creates the file after the current one when OpenNext() asks for it
+    void Prepare()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return is_preparing || is_stopping; });
+            if (is_stopping) return;
+
+            const uint32_t number = next_number;
+            lock.unlock();
+            FILE *file = CreateFile(FilePath(number));
+            lock.lock();
+
+            prepared = file;
+            prepared_number = number;
+            is_preparing = false;
+            changed.notify_all();
+        }
+    }
+
+    const RotationOptions options;
+    std::string base;
+    std::string extension;
+    std::string current_path;
+    uint32_t next_number;
+    uint64_t bytes;                 // in the current file
+    uint64_t duration;              // of the current file, in timescale
+    uint32_t timescale;
+
+    std::thread worker;
+    std::mutex mutex;               // prepared, prepared_number, is_preparing, is_stopping
+    std::condition_variable changed;
+    FILE *prepared;                 // the next file, created and preallocated
+    uint32_t prepared_number;
+    bool is_preparing;
+    bool is_stopping;
+};
+
+} // namespace fmp4
+
+#endif // FMP4_RECORDING_H
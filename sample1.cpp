@@ -34,11 +34,16 @@
 #include <string.h>
 #include <math.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
 
 extern "C" {
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/mathematics.h>
@@ -48,12 +53,19 @@ extern "C" {
 #include <libswresample/swresample.h>
 }
 
+#include "logger.h"
+#include "yuv_pattern.h"
+#include "timestamp.h"
+
 #define STREAM_DURATION   20.0
 #define STREAM_FRAME_RATE 25 /* 25 images/s */
 #define STREAM_PIX_FMT    AV_PIX_FMT_YUV420P /* default pix_fmt */
 
 #define SCALE_FLAGS SWS_BICUBIC
 
+#define FRAME_QUEUE_SIZE  8   /* generated frames waiting for the encoder */
+#define PACKET_QUEUE_SIZE 64  /* encoded packets waiting for the muxer */
+
 static const std::string av_make_error_string(int errnum)
 {
     char errbuf[AV_ERROR_MAX_STRING_SIZE];
@@ -78,35 +90,151 @@ static const std::string av_ts_make_time_string(int64_t ts, AVRational *tb)
 #undef av_ts2timestr
 #define av_ts2timestr(ts, tb) av_ts_make_time_string(ts, tb).c_str()
 
+/*
+ * Bounded FIFO between two pipeline stages.
+ * Push blocks while full, Pop blocks while empty. After Close, Push fails and Pop drains what is left.
+ */
+template <typename T>
+class BlockingQueue
+{
+public:
+
+    BlockingQueue(size_t capacity) : capacity(capacity), is_closed(false) {}
+
+    bool Push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return queue.size() < capacity || is_closed; });
+        if (is_closed) return false;
+
+        queue.push_back(item);
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool Pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !queue.empty() || is_closed; });
+        if (queue.empty()) return false;
+
+        item = queue.front();
+        queue.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+
+    const size_t capacity;
+    bool is_closed;
+    std::deque<T> queue;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+/*
+ * Frames backed by AVBufferPool planes. A plane goes back to its pool when the last reference is
+ * dropped, whether that is ours or one the encoder kept, so a frame handed out by Get() is always
+ * writable and never needs av_frame_make_writable.
+ */
+class FramePool
+{
+public:
+
+    FramePool(enum AVPixelFormat pix_fmt, int width, int height)
+        : pix_fmt(pix_fmt), width(width), height(height)
+    {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+        av_image_fill_linesizes(linesize, pix_fmt, FFALIGN(width, 32));
+
+        for (int i = 0; i < 4; i++) {
+            pools[i] = NULL;
+            if (!linesize[i]) continue;
+
+            linesize[i] = FFALIGN(linesize[i], 32);
+            int plane_height = (i == 1 || i == 2) ? -((-height) >> desc->log2_chroma_h) : height;
+            pools[i] = av_buffer_pool_init(linesize[i] * plane_height + 16, NULL);
+        }
+    }
+
+    ~FramePool()
+    {
+        // Buffers still referenced somewhere keep their pool alive until they are released.
+        for (int i = 0; i < 4; i++) av_buffer_pool_uninit(&pools[i]);
+    }
+
+    AVFrame *Get()
+    {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) return NULL;
+
+        frame->format = pix_fmt;
+        frame->width  = width;
+        frame->height = height;
+        for (int i = 0; i < 4 && pools[i]; i++) {
+            frame->buf[i] = av_buffer_pool_get(pools[i]);
+            if (!frame->buf[i]) {
+                av_frame_free(&frame);
+                return NULL;
+            }
+            frame->data[i]     = frame->buf[i]->data;
+            frame->linesize[i] = linesize[i];
+        }
+        return frame;
+    }
+
+private:
+
+    const enum AVPixelFormat pix_fmt;
+    const int width;
+    const int height;
+    int linesize[4];
+    AVBufferPool *pools[4];
+};
+
 // a wrapper around a single output AVStream
 typedef struct OutputStream {
     AVStream *st;
+    AVCodecContext *enc;
 
     /* pts of the next frame that will be generated */
     int64_t next_pts;
 
-    AVFrame *frame;
-
-    struct SwsContext *sws_ctx;
-    struct SwrContext *swr_ctx;
+    FramePool *frame_pool;
+    fmp4::yuv::Generator *yuv_generator;
+    fmp4::yuv::Pattern pattern;
 
+    BlockingQueue<AVFrame *> *frames;
+    BlockingQueue<AVPacket *> *packets;
 } OutputStream;
 
 static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
 {
     AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
 
-    printf("pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-           av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
-           av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
-           av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
-           pkt->stream_index);
+    FMP4_LOGD("pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
+              av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
+              av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
+              av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
+              pkt->stream_index);
 }
 
-static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt)
+static int write_frame(AVFormatContext *fmt_ctx, const fmp4::TimestampRescaler &rescaler, AVStream *st, AVPacket *pkt)
 {
-    /* rescale output packet timestamp values from codec to stream timebase */
-    av_packet_rescale_ts(pkt, *time_base, st->time_base);
+    /* rescale output packet timestamp values from codec to stream timebase, as av_packet_rescale_ts does */
+    pkt->pts = rescaler.Rescale(pkt->pts);
+    pkt->dts = rescaler.Rescale(pkt->dts);
+    if (pkt->duration > 0) pkt->duration = rescaler.Rescale(pkt->duration);
     pkt->stream_index = st->index;
 
     /* Write the compressed frame to the media file. */
@@ -118,10 +246,10 @@ static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AV
 static void add_stream(OutputStream *ost,
                        AVFormatContext *oc,
                        AVCodec **codec,
-                       enum AVCodecID codec_id)
+                       enum AVCodecID codec_id,
+                       int width, int height)
 {
     AVCodecContext *c;
-    int i;
 
     /* find the encoder */
     *codec = avcodec_find_encoder(codec_id);
@@ -130,22 +258,29 @@ static void add_stream(OutputStream *ost,
         exit(1);
     }
 
-    ost->st = avformat_new_stream(oc, *codec);
+    ost->st = avformat_new_stream(oc, NULL);
     if (!ost->st) {
         fprintf(stderr, "Could not allocate stream\n");
         exit(1);
     }
     ost->st->id = oc->nb_streams-1;
-    c = ost->st->codec;
+
+    c = avcodec_alloc_context3(*codec);
+    if (!c) {
+        fprintf(stderr, "Could not alloc an encoding context\n");
+        exit(1);
+    }
+    ost->enc = c;
 
     switch ((*codec)->type) {
         case AVMEDIA_TYPE_VIDEO:
             c->codec_id = codec_id;
 
-            c->bit_rate = 400000;
+            /* 400 kbit/s at CIF, scaled with the picture size */
+            c->bit_rate = (int64_t)400000 * width * height / (352 * 288);
             /* Resolution must be a multiple of two. */
-            c->width    = 352;
-            c->height   = 288;
+            c->width    = width;
+            c->height   = height;
             /* timebase: This is the fundamental unit of time (in seconds) in terms
              * of which frame timestamps are represented. For fixed-fps content,
              * timebase should be 1/framerate and timestamp increments should be
@@ -165,6 +300,10 @@ static void add_stream(OutputStream *ost,
                  * the motion of the chroma plane does not match the luma plane. */
                 c->mb_decision = 2;
             }
+
+            /* let the encoder use every core, with frame and slice threads */
+            c->thread_count = 0;
+            c->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
             break;
 
         default:
@@ -173,39 +312,16 @@ static void add_stream(OutputStream *ost,
 
     /* Some formats want stream headers to be separate. */
     if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 }
 
 /**************************************************************/
 /* video output */
 
-static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
-{
-    AVFrame *picture;
-    int ret;
-
-    picture = av_frame_alloc();
-    if (!picture)
-        return NULL;
-
-    picture->format = pix_fmt;
-    picture->width  = width;
-    picture->height = height;
-
-    /* allocate the buffers for the frame data */
-    ret = av_frame_get_buffer(picture, 32);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate frame data.\n");
-        exit(1);
-    }
-
-    return picture;
-}
-
 static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, AVDictionary *opt_arg)
 {
     int ret;
-    AVCodecContext *c = ost->st->codec;
+    AVCodecContext *c = ost->enc;
     AVDictionary *opt = NULL;
 
     av_dict_copy(&opt, opt_arg, 0);
@@ -218,125 +334,145 @@ static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, A
         exit(1);
     }
 
-    /* allocate and init a re-usable frame */
-    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!ost->frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
+    /* copy the stream parameters to the muxer */
+    ret = avcodec_parameters_from_context(ost->st->codecpar, c);
+    if (ret < 0) {
+        fprintf(stderr, "Could not copy the stream parameters\n");
         exit(1);
     }
+
+    ost->frame_pool    = new FramePool(c->pix_fmt, c->width, c->height);
+    ost->yuv_generator = new fmp4::yuv::Generator();
+    ost->frames     = new BlockingQueue<AVFrame *>(FRAME_QUEUE_SIZE);
+    ost->packets    = new BlockingQueue<AVPacket *>(PACKET_QUEUE_SIZE);
 }
 
-/* Prepare a dummy image. */
-static void fill_yuv_image(AVFrame *pict, int frame_index,
+/* Prepare a dummy image (SIMD rows, threaded by row bands, see yuv_pattern.h). */
+static void fill_yuv_image(OutputStream *ost, AVFrame *pict, int frame_index,
                            int width, int height)
 {
-    int x, y, i, ret;
-
-    /* when we pass a frame to the encoder, it may keep a reference to it
-     * internally;
-     * make sure we do not overwrite it here
-     */
-    ret = av_frame_make_writable(pict);
-    if (ret < 0)
-        exit(1);
-
-    i = frame_index;
-
-    /* Y */
-    for (y = 0; y < height; y++)
-        for (x = 0; x < width; x++)
-            pict->data[0][y * pict->linesize[0] + x] = x + y + i * 3;
-
-    /* Cb and Cr */
-    for (y = 0; y < height / 2; y++) {
-        for (x = 0; x < width / 2; x++) {
-            pict->data[1][y * pict->linesize[1] + x] = 128 + y + i * 2;
-            pict->data[2][y * pict->linesize[2] + x] = 64 + x + i * 5;
-        }
-    }
+    /* frames come from FramePool, nobody else references their buffers */
+    fmp4::yuv::Picture picture = {
+        { pict->data[0], pict->data[1], pict->data[2] },
+        { pict->linesize[0], pict->linesize[1], pict->linesize[2] },
+        width, height
+    };
+    ost->yuv_generator->Fill(picture, frame_index, ost->pattern, ost->pattern != fmp4::yuv::PATTERN_GRADIENT,
+                             STREAM_FRAME_RATE);
 }
 
-static AVFrame *get_video_frame(OutputStream *ost)
+static AVFrame *get_video_frame(OutputStream *ost, double duration)
 {
     /* check if we want to generate more frames */
-    if (av_compare_ts(ost->next_pts, ost->st->codec->time_base, STREAM_DURATION, (AVRational){ 1, 1 }) >= 0) {
+    if (av_compare_ts(ost->next_pts, ost->enc->time_base, (int64_t)(duration * 1000), (AVRational){ 1, 1000 }) >= 0) {
         return NULL;
     }
 
-    fill_yuv_image(ost->frame,
-                   ost->next_pts,
-                   ost->st->codec->width,
-                   ost->st->codec->height);
+    AVFrame *frame = ost->frame_pool->Get();
+    if (!frame) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        exit(1);
+    }
 
-    ost->frame->pts = ost->next_pts++;
+    fill_yuv_image(ost, frame, ost->next_pts, ost->enc->width, ost->enc->height);
+    frame->pts = ost->next_pts++;
 
-    return ost->frame;
+    return frame;
 }
 
 /*
- * encode one video frame and send it to the muxer
- * return false when encoding is finished, true otherwise
+ * generator thread: fill pooled frames and queue them for the encoder
  */
-static bool write_video_frame(AVFormatContext *oc, OutputStream *ost)
+static void generate_video_frames(OutputStream *ost, double duration)
 {
-    int ret;
-    AVCodecContext *c;
     AVFrame *frame;
-    int got_packet = 0;
-
-    c = ost->st->codec;
-
-    frame = get_video_frame(ost);
-
-    if (oc->oformat->flags & AVFMT_RAWPICTURE) {
-        /* a hack to avoid data copy with some raw video muxers */
-        AVPacket pkt = { 0 };
-        av_init_packet(&pkt);
-
-        if (!frame)
-            return false;
-
-        pkt.flags        |= AV_PKT_FLAG_KEY;
-        pkt.stream_index  = ost->st->index;
-        pkt.data          = (uint8_t *)frame;
-        pkt.size          = sizeof(AVPicture);
-
-        pkt.pts = pkt.dts = frame->pts;
-        av_packet_rescale_ts(&pkt, c->time_base, ost->st->time_base);
+    while ((frame = get_video_frame(ost, duration)) != NULL) {
+        if (!ost->frames->Push(frame)) {
+            av_frame_free(&frame);
+            break;
+        }
+    }
+    ost->frames->Close();
+}
 
-        ret = av_interleaved_write_frame(oc, &pkt);
-    } else {
-        AVPacket pkt = { 0 };
-        av_init_packet(&pkt);
+/* move every packet the encoder has ready to the muxer queue */
+static int receive_video_packets(OutputStream *ost)
+{
+    int ret;
+    for (;;) {
+        AVPacket *pkt = av_packet_alloc();
+        ret = avcodec_receive_packet(ost->enc, pkt);
+        if (ret < 0) {
+            av_packet_free(&pkt);
+            return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+        }
+        if (!ost->packets->Push(pkt)) {
+            av_packet_free(&pkt);
+            return AVERROR_EXIT;
+        }
+    }
+}
 
-        /* encode the image */
-        ret = avcodec_encode_video2(c, &pkt, frame, &got_packet);
+/*
+ * encoder thread: send frames, receive packets; flush with a NULL frame at the end of the stream
+ */
+static void encode_video_frames(OutputStream *ost)
+{
+    int ret = 0;
+    AVFrame *frame;
+    while (ost->frames->Pop(frame)) {
+        ret = avcodec_send_frame(ost->enc, frame);
+        /* the encoder took its own reference if it needs one, the planes go back to the pool later */
+        av_frame_free(&frame);
         if (ret < 0) {
             fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
             exit(1);
         }
 
-        if (got_packet) {
-            ret = write_frame(oc, &c->time_base, ost->st, &pkt);
-        } else {
-            ret = 0;
-        }
+        if ((ret = receive_video_packets(ost)) < 0)
+            break;
     }
 
-    if (ret < 0) {
-        fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
+    if (ret >= 0) {
+        avcodec_send_frame(ost->enc, NULL);
+        ret = receive_video_packets(ost);
+    }
+    if (ret < 0 && ret != AVERROR_EXIT) {
+        fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
         exit(1);
     }
 
-    return (frame || got_packet) ? true : false;
+    ost->packets->Close();
+}
+
+/*
+ * muxer (calling thread): write packets in the order the encoder produced them
+ */
+static void write_video_packets(AVFormatContext *oc, OutputStream *ost)
+{
+    const AVRational codec_time_base = ost->enc->time_base;
+    const AVRational stream_time_base = ost->st->time_base;
+    const fmp4::TimestampRescaler rescaler(fmp4::Rational{codec_time_base.num, codec_time_base.den},
+                                           fmp4::Rational{stream_time_base.num, stream_time_base.den});
+
+    AVPacket *pkt;
+    while (ost->packets->Pop(pkt)) {
+        int ret = write_frame(oc, rescaler, ost->st, pkt);
+        av_packet_free(&pkt);
+        if (ret < 0) {
+            fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
+            exit(1);
+        }
+    }
 }
 
 static void close_stream(AVFormatContext *oc, OutputStream *ost)
 {
-    avcodec_close(ost->st->codec);
-    av_frame_free(&ost->frame);
-    sws_freeContext(ost->sws_ctx);
-    swr_free(&ost->swr_ctx);
+    avcodec_free_context(&ost->enc);
+    delete ost->frames;
+    delete ost->packets;
+    delete ost->frame_pool;
+    delete ost->yuv_generator;
 }
 
 /**************************************************************/
@@ -345,16 +481,28 @@ static void close_stream(AVFormatContext *oc, OutputStream *ost)
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        printf("usage: %s output_file\n"
+        printf("usage: %s output_file [WxH] [seconds] [gradient|bars|noise]\n"
                        "API example program to output a media file with libavformat.\n"
                        "This program generates a synthetic video stream, encodes and\n"
                        "muxes them into a file named output_file.\n"
-                       "The output format is automatically guessed according to the file extension.\n"
-                       "Raw images can also be output by using '%%d' in the filename.\n"
+                       "Generation, encoding and muxing run on their own threads.\n"
+                       "The bars and noise patterns get the frame time burnt in.\n"
                        "\n", argv[0]);
         return 1;
     }
 
+    int width = 352, height = 288;
+    if (argc > 2 && (sscanf(argv[2], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0 || ((width | height) & 1))) {
+        printf("invalid resolution: %s\n", argv[2]);
+        return 1;
+    }
+    double duration = (argc > 3) ? atof(argv[3]) : STREAM_DURATION;
+    fmp4::yuv::Pattern pattern = fmp4::yuv::PATTERN_GRADIENT;
+    if (argc > 4 && !fmp4::yuv::ParsePattern(argv[4], pattern)) {
+        printf("invalid pattern: %s\n", argv[4]);
+        return 1;
+    }
+
     /* Initialize libavcodec, and register all codecs and formats. */
     av_register_all();
 
@@ -370,9 +518,10 @@ int main(int argc, char **argv)
 
     /* Add the video streams using the default format codecs and initialize the codecs. */
     OutputStream video_st = {0};
+    video_st.pattern = pattern;
     AVCodec *video_codec = NULL;
     if (oc->oformat->video_codec != AV_CODEC_ID_NONE) {
-        add_stream(&video_st, oc, &video_codec, oc->oformat->video_codec);
+        add_stream(&video_st, oc, &video_codec, oc->oformat->video_codec, width, height);
     }
 
     /* Now that all the parameters are set, we can open the
@@ -401,10 +550,15 @@ int main(int argc, char **argv)
     }
     av_dict_free(&movflags);
 
-    // Generate raw video frame, encode them and mux into container
-    bool encode_video = true;
-    while (encode_video) {
-        encode_video = write_video_frame(oc, &video_st);
+    // Generate raw video frames, encode them and mux into container: generator -> encoder -> muxer
+    if (video_codec != NULL) {
+        std::thread generator(generate_video_frames, &video_st, duration);
+        std::thread encoder(encode_video_frames, &video_st);
+
+        write_video_packets(oc, &video_st);
+
+        encoder.join();
+        generator.join();
     }
 
     /* Write the trailer, if any. The trailer must be written before you
@@ -425,4 +579,4 @@ int main(int argc, char **argv)
     avformat_free_context(oc);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -2,22 +2,53 @@
 #include <thread>
 #include <vector>
 #include <memory>
-#include <bitset>
+#include <functional>
 
 #include <mp4v2/mp4v2.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
 
 #include <ap4/Ap4.h>
 
 #define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
 #include <gst/codecparsers/gsth264parser.h>
 
+#include "adts.h"
+#include "logger.h"
+#include "h264_parser.h"
+#include "http_server.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "param_set_cache.h"
+#include "segment_index.h"
+
 #define MP4_DEFAULT_VIDEO_TRACK_ID  1
 #define MP4_DEFAULT_AUDIO_TRACK_ID  2
 #define MP4_DEFAULT_MOVIE_TIMESCALE 1000
 #define MP4_DEFAULT_VIDEO_TIMESCALE 9000
 #define MP4_DEFAULT_AUDIO_TIMESCALE 8000
 
+// Random access index: a tfra entry for every video key frame, written in an mfra box when the
+// writer is closed, so a player seeks with a few reads instead of walking every moof.
+#define FMP4_MFRA_MODE
+
+// Segment index for byte range delivery: space is reserved after the moov and filled with a sidx on
+// close, one reference per video key frame to key frame segment (up to FMP4_SIDX_MAX_REFERENCES).
+//#define FMP4_SIDX_MODE
+#define FMP4_SIDX_MAX_REFERENCES 4096
+
+// Built-in HTTP server on 127.0.0.1: /<input number>/ serves init.mp4 and the last segments (key frame
+// to key frame, a chunk per frame) from memory, chunked while they are written, and index.mpd and
+// index.m3u8 of the last FMP4_HTTP_WINDOW segments, written to live/<input number>/.
+//#define FMP4_HTTP_PORT 8080
+#define FMP4_HTTP_WINDOW 6
+
+// Audio from <input>.aac instead of the audio track of the MP4: ADTS, as cameras send it and as
+// fMP4-generator writes it next to its MP4, FMP4_ADTS_FRAMES_PER_READ frames at a time. The writer
+// strips the headers and takes the track configuration from the first one.
+//#define FMP4_ADTS_MODE
+#define FMP4_ADTS_FRAMES_PER_READ 2
+
 class MP4Reader
 {
 public:
@@ -30,8 +61,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , audio_track_id(MP4_INVALID_TRACK_ID)
@@ -126,6 +156,11 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimescale() const
+    {
+        return video_timescale;
+    }
+
     unsigned int GetAudioChannels() const
     {
         return MP4GetTrackAudioChannels(handle, audio_track_id);
@@ -136,11 +171,16 @@ public:
         return audio_timescale;
     }
 
+    // duration and composition_offset (pts - dts, ctts) are in GetVideoTimescale() ticks; the
+    // composition offset is non-zero for streams with B-frames.
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
+                                         long long int &composition_offset,
                                          bool &is_key_frame)
     {
+        FMP4_METRICS_SCOPE(STAGE_READ_SAMPLE, STREAM_VIDEO);
+
         if (next_video_sample_idx > video_sample_number) {
             return MP4_READ_EOS;
         }
@@ -169,18 +209,23 @@ public:
         }
 
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
                            NULL,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
-            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            FMP4_LOGE("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
         }
 
+        // A few files have zero durations (typically the last sample): use the average of the track
+        if (!mp4_duration && video_sample_number)
+            mp4_duration = video_duration / video_sample_number;
+
         // Convert AVC1 format to AnnexB
         unsigned char *tmp_addr = video_sample_start_addr;
         while((tmp_addr - video_sample_start_addr) < sample_size)
@@ -193,15 +238,19 @@ public:
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / video_timescale;
+        duration = mp4_duration;
+        composition_offset = (int32_t)mp4_rendering_offset;    // ctts v1 offsets are signed
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
+    // duration is in GetAudioSampleRate() (the track timescale) ticks
     MP4ReadStatus GetNextAudioSample(unsigned char **sample,
                                      unsigned int &sample_size,
                                      unsigned long long int &duration)
     {
+        FMP4_METRICS_SCOPE(STAGE_READ_SAMPLE, STREAM_AUDIO);
+
         if (next_audio_sample_idx > audio_sample_number) {
             return MP4_READ_EOS;
         }
@@ -215,12 +264,12 @@ public:
                            &mp4_duration,
                            NULL,
                            NULL)) {
-            printf("Fail to read audio sample, id: %d, size: %d", next_audio_sample_idx, sample_size);
+            FMP4_LOGE("Fail to read audio sample, id: %d, size: %d", next_audio_sample_idx, sample_size);
             return MP4_READ_ERR;
         }
 
         *sample = audio_sample;
-        duration = (1000 * mp4_duration) / audio_timescale;
+        duration = mp4_duration;
         next_audio_sample_idx++;
 
         return MP4_READ_OK;
@@ -228,8 +277,6 @@ public:
 
 private:
 
-    const unsigned int time_scale;
-
     std::string file_path;
     MP4FileHandle handle;
     MP4TrackId video_track_id;
@@ -253,13 +300,89 @@ private:
     unsigned int *pPictHeaderSize;
 };
 
+// Whole ADTS frames from a file, headers included, the way a camera hands them over
+class AdtsReader
+{
+public:
+
+    explicit AdtsReader(const std::string &file_path)
+            : fptr(fopen(file_path.c_str(), "rb"))
+            , begin(0)
+            , end(0)
+    {
+    }
+
+    ~AdtsReader()
+    {
+        if (fptr)
+            fclose(fptr);
+    }
+
+    bool IsOpen() const { return fptr != nullptr; }
+
+    // Up to frames ADTS frames; bytes that are not ADTS go along, the writer skips them
+    MP4Reader::MP4ReadStatus GetNextAudioChunk(unsigned char **chunk, unsigned int &chunk_size, unsigned int frames)
+    {
+        FMP4_METRICS_SCOPE(STAGE_READ_SAMPLE, STREAM_AUDIO);
+
+        size_t position = begin;
+        fmp4::adts::Header header;
+        while (frames) {
+            if (end - position < fmp4::adts::kHeaderSize && !Fill(position)) break;
+            if (!fmp4::adts::ParseHeader(buffer.data() + position, end - position, header)) {
+                position++;
+                continue;
+            }
+            if (end - position < header.frame_size && !Fill(position)) break;
+            if (end - position < header.frame_size) break;
+            position += header.frame_size;
+            frames--;
+        }
+        if (position == begin) return MP4Reader::MP4_READ_EOS;
+
+        *chunk = buffer.data() + begin;
+        chunk_size = (unsigned int)(position - begin);
+        begin = position;
+        return MP4Reader::MP4_READ_OK;
+    }
+
+private:
+
+    // Read more behind end, keeping what is left from begin (position moves with it)
+    bool Fill(size_t &position)
+    {
+        if (!fptr) return false;
+        if (begin) {
+            std::copy(buffer.begin() + begin, buffer.begin() + end, buffer.begin());
+            position -= begin;
+            end -= begin;
+            begin = 0;
+        }
+        if (buffer.size() < end + kReadSize) buffer.resize(end + kReadSize);
+        const size_t n = fread(buffer.data() + end, 1, kReadSize, fptr);
+        end += n;
+        return n > 0;
+    }
+
+    static const size_t kReadSize = 64 * 1024;
+
+    FILE *fptr;
+    std::vector<unsigned char> buffer;
+    size_t begin;               // of what was not handed out yet
+    size_t end;
+};
+
 class FileOutputStream : public AP4_ByteStream
 {
 public:
+    // Every byte written at the end of the stream, in order; not what is written after a seek back
+    std::function<void(const unsigned char *data, unsigned int size)> on_append;
+
     FileOutputStream(const std::string &file_path)
             : fptr(nullptr)
             , reference_count(1)
             , position(0)
+            , end(0)
     {
         fptr = fopen(file_path.c_str(), "wb");
     }
@@ -273,13 +396,17 @@ public:
         static int i = 0;
         if (buf_size >=4) {
             if (isprint(buf[0]) && isprint(buf[1]) && isprint(buf[2]) && isprint(buf[3])) {
-                printf("#%d Write: buf: %p(%c%c%c%c), size: %d\n", i++,
-                       buffer, buf[0], buf[1], buf[2], buf[3], buf_size);
+                FMP4_LOGD("#%d Write: buf: %p(%c%c%c%c), size: %d\n", i++,
+                          buffer, buf[0], buf[1], buf[2], buf[3], buf_size);
             }
         }
 
+        if (on_append && position == end) on_append(buf, buf_size);
+
         bytes_written = buf_size;
         position += bytes_written;
+        if (position > end) end = position;
+        FMP4_METRICS_ADD(COUNTER_OUTPUT_BYTES, STREAM_MUX, buf_size);
 
         /*if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
             return AP4_SUCCESS;
@@ -297,7 +424,13 @@ public:
     }
 
     AP4_Result ReadPartial(void* buffer, AP4_Size  bytes_to_read, AP4_Size& bytes_read) { printf("ReadPartial\n"); return AP4_ERROR_NOT_SUPPORTED; }
-    AP4_Result Seek(AP4_Position position)  { printf("Seek\n"); return AP4_ERROR_NOT_SUPPORTED; }
+    AP4_Result Seek(AP4_Position position)
+    {
+        if (!fptr || fseeko(fptr, (off_t)position, SEEK_SET) != 0) return AP4_FAILURE;
+        this->position = position;
+        return AP4_SUCCESS;
+    }
+
     AP4_Result GetSize(AP4_LargeSize& size) { printf("GetSize\n"); return AP4_ERROR_NOT_SUPPORTED; }
 
     // AP4_Referenceable methods
@@ -313,16 +446,20 @@ private:
     FILE *fptr;
     unsigned int reference_count;
     unsigned long long int position;
+    unsigned long long int end;             // of what was written
 };
 
 class AVCSegmentBuilder : public AP4_FeedSegmentBuilder
 {
 public:
-    AVCSegmentBuilder()
+    // timescale: clock of the fed durations, used as the track timescale so they are written unchanged
+    AVCSegmentBuilder(unsigned int timescale)
             : AP4_FeedSegmentBuilder(AP4_Track::TYPE_VIDEO, MP4_DEFAULT_VIDEO_TRACK_ID)
             , h264_parser(gst_h264_nal_parser_new())
+            , composition_delay(0)
+            , has_composition_delay(false)
     {
-        m_Timescale = MP4_DEFAULT_VIDEO_TIMESCALE;
+        m_Timescale = timescale ? timescale : MP4_DEFAULT_VIDEO_TIMESCALE;
     }
 
     ~AVCSegmentBuilder()
@@ -331,23 +468,23 @@ public:
             gst_h264_nal_parser_free(h264_parser);
     }
 
-    void AddTrack(AP4_Movie* movie, GstH264NalUnit &nal_sps, GstH264NalUnit &nal_pps)
+    void AddTrack(AP4_Movie* movie, GstH264NalUnit &nal_sps, const std::vector<uint8_t> &avcc)
     {
-        // Parse SPS to get necessary params.
-        GstH264SPS sps = {0};
-        unsigned int video_width  = 0, video_height = 0;
-        {
-            gst_h264_parser_parse_sps(h264_parser, &nal_sps, &sps, false);
-            video_width  = (unsigned int)(sps.frame_cropping_flag ? sps.crop_rect_width : sps.width);
-            video_height = (unsigned int)(sps.frame_cropping_flag ? sps.crop_rect_height : sps.height);
+        // Parse SPS to get necessary params (no VUI needed).
+        fmp4::h264::SpsInfo sps;
+        fmp4::h264::ParseSps(nal_sps.data + nal_sps.offset, nal_sps.size, sps);
+        unsigned int video_width  = sps.width;
+        unsigned int video_height = sps.height;
+
+        // parse the avcC record (all SPS/PPS, High profile fields) into an atom
+        AP4_MemoryByteStream* avcc_stream = new AP4_MemoryByteStream(avcc.data(), (AP4_Size)avcc.size());
+        AP4_AvccAtom* avcc_atom = AP4_AvccAtom::Create(AP4_ATOM_HEADER_SIZE + (AP4_Size)avcc.size(), *avcc_stream);
+        avcc_stream->Release();
+        if (!avcc_atom) {
+            FMP4_LOGE("Invalid avcC record\n");
+            return;
         }
 
-        // collect the SPS and PPS into arrays
-        AP4_Array<AP4_DataBuffer> sps_array;
-        sps_array.Append(AP4_DataBuffer(nal_sps.data + nal_sps.offset, nal_sps.size));
-        AP4_Array<AP4_DataBuffer> pps_array;
-        pps_array.Append(AP4_DataBuffer(nal_pps.data + nal_pps.offset, nal_pps.size));
-
         // setup the video the sample descripton
         AP4_AvcSampleDescription* sample_description =
                 new AP4_AvcSampleDescription(AP4_SAMPLE_FORMAT_AVC1,
@@ -355,12 +492,8 @@ public:
                                              (AP4_UI16)video_height,
                                              24,
                                              "",
-                                             sps.profile_idc,
-                                             sps.level_idc,
-                                             0,
-                                             4,
-                                             sps_array,
-                                             pps_array);
+                                             avcc_atom);
+        delete avcc_atom;
 
         // create a sample table (with no samples) to hold the sample description
         AP4_SyntheticSampleTable* sample_table = new AP4_SyntheticSampleTable();
@@ -432,9 +565,10 @@ public:
             AP4_Array<AP4_TrunAtom::Entry> trun_entries;
             trun_entries.SetItemCount(m_Samples.ItemCount());
             for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
-                // if we have one non-zero CTS delta, we'll need to express it
+                // if we have one non-zero CTS delta, we'll need to express it (signed, version 1 trun)
                 if (m_Samples[i].GetCtsDelta()) {
                     trun->SetFlags(trun->GetFlags() | AP4_TRUN_FLAG_SAMPLE_COMPOSITION_TIME_OFFSET_PRESENT);
+                    trun->SetVersion(1);
                 }
 
                 // add one sample
@@ -460,6 +594,34 @@ public:
         return size;
     }
 
+    // Index the key frames of the fragment whose moof starts at moof_offset (the video traf is the first one)
+    void AddTfraEntries(AP4_TfraAtom *tfra, AP4_Position moof_offset)
+    {
+        AP4_UI64 dts = m_MediaTimeOrigin + m_MediaStartTime;
+        for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
+            if (m_Samples[i].IsSync()) {
+                tfra->AddEntry(dts + (AP4_SI32)m_Samples[i].GetCtsDelta(), moof_offset, 1, 1, i + 1);
+            }
+            dts += m_Samples[i].GetDuration();
+        }
+    }
+
+    // The fragment whose moof starts at moof_offset; one starting with a key frame starts a segment
+    void AddToSegmentIndex(fmp4::SegmentIndex &segment_index, AP4_Position moof_offset)
+    {
+        segment_index.AddFragment(moof_offset, m_Samples.ItemCount() && m_Samples[0].IsSync());
+        AP4_UI64 dts = m_MediaTimeOrigin + m_MediaStartTime;
+        for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
+            segment_index.AddSample((AP4_SI64)dts + (AP4_SI32)m_Samples[i].GetCtsDelta(), m_Samples[i].GetDuration());
+            dts += m_Samples[i].GetDuration();
+        }
+    }
+
+    AP4_UI32 GetTrackId() const { return m_TrackId; }
+    AP4_UI32 GetTimescale() const { return m_Timescale; }
+    // Decode time after the samples fed so far
+    AP4_UI64 GetMediaTime() const { return m_MediaStartTime + m_MediaDuration; }
+
     bool WriteMdat(AP4_ByteStream &stream)
     {
         for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
@@ -489,11 +651,17 @@ public:
         return true;
     }
 
+    // duration and composition_offset (pts - dts) are in m_Timescale ticks
     bool Feed(const unsigned char *data,
               unsigned int data_size,
               bool is_key_frame,
-              unsigned long long int duration)
+              unsigned long long int duration,
+              long long int composition_offset)
     {
+        FMP4_METRICS_SCOPE(STAGE_FEED, STREAM_VIDEO);
+        FMP4_METRICS_ADD(COUNTER_SAMPLES, STREAM_VIDEO, 1);
+        FMP4_METRICS_ADD(COUNTER_SAMPLE_BYTES, STREAM_VIDEO, data_size);
+
         // format the sample data
         AP4_MemoryByteStream* sample_data = new AP4_MemoryByteStream(data_size);
         {
@@ -505,14 +673,22 @@ public:
              * In this case, hard-code it to 50ms
              */
             if (!duration)
-                duration = 50;
+                duration = m_Timescale / 20;
 
-            // compute the duration in timescale
-            AP4_UI32 timescale_duration = (AP4_UI32)(AP4_ConvertTime(duration, 1000, m_Timescale));
+            // the track runs on the source clock, so there is nothing to convert
+            AP4_UI32 timescale_duration = (AP4_UI32)duration;
             AP4_UI64 timescale_dts      = m_MediaStartTime;
 
+            // The offset of the first sample is taken out of all of them: the first frame is presented
+            // at its decode time, in sync with the audio that starts at 0, and B-frames get negative offsets.
+            if (!has_composition_delay) {
+                composition_delay = composition_offset;
+                has_composition_delay = true;
+            }
+            AP4_SI32 timescale_cts_delta = (AP4_SI32)(composition_offset - composition_delay);
+
             // create a new sample and add it to the list
-            AP4_Sample sample(*sample_data, 0, data_size + 4, timescale_duration, 0, timescale_dts, 0, is_key_frame);
+            AP4_Sample sample(*sample_data, 0, data_size + 4, timescale_duration, 0, timescale_dts, (AP4_UI32)timescale_cts_delta, is_key_frame);
             AddSample(sample);
         }
         sample_data->Release();
@@ -528,6 +704,8 @@ private:
     virtual AP4_Result Feed(const void *data, unsigned int data_size, unsigned int &bytes_consumed) { return AP4_SUCCESS; }
 
     GstH264NalParser *h264_parser;
+    long long int composition_delay;    // composition offset of the first sample
+    bool has_composition_delay;
 };
 
 class AACSegmentBuilder : public AP4_FeedSegmentBuilder
@@ -544,11 +722,14 @@ public:
 
     }
 
-    void AddTrack(AP4_Movie* movie, const unsigned int sample_rate, const unsigned int channels)
+    // object_type: audioObjectType of the AudioSpecificConfig, 2 for AAC LC
+    void AddTrack(AP4_Movie* movie, const unsigned int sample_rate, const unsigned int channels, const unsigned int object_type)
     {
         // create a sample description for our samples
         AP4_DataBuffer dsi;
-        SetDecoderConfig(dsi, sample_rate, channels);
+        const std::vector<uint8_t> audio_specific_config =
+                fmp4::adts::AudioSpecificConfig((uint8_t)object_type, sample_rate, fmp4::adts::ChannelConfig(channels));
+        dsi.SetData(audio_specific_config.data(), (AP4_Size)audio_specific_config.size());
         AP4_MpegAudioSampleDescription *sample_description =
                 new AP4_MpegAudioSampleDescription(AP4_OTI_MPEG4_AUDIO,    // object type
                                                    (AP4_UI32) sample_rate, // sample rate
@@ -563,8 +744,8 @@ public:
         AP4_SyntheticSampleTable* sample_table = new AP4_SyntheticSampleTable();
         sample_table->AddSampleDescription(sample_description, true);
 
-        // create the track
-        m_Timescale = sample_rate;
+        // create the track; a later init segment keeps the timescale, the decode times go on in it
+        if (!m_Timescale) m_Timescale = sample_rate;
         AP4_Track* output_track = new AP4_Track(AP4_Track::TYPE_AUDIO,
                                                 sample_table,
                                                 m_TrackId,
@@ -684,17 +865,21 @@ public:
         return true;
     }
 
+    // duration: in m_Timescale (sample rate) ticks
     bool Feed(const unsigned char *data,
               unsigned int data_size,
               unsigned long long int duration)
     {
+        FMP4_METRICS_SCOPE(STAGE_FEED, STREAM_AUDIO);
+        FMP4_METRICS_ADD(COUNTER_SAMPLES, STREAM_AUDIO, 1);
+        FMP4_METRICS_ADD(COUNTER_SAMPLE_BYTES, STREAM_AUDIO, data_size);
+
         // format the sample data
         AP4_MemoryByteStream* sample_data = new AP4_MemoryByteStream(data_size);
         {
             sample_data->Write(data, data_size);
 
-            // compute the duration in timescale
-            AP4_UI32 timescale_duration = (AP4_UI32)(AP4_ConvertTime(duration, 1000, m_Timescale));
+            AP4_UI32 timescale_duration = (AP4_UI32)duration;
             AP4_UI64 timescale_dts      = m_MediaStartTime;
 
             // create a new sample and add it to the list
@@ -706,86 +891,40 @@ public:
         return true;
     }
 
-private:
-
-    unsigned long GetFreqMask(unsigned int freq)
+    // ADTS frames found in data by fmp4::adts::Splitter, all into the current fragment (one trun): the
+    // samples reference the payloads in data, which has to stay valid until WriteMdat(). The gap of a
+    // frame (frames skipped before it) lengthens the sample before it, or moves the fragment start.
+    bool Feed(unsigned char *data,
+              unsigned int data_size,
+              const std::vector<fmp4::adts::Frame> &frames)
     {
-        switch (freq) {
-            case 96000:
-                return 0x0;
-            case 88200:
-                return 0x1;
-            case 64000:
-                return 0x2;
-            case 48000:
-                return 0x3;
-            case 44100:
-                return 0x4;
-            case 32000:
-                return 0x5;
-            case 24000:
-                return 0x6;
-            case 22050:
-                return 0x7;
-            case 16000:
-                return 0x8;
-            case 12000:
-                return 0x9;
-            case 11025:
-                return 0xa;
-            case 8000:
-                return 0xb;
-            case 7350:
-                return 0xc;
-            default:
-                return 0xb;
+        FMP4_METRICS_SCOPE(STAGE_FEED, STREAM_AUDIO);
+        FMP4_METRICS_ADD(COUNTER_SAMPLES, STREAM_AUDIO, frames.size());
+
+        // wraps the buffer, no copy
+        AP4_MemoryByteStream* sample_data = new AP4_MemoryByteStream(data, data_size);
+        for (const fmp4::adts::Frame &frame : frames) {
+            FMP4_METRICS_ADD(COUNTER_SAMPLE_BYTES, STREAM_AUDIO, frame.size);
+            if (frame.gap && m_Samples.ItemCount()) {
+                AP4_Sample &last = m_Samples[m_Samples.ItemCount() - 1];
+                last.SetDuration(last.GetDuration() + frame.gap);
+                m_MediaDuration += frame.gap;
+            } else if (frame.gap) {
+                m_MediaStartTime += frame.gap;
+            }
+            AP4_Sample sample(*sample_data, frame.offset, frame.size, fmp4::adts::kSamplesPerFrame, 0,
+                              m_MediaStartTime + m_MediaDuration, 0, true);
+            AddSample(sample);
         }
-    }
+        sample_data->Release();
 
-    unsigned long GetChannelMask(unsigned int channels)
-    {
-        switch (channels) {
-            case 1:
-                return 0x1;
-            case 2:
-                return 0x2;
-            default:
-                return 0x1;
-        }
+        return true;
     }
 
-    void SetDecoderConfig(AP4_DataBuffer &decoder_config, const unsigned int sample_rate, const unsigned int channels)
-    {
-        /*
-         * Refer to:
-         * http://www.wenwenti.info/article/805051
-         * http://niulei20012001.blog.163.com/blog/static/7514721120130694144813/
-         *
-         * example:
-         * +-----+----+----+---+
-         * |  A  | B  | C  | D |
-         * +-----+----+----+---+
-         * |00010|1011|0001|000|
-         * +-----+----+----+---+
-         * A: Object profile (AAC-LC)
-         * B: Sampling frequency index (0xb for 8000Hz)
-         * C: Channel configuration (1 channel)
-         * D: Reserved
-        */
-        unsigned int object_type = AP4_MPEG4_AUDIO_OBJECT_TYPE_AAC_LC;
-
-        std::bitset<16> prof_bit(object_type);
-        std::bitset<16> freq_bit(GetFreqMask(sample_rate));
-        std::bitset<16> ch_bit(GetChannelMask(channels));
-        std::bitset<16> bm = (prof_bit << 11) | (freq_bit << 7) | (ch_bit << 3);
-
-        unsigned long mask = bm.to_ulong();
-        unsigned char audio_specific_config[2];
-        audio_specific_config[0] = (unsigned char)((mask >> 8) & 0xff);
-        audio_specific_config[1] = (unsigned char)(mask & 0xff);
-
-        decoder_config.SetData(audio_specific_config, 2);
-    }
+    // A track added after the first fragments starts with the video: media_time in m_Timescale
+    void SetMediaTime(AP4_UI64 media_time) { m_MediaStartTime = media_time; }
+
+private:
 
     // These functions are dummy implement for AP4_FeedSegmentBuilder, but we never use them.
     virtual AP4_Result WriteMediaSegment(AP4_ByteStream& stream, unsigned int sequence_number) { return AP4_SUCCESS; }
@@ -801,7 +940,9 @@ public:
         unsigned char *sample;
         unsigned int sample_size;
         bool is_key_frame;
-        unsigned long long int duration;
+        unsigned long long int duration;            // in timescale ticks
+        long long int composition_offset;
+        unsigned int timescale;
     };
 
     struct AudioFrame {
@@ -810,6 +951,7 @@ public:
         unsigned long long int duration;
         unsigned int sample_rate;
         unsigned int channels;
+        bool is_adts;           // sample holds ADTS frames, their headers give all of the above
     };
 
     MP4Writer(const std::string &file_path)
@@ -818,14 +960,44 @@ public:
             , file_output_stream(new FileOutputStream(file_path))
             , sequence_number(0)
             , h264_parser(gst_h264_nal_parser_new())
+            , init_generation(0)
+            , tfra(new AP4_TfraAtom(MP4_DEFAULT_VIDEO_TRACK_ID))
+            , sidx_offset(0)
+            , audio_sample_rate(0)
+            , audio_channels(0)
+            , audio_object_type(fmp4::adts::kObjectTypeAacLc)
+#ifdef FMP4_HTTP_PORT
+            , live_segments(FMP4_HTTP_WINDOW + FMP4_HTTP_WINDOW / 2 + 1)
+            , video_frame_duration(0)
+#endif
     {
-
+        tfra->SetVersion(1);    // 64 bit time and moof offset, recordings outgrow 4 GB
     }
 
     ~MP4Writer()
     {
-        if (file_output_stream)
+        if (file_output_stream) {
+#ifdef FMP4_SIDX_MODE
+            AP4_Position end = 0;
+            file_output_stream->Tell(end);
+            segment_index.Finish(end);
+#endif
+#ifdef FMP4_MFRA_MODE
+            if (is_write_init_segment)
+                WriteMfraAtom(file_output_stream);
+#endif
+#ifdef FMP4_SIDX_MODE
+            WriteSidxAtom(file_output_stream);
+#endif
             file_output_stream->Release();
+        }
+        delete tfra;
+
+#ifdef FMP4_HTTP_PORT
+        segmenter.Finish();
+        if (manifest && !manifest->Finish())
+            FMP4_LOGE("Fail to finish manifests\n");
+#endif
 
         if (h264_parser)
             gst_h264_nal_parser_free(h264_parser);
@@ -833,11 +1005,11 @@ public:
 
     bool WriteAVSample(VideoFrame video_frame, AudioFrame audio_frame)
     {
-        printf("WriteH264VideoSample -> \n");
+        FMP4_LOGD("WriteH264VideoSample -> \n");
 
         if (!file_output_stream) {
-            printf("ERROR: file_output_stream is null\n");
-            printf("WriteH264VideoSample <- \n");
+            FMP4_LOGE("file_output_stream is null\n");
+            FMP4_LOGD("WriteH264VideoSample <- \n");
             return false;
         }
 
@@ -845,17 +1017,69 @@ public:
         std::vector<GstH264NalUnit> nalus;
         if (video_frame.sample != nullptr) {
             nalus = ParseH264NALU(video_frame.sample, video_frame.sample_size);
+#ifdef FMP4_HTTP_PORT
+            if (video_frame.timescale) video_frame_duration = (double)video_frame.duration / video_frame.timescale;
+#endif
+        }
+
+        // ADTS: the frames are fed without their headers and without a copy, the first header gives the
+        // track configuration
+        adts_frames.clear();
+        if (audio_frame.sample != nullptr && audio_frame.is_adts) {
+            size_t skipped = 0;
+            const uint64_t changed_frames = adts_splitter.ChangedFrames();
+            const size_t used = adts_splitter.Split(audio_frame.sample, audio_frame.sample_size, adts_frames, &skipped);
+            if (adts_splitter.ChangedFrames() != changed_frames) {
+                FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_WARN, 10, "ADTS: configuration changed, %u frames skipped\n",
+                                      (unsigned int)(adts_splitter.ChangedFrames() - changed_frames));
+            }
+            if (skipped || used < audio_frame.sample_size) {
+                FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_WARN, 10, "ADTS: %u bytes skipped\n",
+                                      (unsigned int)(skipped + audio_frame.sample_size - used));
+            }
+            if (adts_frames.empty()) {
+                audio_frame.sample = nullptr;
+            } else {
+                const fmp4::adts::Header &header = adts_splitter.First();
+                audio_frame.sample_rate = header.sample_rate;
+                audio_frame.channels    = fmp4::adts::ChannelCount(header.channel_config);
+                if (!HasAudioTrack()) audio_object_type = header.object_type;
+            }
         }
 
         // Write init segment
         if (video_frame.is_key_frame && !is_write_init_segment) {
             // Reset segment builders
-            avc_segment_builder.reset(new AVCSegmentBuilder());
+            avc_segment_builder.reset(new AVCSegmentBuilder(video_frame.timescale));
             aac_segment_builder.reset(new AACSegmentBuilder());
 
+            // the audio track keeps this configuration in every init segment that follows
+            audio_sample_rate = audio_frame.sample_rate;
+            audio_channels    = audio_frame.channels;
+
             WriteFtypAtom(file_output_stream);
-            WriteMoovAtom(file_output_stream, nalus, audio_frame.sample_rate, audio_frame.channels);
+            WriteMoovAtom(file_output_stream, nalus);
             is_write_init_segment = true;
+            init_generation = parameter_sets.Generation();
+        } else if (video_frame.is_key_frame && !HasAudioTrack() && audio_frame.sample_rate && audio_frame.channels) {
+            // No audio configuration at the first key frame (no ADTS header yet): the audio track
+            // comes with a new init segment, and starts at this key frame
+            FMP4_LOGI("Audio started, writing a new init segment\n");
+            audio_sample_rate = audio_frame.sample_rate;
+            audio_channels    = audio_frame.channels;
+            aac_segment_builder->SetMediaTime(AP4_ConvertTime(avc_segment_builder->GetMediaTime(),
+                                                              avc_segment_builder->GetTimescale(), audio_sample_rate));
+            WriteFtypAtom(file_output_stream);
+            WriteMoovAtom(file_output_stream, nalus);
+            init_generation = parameter_sets.Generation();
+        } else if (video_frame.is_key_frame && parameter_sets.Generation() != init_generation) {
+            // The parameter sets changed: the current moov no longer describes the stream. Keep the
+            // segment builders so the decode times go on, and write a new init segment in front of
+            // the next fragment.
+            FMP4_LOGI("Parameter sets changed, writing a new init segment\n");
+            WriteFtypAtom(file_output_stream);
+            WriteMoovAtom(file_output_stream, nalus);
+            init_generation = parameter_sets.Generation();
         }
 
         // 1. To compatible with AVC1 format, we could not put SPS/PPS in the sample.
@@ -873,15 +1097,20 @@ public:
             }
             unsigned char *data = first_vcl_nalu.data + first_vcl_nalu.offset;
             unsigned int data_size = (unsigned int)((video_frame.sample + video_frame.sample_size) - data);
-            if (!avc_segment_builder->Feed(data, data_size, video_frame.is_key_frame, video_frame.duration)) {
-                printf("ERROR: Feed() video failed\n");
+            if (!avc_segment_builder->Feed(data, data_size, video_frame.is_key_frame, video_frame.duration,
+                                           video_frame.composition_offset)) {
+                FMP4_LOGE("Feed() video failed\n");
                 return false;
             }
         }
 
-        if (audio_frame.sample != nullptr) {
-            if (!aac_segment_builder->Feed(audio_frame.sample, audio_frame.sample_size, audio_frame.duration)) {
-                printf("ERROR: Feed() audio failed\n");
+        // without an audio track (no configuration yet) the audio is dropped
+        if (audio_frame.sample != nullptr && HasAudioTrack()) {
+            const bool is_fed = audio_frame.is_adts
+                    ? aac_segment_builder->Feed(audio_frame.sample, audio_frame.sample_size, adts_frames)
+                    : aac_segment_builder->Feed(audio_frame.sample, audio_frame.sample_size, audio_frame.duration);
+            if (!is_fed) {
+                FMP4_LOGE("Feed() audio failed\n");
                 return false;
             }
         }
@@ -889,14 +1118,100 @@ public:
         WriteMoofAtom(file_output_stream, ++sequence_number);
         WriteMdat(file_output_stream);
 
-        printf("WriteH264VideoSample <- \n\n");
+        FMP4_LOGD("WriteH264VideoSample <- \n\n");
         return true;
     }
 
+#ifdef FMP4_HTTP_PORT
+    // Serve the output under path (e.g. /1) while it is written, with manifests written to
+    // manifest_directory; before the first sample. The server has to outlive the writer.
+    void SetServer(fmp4::HttpServer *server, const std::string &path, const std::string &manifest_directory)
+    {
+        this->manifest_directory = manifest_directory;
+        mkdir(manifest_directory.c_str(), 0755);
+
+        if (file_output_stream) {
+            file_output_stream->on_append = [this](const unsigned char *data, unsigned int size) {
+                if (!segmenter.Write(data, size))
+                    FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to split the output into segments\n");
+            };
+        }
+        segmenter.on_segment_start = [this](uint32_t number) {
+            if (!live_segments.Open(number)) FMP4_LOGE("Fail to create a buffer for segment %u\n", number);
+            if (number == 1 && !manifest) OpenManifest();
+        };
+        segmenter.on_data = [this](const uint8_t *data, size_t size) {
+            if (!live_segments.Append(data, size))
+                FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to buffer segment\n");
+        };
+        segmenter.on_chunk_end = [this](const fmp4::MediaChunk &chunk) {
+            live_segments.AddChunk(chunk);
+            if (manifest && !manifest->AddPart(chunk)) FMP4_LOGE("Fail to update manifests\n");
+        };
+        segmenter.on_segment_end = [this](const fmp4::MediaSegment &segment) {
+            live_segments.Complete();
+            if (manifest && !manifest->AddSegment(segment)) FMP4_LOGE("Fail to update manifests\n");
+        };
+
+        live_segments.on_add = [server, path](const std::shared_ptr<const fmp4::SegmentBuffer> &segment) {
+            server->Publish(path + "/" + SegmentName(segment->Number()), segment);
+        };
+        live_segments.on_drop = [server, path](uint32_t number) { server->Unpublish(path + "/" + SegmentName(number)); };
+        live_segments.on_update = [server]() { server->Notify(); };
+    }
+#endif
+
 private:
 
+    // The init segments have an audio track once its configuration is known
+    bool HasAudioTrack() const { return audio_sample_rate && audio_channels; }
+
+#ifdef FMP4_HTTP_PORT
+    static std::string SegmentName(uint32_t number)
+    {
+        return number ? "frag-" + std::to_string(number) + ".m4s" : "init.mp4";
+    }
+
+    // With the first media segment: the moov went by. Segments live in memory only, so the window of
+    // the manifests is at most what the ring keeps. A chunk is a frame, so is a part.
+    void OpenManifest()
+    {
+        const fmp4::Track *track = segmenter.IndexedTrack();
+        if (!track) return;
+
+        fmp4::ManifestOptions options;
+        options.directory   = manifest_directory;
+        options.timescale   = track->timescale;
+        options.codecs      = fmp4::CodecsString(*track);
+        if (HasAudioTrack()) options.codecs += ",mp4a.40." + std::to_string(audio_object_type);
+        options.width       = track->width;
+        options.height      = track->height;
+        options.window      = FMP4_HTTP_WINDOW;
+        options.part_target = video_frame_duration;
+        manifest.reset(new fmp4::ManifestWriter(options));
+        if (!manifest->Open()) {
+            FMP4_LOGE("Fail to open manifests in %s\n", manifest_directory.c_str());
+            manifest.reset();
+        }
+    }
+#endif
+
+    // The NAL type found by gst_h264_parser_identify_nalu() is all the writer needs for slices and SEI.
+    // Only new or changed SPS/PPS get a full parse; the unchanged repeats in front of every key
+    // frame are skipped.
+    void ParseNal(GstH264NalUnit &nalu)
+    {
+        if (nalu.type != GST_H264_NAL_SPS && nalu.type != GST_H264_NAL_PPS)
+            return;
+        if (parameter_sets.Update(nalu.data + nalu.offset, nalu.size) == fmp4::ParameterSetCache::PARAMETER_SET_UNCHANGED)
+            return;
+        gst_h264_parser_parse_nal(h264_parser, &nalu);
+    }
+
     std::vector<GstH264NalUnit> ParseH264NALU(unsigned char *data, unsigned int length)
     {
+        FMP4_METRICS_SCOPE(STAGE_PARSE_NALU, STREAM_VIDEO);
+
         std::vector<GstH264NalUnit> nalus;
 
         GstH264NalUnit nalu = {0};
@@ -905,7 +1220,7 @@ private:
         while ((result = gst_h264_parser_identify_nalu(h264_parser, data, offset, length, &nalu)) == GST_H264_PARSER_OK)
         {
             // Update the offset
-            gst_h264_parser_parse_nal(h264_parser, &nalu);
+            ParseNal(nalu);
             offset = nalu.size + nalu.offset;
 
             nalus.push_back(nalu);
@@ -914,7 +1229,7 @@ private:
         // Handle the last NALU because there is no other start_code followed it.
         if (gst_h264_parser_identify_nalu_unchecked(h264_parser, data, offset, length, &nalu) == GST_H264_PARSER_OK) {
 
-            gst_h264_parser_parse_nal(h264_parser, &nalu);
+            ParseNal(nalu);
 
             nalus.push_back(nalu);
         }
@@ -934,38 +1249,42 @@ private:
         ftyp->Write(*stream);
     }
 
-    void WriteMoovAtom(AP4_ByteStream *stream,
-                       const std::vector<GstH264NalUnit> &nalus,
-                       const unsigned int sample_rate,
-                       const unsigned int channels)
+    void WriteMoovAtom(AP4_ByteStream *stream, const std::vector<GstH264NalUnit> &nalus)
     {
         GstH264NalUnit nal_sps = {0};
-        GstH264NalUnit nal_pps = {0};
         for (auto nalu : nalus) {
             if (nalu.type == GST_H264_NAL_SPS) nal_sps = nalu;
-            else if (nalu.type == GST_H264_NAL_PPS) nal_pps = nalu;
         }
 
         // Build moov atom
         std::unique_ptr<AP4_Movie> movie(new AP4_Movie(MP4_DEFAULT_MOVIE_TIMESCALE));
         {
             // Add video/audio track
-            avc_segment_builder->AddTrack(movie.get(), nal_sps, nal_pps);
-            aac_segment_builder->AddTrack(movie.get(), sample_rate, channels);
+            avc_segment_builder->AddTrack(movie.get(), nal_sps, parameter_sets.BuildAvcC());
+            if (HasAudioTrack())
+                aac_segment_builder->AddTrack(movie.get(), audio_sample_rate, audio_channels, audio_object_type);
 
             // Add mvex
             AP4_ContainerAtom* mvex = new AP4_ContainerAtom(AP4_ATOM_TYPE_MVEX);
             avc_segment_builder->AddTrexAtom(mvex);
-            aac_segment_builder->AddTrexAtom(mvex);
+            if (HasAudioTrack())
+                aac_segment_builder->AddTrexAtom(mvex);
             movie->GetMoovAtom()->AddChild(mvex);
         }
 
         // Write moov
         movie->GetMoovAtom()->Write(*stream);
+
+#ifdef FMP4_SIDX_MODE
+        ReserveSidxSpace(stream);
+#endif
     }
 
     void WriteMoofAtom(AP4_ByteStream *stream, unsigned int sequence_number)
     {
+        FMP4_METRICS_SCOPE(STAGE_WRITE_MOOF, STREAM_MUX);
+        FMP4_METRICS_ADD(COUNTER_FRAGMENTS, STREAM_MUX, 1);
+
         // Build moof atom
         std::unique_ptr<AP4_ContainerAtom> moof(new AP4_ContainerAtom(AP4_ATOM_TYPE_MOOF));
         {
@@ -975,23 +1294,111 @@ private:
 
             // Add traf
             avc_segment_builder->AddTrafAtom(moof.get());
-            aac_segment_builder->AddTrafAtom(moof.get());
+            if (HasAudioTrack())
+                aac_segment_builder->AddTrafAtom(moof.get());
 
             AP4_ContainerAtom *traf = (AP4_ContainerAtom *)moof->GetChild(AP4_ATOM_TYPE_TRAF, 0);
             AP4_TrunAtom* trun = (AP4_TrunAtom* )traf->GetChild(AP4_ATOM_TYPE_TRUN);
             trun->SetDataOffset((AP4_UI32)moof->GetSize() + AP4_ATOM_HEADER_SIZE);
 
-            traf = (AP4_ContainerAtom *)moof->GetChild(AP4_ATOM_TYPE_TRAF, 1);
-            trun = (AP4_TrunAtom* )traf->GetChild(AP4_ATOM_TYPE_TRUN);
-            trun->SetDataOffset((AP4_UI32)moof->GetSize() + AP4_ATOM_HEADER_SIZE + avc_segment_builder->GetSampleSize());
+            if (HasAudioTrack()) {
+                traf = (AP4_ContainerAtom *)moof->GetChild(AP4_ATOM_TYPE_TRAF, 1);
+                trun = (AP4_TrunAtom* )traf->GetChild(AP4_ATOM_TYPE_TRUN);
+                trun->SetDataOffset((AP4_UI32)moof->GetSize() + AP4_ATOM_HEADER_SIZE + avc_segment_builder->GetSampleSize());
+            }
         }
 
+        AP4_Position moof_offset = 0;
+        stream->Tell(moof_offset);
+#ifdef FMP4_MFRA_MODE
+        avc_segment_builder->AddTfraEntries(tfra, moof_offset);
+#endif
+#ifdef FMP4_SIDX_MODE
+        avc_segment_builder->AddToSegmentIndex(segment_index, moof_offset);
+#endif
+
         // Write moof
         moof->Write(*stream);
     }
 
+    // mfra at the end of the file: the tfra of the video track, then mfro with the size of the whole
+    // mfra so a reader finds it from the last 16 bytes
+    void WriteMfraAtom(AP4_ByteStream *stream)
+    {
+        AP4_ContainerAtom mfra(AP4_ATOM_TYPE_MFRA);
+        mfra.AddChild(tfra);
+        tfra = nullptr;     // owned by mfra now
+        mfra.AddChild(new AP4_MfroAtom((AP4_UI32)mfra.GetSize() + AP4_FULL_ATOM_HEADER_SIZE + 4));
+        mfra.Write(*stream);
+    }
+
+    // After the first moov: a free box big enough for the sidx. A later init segment (new parameter
+    // sets) would end up inside a segment, so there is no sidx then.
+    void ReserveSidxSpace(AP4_ByteStream *stream)
+    {
+        if (sequence_number) {
+            segment_index.Invalidate();
+            return;
+        }
+
+        stream->Tell(sidx_offset);
+        const AP4_UI32 size = (AP4_UI32)fmp4::SegmentIndex::SidxSize(FMP4_SIDX_MAX_REFERENCES) + AP4_ATOM_HEADER_SIZE;
+        std::vector<uint8_t> zeros(size - AP4_ATOM_HEADER_SIZE);
+        stream->WriteUI32(size);
+        stream->WriteUI32(AP4_ATOM_TYPE_FREE);
+        stream->Write(zeros.data(), (AP4_Size)zeros.size());
+    }
+
+    AP4_SidxAtom *BuildSidxAtom(AP4_UI64 first_offset)
+    {
+        const std::vector<fmp4::SegmentReference> &references = segment_index.References();
+        const AP4_SI64 earliest = references[0].earliest_presentation_time;
+        AP4_SidxAtom *sidx = new AP4_SidxAtom(avc_segment_builder->GetTrackId(), avc_segment_builder->GetTimescale(),
+                                              earliest > 0 ? earliest : 0, first_offset);
+        sidx->SetReferenceCount(references.size());
+        for (unsigned int i=0; i<references.size(); i++) {
+            AP4_SidxAtom::Reference &reference = sidx->UseReferences()[i];
+            reference.m_ReferenceType      = 0;    // media
+            reference.m_ReferencedSize     = (AP4_UI32)references[i].size;
+            reference.m_SubsegmentDuration = (AP4_UI32)references[i].duration;
+            reference.m_StartsWithSap      = references[i].starts_with_sap;
+            reference.m_SapType            = references[i].starts_with_sap ? 1 : 0;
+            reference.m_SapDeltaTime       = 0;
+        }
+        return sidx;
+    }
+
+    // Fill the reserved space: the sidx, then a free box with what is left up to the first fragment
+    void WriteSidxAtom(AP4_ByteStream *stream)
+    {
+        if (!sidx_offset) return;
+        const std::vector<fmp4::SegmentReference> &references = segment_index.References();
+        if (!segment_index.IsValid() || references.empty() || references.size() > FMP4_SIDX_MAX_REFERENCES) {
+            FMP4_LOGI("No sidx: %u segments\n", (unsigned int)references.size());
+            return;
+        }
+
+        AP4_UI64 sidx_size;
+        {
+            std::unique_ptr<AP4_SidxAtom> sidx(BuildSidxAtom(0));
+            sidx_size = sidx->GetSize();
+        }
+        const AP4_UI64 first_offset = references[0].offset - (sidx_offset + sidx_size);
+        std::unique_ptr<AP4_SidxAtom> sidx(BuildSidxAtom(first_offset));
+
+        AP4_Position end = 0;
+        stream->Tell(end);
+        if (AP4_FAILED(stream->Seek(sidx_offset))) return;
+        sidx->Write(*stream);
+        stream->WriteUI32((AP4_UI32)first_offset);
+        stream->WriteUI32(AP4_ATOM_TYPE_FREE);
+        stream->Seek(end);
+    }
+
     void WriteMdat(AP4_ByteStream *stream)
     {
+        FMP4_METRICS_SCOPE(STAGE_WRITE_MDAT, STREAM_MUX);
+
         unsigned int mdat_size = AP4_ATOM_HEADER_SIZE;
         mdat_size += avc_segment_builder->GetSampleSize();
         mdat_size += aac_segment_builder->GetSampleSize();
@@ -999,11 +1406,11 @@ private:
         stream->WriteUI32(mdat_size);
         stream->WriteUI32(AP4_ATOM_TYPE_MDAT);
         if (!avc_segment_builder->WriteMdat(*stream)) {
-            printf("ERROR: Fail to write video sample into mdat\n");
+            FMP4_LOGE("Fail to write video sample into mdat\n");
             return;
         }
         if (!aac_segment_builder->WriteMdat(*stream)) {
-            printf("ERROR: Fail to write audio sample into mdat\n");
+            FMP4_LOGE("Fail to write audio sample into mdat\n");
             return;
         }
     }
@@ -1017,6 +1424,25 @@ private:
     unsigned int sequence_number;
 
     GstH264NalParser *h264_parser;
+
+    fmp4::ParameterSetCache parameter_sets;
+    uint32_t init_generation;   // parameter_sets.Generation() of the current init segment
+    AP4_TfraAtom *tfra;         // video key frames written so far, see FMP4_MFRA_MODE
+    fmp4::SegmentIndex segment_index;   // see FMP4_SIDX_MODE
+    AP4_Position sidx_offset;   // of the space reserved for the sidx, 0: none
+    unsigned int audio_sample_rate;     // of the audio track, from the first init segment on
+    unsigned int audio_channels;
+    unsigned int audio_object_type;     // of the AudioSpecificConfig, from the ADTS headers
+    fmp4::adts::Splitter adts_splitter;             // of the audio input, the first header is the configuration
+    std::vector<fmp4::adts::Frame> adts_frames;     // of the current audio frame
+
+#ifdef FMP4_HTTP_PORT
+    fmp4::Segmenter segmenter;          // of the bytes written, see FileOutputStream::on_append
+    fmp4::SegmentRing live_segments;
+    std::unique_ptr<fmp4::ManifestWriter> manifest;
+    std::string manifest_directory;
+    double video_frame_duration;        // seconds, of the last video frame
+#endif
 };
 
 int main(int argc, char **argv)
@@ -1026,15 +1452,37 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    FMP4_METRICS_DUMPER();
+
+#ifdef FMP4_HTTP_PORT
+    mkdir("live", 0755);
+    fmp4::HttpServer server;
+    if (!server.Start("127.0.0.1", FMP4_HTTP_PORT, "live")) {
+        printf("Fail to start the HTTP server on port %d\n", FMP4_HTTP_PORT);
+        return 1;
+    }
+#endif
+
     int i = 1;
     do {
         std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1]);
         std::shared_ptr<MP4Reader> input = std::make_shared<MP4Reader>(argv[i]);
         printf("#%d: %s\n", i, argv[i]);
+#ifdef FMP4_ADTS_MODE
+        const std::string input_path = argv[i];
+        AdtsReader adts_input(input_path.substr(0, input_path.rfind('.')) + ".aac");
+        if (!adts_input.IsOpen())
+            printf("No ADTS input next to %s, video only\n", argv[i]);
+#endif
+#ifdef FMP4_HTTP_PORT
+        output->SetServer(&server, "/" + std::to_string(i), "live/" + std::to_string(i));
+        printf("http://127.0.0.1:%u/%d/index.m3u8\n", server.Port(), i);
+#endif
 
         unsigned char *video_sample = nullptr, *audio_sample = nullptr;
         unsigned int video_sample_size = 0, audio_sample_size = 0;
         unsigned long long int video_duration = 0, audio_duration = 0;
+        long long int composition_offset = 0;
         unsigned int audio_sample_rate = input->GetAudioSampleRate();
         unsigned int audio_channels = input->GetAudioChannels();
         unsigned int video_count = 0, audio_count = 0;
@@ -1044,26 +1492,38 @@ int main(int argc, char **argv)
         while (true) {
 
             MP4Writer::VideoFrame video_frame = {0};
-            video_result = input->GetNextH264VideoSample(&video_sample, video_sample_size, video_duration, is_key_frame);
+            video_result = input->GetNextH264VideoSample(&video_sample, video_sample_size, video_duration, composition_offset, is_key_frame);
             if (video_result == MP4Reader::MP4_READ_OK) {
-                printf("%d video: %dbytes, %lldms\n", ++video_count, video_sample_size, video_duration);
+                FMP4_LOGD("%d video: %dbytes, %llu ticks\n", ++video_count, video_sample_size, video_duration);
                 video_frame.sample = video_sample;
                 video_frame.sample_size = video_sample_size;
                 video_frame.sample_size = video_sample_size;
                 video_frame.is_key_frame = is_key_frame;
                 video_frame.duration = video_duration;
+                video_frame.composition_offset = composition_offset;
+                video_frame.timescale = input->GetVideoTimescale();
             }
 
             MP4Writer::AudioFrame audio_frame = {0};
+#ifdef FMP4_ADTS_MODE
+            audio_result = adts_input.GetNextAudioChunk(&audio_sample, audio_sample_size, FMP4_ADTS_FRAMES_PER_READ);
+            if (audio_result == MP4Reader::MP4_READ_OK) {
+                FMP4_LOGD("%d audio: %dbytes of ADTS\n", ++audio_count, audio_sample_size);
+                audio_frame.sample = audio_sample;
+                audio_frame.sample_size = audio_sample_size;
+                audio_frame.is_adts = true;
+            }
+#else
             audio_result = input->GetNextAudioSample(&audio_sample, audio_sample_size, audio_duration);
             if (audio_result == MP4Reader::MP4_READ_OK) {
-                printf("%d audio: %dbytes(0x%02x 0x%02x), %lldms\n", ++audio_count, audio_sample_size, audio_sample[0], audio_sample[1], audio_duration);
+                FMP4_LOGD("%d audio: %dbytes(0x%02x 0x%02x), %llu ticks\n", ++audio_count, audio_sample_size, audio_sample[0], audio_sample[1], audio_duration);
                 audio_frame.sample = audio_sample;
                 audio_frame.sample_size = audio_sample_size;
                 audio_frame.duration = audio_duration;
                 audio_frame.sample_rate = audio_sample_rate;
                 audio_frame.channels = audio_channels;
             }
+#endif
 
             if (video_result != MP4Reader::MP4_READ_OK && audio_result != MP4Reader::MP4_READ_OK) {
                 break;
@@ -1075,5 +1535,10 @@ int main(int argc, char **argv)
         i++;
     } while (i < argc - 1);
 
+#ifdef FMP4_HTTP_PORT
+    printf("Press Enter to stop the HTTP server\n");
+    getchar();
+#endif
+
     return 0;
 }
\ No newline at end of file
@@ -31,12 +31,16 @@
 #include <string>
 #include <memory>
 #include <functional>
+#include <vector>
 
 extern "C" {
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
 }
 
+#include "logger.h"
+#include "timestamp.h"
+
 static const std::string av_make_error_string(int errnum)
 {
     char errbuf[AV_ERROR_MAX_STRING_SIZE];
@@ -67,12 +71,12 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, cons
 {
     AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
 
-    printf("%s: pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-           tag,
-           av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
-           av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
-           av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
-           pkt->stream_index);
+    FMP4_LOGD("%s: pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
+              tag,
+              av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
+              av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
+              av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
+              pkt->stream_index);
 }
 
 int main(int argc, char **argv)
@@ -160,23 +164,29 @@ int main(int argc, char **argv)
         }
         av_dict_free(&movflags);
 
+        /* the muxer may have changed the output time bases, the conversions are fixed from here on */
+        std::vector<fmp4::TimestampRescaler> rescalers(input_fmt_ctx->nb_streams);
+        for (int i = 0; i < input_fmt_ctx->nb_streams; i++) {
+            const AVRational in_time_base = input_fmt_ctx->streams[i]->time_base;
+            const AVRational out_time_base = output_fmt_ctx->streams[i]->time_base;
+            rescalers[i].SetTimeBases(fmp4::Rational{in_time_base.num, in_time_base.den},
+                                      fmp4::Rational{out_time_base.num, out_time_base.den});
+        }
+
         AVPacket pkt;
         while (1) {
 
-            AVStream *in_stream = NULL, *out_stream = NULL;
-
             if ((ret = av_read_frame(input_fmt_ctx.get(), &pkt)) < 0) break;
             {
-                in_stream  = input_fmt_ctx->streams[pkt.stream_index];
-                out_stream = output_fmt_ctx->streams[pkt.stream_index];
+                const fmp4::TimestampRescaler &rescaler = rescalers[pkt.stream_index];
 
                 log_packet(input_fmt_ctx.get(), &pkt, "in");
                 {
                     /* copy packet */
-                    AVRounding rounding = static_cast<AVRounding>(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-                    pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->time_base, rounding);
-                    pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->time_base, rounding);
-                    pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
+                    /* same rounding as av_rescale_q_rnd(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX) */
+                    pkt.pts = rescaler.Rescale(pkt.pts);
+                    pkt.dts = rescaler.Rescale(pkt.dts);
+                    pkt.duration = rescaler.Rescale(pkt.duration);
                     pkt.pos = -1;
                 }
                 log_packet(output_fmt_ctx.get(), &pkt, "out");
@@ -8,6 +8,9 @@ extern "C" {
 #include <libavformat/avformat.h>
 };
 
+#include "logger.h"
+#include "timestamp.h"
+
 class MP4Reader
 {
 public:
@@ -20,8 +23,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , next_video_sample_idx(1)
@@ -98,9 +100,17 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimescale() const
+    {
+        return video_timescale;
+    }
+
+    // duration and composition_offset (pts - dts, ctts) are in GetVideoTimescale() ticks; the
+    // composition offset is non-zero for streams with B-frames.
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
+                                         long long int &composition_offset,
                                          bool &is_key_frame)
     {
         if (next_video_sample_idx > video_sample_number) {
@@ -131,18 +141,23 @@ public:
         }
 
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
                            NULL,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
-            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            FMP4_LOGE("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
         }
 
+        // A few files have zero durations (typically the last sample): use the average of the track
+        if (!mp4_duration && video_sample_number)
+            mp4_duration = video_duration / video_sample_number;
+
         // Convert AVC1 format to AnnexB
         if (sample_size >= 4) {
             unsigned int *p = (unsigned int *) video_sample_start_addr;
@@ -151,15 +166,14 @@ public:
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / time_scale;
+        duration = mp4_duration;
+        composition_offset = (int32_t)mp4_rendering_offset;    // ctts v1 offsets are signed
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
 private:
 
-    const unsigned int time_scale;
-
     std::string file_path;
     MP4FileHandle handle;
     MP4TrackId video_track_id;
@@ -214,7 +228,8 @@ public:
     bool AddH264VideoTrack(const unsigned int width,
                            const unsigned int height,
                            const double frame_rate,
-                           const unsigned int bit_rate)
+                           const unsigned int bit_rate,
+                           const unsigned int timescale)
     {
         avformat_alloc_output_context2(&format_context, nullptr, "mp4", nullptr);
         if (!format_context) {
@@ -229,7 +244,7 @@ public:
         }
 
         out_stream->id = video_stream_id = format_context->nb_streams - 1;
-        out_stream->time_base = av_d2q(frame_rate, 100);
+        out_stream->time_base = (AVRational){1, (int)timescale};  // the source clock, the muxer may scale it up
         out_stream->codec->time_base = av_d2q(frame_rate, 100);
         out_stream->codec->codec_id   = AV_CODEC_ID_H264;
         out_stream->codec->profile    = FF_PROFILE_H264_CONSTRAINED_BASELINE;
@@ -274,7 +289,7 @@ public:
          */
         {
             AVDictionary *movflags = NULL;
-            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe", 0);
+            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe+negative_cts_offsets", 0);
             if (avformat_write_header(format_context, &movflags) < 0) {
                 printf("Error occurred when opening output file\n");
                 return false;
@@ -282,13 +297,18 @@ public:
             av_dict_free(&movflags);
         }
 
+        // durations from the source clock to the time base the muxer chose, remainder carried over
+        const AVRational time_base = format_context->streams[video_stream_id]->time_base;
+        video_rescaler.SetTimeBases(fmp4::TimeBase(timescale), fmp4::Rational{time_base.num, time_base.den});
+
         return true;
     }
 
     bool WriteH264VideoSample(unsigned char *sample,
                               unsigned int sample_size,
                               bool is_key_frame,
-                              unsigned long long int duration)
+                              unsigned long long int duration,
+                              long long int composition_offset)
     {
         // Convert AnnexB format to AVCC
         if (sample_size >= 4) {
@@ -304,20 +324,21 @@ public:
         packet.size         = sample_size;
         packet.pos          = -1;
 
-        packet.dts = packet.pts = static_cast<int64_t>(file_duration);
-        packet.duration = static_cast<int>(duration);
-        av_packet_rescale_ts(&packet, (AVRational){1, 1000}, format_context->streams[video_stream_id]->time_base);
+        // pts - dts becomes the trun composition offset (signed, see negative_cts_offsets)
+        packet.dts = static_cast<int64_t>(file_duration);
+        packet.pts = packet.dts + video_rescaler.Offset(composition_offset);
+        packet.duration = static_cast<int>(video_rescaler.Duration(duration));
 
         if (is_key_frame) {
             packet.flags |= AV_PKT_FLAG_KEY;
         }
 
         if (av_interleaved_write_frame(format_context, &packet) < 0) {
-            printf("Fail to write frame\n");
+            FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to write frame\n");
             return false;
         }
 
-        file_duration += duration;
+        file_duration += packet.duration;
 
         return true;
     }
@@ -325,7 +346,8 @@ public:
 private:
 
     std::string file_path;
-    unsigned long long int file_duration;
+    unsigned long long int file_duration;      // in the stream time base
+    fmp4::DurationRescaler video_rescaler;
     AVFormatContext *format_context;
     unsigned int video_stream_id;
 };
@@ -340,14 +362,16 @@ int main(int argc, char **argv)
     MP4Reader input(argv[1]);
 
     MP4Writer output(argv[2]);
-    output.AddH264VideoTrack(input.GetVideoWidth(), input.GetVideoHeight(), input.GetVideoFps(), input.GetBitRate());
+    output.AddH264VideoTrack(input.GetVideoWidth(), input.GetVideoHeight(), input.GetVideoFps(), input.GetBitRate(),
+                             input.GetVideoTimescale());
 
     unsigned char *sample = nullptr;
     unsigned int sample_size = 0;
     unsigned long long int duration = 0;
+    long long int composition_offset = 0;
     bool is_key_frame = false;
-    while (input.GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
-        output.WriteH264VideoSample(sample, sample_size, is_key_frame, duration);
+    while (input.GetNextH264VideoSample(&sample, sample_size, duration, composition_offset, is_key_frame) == MP4Reader::MP4_READ_OK) {
+        output.WriteH264VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
     }
 
     return 0;
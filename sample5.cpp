@@ -8,6 +8,14 @@ extern "C" {
 #include <libavformat/avformat.h>
 };
 
+#include "logger.h"
+#include "metrics.h"
+#include "timestamp.h"
+
+// Keep the mfra box (tfra entries of the key frame fragments) that the muxer writes at the end, so a
+// player seeks with a few reads instead of walking every moof. Without it the mfra is dropped.
+#define FMP4_MFRA_MODE
+
 class MP4Reader
 {
 public:
@@ -20,8 +28,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , next_video_sample_idx(1)
@@ -98,11 +105,21 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimescale() const
+    {
+        return video_timescale;
+    }
+
+    // duration and composition_offset (pts - dts, ctts) are in GetVideoTimescale() ticks; the
+    // composition offset is non-zero for streams with B-frames.
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
+                                         long long int &composition_offset,
                                          bool &is_key_frame)
     {
+        FMP4_METRICS_SCOPE(STAGE_READ_SAMPLE, STREAM_VIDEO);
+
         if (next_video_sample_idx > video_sample_number) {
             return MP4_READ_EOS;
         }
@@ -131,18 +148,23 @@ public:
         }
 
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
                            NULL,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
-            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            FMP4_LOGE("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
         }
 
+        // A few files have zero durations (typically the last sample): use the average of the track
+        if (!mp4_duration && video_sample_number)
+            mp4_duration = video_duration / video_sample_number;
+
         // Convert AVC1 format to AnnexB
         if (sample_size >= 4) {
             unsigned int *p = (unsigned int *) video_sample_start_addr;
@@ -151,15 +173,14 @@ public:
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / time_scale;
+        duration = mp4_duration;
+        composition_offset = (int32_t)mp4_rendering_offset;    // ctts v1 offsets are signed
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
 private:
 
-    const unsigned int time_scale;
-
     std::string file_path;
     MP4FileHandle handle;
     MP4TrackId video_track_id;
@@ -222,10 +243,14 @@ public:
     static int Write(void* opaque, uint8_t* buf, int buf_size)
     {
         static int i = 0;
-        printf("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
+        FMP4_LOGD("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
+#ifndef FMP4_MFRA_MODE
         if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
             return buf_size;
-        } else {
+        } else
+#endif
+        {
+            FMP4_METRICS_ADD(COUNTER_OUTPUT_BYTES, STREAM_MUX, buf_size);
             return fwrite(buf, 1, buf_size, reinterpret_cast<MP4Writer*>(opaque)->fptr);
         }
     }
@@ -234,14 +259,15 @@ public:
     static int64_t Seek(void* opaque, int64_t offset, int whence)
     {
         static int i = 0;
-        printf("#%d Seek: offset: %ld, whence: %d\n", i++, offset, whence);
+        FMP4_LOGD("#%d Seek: offset: %ld, whence: %d\n", i++, offset, whence);
         return 0;
     }
 
     bool AddH264VideoTrack(const unsigned int width,
                            const unsigned int height,
                            const double frame_rate,
-                           const unsigned int bit_rate)
+                           const unsigned int bit_rate,
+                           const unsigned int timescale)
     {
         if (!format_context) {
             avformat_alloc_output_context2(&format_context, nullptr, "mp4", nullptr);
@@ -257,7 +283,7 @@ public:
             }
 
             out_stream->id = video_stream_id = format_context->nb_streams - 1;
-            out_stream->time_base = av_d2q(frame_rate, 100);
+            out_stream->time_base = (AVRational){1, (int)timescale};  // the source clock, the muxer may scale it up
             out_stream->codec->time_base = av_d2q(frame_rate, 100);
             out_stream->codec->codec_id   = AV_CODEC_ID_H264;
             out_stream->codec->profile    = FF_PROFILE_H264_CONSTRAINED_BASELINE;
@@ -317,7 +343,7 @@ public:
              */
             {
                 AVDictionary *movflags = NULL;
-                av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe", 0);
+                av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe+negative_cts_offsets", 0);
                 if (avformat_write_header(format_context, &movflags) < 0) {
                     printf("Error occurred when opening output file\n");
                     return false;
@@ -326,13 +352,18 @@ public:
             }
         }
 
+        // durations from the source clock to the time base the muxer chose, remainder carried over
+        const AVRational time_base = format_context->streams[video_stream_id]->time_base;
+        video_rescaler.SetTimeBases(fmp4::TimeBase(timescale), fmp4::Rational{time_base.num, time_base.den});
+
         return true;
     }
 
     bool WriteH264VideoSample(unsigned char *sample,
                               unsigned int sample_size,
                               bool is_key_frame,
-                              unsigned long long int duration)
+                              unsigned long long int duration,
+                              long long int composition_offset)
     {
         // Convert AnnexB format to AVCC
         if (sample_size >= 4) {
@@ -348,20 +379,26 @@ public:
         packet.size         = sample_size;
         packet.pos          = -1;
 
-        packet.dts = packet.pts = static_cast<int64_t>(file_duration);
-        packet.duration = static_cast<int>(duration);
-        av_packet_rescale_ts(&packet, (AVRational){1, 1000}, format_context->streams[video_stream_id]->time_base);
+        // pts - dts becomes the trun composition offset (signed, see negative_cts_offsets)
+        packet.dts = static_cast<int64_t>(file_duration);
+        packet.pts = packet.dts + video_rescaler.Offset(composition_offset);
+        packet.duration = static_cast<int>(video_rescaler.Duration(duration));
 
         if (is_key_frame) {
             packet.flags |= AV_PKT_FLAG_KEY;
         }
 
-        if (av_interleaved_write_frame(format_context, &packet) < 0) {
-            printf("Fail to write frame\n");
-            return false;
+        {
+            FMP4_METRICS_SCOPE(STAGE_WRITE_FRAME, STREAM_VIDEO);
+            if (av_interleaved_write_frame(format_context, &packet) < 0) {
+                FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to write frame\n");
+                return false;
+            }
         }
+        FMP4_METRICS_ADD(COUNTER_SAMPLES, STREAM_VIDEO, 1);
+        FMP4_METRICS_ADD(COUNTER_SAMPLE_BYTES, STREAM_VIDEO, sample_size);
 
-        file_duration += duration;
+        file_duration += packet.duration;
 
         return true;
     }
@@ -369,7 +406,8 @@ public:
 private:
 
     std::string file_path;
-    unsigned long long int file_duration;
+    unsigned long long int file_duration;      // in the stream time base
+    fmp4::DurationRescaler video_rescaler;
     AVFormatContext *format_context;
     unsigned int video_stream_id;
     unsigned int avio_buffer_size;
@@ -383,6 +421,8 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    FMP4_METRICS_DUMPER();
+
     std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1]);
 
     int i = 1;
@@ -390,14 +430,16 @@ int main(int argc, char **argv)
         std::shared_ptr<MP4Reader> input = std::make_shared<MP4Reader>(argv[i]);
         printf("#%d: %s\n", i, argv[i]);
 
-        output->AddH264VideoTrack(input->GetVideoWidth(), input->GetVideoHeight(), input->GetVideoFps(), input->GetBitRate());
+        output->AddH264VideoTrack(input->GetVideoWidth(), input->GetVideoHeight(), input->GetVideoFps(), input->GetBitRate(),
+                                  input->GetVideoTimescale());
 
         unsigned char *sample = nullptr;
         unsigned int sample_size = 0;
         unsigned long long int duration = 0;
+        long long int composition_offset = 0;
         bool is_key_frame = false;
-        while (input->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
-            output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration);
+        while (input->GetNextH264VideoSample(&sample, sample_size, duration, composition_offset, is_key_frame) == MP4Reader::MP4_READ_OK) {
+            output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
         }
 
         i++;
@@ -12,8 +12,28 @@ extern "C" {
 #define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
 #include <gst/codecparsers/gsth264parser.h>
 
+#include "logger.h"
+#include "h264_parser.h"
+#include "hevc.h"
+#include "metrics.h"
+#include "mp4_index.h"
+#include "param_set_cache.h"
+#include "recording.h"
+#include "timestamp.h"
+
 #define FMP4_ONEFRAME_MODE
 
+// Rotation: output.mp4 becomes output-0001.mp4, output-0002.mp4, ..., a new file (with its own init
+// segment) on the first key frame after FMP4_ROTATE_SECONDS of media or FMP4_ROTATE_BYTES, and on a
+// parameter set change. The next file is created and preallocated in the background. 0: no limit.
+//#define FMP4_ROTATE_MODE
+#define FMP4_ROTATE_SECONDS 300
+#define FMP4_ROTATE_BYTES 0
+#define FMP4_ROTATE_PREALLOCATE (256 * 1024 * 1024)
+
+// HEVC sample entry: hvc1 keeps VPS/SPS/PPS in hvcC only, hev1 also keeps them in the samples.
+//#define FMP4_HEV1_MODE
+
 class MP4Reader
 {
 public:
@@ -26,8 +46,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , next_video_sample_idx(1)
@@ -40,6 +59,7 @@ public:
             , pSeqHeaderSize(nullptr)
             , pPictHeaders(nullptr)
             , pPictHeaderSize(nullptr)
+            , is_hevc(false)
     {
         handle = MP4Read(this->file_path.c_str());
 
@@ -70,6 +90,8 @@ public:
                            pPictHeaders[i][0], pPictHeaders[i][1], pPictHeaders[i][2],
                            pPictHeaders[i][3], pPictHeaders[i][4]);
                 }
+            } else {
+                LoadHevcParameterSets();
             }
         }
     }
@@ -84,6 +106,12 @@ public:
         if (video_sample) delete[] video_sample;
     }
 
+    // hvc1/hev1 track: samples are H.265 and GetNextH264VideoSample() puts VPS/SPS/PPS in front of key frames
+    bool IsHevc() const
+    {
+        return is_hevc;
+    }
+
     unsigned int GetVideoWidth() const
     {
         return MP4GetTrackVideoWidth(handle, video_track_id);
@@ -104,11 +132,21 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimescale() const
+    {
+        return video_timescale;
+    }
+
+    // duration and composition_offset (pts - dts, ctts) are in GetVideoTimescale() ticks; the
+    // composition offset is non-zero for streams with B-frames.
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
+                                         long long int &composition_offset,
                                          bool &is_key_frame)
     {
+        FMP4_METRICS_SCOPE(STAGE_READ_SAMPLE, STREAM_VIDEO);
+
         if (next_video_sample_idx > video_sample_number) {
             return MP4_READ_EOS;
         }
@@ -134,37 +172,78 @@ public:
                     video_sample_offset += pPictHeaderSize[i];
                 }
             }
+            for (auto &nal : hevc_parameter_sets) {
+                (*(unsigned int *)(video_sample + video_sample_offset)) = htonl(1);
+                video_sample_offset += 4;
+                memcpy(video_sample + video_sample_offset, nal.data(), nal.size());
+                video_sample_offset += (unsigned int)nal.size();
+            }
         }
 
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
                            NULL,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
-            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            FMP4_LOGE("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
         }
 
+        // A few files have zero durations (typically the last sample): use the average of the track
+        if (!mp4_duration && video_sample_number)
+            mp4_duration = video_duration / video_sample_number;
+
         // Convert AVC1 format to AnnexB
-        if (sample_size >= 4) {
+        if (is_hevc) {
+            // HEVC access units usually carry several NAL units (AUD, SEI, slices)
+            unsigned char *tmp_addr = video_sample_start_addr;
+            while ((tmp_addr - video_sample_start_addr) + 4 <= sample_size) {
+                unsigned int *p = (unsigned int *) tmp_addr;
+                unsigned int nal_size = ntohl(*p);
+                *p = htonl(1);
+                tmp_addr += (nal_size + 4);
+            }
+        } else if (sample_size >= 4) {
             unsigned int *p = (unsigned int *) video_sample_start_addr;
             *p = htonl(1);
         }
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / time_scale;
+        duration = mp4_duration;
+        composition_offset = (int32_t)mp4_rendering_offset;    // ctts v1 offsets are signed
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
 private:
 
-    const unsigned int time_scale;
+    // mp4v2 does not know hvcC, so the parameter sets are taken from the sample entry with mp4_index.
+    void LoadHevcParameterSets()
+    {
+        fmp4::MP4Index index;
+        if (!index.Open(file_path)) return;
+
+        const fmp4::Track *track = index.FindTrackById(video_track_id);
+        if (!track || (track->sample_entry_type != FMP4_FOURCC('h', 'v', 'c', '1') &&
+                       track->sample_entry_type != FMP4_FOURCC('h', 'e', 'v', '1'))) return;
+
+        const uint8_t *hvcc = nullptr;
+        uint64_t hvcc_size = 0;
+        if (!track->FindSampleEntryChild(FMP4_FOURCC('h', 'v', 'c', 'C'), hvcc, hvcc_size) ||
+            !fmp4::hevc::ParseHvcC(hvcc, (size_t)hvcc_size, hevc_parameter_sets)) {
+            printf("Fail to read hvcC\n");
+            return;
+        }
+
+        is_hevc = true;
+        printf("Get VPS/SPS/PPS(%d) from hvcC\n", (int)hevc_parameter_sets.size());
+    }
 
     std::string file_path;
     MP4FileHandle handle;
@@ -180,13 +259,17 @@ private:
     unsigned int *pSeqHeaderSize;
     unsigned char **pPictHeaders;
     unsigned int *pPictHeaderSize;
+
+    bool is_hevc;
+    std::vector<std::vector<uint8_t> > hevc_parameter_sets;
 };
 
 class MP4Writer
 {
 public:
 
-    MP4Writer(const std::string &file_path, const bool is_open_new_file)
+    // video_timescale: clock of the durations and composition offsets given to WriteH264VideoSample()
+    MP4Writer(const std::string &file_path, const bool is_open_new_file, const unsigned int video_timescale)
             : file_path(file_path)
             , file_duration(0)
             , format_context(nullptr)
@@ -195,38 +278,27 @@ public:
             , fptr(nullptr)
             , h264_parser(gst_h264_nal_parser_new())
             , is_open_new_file(is_open_new_file)
+            , video_timescale(video_timescale)
+            , init_generation(0)
     {
         av_register_all();
+
+#ifdef FMP4_ROTATE_MODE
+        fmp4::RotationOptions options;
+        options.max_duration_ms = FMP4_ROTATE_SECONDS * 1000ULL;
+        options.max_size = FMP4_ROTATE_BYTES;
+        options.preallocate = FMP4_ROTATE_PREALLOCATE;
+        rotator.reset(new fmp4::RecordingRotator(file_path, options));
+#endif
     }
 
     ~MP4Writer()
     {
-        if (av_write_trailer(format_context) < 0) {
-            printf("Fail to write trailer\n");
-        }
-
-        if (format_context && format_context->streams[video_stream_id]) {
-            if (format_context->streams[video_stream_id]->codec) {
-                avcodec_close(format_context->streams[video_stream_id]->codec);
-            }
-        }
-
-        if (format_context && !(format_context->oformat->flags & AVFMT_NOFILE)) {
-            // Need to free the buffer that we allocate to our custom AVIOContext.
-            if (format_context->pb->buffer)
-                av_free(format_context->pb->buffer);
-
-            // Free custom AVIOContext.
-            if (format_context->pb)
-                av_free(format_context->pb);
-
-            // Close the file pointer
-            if (fptr)
-                fclose(fptr);
-        }
+        CloseOutput();
 
-        if (format_context)
-            avformat_free_context(format_context);
+        // Close the file pointer
+        if (fptr)
+            fclose(fptr);
 
         if (h264_parser)
             gst_h264_nal_parser_free(h264_parser);
@@ -235,13 +307,16 @@ public:
     // Performs a write operation using the signature required for avio.
     static int Write(void* opaque, uint8_t* buf, int buf_size)
     {
+        FMP4_METRICS_ADD(COUNTER_OUTPUT_BYTES, STREAM_MUX, buf_size);
         static int i = 0;
-        printf("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
+        FMP4_LOGD("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
 
         if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
             return buf_size;
         } else {
-            return fwrite(buf, 1, buf_size, reinterpret_cast<MP4Writer*>(opaque)->fptr);
+            MP4Writer *writer = reinterpret_cast<MP4Writer*>(opaque);
+            if (writer->rotator) writer->rotator->AddBytes(buf_size);
+            return fwrite(buf, 1, buf_size, writer->fptr);
         }
     }
 
@@ -249,30 +324,41 @@ public:
     static int64_t Seek(void* opaque, int64_t offset, int whence)
     {
         static int i = 0;
-        printf("#%d Seek: offset: %ld, whence: %d\n", i++, offset, whence);
+        FMP4_LOGD("#%d Seek: offset: %ld, whence: %d\n", i++, offset, whence);
         return 0;
     }
 
     bool WriteH264VideoSample(unsigned char *sample,
                               unsigned int sample_size,
                               bool is_key_frame,
-                              unsigned long long int duration)
+                              unsigned long long int duration,
+                              long long int composition_offset)
     {
         // Parse the sample into NALUs
         std::vector<GstH264NalUnit> nalus = ParseH264NALU(sample, sample_size);
 
         // To compatible with AVC1 format, we need to add SPS/PPS into mp4 header. (In avcC box)
-        if (!format_context && is_key_frame) {
-            GstH264NalUnit nal_sps = {0}, nal_pps = {0};
+        // When a key frame brings parameter sets that differ from the ones in the header, the header
+        // is stale: finish the current fragments and append a new init segment, the same way a new
+        // input file is appended. (The mp4 muxer always writes avc1, so there is no avc3 mode here.)
+        // In rotation mode the new init segment starts a new file.
+        if (is_key_frame && (!format_context || parameter_sets.Generation() != init_generation || IsRotationDue())) {
+            GstH264NalUnit nal_sps = {0};
             for (auto nalu : nalus) {
                 if (nalu.type == GST_H264_NAL_SPS) nal_sps = nalu;
-                else if (nalu.type == GST_H264_NAL_PPS) nal_pps = nalu;
             }
 
-            if (!AddH264VideoTrack(nal_sps, nal_pps)) {
+            if (format_context) {
+                if (parameter_sets.Generation() != init_generation)
+                    FMP4_LOGI("Parameter sets changed, writing a new init segment\n");
+                CloseOutput();
+            }
+
+            if (!AddH264VideoTrack(nal_sps)) {
                 printf("Fail to add H264 video track\n");
                 return false;
             }
+            init_generation = parameter_sets.Generation();
         }
 
         // To compatible with AVC1 format, we could not put SPS/PPS in the sample.
@@ -284,43 +370,167 @@ public:
                 unsigned int *p = (unsigned int *) (nalu.data + nalu.offset - 4);
                 *p = htonl(nalu.size);
 
-                AVPacket packet = { 0 };
-                av_init_packet(&packet);
+                if (!WriteVideoPacket((unsigned char *)(p), nalu.size + 4, is_key_frame, duration, composition_offset))
+                    return false;
+            }
+        }
 
-                packet.stream_index = video_stream_id;
-                packet.data         = (unsigned char *)(p);
-                packet.size         = nalu.size + 4;
-                packet.pos          = -1;
+        if (rotator) rotator->AddDuration(duration, video_timescale);
+        return true;
+    }
 
-                packet.dts = packet.pts = static_cast<int64_t>(file_duration);
-                packet.duration = static_cast<int>(duration);
-                av_packet_rescale_ts(&packet, (AVRational){1, 1000}, format_context->streams[video_stream_id]->time_base);
+    bool WriteH265VideoSample(unsigned char *sample,
+                              unsigned int sample_size,
+                              bool is_key_frame,
+                              unsigned long long int duration,
+                              long long int composition_offset)
+    {
+        std::vector<fmp4::hevc::NalUnit> nalus;
+        {
+            FMP4_METRICS_SCOPE(STAGE_PARSE_NALU, STREAM_VIDEO);
+            nalus = fmp4::hevc::SplitAnnexB(sample, sample_size);
+        }
 
-                if (is_key_frame) {
-                    packet.flags |= AV_PKT_FLAG_KEY;
-                }
+        bool is_irap = false;
+        for (auto &nalu : nalus) {
+            if (fmp4::hevc::IsParameterSet(nalu.type)) hevc_parameter_sets.Update(nalu.data, nalu.size);
+            else if (fmp4::hevc::IsIrap(nalu.type)) is_irap = true;
+        }
+        is_key_frame = is_key_frame || is_irap;
 
-                if (av_interleaved_write_frame(format_context, &packet) < 0) {
-                    printf("Fail to write frame\n");
-                    return false;
-                }
+        // Same as H.264: (re)write the init segment on a key frame when the parameter sets changed.
+        // In hev1 mode the parameter sets also travel in-band, so a change does not need a new one.
+#ifdef FMP4_HEV1_MODE
+        if (is_key_frame && (!format_context || IsRotationDue())) {
+#else
+        if (is_key_frame && (!format_context || hevc_parameter_sets.Generation() != init_generation || IsRotationDue())) {
+#endif
+            if (format_context) {
+                if (hevc_parameter_sets.Generation() != init_generation)
+                    FMP4_LOGI("Parameter sets changed, writing a new init segment\n");
+                CloseOutput();
+            }
 
-                file_duration += duration;
+            if (!AddH265VideoTrack()) {
+                printf("Fail to add H265 video track\n");
+                return false;
+            }
+            init_generation = hevc_parameter_sets.Generation();
+        }
 
-#ifdef FMP4_ONEFRAME_MODE
-                if (av_write_frame(format_context, NULL) < 0) {
-                    printf("FMP4 OneFrame mode: Fail to write fragment\n");
-                }
+        if (!format_context) {
+            FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_WARN, 10, "Drop H265 sample before the first key frame\n");
+            return false;
+        }
+
+        // The whole access unit is one sample: every NAL unit gets a length prefix, AUDs are dropped
+        // and parameter sets only stay in hev1 mode.
+        hevc_sample.clear();
+        for (auto &nalu : nalus) {
+            if (nalu.type == fmp4::hevc::NAL_AUD) continue;
+#ifndef FMP4_HEV1_MODE
+            if (fmp4::hevc::IsParameterSet(nalu.type)) continue;
 #endif
-            }
+            const uint32_t size = htonl((uint32_t)nalu.size);
+            hevc_sample.insert(hevc_sample.end(), (const uint8_t *)&size, (const uint8_t *)&size + 4);
+            hevc_sample.insert(hevc_sample.end(), nalu.data, nalu.data + nalu.size);
         }
+        if (hevc_sample.empty()) return true;
 
+        if (!WriteVideoPacket(hevc_sample.data(), (int)hevc_sample.size(), is_key_frame, duration, composition_offset))
+            return false;
+        if (rotator) rotator->AddDuration(duration, video_timescale);
         return true;
     }
 
 private:
 
-    bool AddH264VideoTrack(GstH264NalUnit &nal_sps, GstH264NalUnit &nal_pps)
+    // The current file is full: the next key frame starts a new one
+    bool IsRotationDue() const
+    {
+        return rotator && rotator->IsDue();
+    }
+
+    // One length prefixed sample into the muxer. In one-frame mode every sample becomes a fragment.
+    bool WriteVideoPacket(unsigned char *data,
+                          int size,
+                          bool is_key_frame,
+                          unsigned long long int duration,
+                          long long int composition_offset)
+    {
+        AVPacket packet = { 0 };
+        av_init_packet(&packet);
+
+        packet.stream_index = video_stream_id;
+        packet.data         = data;
+        packet.size         = size;
+        packet.pos          = -1;
+
+        // pts - dts becomes the trun composition offset (signed, see negative_cts_offsets)
+        packet.dts = static_cast<int64_t>(file_duration);
+        packet.pts = packet.dts + video_rescaler.Offset(composition_offset);
+        packet.duration = static_cast<int>(video_rescaler.Duration(duration));
+
+        if (is_key_frame) {
+            packet.flags |= AV_PKT_FLAG_KEY;
+        }
+
+        {
+            FMP4_METRICS_SCOPE(STAGE_WRITE_FRAME, STREAM_VIDEO);
+            if (av_interleaved_write_frame(format_context, &packet) < 0) {
+                FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to write frame\n");
+                return false;
+            }
+        }
+        FMP4_METRICS_ADD(COUNTER_SAMPLES, STREAM_VIDEO, 1);
+        FMP4_METRICS_ADD(COUNTER_SAMPLE_BYTES, STREAM_VIDEO, size);
+
+        file_duration += packet.duration;
+
+#ifdef FMP4_ONEFRAME_MODE
+        if (av_write_frame(format_context, NULL) < 0) {
+            FMP4_LOGE("FMP4 OneFrame mode: Fail to write fragment\n");
+        }
+        FMP4_METRICS_ADD(COUNTER_FRAGMENTS, STREAM_MUX, 1);
+#endif
+
+        return true;
+    }
+
+    // Write the trailer and release the muxer. The output file stays open for the next init segment,
+    // in rotation mode it is closed and the next init segment goes to a new one.
+    void CloseOutput()
+    {
+        if (!format_context)
+            return;
+
+        if (av_write_trailer(format_context) < 0) {
+            printf("Fail to write trailer\n");
+        }
+
+        if (format_context->streams[video_stream_id] && format_context->streams[video_stream_id]->codec) {
+            avcodec_close(format_context->streams[video_stream_id]->codec);
+        }
+
+        if (!(format_context->oformat->flags & AVFMT_NOFILE) && format_context->pb) {
+            // Need to free the buffer that we allocate to our custom AVIOContext.
+            if (format_context->pb->buffer)
+                av_free(format_context->pb->buffer);
+
+            // Free custom AVIOContext.
+            av_free(format_context->pb);
+        }
+
+        avformat_free_context(format_context);
+        format_context = nullptr;
+
+        if (rotator) {
+            rotator->CloseFile(fptr);
+            fptr = nullptr;
+        }
+    }
+
+    bool AddH264VideoTrack(GstH264NalUnit &nal_sps)
     {
         // Parse SPS to get necessary params.
         unsigned char profile_idc = 0;
@@ -328,22 +538,64 @@ private:
         unsigned char level_idc = 0;
         int width  = 0, height = 0;
         {
-            GstH264SPS sps = {0};
-            gst_h264_parser_parse_sps(h264_parser, &nal_sps, &sps, false);
+            // Only profile, level and size are needed, the VUI is not parsed.
+            fmp4::h264::SpsInfo sps;
+            fmp4::h264::ParseSps(nal_sps.data + nal_sps.offset, nal_sps.size, sps);
 
             profile_idc = sps.profile_idc;
             level_idc = sps.level_idc;
-            width  = sps.frame_cropping_flag ? sps.crop_rect_width : sps.width;
-            height = sps.frame_cropping_flag ? sps.crop_rect_height : sps.height;
+            width  = sps.width;
+            height = sps.height;
 
-            profile_compatibility = 0x00;
-            //profile_compatibility = (sps.constraint_set0_flag << 7) | (sps.constraint_set1_flag << 6) |
-            //                        (sps.constraint_set2_flag << 5) | (sps.constraint_set3_flag << 4);
+            profile_compatibility = sps.constraint_flags;
 
             printf("Profile: %d, Compatibility: %d, Level: %d\n", profile_idc, profile_compatibility, level_idc);
             printf("Width: %d, Height: %d\n", width, height);
         }
 
+        // Fill extra data for AVCC format, with every SPS/PPS seen so far
+        std::vector<uint8_t> avcc = parameter_sets.BuildAvcC();
+        if (avcc.empty()) {
+            printf("No SPS/PPS for the avcC box\n");
+            return false;
+        }
+
+        return OpenOutput(AV_CODEC_ID_H264, 0, profile_idc, level_idc, width, height, avcc);
+    }
+
+    bool AddH265VideoTrack()
+    {
+        fmp4::hevc::SpsInfo sps;
+        if (!hevc_parameter_sets.GetSpsInfo(sps)) {
+            printf("No valid SPS for the hvcC box\n");
+            return false;
+        }
+        printf("Profile: %d, Tier: %d, Level: %d\n", sps.profile_idc, sps.tier_flag, sps.level_idc);
+        printf("Width: %d, Height: %d\n", sps.width, sps.height);
+
+#ifdef FMP4_HEV1_MODE
+        std::vector<uint8_t> hvcc = hevc_parameter_sets.BuildHvcC(false);
+        const unsigned int codec_tag = MKTAG('h', 'e', 'v', '1');
+#else
+        std::vector<uint8_t> hvcc = hevc_parameter_sets.BuildHvcC(true);
+        const unsigned int codec_tag = MKTAG('h', 'v', 'c', '1');
+#endif
+        if (hvcc.empty()) {
+            printf("No VPS/SPS/PPS for the hvcC box\n");
+            return false;
+        }
+
+        return OpenOutput(AV_CODEC_ID_HEVC, codec_tag, sps.profile_idc, sps.level_idc, sps.width, sps.height, hvcc);
+    }
+
+    bool OpenOutput(AVCodecID codec_id,
+                    unsigned int codec_tag,
+                    int profile,
+                    int level,
+                    int width,
+                    int height,
+                    const std::vector<uint8_t> &extradata)
+    {
         avformat_alloc_output_context2(&format_context, nullptr, "mp4", nullptr);
         if (!format_context) {
             printf("Fail to create output context\n");
@@ -359,38 +611,20 @@ private:
         out_stream->id = video_stream_id = format_context->nb_streams - 1;
         //out_stream->time_base = av_d2q(frame_rate, 100);
         //out_stream->codec->time_base = av_d2q(frame_rate, 100);
-        out_stream->codec->codec_id   = AV_CODEC_ID_H264;
-        out_stream->codec->profile    = profile_idc;
-        out_stream->codec->level      = level_idc;
+        out_stream->time_base = (AVRational){1, (int)video_timescale};  // the source clock, the muxer may scale it up
+        out_stream->codec->codec_id   = codec_id;
+        out_stream->codec->profile    = profile;
+        out_stream->codec->level      = level;
         out_stream->codec->codec_type = AVMEDIA_TYPE_VIDEO;
         out_stream->codec->width      = width;
         out_stream->codec->height     = height;
         out_stream->codec->pix_fmt    = AV_PIX_FMT_YUV420P;
-        out_stream->codec->codec_tag  = 0;
-
-        // Fill extra data for AVCC format
-        unsigned int extradata_offset = 0;
-        out_stream->codec->extradata_size = nal_sps.size + nal_pps.size + 11;
-        out_stream->codec->extradata = (uint8_t *)av_mallocz(out_stream->codec->extradata_size);
-        out_stream->codec->extradata[extradata_offset++] = 0x01;                     // configurationVersion
-        out_stream->codec->extradata[extradata_offset++] = profile_idc;              // AVCProfileIndication
-        out_stream->codec->extradata[extradata_offset++] = profile_compatibility;    // profile_compatibility
-        out_stream->codec->extradata[extradata_offset++] = level_idc;                // AVCLevelIndication, level: 4.0
-        out_stream->codec->extradata[extradata_offset++] = 0xff;                     // 6 bits reserved (111111) + 2 bits nal size length - 1 (11)
-        out_stream->codec->extradata[extradata_offset++] = 0xe1;                     // 3 bits reserved (111) + 5 bits number of sps (00001)
-
-        unsigned short sps_size = static_cast<unsigned short>(nal_sps.size);
-        *(unsigned short *)(out_stream->codec->extradata + extradata_offset) = htons(sps_size);
-        extradata_offset += 2;
-        memcpy(out_stream->codec->extradata + extradata_offset, nal_sps.data + nal_sps.offset, nal_sps.size);
-        extradata_offset += nal_sps.size;
-
-        out_stream->codec->extradata[extradata_offset++] = 0x01;                     // 8 bits number of pps (00000000)
-        unsigned short pps_size = static_cast<unsigned short>(nal_pps.size);
-        *(unsigned short *)(out_stream->codec->extradata + extradata_offset) = htons(pps_size);
-        extradata_offset += 2;
-        memcpy(out_stream->codec->extradata + extradata_offset, nal_pps.data + nal_pps.offset, nal_pps.size);
-        extradata_offset += nal_pps.size;
+        out_stream->codec->codec_tag  = codec_tag;
+
+        // avcC/hvcC record, the muxer writes it into the sample entry as is
+        out_stream->codec->extradata_size = (int)extradata.size();
+        out_stream->codec->extradata = (uint8_t *)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+        memcpy(out_stream->codec->extradata, extradata.data(), extradata.size());
 
         if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
             out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
@@ -419,7 +653,8 @@ private:
                 format_context->pb = avio_out;
                 format_context->flags = AVFMT_FLAG_CUSTOM_IO;
 
-                fptr = fopen(file_path.c_str(), is_open_new_file ? "wb" : "ab");
+                if (!fptr && !OpenFile())
+                    return false;
             }
         }
 
@@ -429,9 +664,9 @@ private:
         {
             AVDictionary *movflags = nullptr;
 #ifdef FMP4_ONEFRAME_MODE
-            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_custom", 0);
+            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_custom+negative_cts_offsets", 0);
 #else
-            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof", 0);
+            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+negative_cts_offsets", 0);
             av_dict_set_int(&movflags, "frag_duration", 200 * 1000, 0);
 #endif
             if (avformat_write_header(format_context, &movflags) < 0) {
@@ -441,11 +676,50 @@ private:
             av_dict_free(&movflags);
         }
 
+        // durations from the source clock to the time base the muxer chose, remainder carried over
+        const AVRational time_base = format_context->streams[video_stream_id]->time_base;
+        video_rescaler.SetTimeBases(fmp4::TimeBase(video_timescale), fmp4::Rational{time_base.num, time_base.den});
+
         return true;
     }
 
+    bool OpenFile()
+    {
+        if (rotator) {
+            fptr = rotator->OpenNext();
+            if (fptr) FMP4_LOGI("Recording to %s\n", rotator->CurrentPath().c_str());
+        } else {
+            // What a crash left of the last fragment has to go before anything is appended
+            uint64_t removed = 0;
+            if (!is_open_new_file && !fmp4::RecoverRecording(file_path, removed))
+                FMP4_LOGE("Fail to recover %s\n", file_path.c_str());
+            else if (removed)
+                FMP4_LOGI("%s: removed %llu bytes of an incomplete fragment\n", file_path.c_str(), (unsigned long long)removed);
+            fptr = fopen(file_path.c_str(), is_open_new_file ? "wb" : "ab");
+        }
+        if (!fptr) {
+            printf("Fail to open output file\n");
+            return false;
+        }
+        return true;
+    }
+
+    // The NAL type found by gst_h264_parser_identify_nalu() is all the writer needs for slices and SEI.
+    // Only new or changed SPS/PPS get a full parse; the unchanged repeats in front of every key
+    // frame are skipped.
+    void ParseNal(GstH264NalUnit &nalu)
+    {
+        if (nalu.type != GST_H264_NAL_SPS && nalu.type != GST_H264_NAL_PPS)
+            return;
+        if (parameter_sets.Update(nalu.data + nalu.offset, nalu.size) == fmp4::ParameterSetCache::PARAMETER_SET_UNCHANGED)
+            return;
+        gst_h264_parser_parse_nal(h264_parser, &nalu);
+    }
+
     std::vector<GstH264NalUnit> ParseH264NALU(unsigned char *data, unsigned int length)
     {
+        FMP4_METRICS_SCOPE(STAGE_PARSE_NALU, STREAM_VIDEO);
+
         std::vector<GstH264NalUnit> nalus;
 
         GstH264NalUnit nalu = {0};
@@ -454,7 +728,7 @@ private:
         while ((result = gst_h264_parser_identify_nalu(h264_parser, data, offset, length, &nalu)) == GST_H264_PARSER_OK)
         {
             // Update the offset
-            gst_h264_parser_parse_nal(h264_parser, &nalu);
+            ParseNal(nalu);
             offset = nalu.size + nalu.offset;
 
             nalus.push_back(nalu);
@@ -463,7 +737,7 @@ private:
         // Handle the last NALU because there is no other start_code followed it.
         if (gst_h264_parser_identify_nalu_unchecked(h264_parser, data, offset, length, &nalu) == GST_H264_PARSER_OK) {
 
-            gst_h264_parser_parse_nal(h264_parser, &nalu);
+            ParseNal(nalu);
 
             nalus.push_back(nalu);
         }
@@ -472,13 +746,21 @@ private:
     }
 
     const std::string file_path;
-    unsigned long long int file_duration;
+    unsigned long long int file_duration;      // in the stream time base
+    fmp4::DurationRescaler video_rescaler;
     AVFormatContext *format_context;
     unsigned int video_stream_id;
     unsigned int avio_buffer_size;
     FILE *fptr;
     GstH264NalParser *h264_parser;
     bool is_open_new_file;
+    unsigned int video_timescale;
+
+    fmp4::ParameterSetCache parameter_sets;
+    fmp4::hevc::ParameterSetCache hevc_parameter_sets;
+    uint32_t init_generation;   // Generation() of the cache the current init segment was built from
+    std::vector<uint8_t> hevc_sample;
+    std::unique_ptr<fmp4::RecordingRotator> rotator;    // rotation mode
 };
 
 int main(int argc, char **argv)
@@ -488,19 +770,25 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    FMP4_METRICS_DUMPER();
+
     bool is_open_new_file = true;
     int i = 1;
     do {
-        std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1], is_open_new_file);
         std::shared_ptr<MP4Reader> input = std::make_shared<MP4Reader>(argv[i]);
+        std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1], is_open_new_file, input->GetVideoTimescale());
         printf("#%d: %s\n", i, argv[i]);
 
         unsigned char *sample = nullptr;
         unsigned int sample_size = 0;
         unsigned long long int duration = 0;
+        long long int composition_offset = 0;
         bool is_key_frame = false;
-        while (input->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
-            output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration);
+        while (input->GetNextH264VideoSample(&sample, sample_size, duration, composition_offset, is_key_frame) == MP4Reader::MP4_READ_OK) {
+            if (input->IsHevc())
+                output->WriteH265VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
+            else
+                output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
         }
 
         i++;
@@ -1,9 +1,11 @@
 #include <string>
 #include <thread>
 #include <vector>
+#include <memory>
 
 #include <mp4v2/mp4v2.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -12,6 +14,33 @@ extern "C" {
 #define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
 #include <gst/codecparsers/gsth264parser.h>
 
+#include "cmaf.h"
+#include "http_server.h"
+#include "logger.h"
+#include "manifest.h"
+#include "timestamp.h"
+
+// Segments of every input go to frag/<input number>/: init.mp4, frag-<n>.m4s from key frame to key
+// frame, with index.mpd and index.m3u8. Segments listed in the manifests, 0: all of them.
+#define FMP4_MANIFEST_WINDOW 0
+
+// CMAF chunked output: a chunk (moof+mdat) is cut before every key frame and after
+// FMP4_CMAF_CHUNK_FRAMES frames or FMP4_CMAF_CHUNK_MS, whichever comes first (0: no limit). The
+// manifests announce the chunks as LL-HLS parts of FMP4_CMAF_CHUNK_MS (none without it), and the
+// last FMP4_CMAF_LIVE_SEGMENTS segments stay in memory for sinks, the one being written included.
+//#define FMP4_CMAF_MODE
+#define FMP4_CMAF_CHUNK_FRAMES 0
+#define FMP4_CMAF_CHUNK_MS 200
+#define FMP4_CMAF_LIVE_SEGMENTS 3
+
+// Built-in HTTP server on 127.0.0.1: /<input number>/ serves the segments from memory while they are
+// written (chunked transfer) and the rest of frag/<input number>/ from disk. Needs FMP4_CMAF_MODE.
+//#define FMP4_HTTP_PORT 8080
+
+#if defined(FMP4_HTTP_PORT) && !defined(FMP4_CMAF_MODE)
+#error FMP4_HTTP_PORT needs FMP4_CMAF_MODE
+#endif
+
 class MP4Reader
 {
 public:
@@ -24,8 +53,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , next_video_sample_idx(1)
@@ -102,9 +130,17 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimescale() const
+    {
+        return video_timescale;
+    }
+
+    // duration and composition_offset (pts - dts, ctts) are in GetVideoTimescale() ticks; the
+    // composition offset is non-zero for streams with B-frames.
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
+                                         long long int &composition_offset,
                                          bool &is_key_frame)
     {
         if (next_video_sample_idx > video_sample_number) {
@@ -135,18 +171,23 @@ public:
         }
 
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
                            NULL,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
-            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            FMP4_LOGE("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
         }
 
+        // A few files have zero durations (typically the last sample): use the average of the track
+        if (!mp4_duration && video_sample_number)
+            mp4_duration = video_duration / video_sample_number;
+
         // Convert AVC1 format to AnnexB
         if (sample_size >= 4) {
             unsigned int *p = (unsigned int *) video_sample_start_addr;
@@ -155,15 +196,14 @@ public:
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / time_scale;
+        duration = mp4_duration;
+        composition_offset = (int32_t)mp4_rendering_offset;    // ctts v1 offsets are signed
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
 private:
 
-    const unsigned int time_scale;
-
     std::string file_path;
     MP4FileHandle handle;
     MP4TrackId video_track_id;
@@ -184,7 +224,10 @@ class MP4Writer
 {
 public:
 
-    MP4Writer(const std::string &file_path, const bool is_open_new_file)
+    // video_timescale: clock of the durations and composition offsets given to WriteH264VideoSample()
+    // segment_directory: where segment files and manifests go
+    MP4Writer(const std::string &file_path, const bool is_open_new_file, const unsigned int video_timescale,
+              const std::string &segment_directory)
             : file_path(file_path)
             , file_duration(0)
             , format_context(nullptr)
@@ -193,8 +236,41 @@ public:
             , fptr(nullptr)
             , h264_parser(gst_h264_nal_parser_new())
             , is_open_new_file(is_open_new_file)
+            , video_timescale(video_timescale)
+            , segment_directory(segment_directory)
+            , segment_fptr(nullptr)
+#ifdef FMP4_CMAF_MODE
+            , chunk_scheduler(FMP4_CMAF_CHUNK_FRAMES, (uint64_t)FMP4_CMAF_CHUNK_MS * video_timescale / 1000)
+            , live_segments(FMP4_CMAF_LIVE_SEGMENTS)
+#endif
     {
         av_register_all();
+
+        mkdir(segment_directory.c_str(), 0755);
+        segmenter.on_segment_start = [this](uint32_t number) { OpenSegment(number); };
+        segmenter.on_data = [this](const uint8_t *data, size_t size) {
+            if (segment_fptr) fwrite(data, 1, size, segment_fptr);
+#ifdef FMP4_CMAF_MODE
+            if (!live_segments.Append(data, size))
+                FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to buffer segment\n");
+#endif
+        };
+#ifdef FMP4_CMAF_MODE
+        segmenter.on_chunk_end = [this](const fmp4::MediaChunk &chunk) {
+            // the part is in the file before the playlist lists it
+            if (segment_fptr) fflush(segment_fptr);
+            live_segments.AddChunk(chunk);
+            if (manifest && !manifest->AddPart(chunk)) FMP4_LOGE("Fail to update manifests\n");
+        };
+#endif
+        segmenter.on_segment_end = [this](const fmp4::MediaSegment &segment) {
+            // the file is complete before the manifests list it
+            if (segment_fptr) fflush(segment_fptr);
+#ifdef FMP4_CMAF_MODE
+            live_segments.Complete();
+#endif
+            if (manifest && !manifest->AddSegment(segment)) FMP4_LOGE("Fail to update manifests\n");
+        };
     }
 
     ~MP4Writer()
@@ -203,6 +279,12 @@ public:
             printf("Fail to write trailer\n");
         }
 
+        segmenter.Finish();
+        if (segment_fptr)
+            fclose(segment_fptr);
+        if (manifest && !manifest->Finish())
+            FMP4_LOGE("Fail to finish manifests\n");
+
         if (format_context && format_context->streams[video_stream_id]) {
             if (format_context->streams[video_stream_id]->codec) {
                 avcodec_close(format_context->streams[video_stream_id]->codec);
@@ -234,22 +316,21 @@ public:
     static int Write(void* opaque, uint8_t* buf, int buf_size)
     {
         static int i = 0;
-        printf("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
+        FMP4_LOGD("#%d Write: buf: %p(%02x%02x%02x%02x %c%c%c%c), size: %d\n", i++, buf, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf_size);
 
-        std::string frag_filename = std::string("frag/frag-") + std::to_string(i);
-        FILE *frag_fptr = fopen(frag_filename.c_str(), "wb");
+        MP4Writer *writer = reinterpret_cast<MP4Writer*>(opaque);
+
+        // the segmenter sees the whole stream, it drops the mfra itself
+        if (!writer->segmenter.Write(buf, buf_size)) {
+            FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to split the output into segments\n");
+        }
 
         if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
             return buf_size;
         } else {
-            fwrite(buf, 1, buf_size, reinterpret_cast<MP4Writer*>(opaque)->fptr);
-
-            printf("Write frag file: %s\n", frag_filename.c_str());
-            fwrite(buf, 1, buf_size, frag_fptr);
-            fclose(frag_fptr);
+            fwrite(buf, 1, buf_size, writer->fptr);
         }
 
-        i++;
         return buf_size;
     }
 
@@ -257,18 +338,24 @@ public:
     static int64_t Seek(void* opaque, int64_t offset, int whence)
     {
         static int i = 0;
-        printf("#%d Seek: offset: %ld, whence: %d\n", i++, offset, whence);
+        FMP4_LOGD("#%d Seek: offset: %ld, whence: %d\n", i++, offset, whence);
         return 0;
     }
 
     bool WriteH264VideoSample(unsigned char *sample,
                               unsigned int sample_size,
                               bool is_key_frame,
-                              unsigned long long int duration)
+                              unsigned long long int duration,
+                              long long int composition_offset)
     {
         // Parse the sample into NALUs
         std::vector<GstH264NalUnit> nalus = ParseH264NALU(sample, sample_size);
 
+#ifdef FMP4_CMAF_MODE
+        // a key frame starts a segment, so it starts a chunk
+        if (format_context && chunk_scheduler.IsCutBefore(is_key_frame)) CutChunk();
+#endif
+
         // To compatible with AVC1 format, we need to add SPS/PPS into mp4 header. (In avcC box)
         if (!format_context && is_key_frame) {
             GstH264NalUnit nal_sps = {0}, nal_pps = {0};
@@ -300,28 +387,98 @@ public:
                 packet.size         = nalu.size + 4;
                 packet.pos          = -1;
 
-                packet.dts = packet.pts = static_cast<int64_t>(file_duration);
-                packet.duration = static_cast<int>(duration);
-                av_packet_rescale_ts(&packet, (AVRational){1, 1000}, format_context->streams[video_stream_id]->time_base);
+                // pts - dts becomes the trun composition offset (signed, see negative_cts_offsets)
+                packet.dts = static_cast<int64_t>(file_duration);
+                packet.pts = packet.dts + video_rescaler.Offset(composition_offset);
+                packet.duration = static_cast<int>(video_rescaler.Duration(duration));
 
                 if (is_key_frame) {
                     packet.flags |= AV_PKT_FLAG_KEY;
                 }
 
                 if (av_interleaved_write_frame(format_context, &packet) < 0) {
-                    printf("Fail to write frame\n");
+                    FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to write frame\n");
                     return false;
                 }
 
-                file_duration += duration;
+                file_duration += packet.duration;
             }
         }
 
+#ifdef FMP4_CMAF_MODE
+        if (format_context && chunk_scheduler.AddFrame(duration)) CutChunk();
+#endif
+
         return true;
     }
 
+#ifdef FMP4_HTTP_PORT
+    // Serve the segments in memory under path (e.g. /1), before the first sample; the server has to
+    // outlive the writer
+    void SetServer(fmp4::HttpServer *server, const std::string &path)
+    {
+        live_segments.on_add = [server, path](const std::shared_ptr<const fmp4::SegmentBuffer> &segment) {
+            server->Publish(path + "/" + SegmentName(segment->Number()), segment);
+        };
+        live_segments.on_drop = [server, path](uint32_t number) { server->Unpublish(path + "/" + SegmentName(number)); };
+        live_segments.on_update = [server]() { server->Notify(); };
+    }
+#endif
+
 private:
 
+    static std::string SegmentName(uint32_t number)
+    {
+        return number ? "frag-" + std::to_string(number) + ".m4s" : "init.mp4";
+    }
+
+    // Segment 0 is the init segment. The manifests start with the first media segment, when the
+    // track (timescale, codec) is known from the moov.
+    void OpenSegment(uint32_t number)
+    {
+        if (segment_fptr)
+            fclose(segment_fptr);
+
+        const std::string name = SegmentName(number);
+        FMP4_LOGD("Write segment file: %s/%s\n", segment_directory.c_str(), name.c_str());
+        segment_fptr = fopen((segment_directory + "/" + name).c_str(), "wb");
+
+#ifdef FMP4_CMAF_MODE
+        if (!live_segments.Open(number))
+            FMP4_LOGE("Fail to create a buffer for segment %u\n", number);
+#endif
+
+        const fmp4::Track *track = segmenter.IndexedTrack();
+        if (number == 1 && !manifest && track) {
+            fmp4::ManifestOptions options;
+            options.directory = segment_directory;
+            options.timescale = track->timescale;
+            options.codecs    = fmp4::CodecsString(*track);
+            options.width     = track->width;
+            options.height    = track->height;
+            options.window    = FMP4_MANIFEST_WINDOW;
+#ifdef FMP4_CMAF_MODE
+            options.part_target = FMP4_CMAF_CHUNK_MS / 1000.0;
+#endif
+            manifest.reset(new fmp4::ManifestWriter(options));
+            if (!manifest->Open()) {
+                FMP4_LOGE("Fail to open manifests in %s\n", segment_directory.c_str());
+                manifest.reset();
+            }
+        }
+    }
+
+#ifdef FMP4_CMAF_MODE
+    // Write the frames since the last cut as one fragment
+    void CutChunk()
+    {
+        if (av_write_frame(format_context, NULL) < 0) {
+            FMP4_LOG_RATE_LIMITED(FMP4_LOG_LEVEL_ERROR, 10, "Fail to flush fragment\n");
+        }
+        chunk_scheduler.Cut();
+    }
+#endif
+
     bool AddH264VideoTrack(GstH264NalUnit &nal_sps, GstH264NalUnit &nal_pps)
     {
         // Parse SPS to get necessary params.
@@ -361,6 +518,7 @@ private:
         out_stream->id = video_stream_id = format_context->nb_streams - 1;
         //out_stream->time_base = av_d2q(frame_rate, 100);
         //out_stream->codec->time_base = av_d2q(frame_rate, 100);
+        out_stream->time_base = (AVRational){1, (int)video_timescale};  // the source clock, the muxer may scale it up
         out_stream->codec->codec_id   = AV_CODEC_ID_H264;
         out_stream->codec->profile    = profile_idc;
         out_stream->codec->level      = level_idc;
@@ -430,8 +588,13 @@ private:
          */
         {
             AVDictionary *movflags = nullptr;
-            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof", 0);
+#ifdef FMP4_CMAF_MODE
+            // chunks are cut by CutChunk()
+            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_custom+negative_cts_offsets", 0);
+#else
+            av_dict_set(&movflags, "movflags", "empty_moov+default_base_moof+frag_keyframe+negative_cts_offsets", 0);
             av_dict_set_int(&movflags, "frag_duration", 200 * 1000, 0);
+#endif
             if (avformat_write_header(format_context, &movflags) < 0) {
                 printf("Error occurred when opening output file\n");
                 return false;
@@ -439,6 +602,10 @@ private:
             av_dict_free(&movflags);
         }
 
+        // durations from the source clock to the time base the muxer chose, remainder carried over
+        const AVRational time_base = format_context->streams[video_stream_id]->time_base;
+        video_rescaler.SetTimeBases(fmp4::TimeBase(video_timescale), fmp4::Rational{time_base.num, time_base.den});
+
         return true;
     }
 
@@ -470,13 +637,24 @@ private:
     }
 
     const std::string file_path;
-    unsigned long long int file_duration;
+    unsigned long long int file_duration;      // in the stream time base
+    fmp4::DurationRescaler video_rescaler;
     AVFormatContext *format_context;
     unsigned int video_stream_id;
     unsigned int avio_buffer_size;
     FILE *fptr;
     GstH264NalParser *h264_parser;
     bool is_open_new_file;
+    unsigned int video_timescale;
+
+    const std::string segment_directory;
+    fmp4::Segmenter segmenter;
+    FILE *segment_fptr;
+    std::unique_ptr<fmp4::ManifestWriter> manifest;
+#ifdef FMP4_CMAF_MODE
+    fmp4::ChunkScheduler chunk_scheduler;
+    fmp4::SegmentRing live_segments;    // init segment and the last segments, for sinks
+#endif
 };
 
 int main(int argc, char **argv)
@@ -486,24 +664,45 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    mkdir("frag", 0755);
+
+#ifdef FMP4_HTTP_PORT
+    fmp4::HttpServer server;
+    if (!server.Start("127.0.0.1", FMP4_HTTP_PORT, "frag")) {
+        printf("Fail to start the HTTP server on port %d\n", FMP4_HTTP_PORT);
+        return 1;
+    }
+#endif
+
     bool is_open_new_file = true;
     int i = 1;
     do {
-        std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1], is_open_new_file);
         std::shared_ptr<MP4Reader> input = std::make_shared<MP4Reader>(argv[i]);
+        std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1], is_open_new_file, input->GetVideoTimescale(),
+                                                                        "frag/" + std::to_string(i));
         printf("#%d: %s\n", i, argv[i]);
+#ifdef FMP4_HTTP_PORT
+        output->SetServer(&server, "/" + std::to_string(i));
+        printf("http://127.0.0.1:%u/%d/index.m3u8\n", server.Port(), i);
+#endif
 
         unsigned char *sample = nullptr;
         unsigned int sample_size = 0;
         unsigned long long int duration = 0;
+        long long int composition_offset = 0;
         bool is_key_frame = false;
-        while (input->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
-            output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration);
+        while (input->GetNextH264VideoSample(&sample, sample_size, duration, composition_offset, is_key_frame) == MP4Reader::MP4_READ_OK) {
+            output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
         }
 
         i++;
         is_open_new_file = false;
     } while (i < argc - 1);
 
+#ifdef FMP4_HTTP_PORT
+    printf("Press Enter to stop the HTTP server\n");
+    getchar();
+#endif
+
     return 0;
 }
\ No newline at end of file
@@ -12,6 +12,9 @@ extern "C" {
 #define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
 #include <gst/codecparsers/gsth264parser.h>
 
+#include "logger.h"
+#include "metrics.h"
+
 #define BUFFER_SIZE (1024 * 1024)
 
 static const std::string av_make_error_string(int errnum)
@@ -124,6 +127,7 @@ public:
             , h264_parser(gst_h264_nal_parser_new())
             , buffer(BUFFER_SIZE)
             , is_opened(false)
+            , packets(0)
     {
         av_register_all();
     }
@@ -201,8 +205,8 @@ public:
     {
         fMP4Demuxer *demuxer = reinterpret_cast<fMP4Demuxer*>(opaque);
 
-        printf("Read: ->\n");
-        printf("buffer: %p, buffer_size: %d, data_buffer_size: %d\n", (void *)buffer, buffer_size, demuxer->buffer.size());
+        FMP4_LOGD("Read: ->\n");
+        FMP4_LOGD("buffer: %p, buffer_size: %d, data_buffer_size: %d\n", (void *)buffer, buffer_size, demuxer->buffer.size());
 
         int read_size = std::min((unsigned int)buffer_size, demuxer->buffer.size());
 
@@ -212,13 +216,15 @@ public:
 //        bd->ptr  += buf_size;
 //        bd->size -= buf_size;
 
-        printf("Read: <- read_size: %d(0x%x)\n", read_size, read_size);
+        FMP4_LOGD("Read: <- read_size: %d(0x%x)\n", read_size, read_size);
         return read_size;
     }
 
     bool FeedSample(unsigned char *sample, unsigned int sample_size)
     {
-        printf("FeedSample -> sample_size: %d\n", sample_size);
+        FMP4_METRICS_SCOPE(STAGE_FEED, STREAM_VIDEO);
+        FMP4_METRICS_ADD(COUNTER_FRAGMENTS, STREAM_MUX, 1);
+        FMP4_LOGD("FeedSample -> sample_size: %d\n", sample_size);
         buffer.write((char *)sample, sample_size);
 
         int ret = 0;
@@ -242,9 +248,9 @@ public:
         }
 
         if (is_opened) {
-            printf("AVIO eof: %d, error: %d\n", format_context->pb->eof_reached, format_context->pb->error);
-            printf("buffer: %p, buffer_size: 0x%x\n", (void *)format_context->pb->buffer, format_context->pb->buffer_size);
-            printf("buf_ptr: %p, buf_end: %p\n", (void *)format_context->pb->buf_ptr, (void *)format_context->pb->buf_end);
+            FMP4_LOGD("AVIO eof: %d, error: %d\n", format_context->pb->eof_reached, format_context->pb->error);
+            FMP4_LOGD("buffer: %p, buffer_size: 0x%x\n", (void *)format_context->pb->buffer, format_context->pb->buffer_size);
+            FMP4_LOGD("buf_ptr: %p, buf_end: %p\n", (void *)format_context->pb->buf_ptr, (void *)format_context->pb->buf_end);
             if (format_context->pb->eof_reached) {
                 format_context->pb->eof_reached = 0;
                 format_context->pb->error = 0;
@@ -254,22 +260,26 @@ public:
             while(true) {
                 AVPacket packet = {0};
                 av_init_packet(&packet);
-                printf("av_read_frame ->\n");
+                FMP4_LOGD("av_read_frame ->\n");
                 if ((ret = av_read_frame(format_context, &packet)) < 0) {
-                    printf("avio_feof: %d, eof_reached: %d\n", avio_feof(format_context->pb), format_context->pb->eof_reached);
-                    printf("av_read_frame <- Fail, ret: %s\n", av_err2str(ret));
+                    FMP4_LOGD("avio_feof: %d, eof_reached: %d\n", avio_feof(format_context->pb), format_context->pb->eof_reached);
+                    FMP4_LOGD("av_read_frame <- Fail, ret: %s\n", av_err2str(ret));
                     break;
                 }
-                printf("av_read_frame <- Success\n");
-                printf("data: %p, size: %d, duration: %d, flags: %d\n", (void *)packet.data, packet.size, packet.duration, packet.flags);
+                FMP4_LOGD("av_read_frame <- Success\n");
+                packets++;
+                FMP4_LOGD("data: %p, size: %d, duration: %d, flags: %d\n", (void *)packet.data, packet.size, packet.duration, packet.flags);
                 av_packet_unref(&packet);
             }
         }
 
-        printf("FeedSample <-\n");
+        FMP4_LOGD("FeedSample <-\n");
         return true;
     }
 
+    // Packets demuxed so far
+    unsigned long long int Packets() const { return packets; }
+
 private:
 
     const std::string output_file_path;
@@ -281,14 +291,20 @@ private:
     AVFormatContext *format_context;
     unsigned int video_stream_id;
     GstH264NalParser *h264_parser;
+    unsigned long long int packets;
 };
 
 int main(int argc, char **argv)
 {
+    // input-dir: a segment directory of sample7 (frag/<input number>), init.mp4 then frag-1.m4s, ...
     if (argc < 3) {
         printf("usage: %s input-dir output-file\n", argv[0]);
         return 1;
     }
+    std::string input_dir = argv[1];
+    if (!input_dir.empty() && input_dir.back() != '/') input_dir += "/";
+
+    FMP4_METRICS_DUMPER();
 
     unsigned int size_read = 0;
     unsigned char buffer[BUFFER_SIZE];
@@ -298,17 +314,29 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    FILE *fptr = nullptr;
-    for (int i = 0; (fptr = fopen((std::string(argv[1]) + std::string("frag-") + std::to_string(i)).c_str(), "rb")) != nullptr; i++) {
-        size_read = fread(buffer, 1, 1024 * 1024, fptr);
-        printf("\nRead frag: %d\n", i);
-        if (!demuxer->FeedSample(buffer, size_read)) {
+    FILE *fptr = fopen((input_dir + "init.mp4").c_str(), "rb");
+    if (!fptr) {
+        printf("No init.mp4 in %s\n", input_dir.c_str());
+        return 1;
+    }
+    int i = 0;
+    do {
+        FMP4_LOGD("Read frag: %d\n", i);
+        bool is_fed = true;
+        while (is_fed && (size_read = fread(buffer, 1, BUFFER_SIZE, fptr)) > 0) {
+            is_fed = demuxer->FeedSample(buffer, size_read);
+        }
+        fclose(fptr);
+        if (!is_fed) {
             printf("Fail to feed sample into demuxer\n");
-            fclose(fptr);
             break;
         }
-        fclose(fptr);
-    }
+    } while ((fptr = fopen((input_dir + "frag-" + std::to_string(++i) + ".m4s").c_str(), "rb")) != nullptr);
 
+    if (!demuxer->Packets()) {
+        printf("Nothing demuxed from %s\n", input_dir.c_str());
+        return 1;
+    }
+    printf("%d segments, %llu packets\n", i, demuxer->Packets());
     return 0;
 }
\ No newline at end of file
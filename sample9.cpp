@@ -1,6 +1,7 @@
 #include <string>
 #include <thread>
 #include <vector>
+#include <memory>
 
 #include <mp4v2/mp4v2.h>
 #include <netinet/in.h>
@@ -10,10 +11,41 @@
 #define GST_USE_UNSTABLE_API /* To avoid H264 parser warning */
 #include <gst/codecparsers/gsth264parser.h>
 
+#include "logger.h"
+#include "h264_parser.h"
+#include "hevc.h"
+#include "metrics.h"
+#include "mp4_index.h"
+#include "param_set_cache.h"
+#include "recording.h"
+#include "segment_index.h"
+
 #define MP4_DEFAULT_VIDEO_TRACK_ID  1
 #define MP4_DEFAULT_TRACK_TIMESCALE 9000
 #define MP4_DEFAULT_MOVIE_TIMESCALE 1000
 
+// HEVC sample entry: hvc1 keeps VPS/SPS/PPS in hvcC only, hev1 also keeps them in the samples.
+//#define FMP4_HEV1_MODE
+
+// Random access index: a tfra entry for every key frame, written in an mfra box when the writer is
+// closed, so a player seeks with a few reads instead of walking every moof.
+#define FMP4_MFRA_MODE
+
+// Segment index for byte range delivery: space is reserved after the moov and filled with a sidx on
+// close, one reference per key frame to key frame segment (up to FMP4_SIDX_MAX_REFERENCES).
+// New files only, appending cannot go back to the reserved space.
+//#define FMP4_SIDX_MODE
+#define FMP4_SIDX_MAX_REFERENCES 4096
+
+// Rotation: output.mp4 becomes output-0001.mp4, output-0002.mp4, ..., a new file (with its own init
+// segment, mfra and sidx) on the first key frame after FMP4_ROTATE_SECONDS of media or
+// FMP4_ROTATE_BYTES, and on a parameter set change. The next file is created and preallocated in the
+// background. 0: no limit.
+//#define FMP4_ROTATE_MODE
+#define FMP4_ROTATE_SECONDS 300
+#define FMP4_ROTATE_BYTES 0
+#define FMP4_ROTATE_PREALLOCATE (256 * 1024 * 1024)
+
 class MP4Reader
 {
 public:
@@ -26,8 +58,7 @@ public:
     };
 
     MP4Reader(const std::string &file_path)
-            : time_scale(9 * MP4_MSECS_TIME_SCALE)
-            , file_path(file_path)
+            : file_path(file_path)
             , handle(MP4_INVALID_FILE_HANDLE)
             , video_track_id(MP4_INVALID_TRACK_ID)
             , next_video_sample_idx(1)
@@ -40,6 +71,7 @@ public:
             , pSeqHeaderSize(nullptr)
             , pPictHeaders(nullptr)
             , pPictHeaderSize(nullptr)
+            , is_hevc(false)
     {
         handle = MP4Read(this->file_path.c_str());
 
@@ -70,6 +102,8 @@ public:
                            pPictHeaders[i][0], pPictHeaders[i][1], pPictHeaders[i][2],
                            pPictHeaders[i][3], pPictHeaders[i][4]);
                 }
+            } else {
+                LoadHevcParameterSets();
             }
         }
     }
@@ -84,6 +118,12 @@ public:
         if (video_sample) delete[] video_sample;
     }
 
+    // hvc1/hev1 track: samples are H.265 and GetNextH264VideoSample() puts VPS/SPS/PPS in front of key frames
+    bool IsHevc() const
+    {
+        return is_hevc;
+    }
+
     unsigned int GetVideoWidth() const
     {
         return MP4GetTrackVideoWidth(handle, video_track_id);
@@ -104,11 +144,21 @@ public:
         return MP4GetTrackBitRate(handle, video_track_id);
     }
 
+    unsigned int GetVideoTimescale() const
+    {
+        return video_timescale;
+    }
+
+    // duration and composition_offset (pts - dts, ctts) are in GetVideoTimescale() ticks; the
+    // composition offset is non-zero for streams with B-frames.
     MP4ReadStatus GetNextH264VideoSample(unsigned char **sample,
                                          unsigned int &sample_size,
                                          unsigned long long int &duration,
+                                         long long int &composition_offset,
                                          bool &is_key_frame)
     {
+        FMP4_METRICS_SCOPE(STAGE_READ_SAMPLE, STREAM_VIDEO);
+
         if (next_video_sample_idx > video_sample_number) {
             return MP4_READ_EOS;
         }
@@ -134,21 +184,32 @@ public:
                     video_sample_offset += pPictHeaderSize[i];
                 }
             }
+            for (auto &nal : hevc_parameter_sets) {
+                (*(unsigned int *)(video_sample + video_sample_offset)) = htonl(1);
+                video_sample_offset += 4;
+                memcpy(video_sample + video_sample_offset, nal.data(), nal.size());
+                video_sample_offset += (unsigned int)nal.size();
+            }
         }
 
         MP4Duration mp4_duration = 0;
+        MP4Duration mp4_rendering_offset = 0;
         unsigned char *video_sample_start_addr = video_sample + video_sample_offset;
         sample_size = video_sample_max_size - video_sample_offset;
         if (!MP4ReadSample(handle, video_track_id, next_video_sample_idx,
                            &video_sample_start_addr, &sample_size,
                            NULL,
                            &mp4_duration,
-                           NULL,
+                           &mp4_rendering_offset,
                            &is_key_frame)) {
-            printf("Fail to read video sample (%d)\n", next_video_sample_idx);
+            FMP4_LOGE("Fail to read video sample (%d)\n", next_video_sample_idx);
             return MP4_READ_ERR;
         }
 
+        // A few files have zero durations (typically the last sample): use the average of the track
+        if (!mp4_duration && video_sample_number)
+            mp4_duration = video_duration / video_sample_number;
+
         // Convert AVC1 format to AnnexB
         unsigned char *tmp_addr = video_sample_start_addr;
         while((tmp_addr - video_sample_start_addr) < sample_size)
@@ -161,14 +222,35 @@ public:
 
         *sample = video_sample;
         sample_size += video_sample_offset;
-        duration = (1000 * mp4_duration) / video_timescale;
+        duration = mp4_duration;
+        composition_offset = (int32_t)mp4_rendering_offset;    // ctts v1 offsets are signed
         next_video_sample_idx++;
         return MP4_READ_OK;
     }
 
 private:
 
-    const unsigned int time_scale;
+    // mp4v2 does not know hvcC, so the parameter sets are taken from the sample entry with mp4_index.
+    void LoadHevcParameterSets()
+    {
+        fmp4::MP4Index index;
+        if (!index.Open(file_path)) return;
+
+        const fmp4::Track *track = index.FindTrackById(video_track_id);
+        if (!track || (track->sample_entry_type != FMP4_FOURCC('h', 'v', 'c', '1') &&
+                       track->sample_entry_type != FMP4_FOURCC('h', 'e', 'v', '1'))) return;
+
+        const uint8_t *hvcc = nullptr;
+        uint64_t hvcc_size = 0;
+        if (!track->FindSampleEntryChild(FMP4_FOURCC('h', 'v', 'c', 'C'), hvcc, hvcc_size) ||
+            !fmp4::hevc::ParseHvcC(hvcc, (size_t)hvcc_size, hevc_parameter_sets)) {
+            printf("Fail to read hvcC\n");
+            return;
+        }
+
+        is_hevc = true;
+        printf("Get VPS/SPS/PPS(%d) from hvcC\n", (int)hevc_parameter_sets.size());
+    }
 
     std::string file_path;
     MP4FileHandle handle;
@@ -184,6 +266,9 @@ private:
     unsigned int *pSeqHeaderSize;
     unsigned char **pPictHeaders;
     unsigned int *pPictHeaderSize;
+
+    bool is_hevc;
+    std::vector<std::vector<uint8_t> > hevc_parameter_sets;
 };
 
 class FileOutputStream : public AP4_ByteStream
@@ -191,10 +276,26 @@ class FileOutputStream : public AP4_ByteStream
 public:
     FileOutputStream(const std::string &file_path, bool is_open_new_file)
         : fptr(nullptr)
+        , rotator(nullptr)
         , reference_count(1)
         , position(0)
     {
         fptr = fopen(file_path.c_str(), is_open_new_file ? "wb" : "ab");
+
+        // Appended data starts at the end of the file: Tell() gives file offsets (tfra needs them)
+        if (fptr && !is_open_new_file && fseek(fptr, 0, SEEK_END) == 0) {
+            const long size = ftell(fptr);
+            if (size > 0) position = (unsigned long long int)size;
+        }
+    }
+
+    // A new file of a rotated recording, closed through the rotator
+    FileOutputStream(FILE *fptr, fmp4::RecordingRotator *rotator)
+        : fptr(fptr)
+        , rotator(rotator)
+        , reference_count(1)
+        , position(0)
+    {
     }
 
     // AP4_ByteStream methods
@@ -206,13 +307,15 @@ public:
         static int i = 0;
         if (buf_size >=4) {
             if (isprint(buf[0]) && isprint(buf[1]) && isprint(buf[2]) && isprint(buf[3])) {
-//                printf("#%d Write: buf: %p(%c%c%c%c), size: %d\n", i++,
-//                       buffer, buf[0], buf[1], buf[2], buf[3], buf_size);
+                FMP4_LOGT("#%d Write: buf: %p(%c%c%c%c), size: %d\n", i++,
+                          buffer, buf[0], buf[1], buf[2], buf[3], buf_size);
             }
         }
 
         bytes_written = buf_size;
         position += bytes_written;
+        FMP4_METRICS_ADD(COUNTER_OUTPUT_BYTES, STREAM_MUX, buf_size);
+        if (rotator) rotator->AddBytes(buf_size);
 
         /*if (buf[4] == 'm' && buf[5] == 'f' && buf[6] == 'r' && buf[7] == 'a') {
             return AP4_SUCCESS;
@@ -230,7 +333,13 @@ public:
     }
 
     AP4_Result ReadPartial(void* buffer, AP4_Size  bytes_to_read, AP4_Size& bytes_read) { printf("ReadPartial\n"); return AP4_ERROR_NOT_SUPPORTED; }
-    AP4_Result Seek(AP4_Position position)  { printf("Seek\n"); return AP4_ERROR_NOT_SUPPORTED; }
+    AP4_Result Seek(AP4_Position position)
+    {
+        if (!fptr || fseeko(fptr, (off_t)position, SEEK_SET) != 0) return AP4_FAILURE;
+        this->position = position;
+        return AP4_SUCCESS;
+    }
+
     AP4_Result GetSize(AP4_LargeSize& size) { printf("GetSize\n"); return AP4_ERROR_NOT_SUPPORTED; }
 
     // AP4_Referenceable methods
@@ -239,11 +348,16 @@ public:
 
 protected:
 
-    ~FileOutputStream() { if (fptr) fclose(fptr); }
+    ~FileOutputStream()
+    {
+        if (rotator) rotator->CloseFile(fptr);
+        else if (fptr) fclose(fptr);
+    }
 
 private:
 
     FILE *fptr;
+    fmp4::RecordingRotator *rotator;
     unsigned int reference_count;
     unsigned long long int position;
 };
@@ -252,20 +366,37 @@ class MP4Writer : public AP4_FeedSegmentBuilder
 {
 public:
 
-    MP4Writer(const std::string &file_path, bool is_open_new_file)
+    // video_timescale: clock of the durations and composition offsets given to WriteH26xVideoSample(),
+    // used as the track timescale so they are written unchanged
+    MP4Writer(const std::string &file_path, bool is_open_new_file, unsigned int video_timescale)
         : AP4_FeedSegmentBuilder(AP4_Track::TYPE_VIDEO, MP4_DEFAULT_VIDEO_TRACK_ID)
+        , file_output_stream(nullptr)
         , file_path(file_path)
         , is_open_new_file(is_open_new_file)
         , sequence_number(0)
         , h264_parser(gst_h264_nal_parser_new())
+        , init_generation(0)
+        , composition_delay(0)
+        , has_composition_delay(false)
+        , tfra(new AP4_TfraAtom(MP4_DEFAULT_VIDEO_TRACK_ID))
+        , sidx_offset(0)
     {
-        m_Timescale = MP4_DEFAULT_TRACK_TIMESCALE;
+        m_Timescale = video_timescale ? video_timescale : MP4_DEFAULT_TRACK_TIMESCALE;
+        tfra->SetVersion(1);    // 64 bit time and moof offset, recordings outgrow 4 GB
+
+#ifdef FMP4_ROTATE_MODE
+        fmp4::RotationOptions options;
+        options.max_duration_ms = FMP4_ROTATE_SECONDS * 1000ULL;
+        options.max_size = FMP4_ROTATE_BYTES;
+        options.preallocate = FMP4_ROTATE_PREALLOCATE;
+        rotator.reset(new fmp4::RecordingRotator(file_path, options));
+#endif
     }
 
     ~MP4Writer()
     {
-        if (file_output_stream)
-            file_output_stream->Release();
+        CloseOutputStream();
+        delete tfra;
 
         if (h264_parser)
             gst_h264_nal_parser_free(h264_parser);
@@ -274,25 +405,32 @@ public:
     bool WriteH264VideoSample(unsigned char *sample,
                               unsigned int sample_size,
                               bool is_key_frame,
-                              unsigned long long int duration)
+                              unsigned long long int duration,
+                              long long int composition_offset)
     {
-        printf("WriteH264VideoSample -> (%c)\n", is_key_frame ? 'I' : 'P');
+        FMP4_LOGD("WriteH264VideoSample -> (%c)\n", is_key_frame ? 'I' : 'P');
 
         // Parse the sample into NALUs
         std::vector<GstH264NalUnit> nalus = ParseH264NALU(sample, sample_size);
 
-        // Write init segment
-        if (!file_output_stream) {
-            if (is_key_frame) {
-                for (auto nalu : nalus) {
-                    if (nalu.type == GST_H264_NAL_SPS) nal_sps = nalu;
-                    else if (nalu.type == GST_H264_NAL_PPS) nal_pps = nalu;
-                }
-                file_output_stream = new FileOutputStream(file_path, is_open_new_file);
+        // Write init segment. A key frame whose parameter sets differ from the ones in the current
+        // init segment gets a new init segment, followed by the fragments that depend on it.
+        // In rotation mode the new init segment starts a new file.
+        if (is_key_frame && (!file_output_stream || parameter_sets.Generation() != init_generation || IsRotationDue())) {
+            for (auto nalu : nalus) {
+                if (nalu.type == GST_H264_NAL_SPS) nal_sps = nalu;
+            }
 
-                if (file_output_stream) {
-                    WriteInitSegment(nal_sps, nal_pps, *file_output_stream);
-                }
+            if (rotator) CloseOutputStream();
+            if (!file_output_stream) {
+                OpenOutputStream();
+            } else {
+                FMP4_LOGI("Parameter sets changed, writing a new init segment\n");
+            }
+
+            if (file_output_stream) {
+                WriteInitSegment(nal_sps, parameter_sets.BuildAvcC(), *file_output_stream);
+                init_generation = parameter_sets.Generation();
             }
         }
 
@@ -312,23 +450,164 @@ public:
         static int c = 0;
         unsigned char *data = first_vcl_nalu.data + first_vcl_nalu.offset;
         unsigned int data_size = (unsigned int)((sample + sample_size) - data);
-        printf("%d Feed: %d bytes\n", c++, data_size);
-        if (!Feed(data, data_size, is_key_frame, duration)) {
-            printf("ERROR: Feed() failed\n");
+        FMP4_LOGD("%d Feed: %d bytes\n", c++, data_size);
+        if (!Feed(data, data_size, is_key_frame, duration, composition_offset)) {
+            FMP4_LOGE("Feed() failed\n");
             return false;
         }
         if (file_output_stream) {
             WriteMediaSegment(*file_output_stream, ++sequence_number);
         }
+        if (rotator) rotator->AddDuration(duration, m_Timescale);
 
-        printf("WriteH264VideoSample <- \n\n");
+        FMP4_LOGD("WriteH264VideoSample <- \n\n");
+        return true;
+    }
+
+    bool WriteH265VideoSample(unsigned char *sample,
+                              unsigned int sample_size,
+                              bool is_key_frame,
+                              unsigned long long int duration,
+                              long long int composition_offset)
+    {
+        FMP4_LOGD("WriteH265VideoSample -> (%c)\n", is_key_frame ? 'I' : 'P');
+
+        std::vector<fmp4::hevc::NalUnit> nalus;
+        {
+            FMP4_METRICS_SCOPE(STAGE_PARSE_NALU, STREAM_VIDEO);
+            nalus = fmp4::hevc::SplitAnnexB(sample, sample_size);
+        }
+
+        bool is_irap = false;
+        for (auto &nalu : nalus) {
+            if (fmp4::hevc::IsParameterSet(nalu.type)) hevc_parameter_sets.Update(nalu.data, nalu.size);
+            else if (fmp4::hevc::IsIrap(nalu.type)) is_irap = true;
+        }
+        is_key_frame = is_key_frame || is_irap;
+
+        // Write init segment, again when the parameter sets changed (not needed in hev1 mode where
+        // they are also in-band)
+#ifdef FMP4_HEV1_MODE
+        if (is_key_frame && (!file_output_stream || IsRotationDue())) {
+#else
+        if (is_key_frame && (!file_output_stream || hevc_parameter_sets.Generation() != init_generation || IsRotationDue())) {
+#endif
+            if (rotator) CloseOutputStream();
+            if (!file_output_stream) {
+                OpenOutputStream();
+            } else {
+                FMP4_LOGI("Parameter sets changed, writing a new init segment\n");
+            }
+
+#ifdef FMP4_HEV1_MODE
+            if (file_output_stream && WriteInitSegment(hevc_parameter_sets.BuildHvcC(false), *file_output_stream)) {
+#else
+            if (file_output_stream && WriteInitSegment(hevc_parameter_sets.BuildHvcC(true), *file_output_stream)) {
+#endif
+                init_generation = hevc_parameter_sets.Generation();
+            }
+        }
+
+        // The whole access unit is one sample: every NAL unit gets a length prefix, AUDs are dropped
+        // and parameter sets only stay in hev1 mode.
+        hevc_sample.clear();
+        for (auto &nalu : nalus) {
+            if (nalu.type == fmp4::hevc::NAL_AUD) continue;
+#ifndef FMP4_HEV1_MODE
+            if (fmp4::hevc::IsParameterSet(nalu.type)) continue;
+#endif
+            const uint32_t size = htonl((uint32_t)nalu.size);
+            hevc_sample.insert(hevc_sample.end(), (const uint8_t *)&size, (const uint8_t *)&size + 4);
+            hevc_sample.insert(hevc_sample.end(), nalu.data, nalu.data + nalu.size);
+        }
+        if (hevc_sample.empty()) return true;
+
+        if (!Feed(hevc_sample.data(), (unsigned int)hevc_sample.size(), is_key_frame, duration, composition_offset, true)) {
+            FMP4_LOGE("Feed() failed\n");
+            return false;
+        }
+        if (file_output_stream) {
+            WriteMediaSegment(*file_output_stream, ++sequence_number);
+        }
+        if (rotator) rotator->AddDuration(duration, m_Timescale);
+
+        FMP4_LOGD("WriteH265VideoSample <- \n\n");
         return true;
     }
 
 private:
 
+    // The current file is full: the next key frame starts a new one
+    bool IsRotationDue() const
+    {
+        return rotator && rotator->IsDue();
+    }
+
+    // The output file, or in rotation mode the next file of the recording with its own sequence
+    // numbers, mfra and sidx
+    void OpenOutputStream()
+    {
+        if (rotator) {
+            FILE *file = rotator->OpenNext();
+            if (!file) return;
+            FMP4_LOGI("Recording to %s\n", rotator->CurrentPath().c_str());
+            file_output_stream = new FileOutputStream(file, rotator.get());
+
+            sequence_number = 0;
+            if (!tfra) {
+                tfra = new AP4_TfraAtom(MP4_DEFAULT_VIDEO_TRACK_ID);
+                tfra->SetVersion(1);
+            }
+            segment_index = fmp4::SegmentIndex();
+            sidx_offset = 0;
+            return;
+        }
+
+        // What a crash left of the last fragment has to go before anything is appended
+        uint64_t removed = 0;
+        if (!is_open_new_file && !fmp4::RecoverRecording(file_path, removed)) {
+            FMP4_LOGE("Fail to recover %s\n", file_path.c_str());
+        } else if (removed) {
+            FMP4_LOGI("%s: removed %llu bytes of an incomplete fragment\n", file_path.c_str(), (unsigned long long)removed);
+        }
+        file_output_stream = new FileOutputStream(file_path, is_open_new_file);
+    }
+
+    // Finish the output file: mfra and sidx, then close it
+    void CloseOutputStream()
+    {
+        if (!file_output_stream) return;
+#ifdef FMP4_SIDX_MODE
+        AP4_Position end = 0;
+        file_output_stream->Tell(end);
+        segment_index.Finish(end);
+#endif
+#ifdef FMP4_MFRA_MODE
+        WriteMfraAtom(*file_output_stream);
+#endif
+#ifdef FMP4_SIDX_MODE
+        WriteSidxAtom(*file_output_stream);
+#endif
+        file_output_stream->Release();
+        file_output_stream = nullptr;
+    }
+
+    // The NAL type found by gst_h264_parser_identify_nalu() is all the writer needs for slices and SEI.
+    // Only new or changed SPS/PPS get a full parse; the unchanged repeats in front of every key
+    // frame are skipped.
+    void ParseNal(GstH264NalUnit &nalu)
+    {
+        if (nalu.type != GST_H264_NAL_SPS && nalu.type != GST_H264_NAL_PPS)
+            return;
+        if (parameter_sets.Update(nalu.data + nalu.offset, nalu.size) == fmp4::ParameterSetCache::PARAMETER_SET_UNCHANGED)
+            return;
+        gst_h264_parser_parse_nal(h264_parser, &nalu);
+    }
+
     std::vector<GstH264NalUnit> ParseH264NALU(unsigned char *data, unsigned int length)
     {
+        FMP4_METRICS_SCOPE(STAGE_PARSE_NALU, STREAM_VIDEO);
+
         std::vector<GstH264NalUnit> nalus;
 
         GstH264NalUnit nalu = {0};
@@ -337,7 +616,7 @@ private:
         while ((result = gst_h264_parser_identify_nalu(h264_parser, data, offset, length, &nalu)) == GST_H264_PARSER_OK)
         {
             // Update the offset
-            gst_h264_parser_parse_nal(h264_parser, &nalu);
+            ParseNal(nalu);
             offset = nalu.size + nalu.offset;
 
             nalus.push_back(nalu);
@@ -346,7 +625,7 @@ private:
         // Handle the last NALU because there is no other start_code followed it.
         if (gst_h264_parser_identify_nalu_unchecked(h264_parser, data, offset, length, &nalu) == GST_H264_PARSER_OK) {
 
-            gst_h264_parser_parse_nal(h264_parser, &nalu);
+            ParseNal(nalu);
 
             nalus.push_back(nalu);
         }
@@ -396,9 +675,10 @@ private:
         AP4_UI32                       mdat_size = AP4_ATOM_HEADER_SIZE;
         trun_entries.SetItemCount(m_Samples.ItemCount());
         for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
-            // if we have one non-zero CTS delta, we'll need to express it
+            // if we have one non-zero CTS delta, we'll need to express it (signed, version 1 trun)
             if (m_Samples[i].GetCtsDelta()) {
                 trun->SetFlags(trun->GetFlags() | AP4_TRUN_FLAG_SAMPLE_COMPOSITION_TIME_OFFSET_PRESENT);
+                trun->SetVersion(1);
             }
 
             // add one sample
@@ -415,10 +695,42 @@ private:
         trun->SetEntries(trun_entries);
         trun->SetDataOffset((AP4_UI32)moof->GetSize()+AP4_ATOM_HEADER_SIZE);
 
+        AP4_Position moof_offset = 0;
+        stream.Tell(moof_offset);
+
+#ifdef FMP4_MFRA_MODE
+        // index the key frames of this fragment: presentation time and the offset of its moof
+        {
+            AP4_UI64 dts = m_MediaTimeOrigin + m_MediaStartTime;
+            for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
+                if (m_Samples[i].IsSync()) {
+                    tfra->AddEntry(dts + (AP4_SI32)m_Samples[i].GetCtsDelta(), moof_offset, 1, 1, i + 1);
+                }
+                dts += m_Samples[i].GetDuration();
+            }
+        }
+#endif
+
+#ifdef FMP4_SIDX_MODE
+        {
+            segment_index.AddFragment(moof_offset, m_Samples.ItemCount() && m_Samples[0].IsSync());
+            AP4_UI64 dts = m_MediaTimeOrigin + m_MediaStartTime;
+            for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
+                segment_index.AddSample((AP4_SI64)dts + (AP4_SI32)m_Samples[i].GetCtsDelta(), m_Samples[i].GetDuration());
+                dts += m_Samples[i].GetDuration();
+            }
+        }
+#endif
+
         // write moof
-        moof->Write(stream);
+        {
+            FMP4_METRICS_SCOPE(STAGE_WRITE_MOOF, STREAM_MUX);
+            moof->Write(stream);
+        }
+        FMP4_METRICS_ADD(COUNTER_FRAGMENTS, STREAM_MUX, 1);
 
         // write mdat
+        FMP4_METRICS_SCOPE(STAGE_WRITE_MDAT, STREAM_MUX);
         stream.WriteUI32(mdat_size);
         stream.WriteUI32(AP4_ATOM_TYPE_MDAT);
         for (unsigned int i=0; i<m_Samples.ItemCount(); i++) {
@@ -450,25 +762,97 @@ private:
         return AP4_SUCCESS;
     }
 
-    // We use our own WriteInitSegment() and Feed() because we need more parameters than the original ones.
-    bool WriteInitSegment(GstH264NalUnit &nal_sps, GstH264NalUnit &nal_pps, AP4_ByteStream &stream)
+    // mfra at the end of the file: the tfra of the video track, then mfro with the size of the whole
+    // mfra so a reader finds it from the last 16 bytes
+    void WriteMfraAtom(AP4_ByteStream &stream)
     {
-        // Parse SPS to get necessary params.
-        GstH264SPS sps = {0};
-        unsigned int video_width  = 0, video_height = 0;
-        {
-            gst_h264_parser_parse_sps(h264_parser, &nal_sps, &sps, false);
-            video_width  = (unsigned int)(sps.frame_cropping_flag ? sps.crop_rect_width : sps.width);
-            video_height = (unsigned int)(sps.frame_cropping_flag ? sps.crop_rect_height : sps.height);
+        AP4_ContainerAtom mfra(AP4_ATOM_TYPE_MFRA);
+        mfra.AddChild(tfra);
+        tfra = nullptr;     // owned by mfra now
+        mfra.AddChild(new AP4_MfroAtom((AP4_UI32)mfra.GetSize() + AP4_FULL_ATOM_HEADER_SIZE + 4));
+        mfra.Write(stream);
+    }
+
+    // After the first moov: a free box big enough for the sidx. A later init segment (new parameter
+    // sets) would end up inside a segment, so there is no sidx then.
+    void ReserveSidxSpace(AP4_ByteStream &stream)
+    {
+        if (sequence_number) {
+            segment_index.Invalidate();
+            return;
         }
+        if (!is_open_new_file && !rotator) return;
+
+        stream.Tell(sidx_offset);
+        const AP4_UI32 size = (AP4_UI32)fmp4::SegmentIndex::SidxSize(FMP4_SIDX_MAX_REFERENCES) + AP4_ATOM_HEADER_SIZE;
+        std::vector<uint8_t> zeros(size - AP4_ATOM_HEADER_SIZE);
+        stream.WriteUI32(size);
+        stream.WriteUI32(AP4_ATOM_TYPE_FREE);
+        stream.Write(zeros.data(), (AP4_Size)zeros.size());
+    }
 
-        AP4_Result result;
+    AP4_SidxAtom *BuildSidxAtom(AP4_UI64 first_offset)
+    {
+        const std::vector<fmp4::SegmentReference> &references = segment_index.References();
+        const AP4_SI64 earliest = references[0].earliest_presentation_time;
+        AP4_SidxAtom *sidx = new AP4_SidxAtom(m_TrackId, m_Timescale, earliest > 0 ? earliest : 0, first_offset);
+        sidx->SetReferenceCount(references.size());
+        for (unsigned int i=0; i<references.size(); i++) {
+            AP4_SidxAtom::Reference &reference = sidx->UseReferences()[i];
+            reference.m_ReferenceType      = 0;    // media
+            reference.m_ReferencedSize     = (AP4_UI32)references[i].size;
+            reference.m_SubsegmentDuration = (AP4_UI32)references[i].duration;
+            reference.m_StartsWithSap      = references[i].starts_with_sap;
+            reference.m_SapType            = references[i].starts_with_sap ? 1 : 0;
+            reference.m_SapDeltaTime       = 0;
+        }
+        return sidx;
+    }
 
-        // collect the SPS and PPS into arrays
-        AP4_Array<AP4_DataBuffer> sps_array;
-        sps_array.Append(AP4_DataBuffer(nal_sps.data + nal_sps.offset, nal_sps.size));
-        AP4_Array<AP4_DataBuffer> pps_array;
-        pps_array.Append(AP4_DataBuffer(nal_pps.data + nal_pps.offset, nal_pps.size));
+    // Fill the reserved space: the sidx, then a free box with what is left up to the first fragment
+    void WriteSidxAtom(AP4_ByteStream &stream)
+    {
+        if (!sidx_offset) return;
+        const std::vector<fmp4::SegmentReference> &references = segment_index.References();
+        if (!segment_index.IsValid() || references.empty() || references.size() > FMP4_SIDX_MAX_REFERENCES) {
+            FMP4_LOGI("No sidx: %u segments\n", (unsigned int)references.size());
+            return;
+        }
+
+        AP4_UI64 sidx_size;
+        {
+            std::unique_ptr<AP4_SidxAtom> sidx(BuildSidxAtom(0));
+            sidx_size = sidx->GetSize();
+        }
+        const AP4_UI64 first_offset = references[0].offset - (sidx_offset + sidx_size);
+        std::unique_ptr<AP4_SidxAtom> sidx(BuildSidxAtom(first_offset));
+
+        AP4_Position end = 0;
+        stream.Tell(end);
+        if (AP4_FAILED(stream.Seek(sidx_offset))) return;
+        sidx->Write(stream);
+        stream.WriteUI32((AP4_UI32)first_offset);
+        stream.WriteUI32(AP4_ATOM_TYPE_FREE);
+        stream.Seek(end);
+    }
+
+    // We use our own WriteInitSegment() and Feed() because we need more parameters than the original ones.
+    bool WriteInitSegment(GstH264NalUnit &nal_sps, const std::vector<uint8_t> &avcc, AP4_ByteStream &stream)
+    {
+        // Parse SPS to get necessary params (no VUI needed).
+        fmp4::h264::SpsInfo sps;
+        fmp4::h264::ParseSps(nal_sps.data + nal_sps.offset, nal_sps.size, sps);
+        unsigned int video_width  = sps.width;
+        unsigned int video_height = sps.height;
+
+        // parse the avcC record (all SPS/PPS, High profile fields) into an atom
+        AP4_MemoryByteStream* avcc_stream = new AP4_MemoryByteStream(avcc.data(), (AP4_Size)avcc.size());
+        AP4_AvccAtom* avcc_atom = AP4_AvccAtom::Create(AP4_ATOM_HEADER_SIZE + (AP4_Size)avcc.size(), *avcc_stream);
+        avcc_stream->Release();
+        if (!avcc_atom) {
+            FMP4_LOGE("Invalid avcC record\n");
+            return false;
+        }
 
         // setup the video the sample descripton
         AP4_AvcSampleDescription* sample_description =
@@ -477,12 +861,52 @@ private:
                                              (AP4_UI16)video_height,
                                              24,
                                              "",
-                                             sps.profile_idc,
-                                             sps.level_idc,
-                                             0,
-                                             4,
-                                             sps_array,
-                                             pps_array);
+                                             avcc_atom);
+        delete avcc_atom;
+
+        return WriteInitSegment(sample_description, video_width, video_height, stream);
+    }
+
+    bool WriteInitSegment(const std::vector<uint8_t> &hvcc, AP4_ByteStream &stream)
+    {
+        fmp4::hevc::SpsInfo sps;
+        if (!hevc_parameter_sets.GetSpsInfo(sps)) {
+            FMP4_LOGE("No valid SPS for the hvcC box\n");
+            return false;
+        }
+
+        // parse the hvcC record into an atom
+        AP4_MemoryByteStream* hvcc_stream = new AP4_MemoryByteStream(hvcc.data(), (AP4_Size)hvcc.size());
+        AP4_HvccAtom* hvcc_atom = AP4_HvccAtom::Create(AP4_ATOM_HEADER_SIZE + (AP4_Size)hvcc.size(), *hvcc_stream);
+        hvcc_stream->Release();
+        if (!hvcc_atom) {
+            FMP4_LOGE("Invalid hvcC record\n");
+            return false;
+        }
+
+        // setup the video the sample descripton
+        AP4_HevcSampleDescription* sample_description =
+#ifdef FMP4_HEV1_MODE
+                new AP4_HevcSampleDescription(AP4_SAMPLE_FORMAT_HEV1,
+#else
+                new AP4_HevcSampleDescription(AP4_SAMPLE_FORMAT_HVC1,
+#endif
+                                              (AP4_UI16)sps.width,
+                                              (AP4_UI16)sps.height,
+                                              24,
+                                              "",
+                                              hvcc_atom);
+        delete hvcc_atom;
+
+        return WriteInitSegment(sample_description, sps.width, sps.height, stream);
+    }
+
+    bool WriteInitSegment(AP4_SampleDescription *sample_description,
+                          unsigned int video_width,
+                          unsigned int video_height,
+                          AP4_ByteStream &stream)
+    {
+        AP4_Result result;
 
         // create the output file object
         AP4_Movie* output_movie = new AP4_Movie(MP4_DEFAULT_MOVIE_TIMESCALE);
@@ -538,35 +962,57 @@ private:
             return false;
         }
 
+#ifdef FMP4_SIDX_MODE
+        ReserveSidxSpace(stream);
+#endif
+
         // cleanup
         delete output_movie;
 
         return true;
     }
+    // duration and composition_offset (pts - dts) are in m_Timescale ticks
+    // is_length_prefixed: data is already a sequence of length prefixed NAL units (HEVC access unit)
     bool Feed(const unsigned char *data,
               unsigned int data_size,
               bool is_key_frame,
-              unsigned long long int duration)
+              unsigned long long int duration,
+              long long int composition_offset,
+              bool is_length_prefixed = false)
     {
+        FMP4_METRICS_SCOPE(STAGE_FEED, STREAM_VIDEO);
+        FMP4_METRICS_ADD(COUNTER_SAMPLES, STREAM_VIDEO, 1);
+        FMP4_METRICS_ADD(COUNTER_SAMPLE_BYTES, STREAM_VIDEO, data_size);
+
         // format the sample data
         AP4_MemoryByteStream* sample_data = new AP4_MemoryByteStream(data_size);
         {
-            sample_data->WriteUI32(data_size);
+            if (!is_length_prefixed)
+                sample_data->WriteUI32(data_size);
             sample_data->Write(data, data_size);
+            const unsigned int sample_size = is_length_prefixed ? data_size : data_size + 4;
 
             /*
              * Sometimes we might encounter frames with duration == 0.
              * In this case, hard-code it to 50ms
              */
             if (!duration)
-                duration = 50;
+                duration = m_Timescale / 20;
 
-            // compute the duration in timescale
-            AP4_UI32 timescale_duration = (AP4_UI32)(AP4_ConvertTime(duration, 1000, m_Timescale));
+            // the track runs on the source clock, so there is nothing to convert
+            AP4_UI32 timescale_duration = (AP4_UI32)duration;
             AP4_UI64 timescale_dts      = m_MediaStartTime;
 
+            // The offset of the first sample is taken out of all of them: the first frame is presented
+            // at its decode time (tfdt) without an edit list, and B-frames get negative offsets.
+            if (!has_composition_delay) {
+                composition_delay = composition_offset;
+                has_composition_delay = true;
+            }
+            AP4_SI32 timescale_cts_delta = (AP4_SI32)(composition_offset - composition_delay);
+
             // create a new sample and add it to the list
-            AP4_Sample sample(*sample_data, 0, data_size + 4, timescale_duration, 0, timescale_dts, 0, is_key_frame);
+            AP4_Sample sample(*sample_data, 0, sample_size, timescale_duration, 0, timescale_dts, (AP4_UI32)timescale_cts_delta, is_key_frame);
             AddSample(sample);
         }
         sample_data->Release();
@@ -585,7 +1031,17 @@ private:
 
     GstH264NalParser *h264_parser;
     GstH264NalUnit nal_sps;
-    GstH264NalUnit nal_pps;
+
+    fmp4::ParameterSetCache parameter_sets;
+    fmp4::hevc::ParameterSetCache hevc_parameter_sets;
+    uint32_t init_generation;   // Generation() of the cache the current init segment was built from
+    std::vector<uint8_t> hevc_sample;
+    long long int composition_delay;    // composition offset of the first sample
+    bool has_composition_delay;
+    AP4_TfraAtom *tfra;                 // key frames written so far, see FMP4_MFRA_MODE
+    fmp4::SegmentIndex segment_index;   // see FMP4_SIDX_MODE
+    AP4_Position sidx_offset;           // of the space reserved for the sidx, 0: none
+    std::unique_ptr<fmp4::RecordingRotator> rotator;    // rotation mode
 };
 
 int main(int argc, char **argv)
@@ -595,20 +1051,26 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    FMP4_METRICS_DUMPER();
+
     bool is_open_new_file = true;
     int i = 1;
     do {
-        std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1], is_open_new_file);
         std::shared_ptr<MP4Reader> input = std::make_shared<MP4Reader>(argv[i]);
+        std::shared_ptr<MP4Writer> output = std::make_shared<MP4Writer>(argv[argc - 1], is_open_new_file, input->GetVideoTimescale());
         printf("#%d: %s\n", i, argv[i]);
 
         unsigned char *sample = nullptr;
         unsigned int sample_size = 0, count = 0;
         unsigned long long int duration = 0;
+        long long int composition_offset = 0;
         bool is_key_frame = false;
-        while (input->GetNextH264VideoSample(&sample, sample_size, duration, is_key_frame) == MP4Reader::MP4_READ_OK) {
-            printf("%d video: %dbytes, %lldms\n", count++, sample_size, duration);
-            output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration);
+        while (input->GetNextH264VideoSample(&sample, sample_size, duration, composition_offset, is_key_frame) == MP4Reader::MP4_READ_OK) {
+            FMP4_LOGD("%d video: %dbytes, %llu ticks\n", count++, sample_size, duration);
+            if (input->IsHevc())
+                output->WriteH265VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
+            else
+                output->WriteH264VideoSample(sample, sample_size, is_key_frame, duration, composition_offset);
         }
 
         i++;
@@ -0,0 +1,100 @@
+#ifndef FMP4_SEGMENT_INDEX_H
+#define FMP4_SEGMENT_INDEX_H
+
+/*
+ * Byte range segments of a fragmented MP4 file, for its sidx.
+ *
+ * A segment runs from a fragment that starts with a key frame (a SAP) to the next one, so a client
+ * that fetches one byte range can start decoding at its beginning. Writers call AddFragment() with
+ * the file offset of every moof they write and AddSample() for the samples of the indexed track in
+ * it; Finish() closes the last segment at the end of the fragments. Times are in the timescale of
+ * the indexed track.
+ *
+ * The sidx has to be in front of the fragments it describes, but its size is only known at the end.
+ * Writers reserve SidxSize(max_references) plus a free box header after the moov and fill it in on
+ * close (the free box takes what the sidx does not use).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace fmp4 {
+
+struct SegmentReference
+{
+    uint64_t offset;                        // of the first moof
+    uint64_t size;                          // bytes up to the next segment
+    int64_t  earliest_presentation_time;
+    uint64_t duration;
+    bool     starts_with_sap;
+};
+
+class SegmentIndex
+{
+public:
+
+    SegmentIndex() : is_valid(true), is_open(false) {}
+
+    // A fragment at offset: a new segment when it starts with a key frame (or is the first one)
+    void AddFragment(uint64_t offset, bool starts_with_sap)
+    {
+        if (is_open && !starts_with_sap) return;
+        Close(offset);
+
+        SegmentReference reference = { offset, 0, INT64_MAX, 0, starts_with_sap };
+        references.push_back(reference);
+        is_open = true;
+    }
+
+    void AddSample(int64_t presentation_time, uint64_t duration)
+    {
+        if (!is_open) return;
+        SegmentReference &reference = references.back();
+        if (presentation_time < reference.earliest_presentation_time) reference.earliest_presentation_time = presentation_time;
+        reference.duration += duration;
+    }
+
+    // end_offset: where the last fragment ends
+    void Finish(uint64_t end_offset)
+    {
+        Close(end_offset);
+    }
+
+    // Something other than fragments (e.g. a new init segment) was written in between: the byte
+    // ranges no longer hold only fragments
+    void Invalidate() { is_valid = false; }
+
+    bool IsValid() const { return is_valid; }
+
+    const std::vector<SegmentReference> &References() const { return references; }
+
+    // Largest sidx (version 1) for a number of references
+    static uint64_t SidxSize(size_t reference_count)
+    {
+        return 12 + 4 + 4 + 8 + 8 + 2 + 2 + 12 * (uint64_t)reference_count;
+    }
+
+private:
+
+    void Close(uint64_t end_offset)
+    {
+        if (!is_open) return;
+        SegmentReference &reference = references.back();
+        reference.size = end_offset - reference.offset;
+        if (reference.earliest_presentation_time == INT64_MAX) reference.earliest_presentation_time = 0;
+
+        // referenced_size is 31 bits, subsegment_duration 32 bits
+        if (reference.size >> 31 || reference.duration >> 32) is_valid = false;
+        is_open = false;
+    }
+
+    std::vector<SegmentReference> references;
+    bool is_valid;
+    bool is_open;               // references.back() is still growing
+};
+
+} // namespace fmp4
+
+#endif // FMP4_SEGMENT_INDEX_H
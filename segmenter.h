@@ -0,0 +1,262 @@
+#ifndef FMP4_SEGMENTER_H
+#define FMP4_SEGMENTER_H
+
+/*
+ * Media segments from the output of a fragmented MP4 muxer.
+ *
+ * Segmenter takes the bytes a muxer writes, as they come (an AVIO write callback, any buffer size),
+ * and splits them at top-level boxes: ftyp and moov are the init segment (number 0), a moof whose
+ * first sample of the indexed track (video, else the first track) is a key frame starts the next
+ * media segment, and the other boxes go to the segment they are in. mdat payloads stream straight
+ * through to on_data; only moov, moof and other small boxes are held until they are complete. The
+ * times of a segment come from its moofs (tfdt, trun), in the timescale of the indexed track.
+ *
+ * A media segment is complete when the next one starts or at Finish(). A top-level mfra describes
+ * the whole file, not a segment, and is dropped.
+ *
+ * Every moof starts a chunk of its segment (CMAF chunk, LL-HLS part) that is complete at the end of
+ * its mdat, so on_chunk_end comes as soon as the muxer has written a fragment, while the segment is
+ * still growing.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "mp4_index.h"
+
+namespace fmp4 {
+
+struct MediaSegment
+{
+    uint32_t number;            // 1, 2, ... in the order written
+    int64_t  start;             // earliest presentation time
+    uint64_t duration;
+    uint64_t size;              // bytes
+    uint32_t fragments;         // moof+mdat pairs
+};
+
+struct MediaChunk
+{
+    uint32_t segment_number;
+    uint32_t index;             // 0, 1, ... in the segment
+    uint64_t offset;            // bytes, in the segment
+    uint64_t size;
+    int64_t  start;             // earliest presentation time
+    uint64_t duration;
+    bool     is_independent;    // starts with a key frame
+};
+
+class Segmenter
+{
+public:
+
+    std::function<void(uint32_t number)> on_segment_start;                  // 0: init segment
+    std::function<void(const uint8_t *data, size_t size)> on_data;          // bytes of the current segment
+    std::function<void(const MediaChunk &chunk)> on_chunk_end;
+    std::function<void(const MediaSegment &segment)> on_segment_end;
+
+    Segmenter()
+        : position(0), box_remaining(0), box_type(0), is_kept(false), track(nullptr), current(-1), next_number(1)
+        , segment(), has_start(false), chunk(), is_chunk_open(false)
+    {
+    }
+
+    // The indexed track, once the moov went by
+    const Track *IndexedTrack() const { return track; }
+
+    bool Write(const uint8_t *data, size_t size)
+    {
+        while (size) {
+            if (!box_remaining) {
+                // box header, possibly split over writes
+                const size_t wanted = header.size() < 8 ? 8 : 16;
+                const size_t n = std::min(size, wanted - header.size());
+                header.insert(header.end(), data, data + n);
+                data += n;
+                size -= n;
+                position += n;
+                if (header.size() < 8 || (ReadU32(header.data()) == 1 && header.size() < 16)) continue;
+                if (!StartBox()) return false;
+                continue;
+            }
+
+            const size_t n = (size_t)std::min<uint64_t>(size, box_remaining);
+            if (is_kept) {
+                box.insert(box.end(), data, data + n);
+            } else if (box_type != FMP4_FOURCC('m', 'f', 'r', 'a')) {
+                Emit(data, n);
+            }
+            data += n;
+            size -= n;
+            position += n;
+            box_remaining -= n;
+            if (!box_remaining && is_kept && !EndBox()) return false;
+            if (!box_remaining && !is_kept) EndStreamedBox();
+        }
+        return true;
+    }
+
+    // End of the stream: completes the last segment
+    void Finish()
+    {
+        if (!pending.empty()) Emit(pending.data(), pending.size());
+        pending.clear();
+        EndSegment();
+    }
+
+private:
+
+    bool StartBox()
+    {
+        const uint32_t size32 = ReadU32(header.data());
+        box_type = ReadU32(header.data() + 4);
+        const uint64_t box_size = size32 == 1 ? ReadU64(header.data() + 8) : size32 == 0 ? UINT64_MAX : size32;
+        if (box_size < header.size()) return false;
+        box_remaining = box_size == UINT64_MAX ? UINT64_MAX : box_size - header.size();
+
+        // everything but mdat is small: keep it whole to decide where it goes
+        is_kept = box_type != FMP4_FOURCC('m', 'd', 'a', 't') && box_size != UINT64_MAX;
+        if (is_kept) {
+            box = header;
+        } else if (box_type != FMP4_FOURCC('m', 'f', 'r', 'a')) {
+            Emit(header.data(), header.size());
+        }
+        header.clear();
+        if (box_remaining) return true;
+        if (!is_kept) {
+            EndStreamedBox();
+            return true;
+        }
+        return EndBox();
+    }
+
+    // The mdat after a moof completes its chunk
+    void EndStreamedBox()
+    {
+        if (box_type == FMP4_FOURCC('m', 'd', 'a', 't')) EndChunk();
+    }
+
+    // A kept box is complete
+    bool EndBox()
+    {
+        switch (box_type) {
+        case FMP4_FOURCC('f', 't', 'y', 'p'):
+            StartSegment(0);
+            Emit(box.data(), box.size());
+            break;
+
+        case FMP4_FOURCC('m', 'o', 'o', 'v'):
+            if (current != 0) StartSegment(0);
+            Emit(box.data(), box.size());
+            index.reset(new MP4Index());
+            if (!index->AddMoov(box)) return false;
+            track = index->VideoTrack();
+            if (!track && !index->Tracks().empty()) track = &index->Tracks()[0];
+            break;
+
+        case FMP4_FOURCC('m', 'o', 'o', 'f'):
+            if (!AddMoof()) return false;
+            break;
+
+        case FMP4_FOURCC('m', 'f', 'r', 'a'):
+            break;
+
+        default:
+            // styp, sidx, prft, emsg, ...: they go with the moof that follows
+            pending.insert(pending.end(), box.begin(), box.end());
+            break;
+        }
+        box.clear();
+        return true;
+    }
+
+    bool AddMoof()
+    {
+        if (!index || !track) return false;
+
+        BoxHeader moof;
+        if (!ParseBoxHeader(box.data(), box.size(), 0, moof)) return false;
+        moof.offset = position - box.size();
+        if (!index->AddMoof(moof, box)) return false;
+
+        const std::vector<Sample> &samples = track->samples;
+        const bool is_independent = !samples.empty() && samples[0].is_sync;
+        EndChunk();
+        if (current <= 0 || is_independent) StartSegment(next_number++);
+
+        chunk = MediaChunk{ segment.number, segment.fragments, segment.size, 0, 0, 0, is_independent };
+        is_chunk_open = true;
+        segment.fragments++;
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample &sample = samples[i];
+            const int64_t pts = (int64_t)sample.dts + sample.cts_offset;
+            if (!has_start || pts < segment.start) segment.start = pts;
+            if (!i || pts < chunk.start) chunk.start = pts;
+            has_start = true;
+            segment.duration += sample.duration;
+            chunk.duration += sample.duration;
+        }
+        index->ClearSamples();
+
+        if (!pending.empty()) Emit(pending.data(), pending.size());
+        pending.clear();
+        Emit(box.data(), box.size());
+        return true;
+    }
+
+    void StartSegment(uint32_t number)
+    {
+        EndSegment();
+        current = (int64_t)number;
+        segment = MediaSegment{ number, 0, 0, 0, 0 };
+        has_start = false;
+        if (on_segment_start) on_segment_start(number);
+    }
+
+    void EndSegment()
+    {
+        EndChunk();
+        if (current > 0 && on_segment_end) on_segment_end(segment);
+        current = -1;
+    }
+
+    void EndChunk()
+    {
+        if (!is_chunk_open) return;
+        is_chunk_open = false;
+        chunk.size = segment.size - chunk.offset;
+        if (on_chunk_end) on_chunk_end(chunk);
+    }
+
+    void Emit(const uint8_t *data, size_t size)
+    {
+        segment.size += size;
+        if (on_data) on_data(data, size);
+    }
+
+    uint64_t position;                  // in the stream
+    std::vector<uint8_t> header;        // of the next box, until it is complete
+    uint64_t box_remaining;             // bytes of the current box still to come
+    uint32_t box_type;
+    bool is_kept;                       // the current box is collected in box
+    std::vector<uint8_t> box;
+    std::vector<uint8_t> pending;       // boxes waiting for their moof
+
+    std::unique_ptr<MP4Index> index;    // tracks of the last moov, samples of one moof at a time
+    const Track *track;
+    int64_t current;                    // number of the open segment, -1: none
+    uint32_t next_number;
+    MediaSegment segment;
+    bool has_start;
+    MediaChunk chunk;
+    bool is_chunk_open;                 // its moof went by, its mdat not yet
+};
+
+} // namespace fmp4
+
+#endif // FMP4_SEGMENTER_H
@@ -0,0 +1,199 @@
+#ifndef FMP4_TIMESTAMP_H
+#define FMP4_TIMESTAMP_H
+
+/*
+ * Exact timestamp conversion between time bases.
+ *
+ * The readers hand out durations and composition offsets in ticks of the source track timescale and
+ * the writers convert them once, into the time base of their output track. Converting every
+ * duration on its own truncates every time (a 30 fps stream through milliseconds loses 1/3 ms a
+ * frame, about 29 seconds a day), so DurationRescaler carries the remainder from one duration to the
+ * next: the sum of what it returned is always the exact sum of its input, rounded down once.
+ * Intermediates are 128 bit, nothing overflows for 64 bit timestamps and 32 bit timescales.
+ *
+ * TimestampRescaler is for per-packet loops where the pair of time bases is fixed: the ratio is
+ * reduced once and the conversion picked up front, so most packets cost a multiply and a shift
+ * instead of a 128 bit division. Results are the same as Rescale() for every input.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fmp4 {
+
+// Length of one tick in seconds, like AVRational: {1, 90000} is a 90 kHz clock
+struct Rational
+{
+    int64_t num;
+    int64_t den;
+};
+
+inline Rational TimeBase(uint32_t timescale) { return Rational{1, (int64_t)timescale}; }
+
+// value * num / den rounded to nearest (halves away from zero)
+inline int64_t Rescale(int64_t value, int64_t num, int64_t den)
+{
+    const __int128 scaled = (__int128)value * num;
+    const __int128 half = den / 2;
+    return (int64_t)(scaled >= 0 ? (scaled + half) / den : -((-scaled + half) / den));
+}
+
+// value from one time base to another, rounded to nearest
+inline int64_t Rescale(int64_t value, Rational from, Rational to)
+{
+    return Rescale(value, from.num * to.den, from.den * to.num);
+}
+
+class TimestampRescaler
+{
+public:
+
+    TimestampRescaler() : kind(IDENTITY), num(1), den(1), limit(INT64_MAX), reciprocal(0), shift(0) {}
+    TimestampRescaler(Rational from, Rational to) { SetTimeBases(from, to); }
+
+    void SetTimeBases(Rational from, Rational to)
+    {
+        num = (uint64_t)(from.num * to.den);
+        den = (uint64_t)(from.den * to.num);
+        const uint64_t divisor = Gcd(num, den);
+        num /= divisor;
+        den /= divisor;
+
+        reciprocal = 0;
+        shift = 0;
+        limit = (den >> 62 || !num) ? 0 : (uint64_t)(INT64_MAX - den / 2) / num;
+        if (num == 1 && den == 1) {
+            kind = IDENTITY;
+        } else if (!limit) {
+            kind = EXACT;
+        } else if (den == 1) {
+            kind = MULTIPLY;
+        } else if (!(den & (den - 1))) {
+            kind = SHIFT;
+            shift = __builtin_ctzll(den);
+        } else {
+            // floor(a / den) == (a * reciprocal) >> (64 + shift) for every a < 2^63
+            kind = RECIPROCAL;
+            const unsigned int log2_den = 64 - __builtin_clzll(den - 1);   // ceil(log2(den))
+            const unsigned __int128 power = (unsigned __int128)1 << (63 + log2_den);
+            reciprocal = (uint64_t)((power + den - 1) / den);
+            shift = log2_den - 1;
+        }
+    }
+
+    // Rounded to nearest (halves away from zero); INT64_MIN (AV_NOPTS_VALUE) and INT64_MAX pass
+    // through unchanged, like AV_ROUND_PASS_MINMAX
+    int64_t Rescale(int64_t value) const
+    {
+        switch (kind) {
+        case IDENTITY:   return value;
+        case MULTIPLY:   return RescaleAs<MULTIPLY>(value);
+        case SHIFT:      return RescaleAs<SHIFT>(value);
+        case RECIPROCAL: return RescaleAs<RECIPROCAL>(value);
+        default:         return RescaleAs<EXACT>(value);
+        }
+    }
+
+    // In place over a run of values, e.g. a whole fragment's dts: the conversion is picked once for
+    // the run and the loop body is branch free apart from the range check
+    void Rescale(int64_t *values, size_t count) const
+    {
+        switch (kind) {
+        case IDENTITY:
+            break;
+        case MULTIPLY:
+            for (size_t i = 0; i < count; i++) values[i] = RescaleAs<MULTIPLY>(values[i]);
+            break;
+        case SHIFT:
+            for (size_t i = 0; i < count; i++) values[i] = RescaleAs<SHIFT>(values[i]);
+            break;
+        case RECIPROCAL:
+            for (size_t i = 0; i < count; i++) values[i] = RescaleAs<RECIPROCAL>(values[i]);
+            break;
+        default:
+            for (size_t i = 0; i < count; i++) values[i] = RescaleAs<EXACT>(values[i]);
+            break;
+        }
+    }
+
+private:
+
+    enum Kind { IDENTITY, MULTIPLY, SHIFT, RECIPROCAL, EXACT };
+
+    static uint64_t Gcd(uint64_t a, uint64_t b)
+    {
+        while (b) {
+            const uint64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    template <Kind K>
+    int64_t RescaleAs(int64_t value) const
+    {
+        if (value == INT64_MIN || value == INT64_MAX) return value;
+        const uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+        if (K == EXACT || magnitude > limit) return fmp4::Rescale(value, (int64_t)num, (int64_t)den);
+
+        // magnitude * num + den / 2 < 2^63 from here on
+        uint64_t scaled;
+        if (K == MULTIPLY) {
+            scaled = magnitude * num;
+        } else if (K == SHIFT) {
+            scaled = (magnitude * num + den / 2) >> shift;
+        } else {
+            const uint64_t rounded = magnitude * num + den / 2;
+            scaled = (uint64_t)(((unsigned __int128)rounded * reciprocal) >> 64) >> shift;
+        }
+        return value < 0 ? -(int64_t)scaled : (int64_t)scaled;
+    }
+
+    Kind kind;
+    uint64_t num;               // output ticks per input tick = num / den, reduced
+    uint64_t den;
+    uint64_t limit;             // largest magnitude the fast conversions take
+    uint64_t reciprocal;        // RECIPROCAL: ceil(2^(64 + shift) / den)
+    unsigned int shift;         // SHIFT: log2(den); RECIPROCAL: ceil(log2(den)) - 1
+};
+
+class DurationRescaler
+{
+public:
+
+    DurationRescaler() : scale_num(1), scale_den(1), remainder(0) {}
+    DurationRescaler(Rational from, Rational to) : remainder(0) { SetTimeBases(from, to); }
+
+    // A new source (e.g. the next input file); the remainder left is less than one output tick.
+    void SetTimeBases(Rational from, Rational to)
+    {
+        scale_num = (uint64_t)(from.num * to.den);
+        scale_den = (uint64_t)(from.den * to.num);
+        remainder = 0;
+    }
+
+    // Next duration in the output time base, rounded down with the remainder kept for the next one
+    uint64_t Duration(uint64_t duration)
+    {
+        const unsigned __int128 scaled = (unsigned __int128)duration * scale_num + remainder;
+        remainder = (uint64_t)(scaled % scale_den);
+        return (uint64_t)(scaled / scale_den);
+    }
+
+    // Stand-alone values such as composition offsets: rounded to nearest, the remainder is untouched
+    int64_t Offset(int64_t value) const
+    {
+        return Rescale(value, (int64_t)scale_num, (int64_t)scale_den);
+    }
+
+private:
+
+    uint64_t scale_num;         // output ticks per input tick = scale_num / scale_den
+    uint64_t scale_den;
+    uint64_t remainder;         // in units of 1 / scale_den output ticks
+};
+
+} // namespace fmp4
+
+#endif // FMP4_TIMESTAMP_H
@@ -0,0 +1,202 @@
+/*
+ * fMP4-trickplay: keyframe-only (trick play) track extraction.
+ *
+ * Builds a fragmented, I-frame-only copy of the video track of an MP4 or fMP4 recording for fast
+ * scrubbing and thumbnails. Only the sync sample list is walked (stss, or the trun sample flags of
+ * fragmented input, see mp4_index.h) and only the key frame payloads are read, with one pread() per
+ * key frame and one writev() per output fragment; nothing else of the input is touched.
+ *
+ * Every key frame keeps its decode time and lasts until the next key frame, so the trick play
+ * track covers the same timeline as the source. Each traf carries a TrickPlayBox ('trik') marking
+ * the samples as IDR or random access pictures, and all samples are flagged as not depending on
+ * others, so players can pick the track for trick modes and decode any sample alone.
+ *
+ * usage: fMP4-trickplay [-n key-frames-per-fragment] input.mp4 output.mp4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <string>
+#include <vector>
+
+#include "logger.h"
+#include "mp4_builder.h"
+#include "mp4_index.h"
+
+// TrickPlayBox pic_type, in the two high bits of each entry
+enum
+{
+    PIC_TYPE_UNKNOWN        = 0,
+    PIC_TYPE_IDR            = 1,
+    PIC_TYPE_RANDOM_ACCESS  = 2,
+    PIC_TYPE_UNCONSTRAINED  = 3,
+};
+
+// Length prefix size of the NAL units in the samples, 0 for codecs that are not H.264/H.265
+static unsigned int NalLengthSize(const fmp4::Track &track)
+{
+    const uint8_t *config;
+    uint64_t config_size;
+    if (track.FindSampleEntryChild(FMP4_FOURCC('a', 'v', 'c', 'C'), config, config_size) && config_size >= 5)
+        return (config[4] & 3) + 1;
+    if (track.FindSampleEntryChild(FMP4_FOURCC('h', 'v', 'c', 'C'), config, config_size) && config_size >= 22)
+        return (config[21] & 3) + 1;
+    return 0;
+}
+
+// pic_type of a key frame from its first VCL NAL unit
+static unsigned int PicType(const uint8_t *data, size_t size, unsigned int nal_length_size, bool is_hevc)
+{
+    if (!nal_length_size) return PIC_TYPE_UNKNOWN;
+
+    size_t offset = 0;
+    while (offset + nal_length_size < size) {
+        uint32_t nal_size = 0;
+        for (unsigned int i = 0; i < nal_length_size; i++) nal_size = nal_size << 8 | data[offset + i];
+        offset += nal_length_size;
+        if (!nal_size || offset + nal_size > size) break;
+
+        if (is_hevc) {
+            const unsigned int type = (data[offset] >> 1) & 0x3f;
+            if (type < 32) {
+                if (type == 19 || type == 20) return PIC_TYPE_IDR;              // IDR_W_RADL, IDR_N_LP
+                return type >= 16 && type <= 21 ? PIC_TYPE_RANDOM_ACCESS : PIC_TYPE_UNCONSTRAINED;
+            }
+        } else {
+            const unsigned int type = data[offset] & 0x1f;
+            if (type == 5) return PIC_TYPE_IDR;
+            if (type >= 1 && type <= 4) return PIC_TYPE_RANDOM_ACCESS;
+        }
+        offset += nal_size;
+    }
+    return PIC_TYPE_UNKNOWN;
+}
+
+static double NowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-n key-frames-per-fragment] input.mp4 output.mp4\n"
+           "Write the key frames of the video track of input.mp4 as a fragmented trick play track\n"
+           "  -n n       key frames per fragment (1)\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int frames_per_fragment = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': frames_per_fragment = (unsigned int)atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 2 != argc || frames_per_fragment < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const std::string input_path = argv[optind], output_path = argv[optind + 1];
+
+    const double start = NowSeconds();
+
+    fmp4::MP4Index index;
+    if (!index.Open(input_path)) {
+        FMP4_LOGE("cannot index %s\n", input_path);
+        return 1;
+    }
+    fmp4::Track *track = index.VideoTrack();
+    if (!track || track->sync_samples.empty()) {
+        FMP4_LOGE("%s has no video key frames\n", input_path);
+        return 1;
+    }
+
+    const unsigned int nal_length_size = NalLengthSize(*track);
+    const bool is_hevc = track->sample_entry_type == FMP4_FOURCC('h', 'v', 'c', '1') ||
+                         track->sample_entry_type == FMP4_FOURCC('h', 'e', 'v', '1');
+    const fmp4::Sample &last = track->samples.back();
+    const uint64_t end_dts = last.dts + last.duration;
+
+    fmp4::OutputFile output;
+    if (!output.Open(output_path)) {
+        FMP4_LOGE("cannot create %s\n", output_path);
+        return 1;
+    }
+
+    std::vector<uint8_t> header;
+    fmp4::BoxWriter writer(header);
+    std::vector<const fmp4::Track *> tracks(1, track);
+    fmp4::WriteInitSegment(writer, tracks);
+    if (!output.Write(header)) {
+        FMP4_LOGE("cannot write %s\n", output_path);
+        return 1;
+    }
+
+    std::vector<fmp4::TrackRun> runs(1);
+    fmp4::TrackRun &run = runs[0];
+    run.track_id = track->track_id;
+
+    std::vector<uint8_t> payload;
+    uint32_t sequence_number = 1;
+    uint64_t payload_bytes = 0;
+    const std::vector<uint32_t> &sync_samples = track->sync_samples;
+    for (size_t first = 0; first < sync_samples.size(); first += frames_per_fragment) {
+        const size_t count = std::min<size_t>(frames_per_fragment, sync_samples.size() - first);
+
+        run.base_dts = track->samples[sync_samples[first]].dts;
+        run.samples.clear();
+        run.trick_play.clear();
+        payload.clear();
+        for (size_t i = first; i < first + count; i++) {
+            const fmp4::Sample &sample = track->samples[sync_samples[i]];
+            const uint64_t next_dts = i + 1 < sync_samples.size() ? track->samples[sync_samples[i + 1]].dts : end_dts;
+
+            const size_t offset = payload.size();
+            payload.resize(offset + sample.size);
+            if (!index.ReadSample(sample, payload.data() + offset)) {
+                FMP4_LOGE("cannot read key frame at offset %llu\n", (unsigned long long)sample.offset);
+                return 1;
+            }
+
+            fmp4::FragmentSample out;
+            out.size       = sample.size;
+            out.duration   = (uint32_t)std::min<uint64_t>(next_dts - sample.dts, 0xffffffff);
+            out.flags      = fmp4::kSyncSampleFlags;
+            out.cts_offset = sample.cts_offset;
+            run.samples.push_back(out);
+            run.trick_play.push_back((uint8_t)(PicType(payload.data() + offset, sample.size, nal_length_size, is_hevc) << 6));
+        }
+
+        header.clear();
+        fmp4::WriteFragmentHeader(writer, sequence_number++, runs);
+        if (!output.Write(header.data(), header.size(), payload.data(), payload.size())) {
+            FMP4_LOGE("cannot write %s\n", output_path);
+            return 1;
+        }
+        payload_bytes += payload.size();
+    }
+
+    if (!output.Close()) {
+        FMP4_LOGE("cannot close %s\n", output_path);
+        return 1;
+    }
+
+    const double seconds = NowSeconds() - start;
+    printf("%s: %zu of %zu samples are key frames, %u fragments, %llu payload bytes read (%.1f%% of the file)\n",
+           output_path.c_str(), sync_samples.size(), track->samples.size(), sequence_number - 1,
+           (unsigned long long)payload_bytes, index.GetFile().Size() ? 100.0 * payload_bytes / index.GetFile().Size() : 0.0);
+    printf("%.3f s, %.1f MB/s of key frame payload\n", seconds,
+           seconds > 0 ? payload_bytes / seconds / (1024.0 * 1024.0) : 0.0);
+    return 0;
+}
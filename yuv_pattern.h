@@ -0,0 +1,443 @@
+#ifndef FMP4_YUV_PATTERN_H
+#define FMP4_YUV_PATTERN_H
+
+/*
+ * Synthetic YUV 4:2:0 test pictures for the encoder samples and the corpus generator.
+ *
+ * Patterns:
+ *   gradient  the muxing example pattern: Y = x + y + 3i, Cb = 128 + y + 2i, Cr = 64 + x + 5i
+ *   bars      75% colour bars scrolling to the left by 4 pixels per frame
+ *   noise     xorshift noise, deterministic for a given frame index
+ * Any of them can get the frame number and time burnt in at the top left corner.
+ *
+ * Rows are produced with SSE2 or AVX2 (picked at run time) and split into bands that run on a small
+ * thread pool, so 4K pictures can be generated at several hundred frames per second.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FMP4_YUV_X86 1
+#include <immintrin.h>
+#endif
+
+namespace fmp4 {
+namespace yuv {
+
+enum Pattern
+{
+    PATTERN_GRADIENT,
+    PATTERN_BARS,
+    PATTERN_NOISE,
+};
+
+inline bool ParsePattern(const std::string &name, Pattern &pattern)
+{
+    if (name == "gradient") pattern = PATTERN_GRADIENT;
+    else if (name == "bars") pattern = PATTERN_BARS;
+    else if (name == "noise") pattern = PATTERN_NOISE;
+    else return false;
+    return true;
+}
+
+// A YUV 4:2:0 planar picture, the layout of AVFrame::data / AVFrame::linesize.
+struct Picture
+{
+    uint8_t *data[3];
+    int linesize[3];
+    int width;
+    int height;
+};
+
+/*
+ * Row kernels
+ */
+
+// row[x] = start + x (mod 256)
+inline void RampRowScalar(uint8_t *row, int width, uint8_t start)
+{
+    for (int x = 0; x < width; x++) row[x] = (uint8_t)(start + x);
+}
+
+// 8 xorshift32 lanes, 32 bytes per step: lane j writes bytes [4j, 4j + 4) of every 32 byte block.
+struct NoiseState
+{
+    uint32_t lane[8];
+
+    void Seed(uint32_t frame_index, uint32_t row, uint32_t plane)
+    {
+        uint32_t h = frame_index * 0x9e3779b1u ^ row * 0x85ebca77u ^ plane * 0xc2b2ae3du;
+        for (int j = 0; j < 8; j++) {
+            h ^= h >> 16; h *= 0x7feb352du; h ^= h >> 15; h *= 0x846ca68bu; h ^= h >> 16;
+            lane[j] = h ? h : 0x6d2b79f5u;
+            h += 0x9e3779b9u;
+        }
+    }
+};
+
+inline void NoiseBlockScalar(NoiseState &state, uint8_t *out)
+{
+    for (int j = 0; j < 8; j++) {
+        uint32_t x = state.lane[j];
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        state.lane[j] = x;
+        memcpy(out + 4 * j, &x, 4);
+    }
+}
+
+inline void NoiseRowScalar(NoiseState &state, uint8_t *row, int width)
+{
+    uint8_t block[32];
+    for (int x = 0; x < width; x += 32) {
+        NoiseBlockScalar(state, block);
+        memcpy(row + x, block, std::min(32, width - x));
+    }
+}
+
+#ifdef FMP4_YUV_X86
+
+inline void RampRowSSE2(uint8_t *row, int width, uint8_t start)
+{
+    const __m128i step = _mm_set1_epi8(16);
+    __m128i v = _mm_add_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                             _mm_set1_epi8((char)start));
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        _mm_storeu_si128((__m128i *)(row + x), v);
+        v = _mm_add_epi8(v, step);
+    }
+    RampRowScalar(row + x, width - x, (uint8_t)(start + x));
+}
+
+inline void NoiseRowSSE2(NoiseState &state, uint8_t *row, int width)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)state.lane);
+    __m128i b = _mm_loadu_si128((const __m128i *)(state.lane + 4));
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        a = _mm_xor_si128(a, _mm_slli_epi32(a, 13)); b = _mm_xor_si128(b, _mm_slli_epi32(b, 13));
+        a = _mm_xor_si128(a, _mm_srli_epi32(a, 17)); b = _mm_xor_si128(b, _mm_srli_epi32(b, 17));
+        a = _mm_xor_si128(a, _mm_slli_epi32(a, 5));  b = _mm_xor_si128(b, _mm_slli_epi32(b, 5));
+        _mm_storeu_si128((__m128i *)(row + x), a);
+        _mm_storeu_si128((__m128i *)(row + x + 16), b);
+    }
+    _mm_storeu_si128((__m128i *)state.lane, a);
+    _mm_storeu_si128((__m128i *)(state.lane + 4), b);
+    NoiseRowScalar(state, row + x, width - x);
+}
+
+__attribute__((target("avx2")))
+inline void RampRowAVX2(uint8_t *row, int width, uint8_t start)
+{
+    const __m256i step = _mm256_set1_epi8(32);
+    __m256i v = _mm256_add_epi8(_mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31),
+                                _mm256_set1_epi8((char)start));
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        _mm256_storeu_si256((__m256i *)(row + x), v);
+        v = _mm256_add_epi8(v, step);
+    }
+    RampRowScalar(row + x, width - x, (uint8_t)(start + x));
+}
+
+__attribute__((target("avx2")))
+inline void NoiseRowAVX2(NoiseState &state, uint8_t *row, int width)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)state.lane);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        v = _mm256_xor_si256(v, _mm256_slli_epi32(v, 13));
+        v = _mm256_xor_si256(v, _mm256_srli_epi32(v, 17));
+        v = _mm256_xor_si256(v, _mm256_slli_epi32(v, 5));
+        _mm256_storeu_si256((__m256i *)(row + x), v);
+    }
+    _mm256_storeu_si256((__m256i *)state.lane, v);
+    NoiseRowScalar(state, row + x, width - x);
+}
+
+#endif // FMP4_YUV_X86
+
+struct Kernels
+{
+    void (*ramp)(uint8_t *row, int width, uint8_t start);
+    void (*noise)(NoiseState &state, uint8_t *row, int width);
+    const char *name;
+};
+
+inline const Kernels &GetKernels()
+{
+    static const Kernels kernels = [] {
+#ifdef FMP4_YUV_X86
+        if (__builtin_cpu_supports("avx2")) return Kernels{ RampRowAVX2, NoiseRowAVX2, "avx2" };
+        return Kernels{ RampRowSSE2, NoiseRowSSE2, "sse2" };
+#else
+        return Kernels{ RampRowScalar, NoiseRowScalar, "scalar" };
+#endif
+    }();
+    return kernels;
+}
+
+/*
+ * Worker threads running bands of a picture. The calling thread works too.
+ */
+class BandPool
+{
+public:
+
+    explicit BandPool(int threads)
+        : generation(0), bands(0), next_band(0), done_bands(0), is_stopping(false)
+    {
+        for (int i = 1; i < threads; i++) workers.emplace_back(&BandPool::WorkerLoop, this);
+    }
+
+    ~BandPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_stopping = true;
+            generation++;
+        }
+        start_cond.notify_all();
+        for (auto &worker : workers) worker.join();
+    }
+
+    int Threads() const { return (int)workers.size() + 1; }
+
+    void Run(int count, const std::function<void(int)> &fn)
+    {
+        if (workers.empty() || count <= 1) {
+            for (int i = 0; i < count; i++) fn(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = fn;
+            bands = count;
+            next_band = 0;
+            done_bands = 0;
+            generation++;
+        }
+        start_cond.notify_all();
+
+        RunBands();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cond.wait(lock, [this] { return done_bands == bands; });
+        job = nullptr;
+    }
+
+private:
+
+    void RunBands()
+    {
+        int band;
+        int finished = 0;
+        while ((band = next_band.fetch_add(1)) < bands) {
+            job(band);
+            finished++;
+        }
+        if (finished) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done_bands += finished;
+            if (done_bands == bands) done_cond.notify_all();
+        }
+    }
+
+    void WorkerLoop()
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cond.wait(lock, [&] { return generation != seen; });
+                seen = generation;
+                if (is_stopping) return;
+            }
+            RunBands();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cond;
+    std::condition_variable done_cond;
+    std::function<void(int)> job;
+    uint64_t generation;
+    int bands;
+    std::atomic<int> next_band;
+    int done_bands;
+    bool is_stopping;
+};
+
+/*
+ * Picture generator
+ */
+class Generator
+{
+public:
+
+    // threads: 0 picks the number of cores (capped at 8)
+    explicit Generator(int threads = 0)
+        : pool(threads > 0 ? threads : std::max(1, std::min(8, (int)std::thread::hardware_concurrency())))
+        , kernels(GetKernels())
+    {
+    }
+
+    const char *Isa() const { return kernels.name; }
+
+    // fps is only used by the time stamp burn-in
+    void Fill(const Picture &pict, int frame_index, Pattern pattern, bool burn_in = false, int fps = 25)
+    {
+        if (pattern == PATTERN_BARS) PrepareBars(pict.width, frame_index);
+
+        // bands of an even number of rows, so each chroma row belongs to one band
+        const int band_rows = std::max(16, ((pict.height + pool.Threads() * 4 - 1) / (pool.Threads() * 4) + 1) & ~1);
+        const int count = (pict.height + band_rows - 1) / band_rows;
+        pool.Run(count, [&](int band) {
+            int y0 = band * band_rows;
+            int y1 = std::min(pict.height, y0 + band_rows);
+            FillRows(pict, frame_index, pattern, y0, y1);
+        });
+
+        if (burn_in) BurnIn(pict, frame_index, fps);
+    }
+
+private:
+
+    void FillRows(const Picture &pict, int i, Pattern pattern, int y0, int y1)
+    {
+        const int chroma_width = pict.width / 2;
+        switch (pattern) {
+            case PATTERN_GRADIENT:
+                for (int y = y0; y < y1; y++)
+                    kernels.ramp(pict.data[0] + y * pict.linesize[0], pict.width, (uint8_t)(y + i * 3));
+                for (int y = y0 / 2; y < y1 / 2; y++) {
+                    memset(pict.data[1] + y * pict.linesize[1], (uint8_t)(128 + y + i * 2), chroma_width);
+                    kernels.ramp(pict.data[2] + y * pict.linesize[2], chroma_width, (uint8_t)(64 + i * 5));
+                }
+                break;
+
+            case PATTERN_BARS:
+                for (int y = y0; y < y1; y++) memcpy(pict.data[0] + y * pict.linesize[0], bar_rows[0].data(), pict.width);
+                for (int y = y0 / 2; y < y1 / 2; y++) {
+                    memcpy(pict.data[1] + y * pict.linesize[1], bar_rows[1].data(), chroma_width);
+                    memcpy(pict.data[2] + y * pict.linesize[2], bar_rows[2].data(), chroma_width);
+                }
+                break;
+
+            case PATTERN_NOISE: {
+                NoiseState state;
+                for (int y = y0; y < y1; y++) {
+                    state.Seed(i, y, 0);
+                    kernels.noise(state, pict.data[0] + y * pict.linesize[0], pict.width);
+                }
+                for (int y = y0 / 2; y < y1 / 2; y++) {
+                    state.Seed(i, y, 1);
+                    kernels.noise(state, pict.data[1] + y * pict.linesize[1], chroma_width);
+                    state.Seed(i, y, 2);
+                    kernels.noise(state, pict.data[2] + y * pict.linesize[2], chroma_width);
+                }
+                break;
+            }
+        }
+    }
+
+    // One row per plane, copied to every row of the picture.
+    void PrepareBars(int width, int frame_index)
+    {
+        // 75% colour bars, BT.601 limited range: white, yellow, cyan, green, magenta, red, blue, black
+        static const uint8_t kBars[8][3] = {
+            { 180, 128, 128 }, { 162, 44, 142 }, { 131, 156, 44 }, { 112, 72, 58 },
+            { 84, 184, 198 }, { 65, 100, 212 }, { 35, 212, 114 }, { 16, 128, 128 },
+        };
+
+        const int chroma_width = width / 2;
+        const int offset = (frame_index * 4) % std::max(1, width);
+        for (int plane = 0; plane < 3; plane++) {
+            int plane_width = plane ? chroma_width : width;
+            int plane_offset = plane ? offset / 2 : offset;
+            bar_rows[plane].resize(std::max(1, plane_width));
+            for (int x = 0; x < plane_width; x++) {
+                int bar = (int)((int64_t)((x + plane_offset) % plane_width) * 8 / plane_width);
+                bar_rows[plane][x] = kBars[bar][plane];
+            }
+        }
+    }
+
+    // "HH:MM:SS.mmm #frame" in a 5x7 font, white on a black box
+    void BurnIn(const Picture &pict, int frame_index, int fps)
+    {
+        static const uint8_t kFont[13][7] = {
+            { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e }, // 0
+            { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e }, // 1
+            { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f }, // 2
+            { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e }, // 3
+            { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 }, // 4
+            { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e }, // 5
+            { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e }, // 6
+            { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, // 7
+            { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e }, // 8
+            { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c }, // 9
+            { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 }, // :
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c }, // .
+            { 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a }, // #
+        };
+
+        int64_t ms = fps > 0 ? (int64_t)frame_index * 1000 / fps : 0;
+        char text[48];
+        snprintf(text, sizeof(text), "%02d:%02d:%02d.%03d #%d", (int)(ms / 3600000), (int)(ms / 60000 % 60),
+                 (int)(ms / 1000 % 60), (int)(ms % 1000), frame_index);
+
+        const int scale = std::max(2, pict.height / 270) & ~1;
+        const int margin = scale * 2;
+        const int box_width = std::min(pict.width, (int)strlen(text) * 6 * scale + margin * 2) & ~1;
+        const int box_height = std::min(pict.height, 7 * scale + margin * 2) & ~1;
+
+        for (int y = 0; y < box_height; y++) memset(pict.data[0] + y * pict.linesize[0], 16, box_width);
+        for (int y = 0; y < box_height / 2; y++) {
+            memset(pict.data[1] + y * pict.linesize[1], 128, box_width / 2);
+            memset(pict.data[2] + y * pict.linesize[2], 128, box_width / 2);
+        }
+
+        for (int c = 0; text[c]; c++) {
+            int glyph = -1;
+            if (text[c] >= '0' && text[c] <= '9') glyph = text[c] - '0';
+            else if (text[c] == ':') glyph = 10;
+            else if (text[c] == '.') glyph = 11;
+            else if (text[c] == '#') glyph = 12;
+            if (glyph < 0) continue;
+
+            for (int row = 0; row < 7; row++) {
+                for (int col = 0; col < 5; col++) {
+                    if (!(kFont[glyph][row] & (0x10 >> col))) continue;
+                    int x0 = margin + (c * 6 + col) * scale;
+                    int y0 = margin + row * scale;
+                    if (x0 + scale > box_width || y0 + scale > box_height) continue;
+                    for (int y = y0; y < y0 + scale; y++) memset(pict.data[0] + y * pict.linesize[0] + x0, 235, scale);
+                }
+            }
+        }
+    }
+
+    BandPool pool;
+    const Kernels &kernels;
+    std::vector<uint8_t> bar_rows[3];
+};
+
+} // namespace yuv
+} // namespace fmp4
+
+#endif // FMP4_YUV_PATTERN_H